@@ -21,11 +21,14 @@ enum class Type : uint16_t {
     CpuStats    = 0x060,
     TaskStats   = 0x061,
     KernelLog   = 0x062,
+    KernelHeap  = 0x063,
+    Trace       = 0x064,
     NetDevice   = 0x070,
     NetEndpoint = 0x071,
     Pci         = 0x080,
     AudioOutput = 0x090,
     Sensor      = 0x0A0,
+    WaitSet     = 0x0B0,
 };
 
 enum class Flag : uint64_t {
@@ -57,6 +60,7 @@ enum class Property : uint32_t {
     BlockGeometry     = 0x00020001,
     DiskInfo          = 0x00020002,
     PartitionInfo     = 0x00020003,
+    BlockCacheStats   = 0x00020004,
     SharedMemoryInfo  = 0x00030001,
     PipeInfo          = 0x00040001,
     VtyInfo           = 0x00050001,
@@ -69,11 +73,15 @@ enum class Property : uint32_t {
     NetDeviceInfo     = 0x00060001,
     NetIpv4Config     = 0x00060002,
     NetDeviceDebug    = 0x00060003,
+    NetPacketRing     = 0x00060004,
     NetEndpointInfo   = 0x00070001,
     AudioFormat       = 0x00080001,
     AudioStatus       = 0x00080002,
     AudioControl      = 0x00080003,
     SensorInfo        = 0x00090001,
+    WaitSetControl    = 0x000A0001,
+    TraceControl      = 0x000B0001,
+    TraceStatus       = 0x000B0002,
 };
 
 enum class SensorKind : uint16_t {
@@ -252,6 +260,22 @@ struct PartitionInfo {
     uint8_t reserved[3];
 };
 
+// Counters for the kernel block cache, shared by all cached devices.
+struct BlockCacheStats {
+    uint64_t page_size;
+    uint64_t pages_total;
+    uint64_t pages_dirty;
+    uint64_t read_hits;       // pages served from the cache
+    uint64_t read_misses;     // pages read from the device for a request
+    uint64_t readahead_pages;
+    uint64_t readahead_hits;
+    uint64_t writeback_sectors;
+    uint64_t write_through_sectors;
+    uint64_t evictions;
+};
+
+static_assert(sizeof(BlockCacheStats) == 80, "BlockCacheStats size mismatch");
+
 struct SharedMemoryInfo {
     uint64_t base;
     uint64_t length;
@@ -338,8 +362,29 @@ struct CpuUsage {
     uint64_t kernel_ticks;
     uint64_t idle_ticks;
     uint64_t irq_ticks;
+    uint64_t steals;      // tasks this CPU pulled from a sibling while idle
+    uint64_t migrations;  // tasks moved here by periodic load balancing
+    uint64_t idle_ns;     // time halted waiting for work, measured by TSC
+    uint64_t timer_interrupts;  // scheduler ticks and one-shot expiries
 };
 
+// One record per kernel heap cache. "kmalloc-large" reports page-granular
+// allocations: slabs counts pages and objects_in_use counts live blocks.
+struct KernelHeapCacheStats {
+    char name[24];
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    uint64_t slabs;
+    uint64_t objects_total;
+    uint64_t objects_in_use;
+    uint64_t objects_cached;
+    uint64_t alloc_count;
+    uint64_t free_count;
+};
+
+static_assert(sizeof(KernelHeapCacheStats) == 80,
+              "KernelHeapCacheStats size mismatch");
+
 enum TaskStatFlag : uint32_t {
     kTaskStatFlagKernel = 1u << 0,
     kTaskStatFlagExited = 1u << 1,
@@ -357,6 +402,87 @@ struct DescriptorWait {
     uint32_t reserved;
 };
 
+enum WaitSetOp : uint32_t {
+    kWaitSetAdd = 1,
+    kWaitSetModify = 2,
+    kWaitSetRemove = 3,
+};
+
+// Written through Property::WaitSetControl. Reading a WaitSet returns one
+// DescriptorWait per member that is currently ready; it never blocks, so
+// callers block with DescriptorWait on the set handle itself.
+struct WaitSetControl {
+    uint32_t op;
+    uint32_t handle;
+    uint32_t events;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(WaitSetControl) == 16, "WaitSetControl size mismatch");
+
+enum class TraceEvent : uint16_t {
+    ContextSwitch = 1,  // arg0 = previous pid, arg1 = next pid
+    Wake = 2,           // arg0 = woken pid
+    SyscallEnter = 3,   // arg0 = syscall number, arg1 = first argument
+    SyscallExit = 4,    // arg0 = syscall number, arg1 = return value
+    BlockSubmit = 5,    // arg0 = lba, arg1 = kTraceBlock* bits
+    BlockComplete = 6,  // arg0 = lba, arg1 = kTraceBlock* bits
+    PageFault = 7,      // arg0 = faulting address, arg1 = error code
+    Irq = 8,            // arg0 = vector
+};
+
+constexpr uint32_t kTraceEventCount = 9;
+
+constexpr uint32_t trace_event_bit(TraceEvent event) {
+    return 1u << static_cast<uint16_t>(event);
+}
+
+constexpr uint32_t kTraceAllEvents = 0x1FEu;
+
+// arg1 of the block events: sector count in the low byte, the direction,
+// and on completion the driver status.
+constexpr uint64_t kTraceBlockSectorMask = 0xFFu;
+constexpr uint64_t kTraceBlockWrite = 1ull << 16;
+constexpr uint32_t kTraceBlockStatusShift = 24;
+
+// One event. Reading a Trace descriptor consumes whole records from the
+// per-CPU buffers, oldest first within each CPU; records from different
+// CPUs are ordered by tsc only.
+struct TraceRecord {
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t pid;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord size mismatch");
+
+enum TraceControlFlags : uint32_t {
+    // Discard everything buffered and reset the counters.
+    kTraceControlClear = 1u << 0,
+};
+
+// Written through Property::TraceControl; enable_mask is a set of
+// trace_event_bit() values and replaces the current mask.
+struct TraceControl {
+    uint32_t enable_mask;
+    uint32_t flags;
+};
+
+static_assert(sizeof(TraceControl) == 8, "TraceControl size mismatch");
+
+struct TraceStatus {
+    uint32_t enabled_mask;
+    uint32_t cpu_count;
+    uint64_t tsc_hz;
+    uint64_t recorded;
+    uint64_t dropped;
+};
+
+static_assert(sizeof(TraceStatus) == 32, "TraceStatus size mismatch");
+
 struct TaskUsage {
     uint32_t pid;
     uint32_t parent_pid;
@@ -366,6 +492,7 @@ struct TaskUsage {
     uint32_t reserved0;
     uint64_t user_ticks;
     uint64_t kernel_ticks;
+    uint64_t page_faults;
     char image_path[64];
 };
 
@@ -431,6 +558,78 @@ struct NetDeviceDebug {
     uint32_t reserved;
 };
 
+// Packet-ring mode of a NetDevice descriptor. Attaching maps one region:
+// a control page, then kNetRingSlots receive buffers, then kNetRingSlots
+// transmit buffers, each kNetRingSlotSize bytes. Indices count frames
+// without wrapping and select slot index % kNetRingSlots. The kernel writes
+// rx_head and tx_tail, the owner rx_tail and tx_head. While a ring is
+// attached, received frames go only to the ring; descriptor reads see none.
+constexpr uint32_t kNetRingSlots = 256;
+constexpr uint32_t kNetRingSlotSize = 2048;
+constexpr uint64_t kNetRingControlBytes = 4096;
+constexpr uint64_t kNetRingBytes =
+    kNetRingControlBytes +
+    2ull * kNetRingSlots * static_cast<uint64_t>(kNetRingSlotSize);
+
+struct NetRingControl {
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    uint32_t rx_dropped;  // frames lost because the receive ring was full
+    uint32_t tx_failed;   // queued frames with an invalid length
+    uint32_t reserved[2];
+    uint16_t rx_lengths[kNetRingSlots];
+    uint16_t tx_lengths[kNetRingSlots];
+};
+
+static_assert(sizeof(NetRingControl) <= kNetRingControlBytes,
+              "NetRingControl exceeds its page");
+
+enum NetPacketRingCommand : uint32_t {
+    kNetPacketRingAttach = 1,
+    kNetPacketRingDetach = 2,
+    // Doorbell: transmit the frames queued since the last kick.
+    kNetPacketRingKick = 3,
+};
+
+// Written through Property::NetPacketRing.
+struct NetPacketRingControl {
+    uint32_t command;
+    uint32_t reserved;
+};
+
+// Read through Property::NetPacketRing once attached.
+struct NetPacketRingInfo {
+    uint64_t base;
+    uint64_t length;
+    uint32_t slot_count;
+    uint32_t slot_size;
+};
+
+static_assert(sizeof(NetPacketRingControl) == 8,
+              "NetPacketRingControl size mismatch");
+static_assert(sizeof(NetPacketRingInfo) == 24,
+              "NetPacketRingInfo size mismatch");
+
+// Batched NetDevice transfers. A read or write at offset
+// kNetFrameBatchOffset moves a NetFrameBatch header followed by the frames
+// packed back to back, each starting where the previous one ends. On read,
+// count is the most frames wanted (0 for kNetFrameBatchMax) and comes back
+// as the number delivered. Both return the number of frames moved; a write
+// sends a prefix of the batch and stops at the first frame the driver
+// cannot take yet.
+constexpr uint64_t kNetFrameBatchOffset = 1ull << 63;
+constexpr uint32_t kNetFrameBatchMax = 32;
+
+struct NetFrameBatch {
+    uint32_t count;
+    uint32_t reserved;
+    uint16_t lengths[kNetFrameBatchMax];
+};
+
+static_assert(sizeof(NetFrameBatch) == 72, "NetFrameBatch size mismatch");
+
 enum NetEndpointOpenFlag : uint64_t {
     kNetEndpointOpenService = 1ull << 0,
 };
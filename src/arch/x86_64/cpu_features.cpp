@@ -70,6 +70,11 @@ FeatureState detect_baseline_features() {
     state.mmx = (basic.edx & (1u << 23)) != 0;
     state.sse = (basic.edx & (1u << 25)) != 0;
     state.sse2 = (basic.edx & (1u << 26)) != 0;
+    state.pcid = (basic.ecx & (1u << 17)) != 0;
+    if (max_basic.eax >= 7) {
+        CpuidResult extended = cpuid(7, 0);
+        state.erms = (extended.ebx & (1u << 9)) != 0;
+    }
     return state;
 }
 
@@ -115,6 +120,18 @@ void restore_interrupt_flag(uint64_t rflags) {
     }
 }
 
+// Picks the memcpy/memset implementation before anything copies in bulk.
+// movnti is part of SSE2, which is already required above.
+void select_memory_routines(const FeatureState& features) {
+    mem::Variant variant =
+        features.erms ? mem::Variant::Erms : mem::Variant::Qwords;
+    mem::select_variant(variant, features.sse2);
+    log_message(LogLevel::Info,
+                "CPU: mem routines use %s%s",
+                mem::variant_name(variant),
+                features.sse2 ? ", non-temporal large clears" : "");
+}
+
 void load_default_fpu_state() {
     if (g_initial_fpu_state_ready) {
         restore_fpu_state(g_initial_fpu_state);
@@ -152,6 +169,7 @@ bool init_boot_features() {
     save_fpu_state(g_initial_fpu_state);
     g_initial_fpu_state_ready = true;
     log_message(LogLevel::Info, "CPU: enabled x87/MMX/SSE/SSE2 support");
+    select_memory_routines(g_features);
     return true;
 }
 
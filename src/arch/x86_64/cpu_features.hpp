@@ -9,6 +9,8 @@ struct FeatureState {
     bool mmx;
     bool sse;
     bool sse2;
+    bool erms;  // enhanced rep movsb/stosb
+    bool pcid;  // process-context identifiers
 };
 
 const FeatureState& feature_state();
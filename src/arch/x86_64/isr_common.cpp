@@ -12,6 +12,7 @@
 #include "../../kernel/process.hpp"
 #include "../../kernel/scheduler.hpp"
 #include "../../kernel/time.hpp"
+#include "../../kernel/trace.hpp"
 #include "../../kernel/vm.hpp"
 #include "arch/x86_64/memory/paging.hpp"
 #include "percpu.hpp"
@@ -86,6 +87,7 @@ extern "C" void isr_handler(InterruptFrame* regs) {
     }
 
     if (regs->int_no >= 32) {
+        trace::record(trace::Event::Irq, regs->int_no);
         uint64_t irq = regs->int_no - 32;
         if (irq == 0) {
             bool user_mode = (regs->cs & 0x3) != 0;
@@ -134,6 +136,24 @@ extern "C" void isr_handler(InterruptFrame* regs) {
         return;
     }
 
+    if (regs->int_no == 14) {
+        // Lazy anonymous mappings are populated here on first touch and
+        // shared image pages are copied on first write, from user mode or
+        // from a kernel access to the current address space.
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        trace::record(trace::Event::PageFault, cr2, regs->err_code);
+        process::Process* proc = process::current();
+        if (proc != nullptr && !proc->is_kernel_task &&
+            vm::handle_page_fault(proc->cr3, cr2, regs->err_code)) {
+            return;
+        }
+    }
+
+    if ((regs->cs & 0x3) == 0) {
+        // The kernel is about to halt; the drain task will not run again.
+        log_enter_panic();
+    }
     log_message(LogLevel::Error, "Exception %x %s",
                 static_cast<unsigned int>(regs->int_no),
                 regs->int_no < 32 ? exception_names[regs->int_no] : "Unknown");
@@ -3,13 +3,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arch/x86_64/registers.hpp"
 #include "drivers/log/logging.hpp"
 
 namespace {
 
 constexpr uint64_t kLapicPhysBase = 0xFEE00000;
+constexpr uint32_t kTimerDivideBy16 = 0x3;
+constexpr uint32_t kTimerMasked = 1u << 16;
+constexpr uint32_t kTimerPeriodic = 1u << 17;
+constexpr uint32_t kCalibrationMs = 10;
 
 volatile uint32_t* g_lapic = nullptr;
+// Timer counts per millisecond at divide-by-16; 0 until calibrated.
+uint64_t g_timer_counts_per_ms = 0;
 
 inline volatile uint32_t* reg(uint32_t offset) {
     return reinterpret_cast<volatile uint32_t*>(
@@ -52,12 +59,56 @@ void setup_timer(uint8_t vector, uint32_t initial_count) {
     if (g_lapic == nullptr) return;
 
     // divide by 16 (binary 0b0011 = 16)
-    write(0x3E0, 0x3);
+    write(0x3E0, kTimerDivideBy16);
     // mask timer during setup
-    write(0x320, (1u << 16) | vector);
+    write(0x320, kTimerMasked | vector);
     write(0x380, initial_count);
     // unmask periodic
-    write(0x320, 0x20000 | vector);
+    write(0x320, kTimerPeriodic | vector);
+}
+
+bool calibrate_timer(uint64_t tsc_hz) {
+    if (g_lapic == nullptr || tsc_hz == 0) {
+        return false;
+    }
+    write(0x3E0, kTimerDivideBy16);
+    write(0x320, kTimerMasked);
+    uint64_t window = tsc_hz / 1000 * kCalibrationMs;
+    write(0x380, 0xFFFFFFFFu);
+    uint64_t start = cpu::read_tsc();
+    while (cpu::read_tsc() - start < window) {
+        asm volatile("pause");
+    }
+    uint32_t remaining = read(0x390);
+    write(0x380, 0);
+    uint64_t elapsed = 0xFFFFFFFFull - remaining;
+    g_timer_counts_per_ms = elapsed / kCalibrationMs;
+    log_message(LogLevel::Info,
+                "LAPIC: timer runs at %llu kHz",
+                static_cast<unsigned long long>(g_timer_counts_per_ms));
+    return g_timer_counts_per_ms != 0;
+}
+
+bool oneshot_available() {
+    return g_lapic != nullptr && g_timer_counts_per_ms != 0;
+}
+
+void setup_oneshot(uint8_t vector) {
+    if (g_lapic == nullptr) return;
+    write(0x3E0, kTimerDivideBy16);
+    write(0x380, 0);
+    write(0x320, vector);
+}
+
+void arm_oneshot(uint64_t delay_ns) {
+    if (g_lapic == nullptr || g_timer_counts_per_ms == 0) return;
+    uint64_t count = delay_ns / 1000 * g_timer_counts_per_ms / 1000;
+    if (count == 0) {
+        count = 1;
+    } else if (count > 0xFFFFFFFFull) {
+        count = 0xFFFFFFFFull;
+    }
+    write(0x380, static_cast<uint32_t>(count));
 }
 
 void eoi() {
@@ -72,4 +123,14 @@ void send_ipi_all_others(uint8_t vector) {
     write(0x300, (3u << 18) | vector);
 }
 
+void send_ipi(uint32_t lapic_id, uint8_t vector) {
+    if (g_lapic == nullptr) return;
+    // wait for the previous IPI to leave the ICR (delivery status)
+    while ((read(0x300) & (1u << 12)) != 0) {
+        asm volatile("pause");
+    }
+    write(0x310, lapic_id << 24);
+    write(0x300, vector);
+}
+
 }  // namespace lapic
@@ -6,8 +6,18 @@ namespace lapic {
 
 void init(uint64_t hhdm_offset);
 void setup_timer(uint8_t vector, uint32_t initial_count);
+// Measures the timer rate against the TSC. The rate is the bus clock and
+// the same on every CPU, so the BSP calibrates once for all of them.
+bool calibrate_timer(uint64_t tsc_hz);
+bool oneshot_available();
+// Switches this CPU's timer to one-shot mode on vector, stopped.
+void setup_oneshot(uint8_t vector);
+// Fires the one-shot vector once, delay_ns from now, replacing any pending
+// expiry. Needs calibrate_timer() and setup_oneshot().
+void arm_oneshot(uint64_t delay_ns);
 void eoi();
 void send_ipi_all_others(uint8_t vector);
+void send_ipi(uint32_t lapic_id, uint8_t vector);
 uint32_t id();
 
 }  // namespace lapic
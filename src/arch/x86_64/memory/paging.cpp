@@ -4,7 +4,9 @@
 #include <stdint.h>
 
 #include "../../drivers/console/console.hpp"
+#include "arch/x86_64/cpu_features.hpp"
 #include "arch/x86_64/lapic.hpp"
+#include "arch/x86_64/percpu.hpp"
 #include "arch/x86_64/smp.hpp"
 #include "drivers/limine/limine_requests.hpp"
 #include "kernel/interrupts.hpp"
@@ -41,7 +43,12 @@ constexpr uint64_t PTE_PCD = 1ull << 4;
 constexpr uint64_t PTE_PAT = 1ull << 7;
 constexpr uint64_t PTE_LARGE = 1ull << 7;
 constexpr uint64_t PTE_GLOBAL = 1ull << 8;
+// PAT selects the memory type through bit 12 in 2 MiB leaves, since bit 7 is
+// the page-size bit there.
+constexpr uint64_t PTE_LARGE_PAT = 1ull << 12;
 constexpr uint64_t PTE_MANAGED = PAGE_FLAG_MANAGED;
+constexpr uint64_t PTE_COPY_ON_WRITE = PAGE_FLAG_COPY_ON_WRITE;
+constexpr uint64_t PTE_COW_WRITABLE = PAGE_FLAG_COW_WRITABLE;
 constexpr uint64_t PTE_NX = 1ull << 63;
 constexpr uint64_t CR0_WRITE_PROTECT = 1ull << 16;
 constexpr uint32_t MSR_EFER = 0xC0000080;
@@ -74,17 +81,276 @@ uint64_t* g_address_space_roots[MAX_ADDRESS_SPACES];
 size_t g_address_space_count = 0;
 sync::SpinLock g_address_space_registry_lock;
 
+uint64_t g_kernel_large_pages = 0;
+uint64_t g_user_large_pages = 0;
+uint64_t g_large_page_splits = 0;
+
+void count_large_leaf(uint64_t entry, bool added) {
+    uint64_t* counter = (entry & PTE_USER) != 0 ? &g_user_large_pages
+                                                : &g_kernel_large_pages;
+    if (added) {
+        __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(counter, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Each registered address space gets PCID slot + 1; the kernel root keeps
+// PCID 0. With PCIDs a CPU keeps an address space's translations after
+// switching away, so invalidations are tracked per CPU: CPUs running the
+// space get an IPI, the rest flush its PCID the next time they load it.
+constexpr int32_t NO_ADDRESS_SPACE = -1;
+constexpr int32_t KERNEL_SHOOTDOWN = -2;
+constexpr size_t TLB_BATCH_RANGES = 8;
+// Larger batches reload CR3 instead of issuing one invlpg per page.
+constexpr uint64_t TLB_INVLPG_MAX_PAGES = 32;
+constexpr uint64_t CR3_NOFLUSH = 1ull << 63;
+constexpr uint64_t CR4_PGE = 1ull << 7;
+constexpr uint64_t CR4_PCIDE = 1ull << 17;
+constexpr uint64_t USER_ADDRESS_LIMIT = 0x0000800000000000ull;
+
+static_assert(percpu::kMaxCpus <= 64, "TLB CPU masks are 64 bits wide");
+static_assert(MAX_ADDRESS_SPACES < 4096, "PCIDs are 12 bits wide");
+
+struct TlbRange {
+    uint64_t start;
+    uint64_t pages;
+};
+
+struct TlbBatch {
+    TlbRange ranges[TLB_BATCH_RANGES];
+    size_t count;
+    bool full;
+};
+
+uint64_t g_address_space_phys[MAX_ADDRESS_SPACES];
+// CPUs that have loaded the address space since it was created.
+uint64_t g_address_space_cpus[MAX_ADDRESS_SPACES];
+// CPUs that must flush the address space's PCID before loading it again.
+uint64_t g_address_space_stale[MAX_ADDRESS_SPACES];
+// Invalidations waiting for paging_flush_tlb_cr3().
+TlbBatch g_pending_shootdowns[MAX_ADDRESS_SPACES];
+sync::SpinLock g_pending_shootdown_lock;
+int32_t g_cpu_address_space[percpu::kMaxCpus];
+uint64_t g_tlb_cpus = 0;  // CPUs that can take shootdown IPIs
+bool g_pcid_enabled = false;
+
 sync::SpinLock g_tlb_shootdown_lock;
 uint8_t g_tlb_shootdown_vector = 0;
-volatile size_t g_tlb_shootdown_acks = 0;
+// Written by the holder of g_tlb_shootdown_lock before raising IPIs.
+int32_t g_shootdown_slot = NO_ADDRESS_SPACE;
+TlbBatch g_shootdown_batch{};
+volatile uint64_t g_shootdown_pending_cpus = 0;
+
+size_t current_cpu_index() {
+    percpu::Cpu* cpu = percpu::current_cpu();
+    return cpu != nullptr ? cpu->index : 0;
+}
 
-void tlb_shootdown_handler() {
+uint64_t read_cr3() {
     uint64_t cr3 = 0;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+void write_cr3(uint64_t cr3) {
     asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
-    __atomic_fetch_add(&g_tlb_shootdown_acks,
-                       static_cast<size_t>(1),
-                       __ATOMIC_RELEASE);
+}
+
+void invlpg(uint64_t virt) {
+    asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(virt)) : "memory");
+}
+
+// Drops every translation on this CPU, global ones and all PCIDs included.
+void flush_local_everything() {
+    uint64_t cr4 = 0;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if ((cr4 & CR4_PGE) != 0) {
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+        return;
+    }
+    write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    if (g_pcid_enabled) {
+        uint64_t bit = 1ull << current_cpu_index();
+        for (size_t i = 0; i < MAX_ADDRESS_SPACES; ++i) {
+            __atomic_fetch_or(&g_address_space_stale[i], bit, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+int32_t slot_for_root(uint64_t root_phys) {
+    size_t count = __atomic_load_n(&g_address_space_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; ++i) {
+        if (__atomic_load_n(&g_address_space_phys[i], __ATOMIC_RELAXED) ==
+            root_phys) {
+            return static_cast<int32_t>(i);
+        }
+    }
+    return NO_ADDRESS_SPACE;
+}
+
+void batch_add(TlbBatch& batch, uint64_t virt, uint64_t pages) {
+    if (batch.full) {
+        return;
+    }
+    for (size_t i = 0; i < batch.count; ++i) {
+        TlbRange& range = batch.ranges[i];
+        if (range.start + range.pages * PAGE_SIZE == virt) {
+            range.pages += pages;
+            return;
+        }
+        if (virt + pages * PAGE_SIZE == range.start) {
+            range.start = virt;
+            range.pages += pages;
+            return;
+        }
+    }
+    if (batch.count == TLB_BATCH_RANGES) {
+        batch.full = true;
+        return;
+    }
+    batch.ranges[batch.count++] = TlbRange{virt, pages};
+}
+
+uint64_t batch_pages(const TlbBatch& batch) {
+    uint64_t pages = 0;
+    for (size_t i = 0; i < batch.count; ++i) {
+        pages += batch.ranges[i].pages;
+    }
+    return pages;
+}
+
+// Applies a batch to the address space this CPU has loaded.
+void flush_local_batch(const TlbBatch& batch) {
+    if (batch.full || batch_pages(batch) > TLB_INVLPG_MAX_PAGES) {
+        write_cr3(read_cr3() & ~CR3_NOFLUSH);
+        return;
+    }
+    for (size_t i = 0; i < batch.count; ++i) {
+        for (uint64_t page = 0; page < batch.ranges[i].pages; ++page) {
+            invlpg(batch.ranges[i].start + page * PAGE_SIZE);
+        }
+    }
+}
+
+// Handles this CPU's part of the current shootdown, if it has one. Also
+// polled by CPUs spinning on the shootdown lock so two senders cannot wait
+// on each other with interrupts disabled.
+void service_tlb_shootdown() {
+    uint64_t bit = 1ull << current_cpu_index();
+    if ((__atomic_load_n(&g_shootdown_pending_cpus, __ATOMIC_ACQUIRE) & bit) ==
+        0) {
+        return;
+    }
+    if (g_shootdown_slot == KERNEL_SHOOTDOWN) {
+        flush_local_everything();
+    } else if (__atomic_load_n(&g_cpu_address_space[current_cpu_index()],
+                               __ATOMIC_RELAXED) == g_shootdown_slot) {
+        flush_local_batch(g_shootdown_batch);
+    }
+    // A CPU that switched away meanwhile has the slot marked stale already.
+    __atomic_fetch_and(&g_shootdown_pending_cpus, ~bit, __ATOMIC_RELEASE);
+}
+
+void tlb_shootdown_handler() {
+    service_tlb_shootdown();
+}
+
+bool ensure_shootdown_vector() {
+    if (g_tlb_shootdown_vector != 0) {
+        return true;
+    }
+    uint8_t vector = interrupts::allocate_vector();
+    if (vector == 0 ||
+        !interrupts::register_vector(vector, tlb_shootdown_handler)) {
+        if (vector != 0) {
+            interrupts::free_vector(vector);
+        }
+        return false;
+    }
+    g_tlb_shootdown_vector = vector;
+    return true;
+}
+
+// Sends batch to the CPUs in targets and waits until each has applied it.
+bool send_tlb_shootdown(int32_t slot, const TlbBatch& batch, uint64_t targets) {
+    uint64_t flags = sync::disable_interrupts();
+    while (!g_tlb_shootdown_lock.try_lock()) {
+        service_tlb_shootdown();
+        asm volatile("pause");
+    }
+    bool ok = ensure_shootdown_vector();
+    if (ok) {
+        g_shootdown_slot = slot;
+        g_shootdown_batch = batch;
+        __atomic_store_n(&g_shootdown_pending_cpus, targets, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < percpu::kMaxCpus; ++i) {
+            if ((targets & (1ull << i)) == 0) {
+                continue;
+            }
+            percpu::Cpu* cpu = percpu::cpu_from_index(i);
+            if (cpu != nullptr) {
+                lapic::send_ipi(cpu->lapic_id, g_tlb_shootdown_vector);
+            }
+        }
+        while (__atomic_load_n(&g_shootdown_pending_cpus, __ATOMIC_ACQUIRE) !=
+               0) {
+            asm volatile("pause");
+        }
+    }
+    g_tlb_shootdown_lock.unlock();
+    sync::restore_interrupts(flags);
+    return ok;
+}
+
+// Invalidates virt in a user address space after its PTE changed. The local
+// CPU flushes immediately; other CPUs are marked stale and the page is queued
+// for the next paging_flush_tlb_cr3().
+void invalidate_user_page(uint64_t root_phys, uint64_t virt) {
+    size_t cpu = current_cpu_index();
+    uint64_t self = 1ull << cpu;
+    bool loaded = (read_cr3() & PHYSICAL_ADDRESS_MASK) == root_phys;
+    if (loaded) {
+        invlpg(virt);
+    }
+    int32_t slot = slot_for_root(root_phys);
+    if (slot == NO_ADDRESS_SPACE) {
+        return;
+    }
+    // Order the PTE store before reading which CPUs hold the space; pairs
+    // with the fence in paging_switch_cr3().
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t others =
+        __atomic_load_n(&g_address_space_cpus[slot], __ATOMIC_RELAXED);
+    if (loaded) {
+        others &= ~self;
+    }
+    if (others == 0) {
+        return;
+    }
+    __atomic_fetch_or(&g_address_space_stale[slot], others, __ATOMIC_SEQ_CST);
+    sync::IrqLockGuard guard(g_pending_shootdown_lock);
+    batch_add(g_pending_shootdowns[slot], virt, 1);
+}
+
+// Kernel-half entries are shared by every address space. invlpg covers the
+// current PCID and global entries only, so with PCIDs a changed present
+// entry needs a full local flush.
+void invalidate_kernel_page(uint64_t virt, bool was_present) {
+    if (g_pcid_enabled && was_present) {
+        flush_local_everything();
+        return;
+    }
+    invlpg(virt);
+}
+
+void invalidate_page(uint64_t root_phys, uint64_t virt, bool was_present) {
+    if (virt >= USER_ADDRESS_LIMIT || root_phys == g_kernel_cr3) {
+        invalidate_kernel_page(virt, was_present);
+    } else if (was_present) {
+        invalidate_user_page(root_phys, virt);
+    }
 }
 
 constexpr uint64_t align_down(uint64_t value, uint64_t alignment) {
@@ -207,6 +473,9 @@ uint64_t* ensure_table(uint64_t* table, size_t index, uint64_t flags) {
         uint64_t base_flags = entry & ((1ull << 12) - 1);
         base_flags &= ~PTE_LARGE;
         base_flags |= PTE_PRESENT;
+        if ((entry & PTE_LARGE_PAT) != 0) {
+            base_flags |= PTE_PAT;
+        }
         uint64_t nx_flag = entry & PTE_NX;
 
         for (size_t i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
@@ -221,6 +490,8 @@ uint64_t* ensure_table(uint64_t* table, size_t index, uint64_t flags) {
         pointer_flags &= ~PTE_LARGE;
         pointer_flags |= PTE_PRESENT | PTE_WRITE;
         table[index] = child_phys_addr | pointer_flags;
+        count_large_leaf(entry, false);
+        __atomic_fetch_add(&g_large_page_splits, 1, __ATOMIC_RELAXED);
         entry = table[index];
     }
 
@@ -289,6 +560,17 @@ void destroy_table_level(uint64_t table_phys, int level) {
             continue;
         }
         if ((entry & PTE_LARGE) != 0) {
+            if (level == 2) {
+                count_large_leaf(entry, false);
+                if ((entry & PTE_MANAGED) != 0) {
+                    uint64_t base =
+                        entry & (PHYSICAL_ADDRESS_MASK & ~PAGE_LARGE_MASK);
+                    for (uint64_t page = 0; page < PAGE_LARGE_SIZE;
+                         page += PAGE_SIZE) {
+                        memory::free_user_page(base + page);
+                    }
+                }
+            }
             table[i] = 0;
             continue;
         }
@@ -333,6 +615,7 @@ bool try_map_large_page(uint64_t* root, uint64_t virt, uint64_t phys, uint64_t f
     }
 
     pd[pd_index] = (phys & ~PAGE_LARGE_MASK) | flags | PTE_PRESENT | PTE_LARGE;
+    count_large_leaf(pd[pd_index], true);
     return true;
 }
 
@@ -552,6 +835,24 @@ void paging_init() {
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     cr0 |= CR0_WRITE_PROTECT;
     asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+
+    paging_init_cpu();
+}
+
+void paging_init_cpu() {
+    size_t cpu = current_cpu_index();
+    __atomic_store_n(&g_cpu_address_space[cpu],
+                     NO_ADDRESS_SPACE,
+                     __ATOMIC_RELAXED);
+    // PCIDE may only be set while CR3 selects PCID 0, which the kernel root
+    // always does.
+    if (cpu::feature_state().pcid) {
+        uint64_t cr4 = 0;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE) : "memory");
+        g_pcid_enabled = true;
+    }
+    __atomic_fetch_or(&g_tlb_cpus, 1ull << cpu, __ATOMIC_SEQ_CST);
 }
 
 bool paging_finish_smp_bootstrap() {
@@ -592,9 +893,11 @@ bool paging_finish_smp_bootstrap() {
 }
 
 bool paging_map_page(uint64_t virt, uint64_t phys, uint64_t flags) {
+    uint64_t previous = 0;
+    bool was_present = paging_resolve_cr3(g_kernel_cr3, virt, previous);
     map_page_with_root(pml4_table, virt, phys, flags);
     sync_kernel_pml4_entry((virt >> 39) & 0x1FF);
-    asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(virt)) : "memory");
+    invalidate_kernel_page(virt, was_present);
     return true;
 }
 
@@ -637,7 +940,7 @@ bool paging_unmap_page(uint64_t virt, uint64_t& phys_out) {
     }
     phys_out = pt_entry & PHYSICAL_ADDRESS_MASK;
     pt[pt_index] = 0;
-    asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(virt)) : "memory");
+    invalidate_kernel_page(virt, true);
     return true;
 }
 
@@ -657,7 +960,8 @@ bool paging_mark_wc(uint64_t virt, uint64_t length) {
     uint64_t start = align_down(virt, PAGE_SIZE);
     uint64_t end = align_up(virt + length, PAGE_SIZE);
 
-    for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
+    uint64_t addr = start;
+    while (addr < end) {
         size_t pml4_index = (addr >> 39) & 0x1FF;
         size_t pdpt_index = (addr >> 30) & 0x1FF;
         size_t pd_index = (addr >> 21) & 0x1FF;
@@ -665,18 +969,29 @@ bool paging_mark_wc(uint64_t virt, uint64_t length) {
 
         uint64_t* pdpt = ensure_table(pml4_table, pml4_index, PTE_WRITE);
         uint64_t* pd = ensure_table(pdpt, pdpt_index, PTE_WRITE);
-        uint64_t* pt = ensure_table(pd, pd_index, PTE_WRITE);
 
-        uint64_t entry = pt[pt_index];
-        if ((entry & PTE_PRESENT) == 0) {
+        // Retype whole 2 MiB leaves in place rather than splitting them.
+        uint64_t pd_entry = pd[pd_index];
+        if ((pd_entry & (PTE_PRESENT | PTE_LARGE)) ==
+                (PTE_PRESENT | PTE_LARGE) &&
+            (addr & PAGE_LARGE_MASK) == 0 && end - addr >= PAGE_LARGE_SIZE) {
+            pd_entry &= ~(PTE_PWT | PTE_PCD);
+            pd_entry |= PTE_LARGE_PAT;
+            pd[pd_index] = pd_entry;
+            invalidate_kernel_page(addr, true);
+            addr += PAGE_LARGE_SIZE;
             continue;
         }
 
-        entry &= ~(PTE_PWT | PTE_PCD);
-        entry |= PTE_PAT;
-        pt[pt_index] = entry;
-
-        asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(addr)) : "memory");
+        uint64_t* pt = ensure_table(pd, pd_index, PTE_WRITE);
+        uint64_t entry = pt[pt_index];
+        if ((entry & PTE_PRESENT) != 0) {
+            entry &= ~(PTE_PWT | PTE_PCD);
+            entry |= PTE_PAT;
+            pt[pt_index] = entry;
+            invalidate_kernel_page(addr, true);
+        }
+        addr += PAGE_SIZE;
     }
 
     return true;
@@ -708,13 +1023,36 @@ void paging_switch_cr3(uint64_t new_cr3) {
     if (new_cr3 == 0) {
         return;
     }
-    uint64_t current_cr3 = 0;
-    asm volatile("mov %%cr3, %0" : "=r"(current_cr3));
-    if ((current_cr3 & PHYSICAL_ADDRESS_MASK) ==
-        (new_cr3 & PHYSICAL_ADDRESS_MASK)) {
+    uint64_t root = new_cr3 & PHYSICAL_ADDRESS_MASK;
+    if ((read_cr3() & PHYSICAL_ADDRESS_MASK) == root) {
         return;
     }
-    asm volatile("mov %0, %%cr3" : : "r"(new_cr3) : "memory");
+
+    size_t cpu = current_cpu_index();
+    uint64_t self = 1ull << cpu;
+    int32_t slot =
+        root == g_kernel_cr3 ? NO_ADDRESS_SPACE : slot_for_root(root);
+    __atomic_store_n(&g_cpu_address_space[cpu], slot, __ATOMIC_RELAXED);
+    if (slot == NO_ADDRESS_SPACE) {
+        write_cr3(g_pcid_enabled ? root | CR3_NOFLUSH : root);
+        return;
+    }
+
+    // Publish this CPU as a holder before sampling the stale mask; pairs
+    // with the fence in invalidate_user_page().
+    __atomic_fetch_or(&g_address_space_cpus[slot], self, __ATOMIC_SEQ_CST);
+    uint64_t stale = __atomic_fetch_and(&g_address_space_stale[slot],
+                                        ~self,
+                                        __ATOMIC_SEQ_CST);
+    if (!g_pcid_enabled) {
+        write_cr3(root);
+        return;
+    }
+    uint64_t value = root | static_cast<uint64_t>(slot + 1);
+    if ((stale & self) == 0) {
+        value |= CR3_NOFLUSH;
+    }
+    write_cr3(value);
 }
 
 uint64_t paging_create_address_space() {
@@ -744,9 +1082,22 @@ uint64_t paging_create_address_space() {
             memory::free_kernel_page(root_page.phys);
             return 0;
         }
-        registry_slot = g_address_space_count++;
+        registry_slot = g_address_space_count;
     }
     g_address_space_roots[registry_slot] = new_root;
+    g_address_space_cpus[registry_slot] = 0;
+    {
+        sync::IrqLockGuard pending_guard(g_pending_shootdown_lock);
+        g_pending_shootdowns[registry_slot] = TlbBatch{};
+    }
+    __atomic_store_n(&g_address_space_phys[registry_slot],
+                     root_page.phys,
+                     __ATOMIC_RELEASE);
+    if (registry_slot == g_address_space_count) {
+        __atomic_store_n(&g_address_space_count,
+                         g_address_space_count + 1,
+                         __ATOMIC_RELEASE);
+    }
     return root_page.phys;
 }
 
@@ -768,6 +1119,17 @@ void paging_destroy_address_space(uint64_t cr3) {
         for (size_t i = 0; i < g_address_space_count; ++i) {
             if (g_address_space_roots[i] == root) {
                 g_address_space_roots[i] = nullptr;
+                __atomic_store_n(&g_address_space_phys[i],
+                                 static_cast<uint64_t>(0),
+                                 __ATOMIC_RELEASE);
+                // The PCID is reused by the next space in this slot; CPUs
+                // that ran this one drop its entries before loading it.
+                uint64_t holders = __atomic_exchange_n(&g_address_space_cpus[i],
+                                                       static_cast<uint64_t>(0),
+                                                       __ATOMIC_SEQ_CST);
+                __atomic_fetch_or(&g_address_space_stale[i],
+                                  holders,
+                                  __ATOMIC_SEQ_CST);
                 break;
             }
         }
@@ -799,8 +1161,10 @@ bool paging_map_page_cr3(uint64_t cr3, uint64_t virt, uint64_t phys, uint64_t fl
     }
     uint64_t root_phys = cr3 & ~PAGE_MASK;
     auto* root = reinterpret_cast<uint64_t*>(table_phys_to_virt(root_phys));
+    uint64_t previous = 0;
+    bool was_present = paging_resolve_cr3(cr3, virt, previous);
     map_page_with_root(root, virt, phys, flags);
-    asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(virt)) : "memory");
+    invalidate_page(root_phys, virt, was_present);
     return true;
 }
 
@@ -834,9 +1198,14 @@ bool paging_unmap_page_cr3(uint64_t cr3, uint64_t virt, uint64_t& phys_out) {
     uint64_t* pd = table_from_entry(pdpt_entry);
 
     uint64_t pd_entry = pd[pd_index];
-    if ((pd_entry & PTE_PRESENT) == 0 || (pd_entry & PTE_LARGE) != 0) {
+    if ((pd_entry & PTE_PRESENT) == 0) {
         return false;
     }
+    if ((pd_entry & PTE_LARGE) != 0) {
+        // Unmapping one page of a 2 MiB leaf keeps the other 511.
+        (void)ensure_table(pd, pd_index, pd_entry & PTE_USER);
+        pd_entry = pd[pd_index];
+    }
     uint64_t pt_phys = pd_entry & PHYSICAL_ADDRESS_MASK;
     uint64_t* pt = table_from_entry(pd_entry);
 
@@ -860,7 +1229,106 @@ bool paging_unmap_page_cr3(uint64_t cr3, uint64_t virt, uint64_t& phys_out) {
             }
         }
     }
-    asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(virt)) : "memory");
+    invalidate_page(root_phys, virt, true);
+    return true;
+}
+
+bool paging_map_large_page_cr3(uint64_t cr3,
+                               uint64_t virt,
+                               uint64_t phys,
+                               uint64_t flags) {
+    if (cr3 == 0 || (virt & PAGE_LARGE_MASK) != 0 ||
+        (phys & PAGE_LARGE_MASK) != 0) {
+        return false;
+    }
+    uint64_t root_phys = cr3 & ~PAGE_MASK;
+    auto* root = reinterpret_cast<uint64_t*>(table_phys_to_virt(root_phys));
+    size_t pml4_index = (virt >> 39) & 0x1FF;
+    size_t pdpt_index = (virt >> 30) & 0x1FF;
+    size_t pd_index = (virt >> 21) & 0x1FF;
+
+    uint64_t* pdpt = ensure_table(root, pml4_index, flags);
+    uint64_t* pd = ensure_table(pdpt, pdpt_index, flags);
+    // Only an untouched 2 MiB slot can take a leaf; 4 KiB pages already in
+    // it stay as they are and the caller falls back to small pages.
+    if ((pd[pd_index] & PTE_PRESENT) != 0) {
+        return false;
+    }
+
+    uint64_t leaf_flags = flags & ~PTE_PAT;
+    if ((flags & PTE_PAT) != 0) {
+        leaf_flags |= PTE_LARGE_PAT;
+    }
+    pd[pd_index] = (phys & (PHYSICAL_ADDRESS_MASK & ~PAGE_LARGE_MASK)) |
+                   leaf_flags | PTE_PRESENT | PTE_LARGE;
+    count_large_leaf(pd[pd_index], true);
+    return true;
+}
+
+bool paging_large_slot_free_cr3(uint64_t cr3, uint64_t virt) {
+    if (cr3 == 0) {
+        return false;
+    }
+    auto* root = reinterpret_cast<uint64_t*>(
+        table_phys_to_virt(cr3 & ~PAGE_MASK));
+    uint64_t pml4_entry = root[(virt >> 39) & 0x1FF];
+    if ((pml4_entry & PTE_PRESENT) == 0) {
+        return true;
+    }
+    uint64_t pdpt_entry = table_from_entry(pml4_entry)[(virt >> 30) & 0x1FF];
+    if ((pdpt_entry & PTE_PRESENT) == 0) {
+        return true;
+    }
+    if ((pdpt_entry & PTE_LARGE) != 0) {
+        return false;
+    }
+    uint64_t pd_entry = table_from_entry(pdpt_entry)[(virt >> 21) & 0x1FF];
+    return (pd_entry & PTE_PRESENT) == 0;
+}
+
+bool paging_unmap_large_page_cr3(uint64_t cr3,
+                                 uint64_t virt,
+                                 uint64_t& phys_out) {
+    phys_out = 0;
+    if (cr3 == 0 || (virt & PAGE_LARGE_MASK) != 0) {
+        return false;
+    }
+    uint64_t root_phys = cr3 & ~PAGE_MASK;
+    auto* root = reinterpret_cast<uint64_t*>(table_phys_to_virt(root_phys));
+    size_t pml4_index = (virt >> 39) & 0x1FF;
+    size_t pdpt_index = (virt >> 30) & 0x1FF;
+    size_t pd_index = (virt >> 21) & 0x1FF;
+
+    uint64_t pml4_entry = root[pml4_index];
+    if ((pml4_entry & PTE_PRESENT) == 0) {
+        return false;
+    }
+    uint64_t pdpt_phys = pml4_entry & PHYSICAL_ADDRESS_MASK;
+    uint64_t* pdpt = table_from_entry(pml4_entry);
+    uint64_t pdpt_entry = pdpt[pdpt_index];
+    if ((pdpt_entry & PTE_PRESENT) == 0 || (pdpt_entry & PTE_LARGE) != 0) {
+        return false;
+    }
+    uint64_t pd_phys = pdpt_entry & PHYSICAL_ADDRESS_MASK;
+    uint64_t* pd = table_from_entry(pdpt_entry);
+    uint64_t pd_entry = pd[pd_index];
+    if ((pd_entry & (PTE_PRESENT | PTE_LARGE)) != (PTE_PRESENT | PTE_LARGE)) {
+        return false;
+    }
+
+    phys_out = pd_entry & (PHYSICAL_ADDRESS_MASK & ~PAGE_LARGE_MASK);
+    pd[pd_index] = 0;
+    count_large_leaf(pd_entry, false);
+    if (pml4_index < PAGE_TABLE_ENTRIES / 2 && table_empty(pd)) {
+        pdpt[pdpt_index] = 0;
+        memory::free_kernel_page(pd_phys);
+        if (table_empty(pdpt)) {
+            root[pml4_index] = 0;
+            memory::free_kernel_page(pdpt_phys);
+        }
+    }
+    // invlpg on any address inside a 2 MiB leaf drops the whole entry.
+    invalidate_page(root_phys, virt, true);
     return true;
 }
 
@@ -950,7 +1418,8 @@ bool paging_flags_cr3(uint64_t cr3, uint64_t virt, uint64_t& flags_out) {
     }
     effective &= pd_entry;
     if ((pd_entry & PTE_LARGE) != 0) {
-        flags_out = (effective & PAGE_MASK) | (pd_entry & PTE_NX);
+        flags_out = (effective & PAGE_MASK) |
+                    (pd_entry & (PTE_NX | PTE_MANAGED));
         return true;
     }
     uint64_t* pt = table_from_entry(pd_entry);
@@ -963,7 +1432,8 @@ bool paging_flags_cr3(uint64_t cr3, uint64_t virt, uint64_t& flags_out) {
     // Effective hardware permissions are the intersection of all levels,
     // while software ownership is stored only on the leaf entry.
     flags_out = (effective & PAGE_MASK) |
-                (pt_entry & (PTE_NX | PTE_MANAGED));
+                (pt_entry & (PTE_NX | PTE_MANAGED | PTE_COPY_ON_WRITE |
+                             PTE_COW_WRITABLE));
     return true;
 }
 
@@ -992,23 +1462,30 @@ bool paging_set_writable_cr3(uint64_t cr3, uint64_t virt, bool writable) {
     uint64_t* pd = table_from_entry(pdpt_entry);
 
     uint64_t pd_entry = pd[pd_index];
-    if ((pd_entry & PTE_PRESENT) == 0 ||
-        (pd_entry & PTE_LARGE) != 0) {
+    if ((pd_entry & PTE_PRESENT) == 0) {
         return false;
     }
+    if ((pd_entry & PTE_LARGE) != 0) {
+        (void)ensure_table(pd, pd_index, pd_entry & PTE_USER);
+        pd_entry = pd[pd_index];
+    }
     uint64_t* pt = table_from_entry(pd_entry);
 
     uint64_t entry = pt[pt_index];
     if ((entry & PTE_PRESENT) == 0) {
         return false;
     }
+    // A shared frame only remembers the permission; the write bit is set
+    // when the page is copied.
+    uint64_t write_bit =
+        (entry & PTE_COPY_ON_WRITE) != 0 ? PTE_COW_WRITABLE : PTE_WRITE;
     if (writable) {
-        entry |= PTE_WRITE;
+        entry |= write_bit;
     } else {
-        entry &= ~PTE_WRITE;
+        entry &= ~write_bit;
     }
     pt[pt_index] = entry;
-    asm volatile("invlpg (%0)" : : "r"(reinterpret_cast<void*>(virt)) : "memory");
+    invalidate_page(root_phys, virt, true);
     return true;
 }
 
@@ -1037,10 +1514,13 @@ bool paging_set_executable_cr3(uint64_t cr3,
     }
     uint64_t* pd = table_from_entry(pdpt_entry);
     uint64_t pd_entry = pd[pd_index];
-    if ((pd_entry & PTE_PRESENT) == 0 ||
-        (pd_entry & PTE_LARGE) != 0) {
+    if ((pd_entry & PTE_PRESENT) == 0) {
         return false;
     }
+    if ((pd_entry & PTE_LARGE) != 0) {
+        (void)ensure_table(pd, pd_index, pd_entry & PTE_USER);
+        pd_entry = pd[pd_index];
+    }
     uint64_t* pt = table_from_entry(pd_entry);
     uint64_t entry = pt[pt_index];
     if ((entry & PTE_PRESENT) == 0) {
@@ -1052,44 +1532,71 @@ bool paging_set_executable_cr3(uint64_t cr3,
         entry |= PTE_NX;
     }
     pt[pt_index] = entry;
-    asm volatile("invlpg (%0)"
-                 :
-                 : "r"(reinterpret_cast<void*>(virt))
-                 : "memory");
+    invalidate_page(root_phys, virt, true);
     return true;
 }
 
 bool paging_flush_tlb_all_cpus() {
-    sync::IrqLockGuard guard(g_tlb_shootdown_lock);
-    if (g_tlb_shootdown_vector == 0) {
-        uint8_t vector = interrupts::allocate_vector();
-        if (vector == 0 ||
-            !interrupts::register_vector(vector, tlb_shootdown_handler)) {
-            if (vector != 0) {
-                interrupts::free_vector(vector);
-            }
-            return false;
-        }
-        g_tlb_shootdown_vector = vector;
+    flush_local_everything();
+    uint64_t targets = __atomic_load_n(&g_tlb_cpus, __ATOMIC_ACQUIRE) &
+                       ~(1ull << current_cpu_index());
+    if (targets == 0) {
+        return true;
     }
+    return send_tlb_shootdown(KERNEL_SHOOTDOWN, TlbBatch{}, targets);
+}
 
-    uint64_t cr3 = 0;
-    asm volatile("mov %%cr3, %0" : "=r"(cr3));
-    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+bool paging_flush_tlb_cr3(uint64_t cr3) {
+    if (cr3 == 0) {
+        return false;
+    }
+    uint64_t root_phys = cr3 & PHYSICAL_ADDRESS_MASK;
+    if (root_phys == g_kernel_cr3) {
+        return paging_flush_tlb_all_cpus();
+    }
+    int32_t slot = slot_for_root(root_phys);
+    if (slot == NO_ADDRESS_SPACE) {
+        return true;
+    }
 
-    size_t online = smp::online_cpus();
-    if (online <= 1) {
+    TlbBatch batch{};
+    {
+        sync::IrqLockGuard guard(g_pending_shootdown_lock);
+        batch = g_pending_shootdowns[slot];
+        g_pending_shootdowns[slot] = TlbBatch{};
+    }
+    if (batch.count == 0 && !batch.full) {
         return true;
     }
-    __atomic_store_n(&g_tlb_shootdown_acks,
-                     static_cast<size_t>(0),
-                     __ATOMIC_RELEASE);
-    lapic::send_ipi_all_others(g_tlb_shootdown_vector);
-    while (__atomic_load_n(&g_tlb_shootdown_acks, __ATOMIC_ACQUIRE) <
-           online - 1) {
-        asm volatile("pause");
+
+    // Only CPUs running the space need an IPI; the others were marked stale
+    // when the entries changed.
+    uint64_t self = 1ull << current_cpu_index();
+    uint64_t cpus = __atomic_load_n(&g_tlb_cpus, __ATOMIC_ACQUIRE);
+    uint64_t targets = 0;
+    for (size_t i = 0; i < percpu::kMaxCpus; ++i) {
+        uint64_t bit = 1ull << i;
+        if ((cpus & bit) == 0 || bit == self) {
+            continue;
+        }
+        if (__atomic_load_n(&g_cpu_address_space[i], __ATOMIC_ACQUIRE) ==
+            slot) {
+            targets |= bit;
+        }
     }
-    return true;
+    if (targets == 0) {
+        return true;
+    }
+    return send_tlb_shootdown(slot, batch, targets);
+}
+
+PagingLargePageStats paging_large_page_stats() {
+    PagingLargePageStats stats{};
+    stats.kernel_pages =
+        __atomic_load_n(&g_kernel_large_pages, __ATOMIC_RELAXED);
+    stats.user_pages = __atomic_load_n(&g_user_large_pages, __ATOMIC_RELAXED);
+    stats.splits = __atomic_load_n(&g_large_page_splits, __ATOMIC_RELAXED);
+    return stats;
 }
 
 void* paging_phys_to_virt(uint64_t phys) {
@@ -9,9 +9,25 @@ constexpr uint64_t PAGE_FLAG_WRITE_COMBINING = 1ull << 7;
 constexpr uint64_t PAGE_FLAG_GLOBAL = 1ull << 8;
 // Software-owned bit: the kernel allocated this user page and may reclaim it.
 constexpr uint64_t PAGE_FLAG_MANAGED = 1ull << 9;
+// Software-owned bits: the frame belongs to the image cache and must be
+// copied before anything writes to it. COW_WRITABLE records whether the
+// mapping becomes writable once copied; the hardware write bit stays clear.
+constexpr uint64_t PAGE_FLAG_COPY_ON_WRITE = 1ull << 10;
+constexpr uint64_t PAGE_FLAG_COW_WRITABLE = 1ull << 11;
 constexpr uint64_t PAGE_FLAG_NO_EXECUTE = 1ull << 63;
 
+constexpr uint64_t PAGING_LARGE_PAGE_SIZE = 0x200000;
+
+struct PagingLargePageStats {
+    uint64_t kernel_pages;  // 2 MiB leaves in kernel mappings (HHDM etc.)
+    uint64_t user_pages;    // 2 MiB leaves in user address spaces
+    uint64_t splits;        // leaves broken up into 4 KiB tables
+};
+
 void paging_init();
+// Per-CPU paging setup (PCID enable, shootdown registration). paging_init()
+// covers the BSP; APs call it once their LAPIC is up.
+void paging_init_cpu();
 bool paging_finish_smp_bootstrap();
 bool paging_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
 uint64_t paging_virt_to_phys(uint64_t virt);
@@ -27,11 +43,30 @@ uint64_t paging_create_address_space();
 void paging_destroy_address_space(uint64_t cr3);
 bool paging_map_page_cr3(uint64_t cr3, uint64_t virt, uint64_t phys, uint64_t flags);
 bool paging_unmap_page_cr3(uint64_t cr3, uint64_t virt, uint64_t& phys_out);
+// Maps one 2 MiB leaf. virt and phys must be 2 MiB aligned and the slot must
+// hold no 4 KiB pages yet; returns false otherwise so callers can fall back.
+// The *_cr3 calls above split a leaf when they touch a single page of it.
+bool paging_map_large_page_cr3(uint64_t cr3,
+                               uint64_t virt,
+                               uint64_t phys,
+                               uint64_t flags);
+// True when nothing at all is mapped in the 2 MiB slot containing virt.
+bool paging_large_slot_free_cr3(uint64_t cr3, uint64_t virt);
+// Removes the 2 MiB leaf at virt; false if virt is not mapped by one.
+bool paging_unmap_large_page_cr3(uint64_t cr3,
+                                 uint64_t virt,
+                                 uint64_t& phys_out);
 bool paging_resolve_cr3(uint64_t cr3, uint64_t virt, uint64_t& phys_out);
 bool paging_flags_cr3(uint64_t cr3, uint64_t virt, uint64_t& flags_out);
 bool paging_set_writable_cr3(uint64_t cr3, uint64_t virt, bool writable);
 bool paging_set_executable_cr3(uint64_t cr3, uint64_t virt, bool executable);
+// Flushes every CPU's TLB, kernel and global entries included.
 bool paging_flush_tlb_all_cpus();
+// Page-table updates through the *_cr3 calls invalidate the local TLB at
+// once and queue the pages for other CPUs; this sends the queued batch to
+// the CPUs currently running the address space.
+bool paging_flush_tlb_cr3(uint64_t cr3);
+PagingLargePageStats paging_large_page_stats();
 void* paging_phys_to_virt(uint64_t phys);
 bool paging_unmap_page(uint64_t virt, uint64_t& phys_out);
 void paging_free_physical(uint64_t phys);
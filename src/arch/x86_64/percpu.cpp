@@ -4,7 +4,9 @@
 #include <stdint.h>
 
 #include "arch/x86_64/gdt.hpp"
+#include "arch/x86_64/registers.hpp"
 #include "arch/x86_64/tss.hpp"
+#include "kernel/time.hpp"
 
 namespace {
 
@@ -13,6 +15,7 @@ constexpr uint32_t kMsrKernelGsBase = 0xC0000102;
 
 percpu::Cpu g_cpus[percpu::kMaxCpus];
 size_t g_cpu_count = 0;
+uint64_t g_tsc_hz = 0;
 
 inline void write_msr(uint32_t msr, uint64_t value) {
     uint32_t low = static_cast<uint32_t>(value & 0xFFFFFFFF);
@@ -56,10 +59,17 @@ Cpu* register_cpu(uint32_t lapic_id, uint32_t processor_id) {
     cpu.kernel_ticks = 0;
     cpu.idle_ticks = 0;
     cpu.irq_ticks = 0;
+    cpu.steals = 0;
+    cpu.migrations = 0;
     cpu.kernel_fpu_depth = 0;
     cpu.kernel_fpu_reserved = 0;
     cpu.kernel_fpu_rflags = 0;
     cpu.kernel_fpu_process = nullptr;
+    cpu.last_sample_tick = 0;
+    cpu.idle_enter_tick = 0;
+    cpu.idle_enter_tsc = 0;
+    cpu.idle_tsc = 0;
+    cpu.timer_interrupts = 0;
     return &cpu;
 }
 
@@ -125,17 +135,50 @@ void record_tick(bool user_mode, bool has_process) {
     if (cpu == nullptr) {
         return;
     }
+    ++cpu->timer_interrupts;
+    uint64_t now = timekeeping::tick_count();
+    uint64_t elapsed = now - cpu->last_sample_tick;
+    cpu->last_sample_tick = now;
     if (!has_process) {
-        ++cpu->idle_ticks;
+        cpu->idle_ticks += elapsed;
         return;
     }
     if (user_mode) {
-        ++cpu->user_ticks;
+        cpu->user_ticks += elapsed;
     } else {
-        ++cpu->kernel_ticks;
+        cpu->kernel_ticks += elapsed;
     }
 }
 
+void idle_enter() {
+    Cpu* cpu = current_cpu();
+    if (cpu == nullptr) {
+        return;
+    }
+    cpu->idle_enter_tick = timekeeping::tick_count();
+    cpu->idle_enter_tsc = cpu::read_tsc();
+}
+
+void idle_exit() {
+    Cpu* cpu = current_cpu();
+    if (cpu == nullptr) {
+        return;
+    }
+    cpu->idle_tsc += cpu::read_tsc() - cpu->idle_enter_tsc;
+    // Work done before the halt stays pending for the next sample.
+    uint64_t now = timekeeping::tick_count();
+    uint64_t from = cpu->last_sample_tick > cpu->idle_enter_tick
+                        ? cpu->last_sample_tick
+                        : cpu->idle_enter_tick;
+    uint64_t idle = now - from;
+    cpu->idle_ticks += idle;
+    cpu->last_sample_tick += idle;
+}
+
+void set_tsc_hz(uint64_t tsc_hz) {
+    g_tsc_hz = tsc_hz;
+}
+
 void record_irq() {
     Cpu* cpu = current_cpu();
     if (cpu == nullptr) {
@@ -144,6 +187,22 @@ void record_irq() {
     ++cpu->irq_ticks;
 }
 
+void record_steal() {
+    Cpu* cpu = current_cpu();
+    if (cpu == nullptr) {
+        return;
+    }
+    __atomic_fetch_add(&cpu->steals, 1, __ATOMIC_RELAXED);
+}
+
+void record_migration() {
+    Cpu* cpu = current_cpu();
+    if (cpu == nullptr) {
+        return;
+    }
+    __atomic_fetch_add(&cpu->migrations, 1, __ATOMIC_RELAXED);
+}
+
 size_t usage_snapshot(descriptor_defs::CpuUsage* out, size_t max_entries) {
     if (out == nullptr || max_entries == 0) {
         return 0;
@@ -163,6 +222,12 @@ size_t usage_snapshot(descriptor_defs::CpuUsage* out, size_t max_entries) {
         out[i].kernel_ticks = cpu->kernel_ticks;
         out[i].idle_ticks = cpu->idle_ticks;
         out[i].irq_ticks = cpu->irq_ticks;
+        out[i].steals = __atomic_load_n(&cpu->steals, __ATOMIC_RELAXED);
+        out[i].migrations = __atomic_load_n(&cpu->migrations, __ATOMIC_RELAXED);
+        out[i].idle_ns =
+            g_tsc_hz >= 1000000 ? cpu->idle_tsc / (g_tsc_hz / 1000000) * 1000
+                                : 0;
+        out[i].timer_interrupts = cpu->timer_interrupts;
     }
     return count;
 }
@@ -31,10 +31,18 @@ struct Cpu {
     uint64_t kernel_ticks;
     uint64_t idle_ticks;
     uint64_t irq_ticks;
+    uint64_t steals;
+    uint64_t migrations;
     uint32_t kernel_fpu_depth;
     uint32_t kernel_fpu_reserved;
     uint64_t kernel_fpu_rflags;
     process::Process* kernel_fpu_process;
+    // Global ticks up to here are already charged to a usage bucket.
+    uint64_t last_sample_tick;
+    uint64_t idle_enter_tick;
+    uint64_t idle_enter_tsc;
+    uint64_t idle_tsc;
+    uint64_t timer_interrupts;
 };
 
 static_assert(offsetof(Cpu, syscall_user_rsp) == 16,
@@ -53,8 +61,17 @@ void setup_cpu_tss(Cpu& cpu);
 void setup_cpu_gdt(Cpu& cpu);
 void set_current_process(process::Process* proc);
 process::Process* get_current_process();
+// Charges the global ticks since this CPU's previous sample to one
+// bucket, so CPUs whose timer fires once per slice account like the BSP.
 void record_tick(bool user_mode, bool has_process);
+// Bracket a halt. The halted span is charged to idle however many timer
+// samples fell inside it.
+void idle_enter();
+void idle_exit();
+void set_tsc_hz(uint64_t tsc_hz);
 void record_irq();
+void record_steal();
+void record_migration();
 size_t usage_snapshot(descriptor_defs::CpuUsage* out, size_t max_entries);
 
 }  // namespace percpu
@@ -17,6 +17,13 @@ inline void write_msr(uint32_t msr, uint64_t value) {
     asm volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
 }
 
+inline uint64_t read_tsc() {
+    uint32_t low = 0;
+    uint32_t high = 0;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
 constexpr uint32_t kMsrFsBase = 0xC0000100;
 
 inline uint64_t read_fs_base() {
@@ -43,6 +43,7 @@ extern "C" [[noreturn]] void smp_ap_run(struct LIMINE_MP(info)* info,
     // The APIC enable bit is local to each processor.  Initializing it only on
     // the BSP leaves APs unable to receive fixed IPIs such as TLB shootdowns.
     lapic::init(paging_hhdm_offset());
+    paging_init_cpu();
     __atomic_fetch_add(&g_online_cpus, 1, __ATOMIC_SEQ_CST);
     log_message(LogLevel::Info,
                 "SMP: AP online (processor_id=%u lapic_id=%u)",
@@ -59,7 +60,7 @@ extern "C" [[noreturn]] void smp_ap_run(struct LIMINE_MP(info)* info,
         asm volatile("pause");
     }
     asm volatile("cli" ::: "memory");
-    lapic::setup_timer(0x40, 10'000'000);
+    scheduler::start_local_timer();
     scheduler::run_cpu();
 }
 
@@ -5,6 +5,7 @@
 #include "../../kernel/scheduler.hpp"
 #include "../../kernel/descriptor.hpp"
 #include "../../kernel/process.hpp"
+#include "../../kernel/trace.hpp"
 #include "../../kernel/vm.hpp"
 #include "../../drivers/log/logging.hpp"
 #include "arch/x86_64/gdt.hpp"
@@ -79,7 +80,10 @@ extern "C" void syscall_dispatch(SyscallFrame* frame) {
         return;
     }
 
+    uint64_t number = frame->rax;
+    trace::record(trace::Event::SyscallEnter, number, frame->rdi);
     Result res = handle_syscall(*frame);
+    trace::record(trace::Event::SyscallExit, number, frame->rax);
 
     switch (res) {
         case Result::Continue:
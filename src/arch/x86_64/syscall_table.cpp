@@ -102,6 +102,7 @@ constexpr uint64_t kProcessSpawnFlagPrincipalConfig = 1ull << 1;
 
 void request_cpu_reset() {
     log_message(LogLevel::Info, "Shutdown: requesting CPU reset");
+    log_flush();
 
     uint8_t port92 = inb(0x92);
     outb(0x92, static_cast<uint8_t>(port92 | 0x01));
@@ -360,6 +361,8 @@ bool descriptor_type_requires_monitor_access(uint32_t type) {
     return type == descriptor::kTypeCpuStats ||
            type == descriptor::kTypeTaskStats ||
            type == descriptor::kTypeKernelLog ||
+           type == descriptor::kTypeKernelHeap ||
+           type == descriptor::kTypeTrace ||
            type == descriptor::kTypeSensor;
 }
 
@@ -546,11 +549,11 @@ Result handle_syscall(SyscallFrame& frame) {
             }
 
             uint64_t now_ticks = timekeeping::tick_count();
-            proc->sleep_until_tick =
-                ticks > UINT64_MAX - now_ticks ? UINT64_MAX
-                                                : now_ticks + ticks;
             proc->waiting_on = nullptr;
-            process::store_state(*proc, process::State::Blocked);
+            process::block_until(*proc,
+                                 ticks > UINT64_MAX - now_ticks
+                                     ? UINT64_MAX
+                                     : now_ticks + ticks);
             frame.rax = 0;
             return Result::Reschedule;
         }
@@ -761,7 +764,8 @@ Result handle_syscall(SyscallFrame& frame) {
             int result = descriptor::wait(*proc,
                                           proc->descriptors,
                                           frame.rdi,
-                                          static_cast<size_t>(frame.rsi));
+                                          static_cast<size_t>(frame.rsi),
+                                          frame.rdx);
             if (result == descriptor::kWouldBlock) {
                 frame.rax = static_cast<uint64_t>(
                     static_cast<int64_t>(result));
@@ -898,6 +902,7 @@ Result handle_syscall(SyscallFrame& frame) {
                 request_cpu_reset();
             }
             log_message(LogLevel::Info, "Shutdown: halted");
+            log_flush();
             halt_forever();
         }
         case SystemCall::ModuleLoad: {
@@ -1924,6 +1929,30 @@ Result handle_syscall(SyscallFrame& frame) {
             }
             return Result::Continue;
         }
+        case SystemCall::BindLazySymbol: {
+            // Only reached through the loader's PLT trampoline, which left
+            // rax, rcx, the object id and the relocation index on the stack
+            // above the caller's return address.
+            process::Process* proc = process::current();
+            uint64_t saved[4] = {};
+            uint64_t target = 0;
+            if (proc == nullptr ||
+                !vm::copy_from_user(proc->cr3,
+                                    saved,
+                                    frame.user_rsp,
+                                    sizeof(saved)) ||
+                !loader::bind_lazy_slot(*proc, saved[2], saved[3], target)) {
+                log_message(LogLevel::Error,
+                            "Loader: lazy PLT binding failed");
+                frame.rax = 0x800Du;
+                return Result::Unschedule;
+            }
+            frame.rax = saved[0];
+            frame.rcx = saved[1];
+            frame.user_rsp += sizeof(saved);
+            frame.user_rip = target;
+            return Result::Continue;
+        }
         default: {
             log_message(LogLevel::Warn, "Unhandled syscall %llx", frame.rax);
             frame.rax = static_cast<uint64_t>(-1);
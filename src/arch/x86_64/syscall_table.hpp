@@ -66,6 +66,7 @@ enum class SystemCall : uint64_t {
     RandomGet            = 56,
     FileGetAcl           = 57,
     FileSetAcl           = 58,
+    BindLazySymbol       = 59,
 };
 
 Result handle_syscall(SyscallFrame& frame);
@@ -4,6 +4,10 @@
 #include <stdint.h>
 
 #include "drivers/log/logging.hpp"
+#include "kernel/memory/physical_allocator.hpp"
+#include "kernel/process.hpp"
+#include "kernel/scheduler.hpp"
+#include "kernel/time.hpp"
 #include "lib/mem.hpp"
 
 namespace fs {
@@ -11,83 +15,135 @@ namespace block_cache {
 namespace {
 
 constexpr size_t kMaxCachedDevices = 32;
-constexpr size_t kCacheEntryCount = 65536;
-constexpr size_t kCacheHashBucketCount = 65536;
 constexpr size_t kCacheSectorSize = 512;
-constexpr size_t kIdleFlushBudget = 16;
+// The cache holds 4 KiB pages of eight sectors, each aligned to its LBA.
+constexpr uint32_t kPageSectors = 8;
+constexpr size_t kCachePageSize = kPageSectors * kCacheSectorSize;
+constexpr size_t kCachePageCount = 8192;
+constexpr size_t kCacheHashBucketCount = 8192;
+// Hash buckets share these spinlocks. A page's identity, masks and data are
+// protected by the stripe of the bucket it is linked into.
+constexpr size_t kLockStripeCount = 256;
 constexpr uint16_t kSequentialWriteThroughSectors = 4;
+// A miss reads up to kMaxFillPages in one command: the rest of the request
+// plus, for a sequential stream, a readahead window that starts at
+// kInitialReadaheadPages and doubles on every sequential read.
+constexpr uint32_t kMaxFillPages = 255 / kPageSectors;
+constexpr uint32_t kInitialReadaheadPages = 4;
+constexpr size_t kFillBufferSize = kMaxFillPages * kCachePageSize;
+constexpr uint32_t kNoStream = UINT32_MAX;
+// Writeback commands one flush keeps queued on devices that support it.
+constexpr size_t kMaxQueuedWrites = 8;
+// Dirty pages are written back by a kernel task. It wakes every
+// kWritebackIntervalNs to write pages dirty for longer than kDirtyExpireNs,
+// and writes regardless of age while more than kBackgroundDirtyPages are
+// dirty. Past kThrottleDirtyPages, writers flush a batch of their own device
+// before dirtying more.
+constexpr uint64_t kWritebackIntervalNs = 500ull * 1000 * 1000;
+constexpr uint64_t kDirtyExpireNs = 5ull * 1000 * 1000 * 1000;
+constexpr uint64_t kBackgroundDirtyPages = kCachePageCount / 10;
+constexpr uint64_t kThrottleDirtyPages = kCachePageCount / 2;
+constexpr size_t kWritebackBatchBudget = 64;
 
 struct CachedDevice {
     BlockDevice backing;
-    volatile int io_lock;
-    uint64_t write_sequence;
+    volatile int io_lock;     // backing I/O and fill_buffer
+    volatile int state_lock;  // stream detection and readahead fields
+    uint8_t* fill_buffer;     // kFillBufferSize bytes
     bool in_use;
     bool have_last_write;
     uint16_t sequential_write_sectors;
     uint32_t last_write_end_lba;
+    uint32_t read_next_lba;
+    uint32_t readahead_pages;  // current window, 0 when not streaming
+    uint32_t readahead_end_lba;
+    uint32_t pending_readahead_lba;
+    uint32_t pending_readahead_pages;  // queued for the idle loop, 0 if none
+    // Dirty pages of this device in LBA order, linked through CachePage.
+    volatile int dirty_lock;
+    int32_t dirty_head;
+    int32_t dirty_tail;
+    uint32_t writeback_lba;  // where the background sweep resumes
 };
 
-struct CacheEntry {
-    CachedDevice* owner;
-    uint32_t lba;
-    uint64_t age;
-    uint64_t generation;
-    size_t sector_size;
-    bool valid;
-    bool dirty;
+struct CachePage {
+    CachedDevice* owner;  // nullptr while the page is free
+    uint32_t first_lba;
+    uint8_t valid_mask;   // one bit per sector
+    uint8_t dirty_mask;
     bool flushing;
+    bool referenced;      // second chance for the eviction clock
+    bool readahead;       // filled speculatively and not read since
+    bool on_dirty_list;
     int32_t hash_next;
-    alignas(512) uint8_t data[kCacheSectorSize];
+    int32_t dirty_prev;   // owner's dirty list, under its dirty_lock
+    int32_t dirty_next;
+    uint64_t dirtied_tick;  // when the page went from clean to dirty
+    uint64_t generation;    // bumped whenever the data changes
+};
+
+struct Counters {
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t readahead_pages;
+    uint64_t readahead_hits;
+    uint64_t writeback_sectors;
+    uint64_t write_through_sectors;
+    uint64_t evictions;
+    uint64_t dirty_pages;
 };
 
 CachedDevice g_devices[kMaxCachedDevices]{};
-CacheEntry g_entries[kCacheEntryCount]{};
+CachePage g_pages[kCachePageCount]{};
+alignas(4096) uint8_t g_page_data[kCachePageCount][kCachePageSize];
 int32_t g_hash_heads[kCacheHashBucketCount]{};
-volatile int g_cache_lock = 0;
-uint64_t g_clock = 0;
-size_t g_victim_cursor = 0;
+volatile int g_stripe_locks[kLockStripeCount]{};
+// Taken before any stripe lock whenever a page changes identity.
+volatile int g_alloc_lock = 0;
+volatile int g_device_lock = 0;
+size_t g_clock_hand = 0;
+process::Process* g_writeback_worker = nullptr;
+bool g_writeback_kicked = false;
+Counters g_counters{};
 bool g_enabled = true;
 size_t g_active_cached_ops = 0;
 volatile int g_mode_lock = 0;
 
-bool cache_enabled() {
-    return __atomic_load_n(&g_enabled, __ATOMIC_ACQUIRE);
-}
-
-void lock() {
-    while (__atomic_test_and_set(&g_cache_lock, __ATOMIC_ACQUIRE)) {
+void spin_lock(volatile int& lock) {
+    while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE)) {
         asm volatile("pause");
     }
 }
 
-void unlock() {
-    __atomic_clear(&g_cache_lock, __ATOMIC_RELEASE);
+void spin_unlock(volatile int& lock) {
+    __atomic_clear(&lock, __ATOMIC_RELEASE);
 }
 
-class LockGuard {
-public:
-    LockGuard() { lock(); }
-    ~LockGuard() { unlock(); }
-};
+void count(uint64_t& counter, uint64_t amount) {
+    __atomic_fetch_add(&counter, amount, __ATOMIC_RELAXED);
+}
 
+bool cache_enabled() {
+    return __atomic_load_n(&g_enabled, __ATOMIC_SEQ_CST);
+}
+
+// Registers an in-flight cached operation. set_enabled(false) publishes the
+// flag before waiting for the count to drain, so either the operation sees
+// the cache disabled or the disabler waits for it.
 class CacheOperation {
 public:
     CacheOperation() {
-        lock();
+        __atomic_add_fetch(&g_active_cached_ops, 1, __ATOMIC_SEQ_CST);
         cached_ = cache_enabled();
-        if (cached_) {
-            ++g_active_cached_ops;
+        if (!cached_) {
+            __atomic_sub_fetch(&g_active_cached_ops, 1, __ATOMIC_SEQ_CST);
         }
-        unlock();
     }
 
     ~CacheOperation() {
-        if (!cached_) {
-            return;
+        if (cached_) {
+            __atomic_sub_fetch(&g_active_cached_ops, 1, __ATOMIC_SEQ_CST);
         }
-        lock();
-        --g_active_cached_ops;
-        unlock();
     }
 
     bool uses_cache() const { return cached_; }
@@ -99,223 +155,713 @@ private:
     bool cached_{false};
 };
 
-void lock_mode() {
-    while (__atomic_test_and_set(&g_mode_lock, __ATOMIC_ACQUIRE)) {
-        asm volatile("pause");
-    }
+void* byte_offset(void* ptr, size_t offset) {
+    return static_cast<void*>(static_cast<uint8_t*>(ptr) + offset);
 }
 
-void unlock_mode() {
-    __atomic_clear(&g_mode_lock, __ATOMIC_RELEASE);
+const void* byte_offset(const void* ptr, size_t offset) {
+    return static_cast<const void*>(static_cast<const uint8_t*>(ptr) + offset);
 }
 
-void* byte_offset(void* ptr, size_t offset) {
-    return static_cast<void*>(static_cast<uint8_t*>(ptr) + offset);
+uint32_t page_base(uint32_t lba) {
+    return lba & ~(kPageSectors - 1);
 }
 
-void lock_io(CachedDevice& cached) {
-    while (__atomic_test_and_set(&cached.io_lock, __ATOMIC_ACQUIRE)) {
-        asm volatile("pause");
-    }
+uint8_t sector_mask(uint32_t first, uint32_t count) {
+    return static_cast<uint8_t>(((1u << count) - 1u) << first);
 }
 
-void unlock_io(CachedDevice& cached) {
-    __atomic_clear(&cached.io_lock, __ATOMIC_RELEASE);
+uint8_t* page_data(const CachePage& page) {
+    return g_page_data[static_cast<size_t>(&page - g_pages)];
 }
 
 BlockIoStatus read_uncached(CachedDevice& cached,
                             uint32_t lba,
                             uint8_t sector_count,
                             void* buffer) {
-    lock_io(cached);
+    spin_lock(cached.io_lock);
     BlockIoStatus status =
         block_read(cached.backing, lba, sector_count, buffer);
-    unlock_io(cached);
+    spin_unlock(cached.io_lock);
     return status;
 }
 
-BlockIoStatus write_uncached(CachedDevice& cached,
-                             uint32_t lba,
-                             uint8_t sector_count,
-                             const void* buffer) {
-    lock_io(cached);
-    BlockIoStatus status =
-        block_write(cached.backing, lba, sector_count, buffer);
-    unlock_io(cached);
-    return status;
+size_t cache_bucket(const CachedDevice* cached, uint32_t first_lba) {
+    uintptr_t owner = reinterpret_cast<uintptr_t>(cached);
+    uint64_t mixed = static_cast<uint64_t>(first_lba / kPageSectors) *
+                     11400714819323198485ull;
+    mixed ^= static_cast<uint64_t>(owner >> 4);
+    return static_cast<size_t>(mixed >> 17) & (kCacheHashBucketCount - 1);
 }
 
-size_t cache_hash(const CachedDevice& cached, uint32_t lba) {
-    uintptr_t owner = reinterpret_cast<uintptr_t>(&cached);
-    uint64_t mixed = static_cast<uint64_t>(lba) * 11400714819323198485ull;
-    mixed ^= static_cast<uint64_t>(owner >> 4);
-    return static_cast<size_t>(mixed) & (kCacheHashBucketCount - 1);
+size_t bucket_stripe(size_t bucket) {
+    return bucket % kLockStripeCount;
 }
 
-CacheEntry* find_entry(CachedDevice& cached, uint32_t lba, size_t sector_size) {
-    int32_t index = g_hash_heads[cache_hash(cached, lba)];
+CachePage* find_page_locked(const CachedDevice& cached,
+                            uint32_t first_lba,
+                            size_t bucket) {
+    int32_t index = g_hash_heads[bucket];
     while (index >= 0) {
-        CacheEntry& entry = g_entries[static_cast<size_t>(index)];
-        if (entry.valid && entry.owner == &cached && entry.lba == lba &&
-            entry.sector_size == sector_size) {
-            return &entry;
+        CachePage& page = g_pages[static_cast<size_t>(index)];
+        if (page.owner == &cached && page.first_lba == first_lba) {
+            return &page;
         }
-        index = entry.hash_next;
+        index = page.hash_next;
     }
     return nullptr;
 }
 
-void unlink_entry_locked(CacheEntry& target) {
-    if (!target.valid || target.owner == nullptr) {
-        target.hash_next = -1;
-        return;
-    }
-    size_t bucket = cache_hash(*target.owner, target.lba);
-    int32_t* link = &g_hash_heads[bucket];
+void unlink_page_locked(CachePage& target) {
+    int32_t* link =
+        &g_hash_heads[cache_bucket(target.owner, target.first_lba)];
     while (*link >= 0) {
-        CacheEntry& entry = g_entries[static_cast<size_t>(*link)];
-        if (&entry == &target) {
-            *link = entry.hash_next;
-            entry.hash_next = -1;
-            return;
+        CachePage& page = g_pages[static_cast<size_t>(*link)];
+        if (&page == &target) {
+            *link = page.hash_next;
+            break;
         }
-        link = &entry.hash_next;
+        link = &page.hash_next;
     }
     target.hash_next = -1;
 }
 
-void link_entry_locked(CacheEntry& entry) {
-    size_t index = static_cast<size_t>(&entry - g_entries);
-    size_t bucket = cache_hash(*entry.owner, entry.lba);
-    entry.hash_next = g_hash_heads[bucket];
-    g_hash_heads[bucket] = static_cast<int32_t>(index);
+void assign_page_locked(CachePage& page,
+                        CachedDevice& cached,
+                        uint32_t first_lba,
+                        size_t bucket) {
+    page.owner = &cached;
+    page.first_lba = first_lba;
+    page.valid_mask = 0;
+    page.dirty_mask = 0;
+    page.flushing = false;
+    page.referenced = false;
+    page.readahead = false;
+    ++page.generation;
+    page.hash_next = g_hash_heads[bucket];
+    g_hash_heads[bucket] = static_cast<int32_t>(&page - g_pages);
+}
+
+void lock_stripe_pair(size_t a, size_t b) {
+    if (a == b) {
+        spin_lock(g_stripe_locks[a]);
+    } else if (a < b) {
+        spin_lock(g_stripe_locks[a]);
+        spin_lock(g_stripe_locks[b]);
+    } else {
+        spin_lock(g_stripe_locks[b]);
+        spin_lock(g_stripe_locks[a]);
+    }
+}
+
+// Returns the page caching first_lba with its stripe lock held, or nullptr.
+// With create set, a missing page is taken from the free pool or evicted
+// from a clean page the clock finds unreferenced; nullptr then means every
+// page is dirty or being flushed.
+CachePage* acquire_page(CachedDevice& cached,
+                        uint32_t first_lba,
+                        bool create,
+                        size_t& out_stripe) {
+    size_t bucket = cache_bucket(&cached, first_lba);
+    size_t stripe = bucket_stripe(bucket);
+    out_stripe = stripe;
+    spin_lock(g_stripe_locks[stripe]);
+    CachePage* page = find_page_locked(cached, first_lba, bucket);
+    if (page != nullptr || !create) {
+        if (page == nullptr) {
+            spin_unlock(g_stripe_locks[stripe]);
+        }
+        return page;
+    }
+    spin_unlock(g_stripe_locks[stripe]);
+
+    spin_lock(g_alloc_lock);
+    for (size_t scanned = 0; scanned < kCachePageCount * 2; ++scanned) {
+        CachePage& candidate = g_pages[g_clock_hand];
+        g_clock_hand = (g_clock_hand + 1) % kCachePageCount;
+
+        if (candidate.owner == nullptr) {
+            spin_lock(g_stripe_locks[stripe]);
+            page = find_page_locked(cached, first_lba, bucket);
+            if (page == nullptr) {
+                page = &candidate;
+                assign_page_locked(*page, cached, first_lba, bucket);
+            }
+            spin_unlock(g_alloc_lock);
+            return page;
+        }
+
+        size_t victim_stripe = bucket_stripe(
+            cache_bucket(candidate.owner, candidate.first_lba));
+        lock_stripe_pair(stripe, victim_stripe);
+        bool evictable = candidate.dirty_mask == 0 && !candidate.flushing;
+        if (evictable && candidate.referenced && candidate.valid_mask != 0) {
+            candidate.referenced = false;
+            evictable = false;
+        }
+        if (evictable) {
+            page = find_page_locked(cached, first_lba, bucket);
+            if (page == nullptr) {
+                page = &candidate;
+                unlink_page_locked(*page);
+                assign_page_locked(*page, cached, first_lba, bucket);
+                count(g_counters.evictions, 1);
+            }
+        }
+        if (victim_stripe != stripe) {
+            spin_unlock(g_stripe_locks[victim_stripe]);
+        }
+        if (page != nullptr) {
+            spin_unlock(g_alloc_lock);
+            return page;
+        }
+        spin_unlock(g_stripe_locks[stripe]);
+    }
+    spin_unlock(g_alloc_lock);
+    return nullptr;
+}
+
+void release_page(size_t stripe) {
+    spin_unlock(g_stripe_locks[stripe]);
+}
+
+int32_t page_index(const CachePage& page) {
+    return static_cast<int32_t>(&page - g_pages);
+}
+
+// Inserts the page into its owner's dirty list, searching from the tail
+// since pages are usually dirtied in ascending order.
+void dirty_list_insert(CachedDevice& cached, CachePage& page) {
+    spin_lock(cached.dirty_lock);
+    int32_t after = cached.dirty_tail;
+    while (after >= 0 &&
+           g_pages[static_cast<size_t>(after)].first_lba > page.first_lba) {
+        after = g_pages[static_cast<size_t>(after)].dirty_prev;
+    }
+    int32_t before = (after >= 0)
+                         ? g_pages[static_cast<size_t>(after)].dirty_next
+                         : cached.dirty_head;
+    page.dirty_prev = after;
+    page.dirty_next = before;
+    if (after >= 0) {
+        g_pages[static_cast<size_t>(after)].dirty_next = page_index(page);
+    } else {
+        cached.dirty_head = page_index(page);
+    }
+    if (before >= 0) {
+        g_pages[static_cast<size_t>(before)].dirty_prev = page_index(page);
+    } else {
+        cached.dirty_tail = page_index(page);
+    }
+    page.on_dirty_list = true;
+    spin_unlock(cached.dirty_lock);
+}
+
+void dirty_list_remove(CachedDevice& cached, CachePage& page) {
+    spin_lock(cached.dirty_lock);
+    if (page.dirty_prev >= 0) {
+        g_pages[static_cast<size_t>(page.dirty_prev)].dirty_next =
+            page.dirty_next;
+    } else {
+        cached.dirty_head = page.dirty_next;
+    }
+    if (page.dirty_next >= 0) {
+        g_pages[static_cast<size_t>(page.dirty_next)].dirty_prev =
+            page.dirty_prev;
+    } else {
+        cached.dirty_tail = page.dirty_prev;
+    }
+    page.dirty_prev = -1;
+    page.dirty_next = -1;
+    page.on_dirty_list = false;
+    spin_unlock(cached.dirty_lock);
+}
+
+void set_dirty_locked(CachePage& page, uint8_t mask) {
+    if (page.dirty_mask == 0 && mask != 0) {
+        count(g_counters.dirty_pages, 1);
+        page.dirtied_tick = timekeeping::tick_count();
+        dirty_list_insert(*page.owner, page);
+    }
+    page.dirty_mask |= mask;
+}
+
+void clear_dirty_locked(CachePage& page, uint8_t mask) {
+    bool was_dirty = page.dirty_mask != 0;
+    page.dirty_mask &= static_cast<uint8_t>(~mask);
+    if (was_dirty && page.dirty_mask == 0) {
+        __atomic_fetch_sub(&g_counters.dirty_pages, 1, __ATOMIC_RELAXED);
+        dirty_list_remove(*page.owner, page);
+    }
+}
+
+// Picks the batch for flush_batch: the first dirty page at or after
+// start_lba (older than expire_tick unless it is UINT64_MAX) and the dirty
+// pages directly following it. Returns the number of pages.
+uint32_t collect_batch(CachedDevice& cached,
+                       uint32_t start_lba,
+                       uint64_t expire_tick,
+                       int32_t* out_pages) {
+    spin_lock(cached.dirty_lock);
+    int32_t index = cached.dirty_head;
+    while (index >= 0) {
+        const CachePage& page = g_pages[static_cast<size_t>(index)];
+        if (page.first_lba >= start_lba &&
+            (expire_tick == UINT64_MAX || page.dirtied_tick <= expire_tick)) {
+            break;
+        }
+        index = page.dirty_next;
+    }
+    uint32_t count = 0;
+    uint32_t next_lba = 0;
+    while (index >= 0 && count < kMaxFillPages) {
+        const CachePage& page = g_pages[static_cast<size_t>(index)];
+        if (count != 0 && page.first_lba != next_lba) {
+            break;
+        }
+        out_pages[count++] = index;
+        next_lba = page.first_lba + kPageSectors;
+        index = page.dirty_next;
+    }
+    spin_unlock(cached.dirty_lock);
+    return count;
 }
 
-CacheEntry* choose_clean_victim() {
-    CacheEntry* oldest = nullptr;
-    for (size_t scanned = 0; scanned < kCacheEntryCount; ++scanned) {
-        size_t index = (g_victim_cursor + scanned) % kCacheEntryCount;
-        CacheEntry& entry = g_entries[index];
-        if (!entry.valid) {
-            g_victim_cursor = (index + 1) % kCacheEntryCount;
-            return &entry;
+// Writes back up to kMaxFillPages adjacent dirty pages, coalescing their
+// dirty sectors into as few commands as possible. Holding the device I/O
+// lock across the snapshot and the writes keeps a write-through of the same
+// sectors from landing between them and being overwritten by older data;
+// it also means no other flush of this device is in flight. Returns false
+// when there was nothing to write or a write failed; out_next_lba is where
+// the next sweep step starts.
+bool flush_batch(CachedDevice& cached,
+                 uint32_t start_lba,
+                 uint64_t expire_tick,
+                 uint32_t& out_next_lba,
+                 bool& out_failed) {
+    out_failed = false;
+    int32_t pages[kMaxFillPages];
+    uint32_t page_count = collect_batch(cached, start_lba, expire_tick, pages);
+    if (page_count == 0) {
+        return false;
+    }
+    uint32_t first_lba = g_pages[static_cast<size_t>(pages[0])].first_lba;
+    out_next_lba = first_lba + page_count * kPageSectors;
+
+    uint8_t masks[kMaxFillPages];
+    uint64_t generations[kMaxFillPages];
+    spin_lock(cached.io_lock);
+    for (uint32_t i = 0; i < page_count; ++i) {
+        CachePage& page = g_pages[static_cast<size_t>(pages[i])];
+        uint32_t page_lba = first_lba + i * kPageSectors;
+        size_t stripe = bucket_stripe(cache_bucket(&cached, page_lba));
+        spin_lock(g_stripe_locks[stripe]);
+        masks[i] = 0;
+        // The page may have been written back or reused since it was listed.
+        if (page.owner == &cached && page.first_lba == page_lba &&
+            page.dirty_mask != 0) {
+            masks[i] = page.dirty_mask;
+            generations[i] = page.generation;
+            page.flushing = true;
+            memcpy(cached.fill_buffer + i * kCachePageSize,
+                   page_data(page),
+                   kCachePageSize);
         }
+        spin_unlock(g_stripe_locks[stripe]);
     }
-    for (auto& entry : g_entries) {
-        if (entry.dirty || entry.flushing) {
+
+    // Runs go out without waiting for each other on queued devices; a full
+    // queue is drained from the oldest request.
+    BlockIoStatus status = BlockIoStatus::Ok;
+    BlockRequest queue[kMaxQueuedWrites];
+    size_t queue_head = 0;
+    size_t queued = 0;
+    auto retire_oldest = [&]() {
+        BlockRequest& oldest = queue[queue_head];
+        if (block_wait(cached.backing, oldest) == BlockIoStatus::Ok) {
+            count(g_counters.writeback_sectors, oldest.sector_count);
+        } else {
+            status = BlockIoStatus::IoError;
+        }
+        queue_head = (queue_head + 1) % kMaxQueuedWrites;
+        --queued;
+    };
+    uint32_t total = page_count * kPageSectors;
+    uint32_t sector = 0;
+    auto dirty = [&](uint32_t s) {
+        return (masks[s / kPageSectors] & (1u << (s % kPageSectors))) != 0;
+    };
+    while (sector < total && status == BlockIoStatus::Ok) {
+        if (!dirty(sector)) {
+            ++sector;
             continue;
         }
-        if (oldest == nullptr) {
-            oldest = &entry;
+        uint32_t run = 1;
+        while (sector + run < total && dirty(sector + run)) {
+            ++run;
+        }
+        if (queued == kMaxQueuedWrites) {
+            retire_oldest();
             continue;
         }
-        if (entry.age < oldest->age) {
-            oldest = &entry;
+        BlockRequest& request = queue[(queue_head + queued) % kMaxQueuedWrites];
+        request = {};
+        request.lba = first_lba + sector;
+        request.sector_count = static_cast<uint8_t>(run);
+        request.is_write = true;
+        request.buffer = cached.fill_buffer + sector * kCacheSectorSize;
+        BlockIoStatus submitted = block_submit(cached.backing, request);
+        if (submitted == BlockIoStatus::Busy && queued != 0) {
+            retire_oldest();
+            continue;
+        }
+        if (submitted == BlockIoStatus::Busy) {
+            // Other users hold the whole queue; wait for a slot instead.
+            request.status = block_write(cached.backing, request.lba,
+                                         request.sector_count, request.buffer);
+            request.driver_data = nullptr;
+            submitted = BlockIoStatus::Ok;
+        }
+        if (submitted != BlockIoStatus::Ok) {
+            status = submitted;
+            break;
         }
+        ++queued;
+        sector += run;
     }
-    return oldest;
+    while (queued != 0) {
+        retire_oldest();
+    }
+
+    for (uint32_t i = 0; i < page_count; ++i) {
+        if (masks[i] == 0) {
+            continue;
+        }
+        CachePage& page = g_pages[static_cast<size_t>(pages[i])];
+        size_t stripe = bucket_stripe(
+            cache_bucket(&cached, first_lba + i * kPageSectors));
+        spin_lock(g_stripe_locks[stripe]);
+        page.flushing = false;
+        // A cached write during the flush bumped the generation; the page
+        // stays dirty and is written again with the newer data.
+        if (status == BlockIoStatus::Ok && page.generation == generations[i]) {
+            clear_dirty_locked(page, masks[i]);
+        }
+        spin_unlock(g_stripe_locks[stripe]);
+    }
+    spin_unlock(cached.io_lock);
+    out_failed = status != BlockIoStatus::Ok;
+    return !out_failed;
 }
 
-bool flush_dirty_entry(CacheEntry* target) {
-    CachedDevice* owner = nullptr;
+// Writes back every page of the device that was dirty on entry.
+bool flush_device_pages(CachedDevice& cached) {
     uint32_t lba = 0;
-    uint64_t generation = 0;
-    size_t sector_size = 0;
-    alignas(512) uint8_t sector_buffer[kCacheSectorSize];
-
-    lock();
-    if (target == nullptr || !target->valid || !target->dirty ||
-        target->flushing) {
-        unlock();
-        return true;
+    bool ok = true;
+    for (;;) {
+        uint32_t next_lba = 0;
+        bool failed = false;
+        if (!flush_batch(cached, lba, UINT64_MAX, next_lba, failed)) {
+            if (!failed) {
+                return ok;
+            }
+            ok = false;
+        }
+        if (next_lba <= lba) {
+            return ok;
+        }
+        lba = next_lba;
     }
+}
 
-    owner = target->owner;
-    lba = target->lba;
-    generation = target->generation;
-    sector_size = target->sector_size;
-    // Claim the backing device while the cache identity is still protected.
-    // A write-through invalidation cannot overtake this older snapshot and be
-    // overwritten by it later.
-    lock_io(*owner);
-    target->flushing = true;
-    memcpy(sector_buffer, target->data, sector_size);
-    unlock();
+void kick_writeback() {
+    process::Process* worker =
+        __atomic_load_n(&g_writeback_worker, __ATOMIC_ACQUIRE);
+    if (worker == nullptr ||
+        __atomic_exchange_n(&g_writeback_kicked, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    (void)process::wake(*worker);
+}
 
-    BlockIoStatus status =
-        block_write(owner->backing, lba, 1, sector_buffer);
-    unlock_io(*owner);
+// Runs one background pass: a bounded LBA-ordered sweep per device while
+// the cache is over the background threshold, otherwise only expired pages.
+void writeback_worker(process::Process& worker) {
+    __atomic_store_n(&g_writeback_kicked, false, __ATOMIC_RELEASE);
+    uint64_t now = timekeeping::tick_count();
+    uint64_t expire = timekeeping::ticks_for_duration_ns(kDirtyExpireNs);
+    uint64_t expire_tick = (now > expire) ? now - expire : 0;
+
+    size_t budget = kWritebackBatchBudget;
+    for (auto& device : g_devices) {
+        if (!__atomic_load_n(&device.in_use, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        while (budget > 0) {
+            bool background =
+                __atomic_load_n(&g_counters.dirty_pages, __ATOMIC_RELAXED) >
+                kBackgroundDirtyPages;
+            uint32_t next_lba = 0;
+            bool failed = false;
+            uint32_t start = device.writeback_lba;
+            if (!flush_batch(device, start,
+                             background ? UINT64_MAX : expire_tick,
+                             next_lba, failed)) {
+                if (failed) {
+                    break;
+                }
+                // Nothing past the cursor; wrap to the start of the device.
+                device.writeback_lba = 0;
+                if (start == 0) {
+                    break;
+                }
+                continue;
+            }
+            device.writeback_lba = next_lba;
+            --budget;
+        }
+    }
+
+    uint64_t interval =
+        (__atomic_load_n(&g_counters.dirty_pages, __ATOMIC_RELAXED) >
+         kBackgroundDirtyPages)
+            ? 1
+            : timekeeping::ticks_for_duration_ns(kWritebackIntervalNs);
+    if (interval == 0) {
+        interval = 1;
+    }
+    worker.waiting_on = nullptr;
+    process::block_until(worker, now + interval);
+}
 
-    lock();
-    if (target->valid && target->owner == owner && target->lba == lba) {
-        target->flushing = false;
-        if (target->generation == generation &&
-            status == BlockIoStatus::Ok) {
-            target->dirty = false;
+// Past the throttle threshold a writer pays for its own dirty data by
+// writing back a batch of its device before adding more.
+void throttle_writer(CachedDevice& cached) {
+    uint64_t dirty = __atomic_load_n(&g_counters.dirty_pages, __ATOMIC_RELAXED);
+    if (dirty > kBackgroundDirtyPages) {
+        kick_writeback();
+    }
+    if (dirty > kThrottleDirtyPages) {
+        uint32_t next_lba = 0;
+        bool failed = false;
+        if (!flush_batch(cached, 0, UINT64_MAX, next_lba, failed)) {
+            kick_writeback();
         }
     }
-    unlock();
-    return status == BlockIoStatus::Ok;
 }
 
-bool flush_one_dirty() {
-    lock();
-    CacheEntry* entry = nullptr;
-    for (auto& candidate : g_entries) {
-        if (!candidate.valid || !candidate.dirty || candidate.flushing) {
+// Copies sectors [lba, lba + count) of one page when all of them are cached.
+bool copy_from_cache(CachedDevice& cached,
+                     uint32_t lba,
+                     uint32_t count,
+                     void* out,
+                     bool& out_readahead_hit) {
+    out_readahead_hit = false;
+    uint32_t first_lba = page_base(lba);
+    uint8_t need = sector_mask(lba - first_lba, count);
+    size_t stripe = 0;
+    CachePage* page = acquire_page(cached, first_lba, false, stripe);
+    if (page == nullptr) {
+        return false;
+    }
+    bool hit = (page->valid_mask & need) == need;
+    if (hit) {
+        memcpy(out,
+               page_data(*page) + (lba - first_lba) * kCacheSectorSize,
+               count * kCacheSectorSize);
+        page->referenced = true;
+        out_readahead_hit = page->readahead;
+        page->readahead = false;
+    }
+    release_page(stripe);
+    return hit;
+}
+
+bool page_fully_cached(CachedDevice& cached, uint32_t first_lba) {
+    size_t stripe = 0;
+    CachePage* page = acquire_page(cached, first_lba, false, stripe);
+    if (page == nullptr) {
+        return false;
+    }
+    bool full = page->valid_mask == 0xFF;
+    release_page(stripe);
+    return full;
+}
+
+// Reads pages [first_lba, first_lba + pages * 8) in one command and installs
+// them. Sectors already cached win over the device copy, since they may be
+// dirty. Pages wholly outside [request_lba, request_end) are marked as
+// readahead. When out is set, the requested sectors inside the filled range
+// are copied to it; out_copied reports how many.
+BlockIoStatus fill_pages(CachedDevice& cached,
+                         uint32_t first_lba,
+                         uint32_t pages,
+                         uint32_t request_lba,
+                         uint32_t request_end,
+                         void* out,
+                         uint32_t& out_copied) {
+    out_copied = 0;
+    uint64_t device_sectors = cached.backing.sector_count;
+    if (first_lba >= device_sectors) {
+        return BlockIoStatus::IoError;
+    }
+    uint64_t sectors = static_cast<uint64_t>(pages) * kPageSectors;
+    if (sectors > device_sectors - first_lba) {
+        sectors = device_sectors - first_lba;
+    }
+
+    spin_lock(cached.io_lock);
+    uint8_t* buffer = cached.fill_buffer;
+    BlockIoStatus status = block_read(cached.backing,
+                                      first_lba,
+                                      static_cast<uint8_t>(sectors),
+                                      buffer);
+    if (status != BlockIoStatus::Ok) {
+        spin_unlock(cached.io_lock);
+        return status;
+    }
+
+    uint32_t fill_end = first_lba + static_cast<uint32_t>(sectors);
+    for (uint32_t page_lba = first_lba; page_lba < fill_end;
+         page_lba += kPageSectors) {
+        uint32_t in_page = fill_end - page_lba;
+        if (in_page > kPageSectors) {
+            in_page = kPageSectors;
+        }
+        bool speculative =
+            page_lba + in_page <= request_lba || page_lba >= request_end;
+        size_t stripe = 0;
+        CachePage* page = acquire_page(cached, page_lba, true, stripe);
+        if (page == nullptr) {
             continue;
         }
-        if (entry == nullptr || candidate.age < entry->age) {
-            entry = &candidate;
+        uint8_t* slot = page_data(*page);
+        uint8_t* source = buffer + (page_lba - first_lba) * kCacheSectorSize;
+        bool installed = false;
+        for (uint32_t sector = 0; sector < in_page; ++sector) {
+            size_t offset = sector * kCacheSectorSize;
+            if ((page->valid_mask & (1u << sector)) != 0) {
+                memcpy(source + offset, slot + offset, kCacheSectorSize);
+                continue;
+            }
+            memcpy(slot + offset, source + offset, kCacheSectorSize);
+            page->valid_mask |= static_cast<uint8_t>(1u << sector);
+            installed = true;
         }
+        if (installed) {
+            ++page->generation;
+        }
+        if (speculative) {
+            if (installed) {
+                page->readahead = true;
+                count(g_counters.readahead_pages, 1);
+            }
+        } else {
+            page->referenced = true;
+            count(g_counters.read_misses, 1);
+        }
+        release_page(stripe);
     }
-    unlock();
 
-    if (entry == nullptr) {
-        return false;
+    if (out != nullptr && request_lba >= first_lba &&
+        request_lba < fill_end) {
+        uint32_t copy_end = (request_end < fill_end) ? request_end : fill_end;
+        out_copied = copy_end - request_lba;
+        memcpy(out,
+               buffer + (request_lba - first_lba) * kCacheSectorSize,
+               static_cast<size_t>(out_copied) * kCacheSectorSize);
     }
-    return flush_dirty_entry(entry);
-}
-
-CacheEntry* find_or_prepare_entry_locked(CachedDevice& cached,
-                                         uint32_t lba,
-                                         size_t sector_size) {
-    CacheEntry* entry = find_entry(cached, lba, sector_size);
-    if (entry != nullptr) {
-        return entry;
-    }
-    entry = choose_clean_victim();
-    if (entry == nullptr) {
-        return nullptr;
-    }
-    if (entry->valid) {
-        unlink_entry_locked(*entry);
-    }
-    entry->owner = &cached;
-    entry->lba = lba;
-    entry->sector_size = sector_size;
-    entry->valid = true;
-    entry->dirty = false;
-    entry->flushing = false;
-    link_entry_locked(*entry);
-    return entry;
-}
-
-void invalidate_write_range_locked(CachedDevice& cached,
-                                   uint32_t lba,
-                                   uint8_t sector_count) {
-    for (uint16_t i = 0; i < sector_count; ++i) {
-        CacheEntry* entry = find_entry(cached,
-                                       lba + static_cast<uint32_t>(i),
-                                       cached.backing.sector_size);
-        if (entry == nullptr) {
+    spin_unlock(cached.io_lock);
+    return BlockIoStatus::Ok;
+}
+
+// Tracks the read stream and returns the readahead window in pages, 0 for
+// reads that do not continue the previous one.
+uint32_t note_read(CachedDevice& cached, uint32_t lba, uint32_t sector_count) {
+    spin_lock(cached.state_lock);
+    uint32_t window = 0;
+    if (lba == cached.read_next_lba) {
+        window = (cached.readahead_pages == 0) ? kInitialReadaheadPages
+                                               : cached.readahead_pages * 2;
+        if (window > kMaxFillPages) {
+            window = kMaxFillPages;
+        }
+    }
+    cached.readahead_pages = window;
+    cached.read_next_lba = lba + sector_count;
+    spin_unlock(cached.state_lock);
+    return window;
+}
+
+void note_readahead_end(CachedDevice& cached, uint32_t end_lba) {
+    spin_lock(cached.state_lock);
+    if (end_lba > cached.readahead_end_lba ||
+        cached.readahead_end_lba == kNoStream) {
+        cached.readahead_end_lba = end_lba;
+    }
+    spin_unlock(cached.state_lock);
+}
+
+// A stream consuming readahead pages queues the next window for the idle
+// loop, so it is usually cached before the reader gets there.
+void queue_readahead(CachedDevice& cached) {
+    spin_lock(cached.state_lock);
+    if (cached.readahead_pages != 0 && cached.pending_readahead_pages == 0 &&
+        cached.readahead_end_lba != kNoStream) {
+        uint32_t start = cached.readahead_end_lba;
+        uint32_t stream = page_base(cached.read_next_lba + kPageSectors - 1);
+        if (start < stream) {
+            start = stream;
+        }
+        cached.pending_readahead_lba = start;
+        cached.pending_readahead_pages = cached.readahead_pages;
+    }
+    spin_unlock(cached.state_lock);
+}
+
+void service_readahead(CachedDevice& cached) {
+    spin_lock(cached.state_lock);
+    uint32_t lba = cached.pending_readahead_lba;
+    uint32_t pages = cached.pending_readahead_pages;
+    cached.pending_readahead_pages = 0;
+    spin_unlock(cached.state_lock);
+    if (pages == 0 || lba >= cached.backing.sector_count) {
+        return;
+    }
+    while (pages > 0 && page_fully_cached(cached, lba)) {
+        lba += kPageSectors;
+        --pages;
+    }
+    if (pages == 0) {
+        return;
+    }
+    uint32_t copied = 0;
+    if (fill_pages(cached, lba, pages, lba, lba, nullptr, copied) ==
+        BlockIoStatus::Ok) {
+        note_readahead_end(cached, lba + pages * kPageSectors);
+    }
+}
+
+void invalidate_range(CachedDevice& cached,
+                      uint32_t lba,
+                      uint32_t sector_count) {
+    uint32_t end = lba + sector_count;
+    for (uint32_t page_lba = page_base(lba); page_lba < end;
+         page_lba += kPageSectors) {
+        size_t stripe = 0;
+        CachePage* page = acquire_page(cached, page_lba, false, stripe);
+        if (page == nullptr) {
             continue;
         }
-        unlink_entry_locked(*entry);
-        entry->owner = nullptr;
-        entry->valid = false;
-        entry->dirty = false;
-        entry->flushing = false;
+        uint32_t first = (lba > page_lba) ? lba - page_lba : 0;
+        uint32_t last = (end < page_lba + kPageSectors) ? end - page_lba
+                                                        : kPageSectors;
+        uint8_t mask = sector_mask(first, last - first);
+        page->valid_mask &= static_cast<uint8_t>(~mask);
+        clear_dirty_locked(*page, mask);
+        page->readahead = false;
+        ++page->generation;
+        release_page(stripe);
     }
 }
 
@@ -323,25 +869,24 @@ BlockIoStatus write_through(CachedDevice& cached,
                             uint32_t lba,
                             uint8_t sector_count,
                             const void* buffer) {
-    // Establish cache invalidation and backing-I/O order as one operation.
-    // Readers snapshot write_sequence under the same cache lock, so they
-    // cannot install a backing read that this write has made stale.
-    lock();
-    lock_io(cached);
-    ++cached.write_sequence;
-    invalidate_write_range_locked(cached, lba, sector_count);
-    unlock();
-
+    // Invalidate and write under the I/O lock: fills and flushes of these
+    // sectors also hold it, so none can reinstall or write back older data
+    // around this write.
+    spin_lock(cached.io_lock);
+    invalidate_range(cached, lba, sector_count);
     BlockIoStatus status =
         block_write(cached.backing, lba, sector_count, buffer);
-    unlock_io(cached);
+    spin_unlock(cached.io_lock);
+    if (status == BlockIoStatus::Ok) {
+        count(g_counters.write_through_sectors, sector_count);
+    }
     return status;
 }
 
 bool should_write_through(CachedDevice& cached,
                           uint32_t lba,
                           uint8_t sector_count) {
-    LockGuard guard;
+    spin_lock(cached.state_lock);
     if (cached.have_last_write && lba == cached.last_write_end_lba) {
         uint32_t total = static_cast<uint32_t>(cached.sequential_write_sectors) +
                          static_cast<uint32_t>(sector_count);
@@ -352,8 +897,11 @@ bool should_write_through(CachedDevice& cached,
     }
     cached.have_last_write = true;
     cached.last_write_end_lba = lba + static_cast<uint32_t>(sector_count);
-    return sector_count > 1 ||
-           cached.sequential_write_sectors >= kSequentialWriteThroughSectors;
+    bool through = sector_count > 1 ||
+                   cached.sequential_write_sectors >=
+                       kSequentialWriteThroughSectors;
+    spin_unlock(cached.state_lock);
+    return through;
 }
 
 BlockIoStatus cached_read(void* context,
@@ -367,80 +915,64 @@ BlockIoStatus cached_read(void* context,
     if (sector_count == 0) {
         return BlockIoStatus::Ok;
     }
-    if (cached->backing.sector_size == 0 ||
-        cached->backing.sector_size != kCacheSectorSize) {
-        return read_uncached(*cached, lba, sector_count, buffer);
-    }
     CacheOperation operation;
     if (!operation.uses_cache()) {
         return read_uncached(*cached, lba, sector_count, buffer);
     }
 
-    const size_t sector_size = cached->backing.sector_size;
-    for (uint8_t i = 0; i < sector_count; ++i) {
-        uint32_t sector_lba = lba + i;
-        void* out = byte_offset(buffer, static_cast<size_t>(i) * sector_size);
-        for (;;) {
-            lock();
-            CacheEntry* entry = find_entry(*cached, sector_lba, sector_size);
-            if (entry != nullptr) {
-                ++g_clock;
-                entry->age = g_clock;
-                memcpy(out, entry->data, sector_size);
-                unlock();
-                break;
-            }
-            uint64_t observed_write_sequence = cached->write_sequence;
-            unlock();
-
-            alignas(512) uint8_t sector_buffer[kCacheSectorSize];
-            BlockIoStatus status =
-                read_uncached(*cached, sector_lba, 1, sector_buffer);
-            if (status != BlockIoStatus::Ok) {
-                return status;
+    uint32_t window = note_read(*cached, lba, sector_count);
+    uint32_t end = lba + sector_count;
+    uint32_t current = lba;
+    bool readahead_hit = false;
+    while (current < end) {
+        uint32_t first_lba = page_base(current);
+        uint32_t in_page = first_lba + kPageSectors - current;
+        if (in_page > end - current) {
+            in_page = end - current;
+        }
+        void* out = byte_offset(
+            buffer, static_cast<size_t>(current - lba) * kCacheSectorSize);
+        bool page_readahead_hit = false;
+        if (copy_from_cache(*cached, current, in_page, out,
+                            page_readahead_hit)) {
+            count(g_counters.read_hits, 1);
+            if (page_readahead_hit) {
+                count(g_counters.readahead_hits, 1);
+                readahead_hit = true;
             }
+            current += in_page;
+            continue;
+        }
 
-            bool retry_read = false;
-            for (;;) {
-                lock();
-                // Prefer a cache write that completed while the backing read
-                // was in flight. If a write left no entry (write-through),
-                // repeat the read after that ordered backing write.
-                entry = find_entry(*cached, sector_lba, sector_size);
-                if (entry != nullptr) {
-                    memcpy(sector_buffer, entry->data, sector_size);
-                    ++g_clock;
-                    entry->age = g_clock;
-                    unlock();
-                    break;
-                }
-                if (cached->write_sequence != observed_write_sequence) {
-                    unlock();
-                    retry_read = true;
-                    break;
-                }
-                entry = find_or_prepare_entry_locked(*cached,
-                                                      sector_lba,
-                                                      sector_size);
-                if (entry != nullptr) {
-                    memcpy(entry->data, sector_buffer, sector_size);
-                    ++g_clock;
-                    ++entry->generation;
-                    entry->age = g_clock;
-                    unlock();
-                    break;
-                }
-                unlock();
-                if (!flush_one_dirty()) {
-                    break;
-                }
-            }
-            if (retry_read) {
-                continue;
-            }
-            memcpy(out, sector_buffer, sector_size);
-            break;
+        // Miss: read the rest of the request in one command, plus the
+        // readahead window for a sequential stream, stopping early at pages
+        // that are already cached.
+        uint32_t request_pages =
+            (page_base(end - 1) - first_lba) / kPageSectors + 1;
+        if (request_pages > kMaxFillPages) {
+            request_pages = kMaxFillPages;
         }
+        uint32_t pages = request_pages;
+        while (pages < kMaxFillPages && pages < request_pages + window &&
+               !page_fully_cached(*cached, first_lba + pages * kPageSectors)) {
+            ++pages;
+        }
+        uint32_t copied = 0;
+        BlockIoStatus status = fill_pages(*cached, first_lba, pages, current,
+                                          end, out, copied);
+        if (status != BlockIoStatus::Ok) {
+            return status;
+        }
+        if (copied == 0) {
+            return BlockIoStatus::IoError;
+        }
+        if (pages > request_pages) {
+            note_readahead_end(*cached, first_lba + pages * kPageSectors);
+        }
+        current += copied;
+    }
+    if (readahead_hit) {
+        queue_readahead(*cached);
     }
     return BlockIoStatus::Ok;
 }
@@ -456,11 +988,6 @@ BlockIoStatus cached_write(void* context,
     if (sector_count == 0) {
         return BlockIoStatus::Ok;
     }
-
-    if (cached->backing.sector_size == 0 ||
-        cached->backing.sector_size != kCacheSectorSize) {
-        return write_uncached(*cached, lba, sector_count, buffer);
-    }
     CacheOperation operation;
     if (!operation.uses_cache()) {
         return write_through(*cached, lba, sector_count, buffer);
@@ -468,50 +995,49 @@ BlockIoStatus cached_write(void* context,
 
     // Full-cluster and sustained sequential writes are streaming I/O, even on
     // FAT volumes that use one sector per cluster. Caching them only turns the
-    // transfer into a 32 MiB burst followed by one-sector writeback once the
+    // transfer into a 32 MiB burst followed by page-sized writeback once the
     // cache is full.
     if (should_write_through(*cached, lba, sector_count)) {
         return write_through(*cached, lba, sector_count, buffer);
     }
 
-    const size_t sector_size = cached->backing.sector_size;
-    uint8_t cached_count = 0;
-    while (cached_count < sector_count) {
-        bool cache_full = false;
-        lock();
-        while (cached_count < sector_count) {
-            uint32_t sector_lba = lba + cached_count;
-            const void* in = static_cast<const void*>(
-                static_cast<const uint8_t*>(buffer) +
-                static_cast<size_t>(cached_count) * sector_size);
-            CacheEntry* entry = find_or_prepare_entry_locked(*cached,
-                                                             sector_lba,
-                                                             sector_size);
-            if (entry == nullptr) {
-                cache_full = true;
-                break;
-            }
-            ++cached->write_sequence;
-            memcpy(entry->data, in, sector_size);
-            ++g_clock;
-            ++entry->generation;
-            entry->age = g_clock;
-            entry->dirty = true;
-            ++cached_count;
-        }
-        unlock();
-
-        if (cache_full && !flush_one_dirty()) {
-            const void* in = static_cast<const void*>(
-                static_cast<const uint8_t*>(buffer) +
-                static_cast<size_t>(cached_count) * sector_size);
-            BlockIoStatus status =
-                write_through(*cached, lba + cached_count, 1, in);
+    throttle_writer(*cached);
+    uint32_t end = lba + sector_count;
+    uint32_t current = lba;
+    while (current < end) {
+        uint32_t first_lba = page_base(current);
+        uint32_t in_page = first_lba + kPageSectors - current;
+        if (in_page > end - current) {
+            in_page = end - current;
+        }
+        const void* in = byte_offset(
+            buffer, static_cast<size_t>(current - lba) * kCacheSectorSize);
+        size_t stripe = 0;
+        CachePage* page = acquire_page(*cached, first_lba, true, stripe);
+        if (page == nullptr) {
+            // Every page is dirty: write this sector through and let the
+            // writeback task catch up.
+            kick_writeback();
+            BlockIoStatus status = write_through(
+                *cached, current, static_cast<uint8_t>(in_page), in);
             if (status != BlockIoStatus::Ok) {
                 return status;
             }
-            ++cached_count;
+            current += in_page;
+            continue;
         }
+        uint32_t offset = current - first_lba;
+        memcpy(page_data(*page) + offset * kCacheSectorSize,
+               in,
+               static_cast<size_t>(in_page) * kCacheSectorSize);
+        uint8_t mask = sector_mask(offset, in_page);
+        page->valid_mask |= mask;
+        set_dirty_locked(*page, mask);
+        page->referenced = true;
+        page->readahead = false;
+        ++page->generation;
+        release_page(stripe);
+        current += in_page;
     }
     return BlockIoStatus::Ok;
 }
@@ -519,100 +1045,118 @@ BlockIoStatus cached_write(void* context,
 }  // namespace
 
 void init() {
-    LockGuard guard;
+    spin_lock(g_alloc_lock);
     for (auto& device : g_devices) {
+        uint8_t* fill_buffer = device.fill_buffer;
         device = {};
+        device.fill_buffer = fill_buffer;
+    }
+    for (auto& device : g_devices) {
+        device.dirty_head = -1;
+        device.dirty_tail = -1;
     }
-    for (auto& entry : g_entries) {
-        entry = {};
-        entry.hash_next = -1;
+    for (auto& page : g_pages) {
+        page = {};
+        page.hash_next = -1;
+        page.dirty_prev = -1;
+        page.dirty_next = -1;
     }
     for (auto& head : g_hash_heads) {
         head = -1;
     }
-    g_clock = 0;
-    g_victim_cursor = 0;
+    g_clock_hand = 0;
+    g_counters = {};
     g_active_cached_ops = 0;
-    __atomic_store_n(&g_enabled, true, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_enabled, true, __ATOMIC_SEQ_CST);
+    spin_unlock(g_alloc_lock);
 }
 
-void service_idle_flush() {
-    for (size_t i = 0; i < kIdleFlushBudget; ++i) {
-        if (!flush_one_dirty()) {
-            break;
+void service_idle() {
+    if (cache_enabled()) {
+        for (auto& device : g_devices) {
+            if (!__atomic_load_n(&device.in_use, __ATOMIC_ACQUIRE) ||
+                __atomic_load_n(&device.pending_readahead_pages,
+                                __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+            CacheOperation operation;
+            if (operation.uses_cache()) {
+                service_readahead(device);
+            }
         }
     }
 }
 
-bool flush_all() {
-    for (;;) {
-        bool has_dirty = false;
-        bool has_in_flight = false;
-        bool flushed_any = false;
-        bool failed_any = false;
-
-        for (auto& entry : g_entries) {
-            lock();
-            bool dirty = entry.valid && entry.dirty;
-            bool flushing = dirty && entry.flushing;
-            unlock();
-            if (!dirty) {
-                continue;
-            }
+void start_writeback() {
+    if (__atomic_load_n(&g_writeback_worker, __ATOMIC_ACQUIRE) != nullptr) {
+        return;
+    }
+    process::Process* worker = process::allocate_kernel_task(writeback_worker);
+    if (worker == nullptr) {
+        log_message(LogLevel::Warn,
+                    "BlockCache: no writeback task; dirty pages are only "
+                    "written on sync");
+        return;
+    }
+    __atomic_store_n(&g_writeback_worker, worker, __ATOMIC_RELEASE);
+    scheduler::enqueue(worker);
+}
 
-            has_dirty = true;
-            if (flushing) {
-                has_in_flight = true;
-                continue;
-            }
-            if (flush_dirty_entry(&entry)) {
-                flushed_any = true;
-            } else {
-                failed_any = true;
-            }
+bool flush_all() {
+    bool ok = true;
+    for (auto& device : g_devices) {
+        if (__atomic_load_n(&device.in_use, __ATOMIC_ACQUIRE) &&
+            !flush_device_pages(device)) {
+            ok = false;
         }
+    }
+    return ok;
+}
 
-        if (!has_dirty) {
-            return true;
-        }
-        if (failed_any && !flushed_any) {
-            return false;
-        }
-        if (has_in_flight && !flushed_any) {
-            asm volatile("pause");
-        }
+bool flush_device(const BlockDevice& device) {
+    if (device.read != cached_read || device.context == nullptr) {
+        return true;
     }
+    return flush_device_pages(*static_cast<CachedDevice*>(device.context));
 }
 
 void set_enabled(bool enabled) {
-    lock_mode();
+    spin_lock(g_mode_lock);
     if (!enabled) {
-        lock();
-        __atomic_store_n(&g_enabled, false, __ATOMIC_RELEASE);
-        unlock();
-        for (;;) {
-            lock();
-            bool idle = g_active_cached_ops == 0;
-            unlock();
-            if (idle) {
-                break;
-            }
+        __atomic_store_n(&g_enabled, false, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&g_active_cached_ops, __ATOMIC_SEQ_CST) != 0) {
             asm volatile("pause");
         }
         (void)flush_all();
-        unlock_mode();
+        spin_unlock(g_mode_lock);
         return;
     }
-    lock();
-    __atomic_store_n(&g_enabled, true, __ATOMIC_RELEASE);
-    unlock();
-    unlock_mode();
+    __atomic_store_n(&g_enabled, true, __ATOMIC_SEQ_CST);
+    spin_unlock(g_mode_lock);
 }
 
 bool enabled() {
     return cache_enabled();
 }
 
+void snapshot(descriptor_defs::BlockCacheStats& out) {
+    out = {};
+    out.page_size = kCachePageSize;
+    out.pages_total = kCachePageCount;
+    out.pages_dirty = __atomic_load_n(&g_counters.dirty_pages, __ATOMIC_RELAXED);
+    out.read_hits = __atomic_load_n(&g_counters.read_hits, __ATOMIC_RELAXED);
+    out.read_misses = __atomic_load_n(&g_counters.read_misses, __ATOMIC_RELAXED);
+    out.readahead_pages =
+        __atomic_load_n(&g_counters.readahead_pages, __ATOMIC_RELAXED);
+    out.readahead_hits =
+        __atomic_load_n(&g_counters.readahead_hits, __ATOMIC_RELAXED);
+    out.writeback_sectors =
+        __atomic_load_n(&g_counters.writeback_sectors, __ATOMIC_RELAXED);
+    out.write_through_sectors =
+        __atomic_load_n(&g_counters.write_through_sectors, __ATOMIC_RELAXED);
+    out.evictions = __atomic_load_n(&g_counters.evictions, __ATOMIC_RELAXED);
+}
+
 bool wrap_device(const BlockDevice& backing, BlockDevice& out_device) {
     out_device = backing;
     if (backing.sector_size == 0 || backing.sector_size != kCacheSectorSize ||
@@ -620,20 +1164,44 @@ bool wrap_device(const BlockDevice& backing, BlockDevice& out_device) {
         return true;
     }
 
-    LockGuard guard;
+    spin_lock(g_device_lock);
     for (auto& device : g_devices) {
         if (device.in_use) {
             continue;
         }
+        if (device.fill_buffer == nullptr) {
+            device.fill_buffer = static_cast<uint8_t*>(
+                memory::alloc_kernel_uninitialized(kFillBufferSize, 4096));
+        }
+        if (device.fill_buffer == nullptr) {
+            // Leave the device uncached rather than fail the mount.
+            spin_unlock(g_device_lock);
+            log_message(LogLevel::Warn,
+                        "BlockCache: no fill buffer for %s",
+                        backing.name != nullptr ? backing.name : "(unnamed)");
+            return true;
+        }
         device.backing = backing;
-        device.in_use = true;
+        device.read_next_lba = kNoStream;
+        device.readahead_pages = 0;
+        device.readahead_end_lba = kNoStream;
+        device.pending_readahead_pages = 0;
+        device.dirty_head = -1;
+        device.dirty_tail = -1;
+        device.writeback_lba = 0;
+        __atomic_store_n(&device.in_use, true, __ATOMIC_RELEASE);
+        spin_unlock(g_device_lock);
 
         out_device.read = cached_read;
         out_device.write = backing.write != nullptr ? cached_write : nullptr;
         out_device.context = &device;
+        // Queued I/O would bypass the cache; callers go through read/write.
+        out_device.submit = nullptr;
+        out_device.wait = nullptr;
         out_device.descriptor_handle = descriptor::kInvalidHandle;
         return true;
     }
+    spin_unlock(g_device_lock);
 
     log_message(LogLevel::Warn,
                 "BlockCache: no wrapper slots for %s",
@@ -1,15 +1,22 @@
 #pragma once
 
 #include "block_device.hpp"
+#include "descriptors.hpp"
 
 namespace fs {
 namespace block_cache {
 
 void init();
-void service_idle_flush();
+// Starts the background writeback task; needs the scheduler.
+void start_writeback();
+// Runs readahead queued by sequential readers.
+void service_idle();
 bool flush_all();
+// Writes back the dirty pages of one device returned by wrap_device.
+bool flush_device(const BlockDevice& device);
 void set_enabled(bool enabled);
 bool enabled();
+void snapshot(descriptor_defs::BlockCacheStats& out);
 
 bool wrap_device(const BlockDevice& backing, BlockDevice& out_device);
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "kernel/descriptor.hpp"
+#include "kernel/trace.hpp"
 
 namespace fs {
 
@@ -21,6 +22,22 @@ using BlockWriteFn =
     BlockIoStatus (*)(void* context, uint32_t lba, uint8_t sector_count,
                       const void* buffer);
 
+// A transfer that can be left in flight while the caller queues more.
+// When block_submit() returns Ok, the buffer and the request belong to the
+// driver until block_wait() returns the transfer's status. Busy means the
+// device queue is full and the caller should wait on an earlier request.
+struct BlockRequest {
+    uint32_t lba;
+    uint8_t sector_count;
+    bool is_write;
+    void* buffer;
+    BlockIoStatus status;
+    void* driver_data;  // nullptr when the request already completed
+};
+
+using BlockSubmitFn = BlockIoStatus (*)(void* context, BlockRequest& request);
+using BlockWaitFn = BlockIoStatus (*)(void* context, BlockRequest& request);
+
 struct BlockDevice {
     const char* name;
     const char* parent_name = nullptr;
@@ -34,10 +51,32 @@ struct BlockDevice {
     BlockReadFn read;
     BlockWriteFn write;
     void* context;
+    // Optional queued I/O; devices without it complete requests in submit.
+    BlockSubmitFn submit = nullptr;
+    BlockWaitFn wait = nullptr;
 };
 
-inline BlockIoStatus block_read(const BlockDevice& device, uint32_t lba,
-                                uint8_t sector_count, void* buffer) {
+inline uint64_t block_trace_bits(uint8_t sector_count, bool is_write) {
+    return (static_cast<uint64_t>(sector_count) &
+            descriptor_defs::kTraceBlockSectorMask) |
+           (is_write ? descriptor_defs::kTraceBlockWrite : 0);
+}
+
+inline void block_trace_complete(uint64_t lba,
+                                 uint8_t sector_count,
+                                 bool is_write,
+                                 BlockIoStatus status) {
+    trace::record(trace::Event::BlockComplete,
+                  lba,
+                  block_trace_bits(sector_count, is_write) |
+                      (static_cast<uint64_t>(status)
+                       << descriptor_defs::kTraceBlockStatusShift));
+}
+
+inline BlockIoStatus block_read_untraced(const BlockDevice& device,
+                                         uint32_t lba,
+                                         uint8_t sector_count,
+                                         void* buffer) {
     if (device.descriptor_handle != descriptor::kInvalidHandle) {
         uint64_t length = static_cast<uint64_t>(sector_count) * device.sector_size;
         uint64_t offset = static_cast<uint64_t>(lba) * device.sector_size;
@@ -56,8 +95,11 @@ inline BlockIoStatus block_read(const BlockDevice& device, uint32_t lba,
     return device.read(device.context, lba, sector_count, buffer);
 }
 
-inline BlockIoStatus block_write(const BlockDevice& device, uint32_t lba,
-                                 uint8_t sector_count, const void* buffer) {
+inline BlockIoStatus block_write_untraced(const BlockDevice& device,
+                                          uint32_t lba,
+                                          uint8_t sector_count,
+                                          const void* buffer) {
+
     if (device.descriptor_handle != descriptor::kInvalidHandle) {
         uint64_t length = static_cast<uint64_t>(sector_count) * device.sector_size;
         uint64_t offset = static_cast<uint64_t>(lba) * device.sector_size;
@@ -76,4 +118,69 @@ inline BlockIoStatus block_write(const BlockDevice& device, uint32_t lba,
     return device.write(device.context, lba, sector_count, buffer);
 }
 
+// Block tracepoints carry the device-relative LBA the caller asked for.
+inline BlockIoStatus block_read(const BlockDevice& device, uint32_t lba,
+                                uint8_t sector_count, void* buffer) {
+    trace::record(trace::Event::BlockSubmit,
+                  lba,
+                  block_trace_bits(sector_count, false));
+    BlockIoStatus status =
+        block_read_untraced(device, lba, sector_count, buffer);
+    block_trace_complete(lba, sector_count, false, status);
+    return status;
+}
+
+inline BlockIoStatus block_write(const BlockDevice& device, uint32_t lba,
+                                 uint8_t sector_count, const void* buffer) {
+    trace::record(trace::Event::BlockSubmit,
+                  lba,
+                  block_trace_bits(sector_count, true));
+    BlockIoStatus status =
+        block_write_untraced(device, lba, sector_count, buffer);
+    block_trace_complete(lba, sector_count, true, status);
+    return status;
+}
+
+inline BlockIoStatus block_submit(const BlockDevice& device,
+                                  BlockRequest& request) {
+    request.driver_data = nullptr;
+    if (device.descriptor_handle == descriptor::kInvalidHandle &&
+        device.submit != nullptr && device.wait != nullptr) {
+        trace::record(trace::Event::BlockSubmit,
+                      request.lba,
+                      block_trace_bits(request.sector_count,
+                                       request.is_write));
+        BlockIoStatus status = device.submit(device.context, request);
+        if (status != BlockIoStatus::Ok || request.driver_data == nullptr) {
+            block_trace_complete(request.lba,
+                                 request.sector_count,
+                                 request.is_write,
+                                 status != BlockIoStatus::Ok
+                                     ? status
+                                     : request.status);
+        }
+        return status;
+    }
+    request.status =
+        request.is_write
+            ? block_write(device, request.lba, request.sector_count,
+                          request.buffer)
+            : block_read(device, request.lba, request.sector_count,
+                         request.buffer);
+    return BlockIoStatus::Ok;
+}
+
+inline BlockIoStatus block_wait(const BlockDevice& device,
+                                BlockRequest& request) {
+    if (request.driver_data == nullptr || device.wait == nullptr) {
+        return request.status;
+    }
+    BlockIoStatus status = device.wait(device.context, request);
+    block_trace_complete(request.lba,
+                         request.sector_count,
+                         request.is_write,
+                         status);
+    return status;
+}
+
 }  // namespace fs
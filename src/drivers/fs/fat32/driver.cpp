@@ -14,7 +14,10 @@ Fat32Volume g_volumes[kMaxFat32Volumes];
 Fat32Volume* allocate_volume() {
     for (size_t i = 0; i < kMaxFat32Volumes; ++i) {
         if (!g_volumes[i].mounted) {
+            // A slot whose mount failed keeps its FAT cache for the next one.
+            Fat32FatCache* fat_cache = g_volumes[i].fat_cache;
             memset(&g_volumes[i], 0, sizeof(Fat32Volume));
+            g_volumes[i].fat_cache = fat_cache;
             return &g_volumes[i];
         }
     }
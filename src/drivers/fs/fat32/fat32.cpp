@@ -3,8 +3,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "drivers/fs/block_cache.hpp"
 #include "drivers/log/logging.hpp"
 #include "fs/vfs.hpp"
+#include "kernel/memory/physical_allocator.hpp"
 #include "lib/mem.hpp"
 
 namespace {
@@ -59,11 +61,52 @@ constexpr uint32_t kFsInfoLeadSignature = 0x41615252;
 constexpr uint32_t kFsInfoStructSignature = 0x61417272;
 constexpr uint32_t kFsInfoTrailSignature = 0xAA550000;
 
-alignas(512) uint8_t sector_buffer[512];
-alignas(512) uint8_t cluster_buffer[32768];
-alignas(512) uint8_t fat_cache[512];
-uint32_t fat_cache_sector = 0xFFFFFFFF;
-const fs::BlockDevice* fat_cache_device = nullptr;
+// Each volume caches FAT sectors in windows of kFatSectorsPerLine, each
+// filled by one device request and evicted least recently used.
+constexpr uint32_t kFatCacheLines = 32;
+constexpr uint32_t kFatSectorsPerLine = 8;
+// Largest transfer the block layer takes in one request.
+constexpr uint32_t kMaxSectorsPerRequest = 255;
+constexpr size_t kMaxClusterBytes = 32768;
+// Idle cluster scratch buffers kept for reuse between operations.
+constexpr size_t kMaxPooledScratch = 8;
+
+struct FatCacheLine {
+    uint8_t data[kFatSectorsPerLine * 512];
+    uint32_t first_sector;  // relative to the start of the first FAT
+    bool valid;
+    uint64_t last_use;
+};
+
+// Clusters of a file held as runs of physically consecutive clusters, in
+// file order. Filled from the FAT on demand, so only the part of the chain
+// up to the furthest cluster touched has been walked.
+struct Fat32Extent {
+    uint32_t file_cluster;  // index of the run's first cluster in the file
+    uint32_t disk_cluster;
+    uint32_t length;
+};
+
+struct ExtentMap {
+    Fat32Extent* extents;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t mapped_clusters;
+    bool complete;  // the chain ends after mapped_clusters
+};
+
+sync::SpinLock g_scratch_lock;
+uint8_t* g_scratch_pool[kMaxPooledScratch]{};
+size_t g_scratch_pooled = 0;
+
+}  // namespace
+
+struct Fat32FatCache {
+    FatCacheLine lines[kFatCacheLines];
+    uint64_t clock;
+};
+
+namespace {
 
 struct LfnState {
     char name[kMaxLfnLength];
@@ -126,58 +169,155 @@ bool write_sectors(const fs::BlockDevice& device, uint32_t lba, uint8_t count,
     return true;
 }
 
-uint32_t read_fat_entry(Fat32Volume& volume, uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = volume.fat_begin_lba + (fat_offset / 512);
-    uint32_t within_sector = fat_offset % 512;
+// Cluster-sized scratch owned by one operation, so concurrent operations
+// never share a buffer. Released buffers are pooled for the next one.
+uint8_t* acquire_scratch() {
+    {
+        sync::IrqLockGuard guard(g_scratch_lock);
+        if (g_scratch_pooled != 0) {
+            return g_scratch_pool[--g_scratch_pooled];
+        }
+    }
+    auto* buffer = static_cast<uint8_t*>(
+        memory::alloc_kernel_uninitialized(kMaxClusterBytes, 512));
+    if (buffer == nullptr) {
+        log_message(LogLevel::Warn, "FAT32: out of memory for cluster scratch");
+    }
+    return buffer;
+}
 
-    if (fat_cache_sector != fat_sector || fat_cache_device != &volume.device) {
-        if (!read_sector(volume.device, fat_sector, fat_cache)) {
-            return 0x0FFFFFFF;
+void release_scratch(uint8_t* buffer) {
+    if (buffer == nullptr) {
+        return;
+    }
+    {
+        sync::IrqLockGuard guard(g_scratch_lock);
+        if (g_scratch_pooled < kMaxPooledScratch) {
+            g_scratch_pool[g_scratch_pooled++] = buffer;
+            return;
+        }
+    }
+    memory::free_kernel(buffer);
+}
+
+class ScratchBuffer {
+public:
+    ScratchBuffer() : data_(acquire_scratch()) {}
+    ~ScratchBuffer() { release_scratch(data_); }
+    ScratchBuffer(const ScratchBuffer&) = delete;
+    ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+    uint8_t* data() const { return data_; }
+private:
+    uint8_t* data_;
+};
+
+// Returns the cache line holding FAT sector |sector|, reading the window
+// around it on a miss. Needs volume.fat_lock.
+FatCacheLine* fat_cache_line(Fat32Volume& volume, uint32_t sector) {
+    Fat32FatCache* cache = volume.fat_cache;
+    if (cache == nullptr || sector >= volume.fat_size_sectors) {
+        return nullptr;
+    }
+    uint32_t first = sector - (sector % kFatSectorsPerLine);
+    FatCacheLine* victim = &cache->lines[0];
+    for (auto& line : cache->lines) {
+        if (line.valid && line.first_sector == first) {
+            line.last_use = ++cache->clock;
+            return &line;
+        }
+        if (victim->valid &&
+            (!line.valid || line.last_use < victim->last_use)) {
+            victim = &line;
         }
-        fat_cache_sector = fat_sector;
-        fat_cache_device = &volume.device;
     }
 
-    uint32_t value = *reinterpret_cast<uint32_t*>(fat_cache + within_sector);
-    return value & kFatEntryMask;
+    uint32_t count = volume.fat_size_sectors - first;
+    if (count > kFatSectorsPerLine) {
+        count = kFatSectorsPerLine;
+    }
+    victim->valid = false;
+    if (!read_sectors(volume.device,
+                      volume.fat_begin_lba + first,
+                      static_cast<uint8_t>(count),
+                      victim->data)) {
+        return nullptr;
+    }
+    victim->valid = true;
+    victim->first_sector = first;
+    victim->last_use = ++cache->clock;
+    return victim;
 }
 
-bool write_fat_entry(Fat32Volume& volume, uint32_t cluster,
-                     uint32_t value) {
+uint32_t* fat_entry_slot(FatCacheLine& line, uint32_t cluster) {
     uint32_t fat_offset = cluster * 4;
-    uint32_t sector_index = fat_offset / 512;
-    uint32_t within_sector = fat_offset % 512;
-    uint32_t fat_sector = volume.fat_begin_lba + sector_index;
+    uint32_t within_line = fat_offset - line.first_sector * 512;
+    return reinterpret_cast<uint32_t*>(line.data + within_line);
+}
 
-    if (!read_sector(volume.device, fat_sector, fat_cache)) {
+bool load_fat_entry(Fat32Volume& volume, uint32_t cluster, uint32_t& out) {
+    sync::LockGuard guard(volume.fat_lock);
+    FatCacheLine* line = fat_cache_line(volume, (cluster * 4) / 512);
+    if (line == nullptr) {
         return false;
     }
+    out = *fat_entry_slot(*line, cluster) & kFatEntryMask;
+    return true;
+}
 
-    uint32_t original =
-        *reinterpret_cast<uint32_t*>(fat_cache + within_sector);
-    uint32_t new_value =
-        (original & 0xF0000000u) | (value & kFatEntryMask);
-    *reinterpret_cast<uint32_t*>(fat_cache + within_sector) = new_value;
+uint32_t read_fat_entry(Fat32Volume& volume, uint32_t cluster) {
+    uint32_t value = 0;
+    if (!load_fat_entry(volume, cluster, value)) {
+        return 0x0FFFFFFF;
+    }
+    return value;
+}
 
-    if (!write_sector(volume.device, fat_sector, fat_cache)) {
+void note_cluster_state(Fat32Volume& volume, uint32_t cluster, bool used) {
+    if (volume.cluster_bitmap == nullptr || cluster < 2 ||
+        cluster > volume.total_clusters + 1) {
+        return;
+    }
+    uint32_t bit = cluster - 2;
+    uint64_t mask = 1ull << (bit % 64);
+    uint64_t& word = volume.cluster_bitmap[bit / 64];
+    if (used && (word & mask) == 0) {
+        word |= mask;
+        --volume.free_clusters;
+    } else if (!used && (word & mask) != 0) {
+        word &= ~mask;
+        ++volume.free_clusters;
+    }
+}
+
+// Updates the cached FAT entry and writes its sector through to every FAT
+// copy.
+bool write_fat_entry(Fat32Volume& volume, uint32_t cluster,
+                     uint32_t value) {
+    uint32_t sector_index = (cluster * 4) / 512;
+    sync::LockGuard guard(volume.fat_lock);
+    FatCacheLine* line = fat_cache_line(volume, sector_index);
+    if (line == nullptr) {
         return false;
     }
 
-    // Update cache to reflect new value.
-    fat_cache_sector = fat_sector;
-    fat_cache_device = &volume.device;
+    uint32_t* slot = fat_entry_slot(*line, cluster);
+    *slot = (*slot & 0xF0000000u) | (value & kFatEntryMask);
+    const uint8_t* sector_data =
+        line->data + (sector_index - line->first_sector) * 512;
 
-    // Mirror to additional FATs if present.
-    for (uint32_t fat = 1; fat < volume.num_fats; ++fat) {
-        uint32_t mirror_sector =
-            volume.fat_begin_lba + (fat * volume.fat_size_sectors) +
-            sector_index;
-        if (!write_sector(volume.device, mirror_sector, fat_cache)) {
+    for (uint32_t fat = 0; fat < volume.num_fats; ++fat) {
+        uint32_t lba = volume.fat_begin_lba + (fat * volume.fat_size_sectors) +
+                       sector_index;
+        if (!write_sector(volume.device, lba, sector_data)) {
+            // The cached copy no longer matches the disk.
+            line->valid = false;
             return false;
         }
     }
 
+    note_cluster_state(volume,
+                       cluster,
+                       (value & kFatEntryMask) != kFatFreeCluster);
     return true;
 }
 
@@ -388,6 +528,11 @@ enum class IterationResult {
 
 template <typename Fn>
 bool iterate_directory(Fat32Volume& volume, uint32_t start_cluster, Fn&& fn) {
+    ScratchBuffer scratch;
+    uint8_t* cluster_buffer = scratch.data();
+    if (cluster_buffer == nullptr) {
+        return false;
+    }
     uint32_t current_cluster = start_cluster;
     bool done = false;
     size_t raw_index = 0;
@@ -508,6 +653,7 @@ void initialize_next_free(Fat32Volume& volume) {
         return;
     }
 
+    alignas(16) uint8_t sector_buffer[512];
     if (!read_sector(volume.device, volume.fs_info_sector, sector_buffer)) {
         log_message(LogLevel::Warn,
                     "FAT32: failed to read FSINFO, using default allocator");
@@ -538,12 +684,17 @@ void initialize_next_free(Fat32Volume& volume) {
 bool clear_cluster(Fat32Volume& volume, uint32_t cluster) {
     size_t bytes =
         static_cast<size_t>(volume.sectors_per_cluster) * 512u;
-    if (bytes > sizeof(cluster_buffer)) {
+    if (bytes > kMaxClusterBytes) {
         log_message(LogLevel::Warn,
                     "FAT32: cluster buffer too small for cluster %u",
                     cluster);
         return false;
     }
+    ScratchBuffer scratch;
+    uint8_t* cluster_buffer = scratch.data();
+    if (cluster_buffer == nullptr) {
+        return false;
+    }
     memset(cluster_buffer, 0, bytes);
     uint32_t lba = cluster_to_lba(volume, cluster);
     return write_sectors(volume.device,
@@ -552,6 +703,125 @@ bool clear_cluster(Fat32Volume& volume, uint32_t cluster) {
                          cluster_buffer);
 }
 
+size_t cluster_bitmap_words(const Fat32Volume& volume) {
+    return (static_cast<size_t>(volume.total_clusters) + 63u) / 64u;
+}
+
+// Builds the free-cluster bitmap from the FAT, one scratch buffer of FAT
+// sectors per device read. Runs at mount, before the volume is visible to
+// other CPUs. Failure only costs speed: allocation keeps scanning the FAT.
+bool build_cluster_bitmap(Fat32Volume& volume) {
+    size_t words = cluster_bitmap_words(volume);
+    auto* bitmap = static_cast<uint64_t*>(
+        memory::alloc_kernel(words * sizeof(uint64_t)));
+    if (bitmap == nullptr) {
+        return false;
+    }
+    ScratchBuffer scratch;
+    uint8_t* buffer = scratch.data();
+    if (buffer == nullptr) {
+        memory::free_kernel(bitmap);
+        return false;
+    }
+
+    constexpr uint32_t kEntriesPerSector = 512 / 4;
+    constexpr uint32_t kWindowSectors = kMaxClusterBytes / 512;
+    // A FAT shorter than the data area leaves the clusters past its end
+    // marked allocated, so they are never handed out.
+    uint64_t fat_entries =
+        static_cast<uint64_t>(volume.fat_size_sectors) * kEntriesPerSector;
+    uint32_t end = volume.total_clusters + 2;
+    if (fat_entries < end) {
+        end = static_cast<uint32_t>(fat_entries);
+    }
+    uint32_t free_count = 0;
+    for (uint32_t sector = 0; sector * kEntriesPerSector < end;
+         sector += kWindowSectors) {
+        uint32_t first = sector * kEntriesPerSector;
+        uint32_t count = volume.fat_size_sectors - sector;
+        if (count > kWindowSectors) {
+            count = kWindowSectors;
+        }
+        if (!read_sectors(volume.device,
+                          volume.fat_begin_lba + sector,
+                          static_cast<uint8_t>(count),
+                          buffer)) {
+            memory::free_kernel(bitmap);
+            return false;
+        }
+        const auto* entries = reinterpret_cast<const uint32_t*>(buffer);
+        uint32_t last = first + count * kEntriesPerSector;
+        if (last > end) {
+            last = end;
+        }
+        for (uint32_t cluster = first < 2 ? 2 : first; cluster < last;
+             ++cluster) {
+            uint32_t bit = cluster - 2;
+            if ((entries[cluster - first] & kFatEntryMask) == kFatFreeCluster) {
+                ++free_count;
+            } else {
+                bitmap[bit / 64] |= 1ull << (bit % 64);
+            }
+        }
+    }
+    for (uint32_t bit = end > 2 ? end - 2 : 0; bit < volume.total_clusters;
+         ++bit) {
+        bitmap[bit / 64] |= 1ull << (bit % 64);
+    }
+    // Bits past the last cluster read as allocated so searches skip them.
+    uint32_t tail_bits = volume.total_clusters % 64;
+    if (tail_bits != 0) {
+        bitmap[words - 1] |= ~0ull << tail_bits;
+    }
+
+    volume.cluster_bitmap = bitmap;
+    volume.free_clusters = free_count;
+    log_message(LogLevel::Info,
+                "FAT32: %u of %u clusters free",
+                free_count,
+                volume.total_clusters);
+    return true;
+}
+
+bool find_free_cluster(Fat32Volume& volume,
+                       uint32_t start,
+                       uint32_t& out_cluster) {
+    uint32_t max_cluster = volume.total_clusters + 1;
+    if (volume.cluster_bitmap != nullptr) {
+        if (volume.free_clusters == 0) {
+            return false;
+        }
+        size_t words = cluster_bitmap_words(volume);
+        size_t first_word = (start - 2) / 64;
+        for (size_t scanned = 0; scanned <= words; ++scanned) {
+            size_t word_index = (first_word + scanned) % words;
+            uint64_t used = volume.cluster_bitmap[word_index];
+            if (scanned == 0) {
+                used |= (1ull << ((start - 2) % 64)) - 1;
+            }
+            if (used != ~0ull) {
+                out_cluster = static_cast<uint32_t>(
+                    word_index * 64 + __builtin_ctzll(~used) + 2);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t cluster = start;
+    do {
+        if (read_fat_entry(volume, cluster) == kFatFreeCluster) {
+            out_cluster = cluster;
+            return true;
+        }
+        ++cluster;
+        if (cluster > max_cluster) {
+            cluster = 2;
+        }
+    } while (cluster != start);
+    return false;
+}
+
 bool allocate_cluster(Fat32Volume& volume, uint32_t& out_cluster) {
     if (volume.total_clusters == 0) {
         log_message(LogLevel::Warn, "FAT32: no clusters available");
@@ -564,34 +834,349 @@ bool allocate_cluster(Fat32Volume& volume, uint32_t& out_cluster) {
         start = 2;
     }
 
-    uint32_t cluster = start;
-    do {
-        uint32_t status = read_fat_entry(volume, cluster);
-        if (status == kFatFreeCluster) {
-            if (!write_fat_entry(volume, cluster, kFatEoc)) {
+    uint32_t cluster = 0;
+    if (!find_free_cluster(volume, start, cluster)) {
+        log_message(LogLevel::Warn, "FAT32: out of free clusters");
+        return false;
+    }
+    if (!write_fat_entry(volume, cluster, kFatEoc)) {
+        return false;
+    }
+    if (!clear_cluster(volume, cluster)) {
+        return false;
+    }
+    out_cluster = cluster;
+
+    uint32_t next_candidate = cluster + 1;
+    if (next_candidate > max_cluster) {
+        next_candidate = 2;
+    }
+    volume.next_free_cluster = next_candidate;
+    return true;
+}
+
+void reset_extent_map(ExtentMap& map) {
+    if (map.extents != nullptr) {
+        memory::free_kernel(map.extents);
+    }
+    memset(&map, 0, sizeof(map));
+}
+
+bool append_extent(ExtentMap& map, uint32_t cluster) {
+    if (map.count != 0) {
+        Fat32Extent& last = map.extents[map.count - 1];
+        if (last.disk_cluster + last.length == cluster) {
+            ++last.length;
+            ++map.mapped_clusters;
+            return true;
+        }
+    }
+    if (map.count == map.capacity) {
+        uint32_t capacity = map.capacity == 0 ? 8 : map.capacity * 2;
+        auto* grown = static_cast<Fat32Extent*>(
+            memory::alloc_kernel(capacity * sizeof(Fat32Extent)));
+        if (grown == nullptr) {
+            log_message(LogLevel::Warn,
+                        "FAT32: out of memory for %u extents",
+                        capacity);
+            return false;
+        }
+        if (map.extents != nullptr) {
+            memcpy(grown, map.extents, map.count * sizeof(Fat32Extent));
+            memory::free_kernel(map.extents);
+        }
+        map.extents = grown;
+        map.capacity = capacity;
+    }
+    map.extents[map.count++] = {map.mapped_clusters, cluster, 1};
+    ++map.mapped_clusters;
+    return true;
+}
+
+uint32_t last_mapped_cluster(const ExtentMap& map) {
+    const Fat32Extent& last = map.extents[map.count - 1];
+    return last.disk_cluster + last.length - 1;
+}
+
+// Walks the chain from where the map ends until it covers file cluster
+// |index| or reaches the end of the chain.
+bool extend_extent_map(Fat32Volume& volume,
+                       ExtentMap& map,
+                       uint32_t first_cluster,
+                       uint32_t index) {
+    uint32_t max_cluster = volume.total_clusters + 1;
+    if (map.mapped_clusters == 0 && !map.complete) {
+        if (first_cluster < 2) {
+            map.complete = true;
+            return true;
+        }
+        if (first_cluster > max_cluster) {
+            log_message(LogLevel::Warn,
+                        "FAT32: invalid first cluster %u", first_cluster);
+            return false;
+        }
+        if (!append_extent(map, first_cluster)) {
+            return false;
+        }
+    }
+
+    while (!map.complete && map.mapped_clusters <= index) {
+        uint32_t cluster = last_mapped_cluster(map);
+        uint32_t next = 0;
+        if (!load_fat_entry(volume, cluster, next)) {
+            return false;
+        }
+        if (next >= kFatEoc) {
+            map.complete = true;
+            break;
+        }
+        if (next == kFatBadCluster) {
+            log_message(LogLevel::Warn, "FAT32: bad cluster in chain");
+            return false;
+        }
+        if (next < 2 || next > max_cluster) {
+            log_message(LogLevel::Warn,
+                        "FAT32: cluster %u points to invalid next %u",
+                        cluster, next);
+            return false;
+        }
+        if (map.mapped_clusters > volume.total_clusters) {
+            log_message(LogLevel::Warn, "FAT32: cluster chain loop detected");
+            return false;
+        }
+        if (!append_extent(map, next)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds file cluster |index| and how many clusters from it on are
+// physically consecutive. Fails when the chain is shorter than that;
+// map.complete then tells a short chain from an I/O or memory error.
+bool lookup_extent(Fat32Volume& volume,
+                   ExtentMap& map,
+                   uint32_t first_cluster,
+                   uint32_t index,
+                   uint32_t& out_cluster,
+                   uint32_t& out_run) {
+    if (!extend_extent_map(volume, map, first_cluster, index) ||
+        index >= map.mapped_clusters) {
+        return false;
+    }
+    uint32_t low = 0;
+    uint32_t high = map.count - 1;
+    while (low < high) {
+        uint32_t mid = low + (high - low + 1) / 2;
+        if (map.extents[mid].file_cluster <= index) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    const Fat32Extent& extent = map.extents[low];
+    uint32_t skip = index - extent.file_cluster;
+    out_cluster = extent.disk_cluster + skip;
+    out_run = extent.length - skip;
+    return true;
+}
+
+// Clusters moved per device request for runs of consecutive clusters.
+uint32_t max_clusters_per_request(const Fat32Volume& volume) {
+    uint32_t clusters = kMaxSectorsPerRequest / volume.sectors_per_cluster;
+    return clusters == 0 ? 1 : clusters;
+}
+
+// How the caller of a data transfer holds the volume lock, so whole-cluster
+// runs can be moved with it dropped, and the flag of the handle being served,
+// which says whether the file was removed while it was.
+struct VolumeLockHold {
+    bool exclusive;
+    const bool* chain_freed;
+};
+
+// Drops the volume lock around one device transfer; a null hold means the
+// caller does not take it. The pin keeps free_cluster_chain() from reusing
+// the clusters until the transfer is done, and goes before the lock is taken
+// back since a remover waits for it with the lock held.
+class UnlockedDataIo {
+public:
+    UnlockedDataIo(Fat32Volume& volume, const VolumeLockHold* hold)
+        : volume_(volume), hold_(hold) {
+        if (hold_ == nullptr) {
+            return;
+        }
+        __atomic_add_fetch(&volume_.data_io_pins, 1u, __ATOMIC_ACQUIRE);
+        if (hold_->exclusive) {
+            volume_.lock.unlock();
+        } else {
+            volume_.lock.unlock_shared();
+        }
+    }
+    ~UnlockedDataIo() {
+        if (hold_ == nullptr) {
+            return;
+        }
+        __atomic_sub_fetch(&volume_.data_io_pins, 1u, __ATOMIC_RELEASE);
+        if (hold_->exclusive) {
+            volume_.lock.lock();
+        } else {
+            volume_.lock.lock_shared();
+        }
+    }
+    UnlockedDataIo(const UnlockedDataIo&) = delete;
+    UnlockedDataIo& operator=(const UnlockedDataIo&) = delete;
+private:
+    Fat32Volume& volume_;
+    const VolumeLockHold* hold_;
+};
+
+bool chain_freed_meanwhile(const VolumeLockHold* hold) {
+    return hold != nullptr && *hold->chain_freed;
+}
+
+// Copies file bytes [offset, offset + length) out through |map|. Whole
+// clusters go straight to |out|, one request per consecutive run and, given
+// a |hold|, with the volume lock dropped; partial clusters bounce through a
+// scratch buffer. Stops early, successfully, where the chain ends or once
+// the file has been removed.
+bool read_mapped_range(Fat32Volume& volume,
+                       ExtentMap& map,
+                       uint32_t first_cluster,
+                       uint32_t offset,
+                       uint8_t* out,
+                       size_t length,
+                       size_t& out_size,
+                       const VolumeLockHold* hold) {
+    const uint32_t cluster_size = volume.sectors_per_cluster * 512u;
+    while (length != 0) {
+        uint32_t cluster_index = offset / cluster_size;
+        uint32_t cluster_offset = offset % cluster_size;
+        uint32_t cluster = 0;
+        uint32_t run = 0;
+        if (!lookup_extent(volume, map, first_cluster, cluster_index, cluster,
+                           run)) {
+            return map.complete && cluster_index >= map.mapped_clusters;
+        }
+
+        uint32_t lba = cluster_to_lba(volume, cluster);
+        size_t chunk = 0;
+        if (cluster_offset == 0 && length >= cluster_size) {
+            uint32_t clusters = static_cast<uint32_t>(length / cluster_size);
+            if (clusters > run) {
+                clusters = run;
+            }
+            uint32_t limit = max_clusters_per_request(volume);
+            if (clusters > limit) {
+                clusters = limit;
+            }
+            bool ok = false;
+            {
+                UnlockedDataIo unlocked(volume, hold);
+                ok = read_sectors(volume.device, lba,
+                                  static_cast<uint8_t>(
+                                      clusters * volume.sectors_per_cluster),
+                                  out);
+            }
+            if (!ok) {
                 return false;
             }
-            if (!clear_cluster(volume, cluster)) {
+            if (chain_freed_meanwhile(hold)) {
+                return true;
+            }
+            chunk = static_cast<size_t>(clusters) * cluster_size;
+        } else {
+            ScratchBuffer scratch;
+            if (scratch.data() == nullptr ||
+                !read_sectors(volume.device, lba, volume.sectors_per_cluster,
+                              scratch.data())) {
                 return false;
             }
-            out_cluster = cluster;
-
-            uint32_t next_candidate = cluster + 1;
-            if (next_candidate > max_cluster) {
-                next_candidate = 2;
+            chunk = cluster_size - cluster_offset;
+            if (chunk > length) {
+                chunk = length;
             }
-            volume.next_free_cluster = next_candidate;
-            return true;
+            memcpy(out, scratch.data() + cluster_offset, chunk);
         }
 
-        ++cluster;
-        if (cluster > max_cluster) {
-            cluster = 2;
+        out += chunk;
+        out_size += chunk;
+        length -= chunk;
+        offset += static_cast<uint32_t>(chunk);
+    }
+    return true;
+}
+
+// Write counterpart of read_mapped_range(); the clusters must exist already.
+// Partial clusters are read, patched and written back under the lock so that
+// handles writing different bytes of one cluster do not undo each other.
+// Fails once the file has been removed.
+bool write_mapped_range(Fat32Volume& volume,
+                        ExtentMap& map,
+                        uint32_t first_cluster,
+                        uint32_t offset,
+                        const uint8_t* src,
+                        size_t length,
+                        size_t& out_size,
+                        const VolumeLockHold* hold) {
+    const uint32_t cluster_size = volume.sectors_per_cluster * 512u;
+    while (length != 0) {
+        uint32_t cluster_index = offset / cluster_size;
+        uint32_t cluster_offset = offset % cluster_size;
+        uint32_t cluster = 0;
+        uint32_t run = 0;
+        if (!lookup_extent(volume, map, first_cluster, cluster_index, cluster,
+                           run)) {
+            return false;
         }
-    } while (cluster != start);
 
-    log_message(LogLevel::Warn, "FAT32: out of free clusters");
-    return false;
+        uint32_t lba = cluster_to_lba(volume, cluster);
+        size_t chunk = 0;
+        if (cluster_offset == 0 && length >= cluster_size) {
+            uint32_t clusters = static_cast<uint32_t>(length / cluster_size);
+            if (clusters > run) {
+                clusters = run;
+            }
+            uint32_t limit = max_clusters_per_request(volume);
+            if (clusters > limit) {
+                clusters = limit;
+            }
+            bool ok = false;
+            {
+                UnlockedDataIo unlocked(volume, hold);
+                ok = write_sectors(volume.device, lba,
+                                   static_cast<uint8_t>(
+                                       clusters * volume.sectors_per_cluster),
+                                   src);
+            }
+            if (!ok || chain_freed_meanwhile(hold)) {
+                return false;
+            }
+            chunk = static_cast<size_t>(clusters) * cluster_size;
+        } else {
+            ScratchBuffer scratch;
+            if (scratch.data() == nullptr ||
+                !read_sectors(volume.device, lba, volume.sectors_per_cluster,
+                              scratch.data())) {
+                return false;
+            }
+            chunk = cluster_size - cluster_offset;
+            if (chunk > length) {
+                chunk = length;
+            }
+            memcpy(scratch.data() + cluster_offset, src, chunk);
+            if (!write_sectors(volume.device, lba, volume.sectors_per_cluster,
+                               scratch.data())) {
+                return false;
+            }
+        }
+
+        src += chunk;
+        out_size += chunk;
+        length -= chunk;
+        offset += static_cast<uint32_t>(chunk);
+    }
+    return true;
 }
 
 bool get_chain_info(Fat32Volume& volume,
@@ -645,75 +1230,63 @@ bool get_chain_info(Fat32Volume& volume,
     return true;
 }
 
+// Grows the chain to |required_clusters|, recording new clusters in |map|.
 bool ensure_cluster_count(Fat32Volume& volume,
                           Fat32DirEntry& entry,
+                          ExtentMap& map,
                           uint32_t required_clusters) {
     if (required_clusters == 0) {
         return true;
     }
 
-    uint32_t length = 0;
-    uint32_t tail = 0;
-    if (!get_chain_info(volume, entry.first_cluster, length, tail)) {
-        return false;
-    }
-
-    if (length == 0) {
-        uint32_t new_cluster = 0;
-        if (!allocate_cluster(volume, new_cluster)) {
+    // Another handle to the file may have grown the chain since this map
+    // saw its end; appending to the old tail would cut that growth off.
+    if (map.complete && map.mapped_clusters != 0) {
+        uint32_t next = 0;
+        if (!load_fat_entry(volume, last_mapped_cluster(map), next)) {
             return false;
         }
-        entry.first_cluster = new_cluster;
-        tail = new_cluster;
-        length = 1;
+        if (next < kFatEoc) {
+            map.complete = false;
+        }
+    }
+    if (!extend_extent_map(volume, map, entry.first_cluster, UINT32_MAX)) {
+        return false;
     }
 
-    while (length < required_clusters) {
+    if (map.mapped_clusters == 0) {
         uint32_t new_cluster = 0;
         if (!allocate_cluster(volume, new_cluster)) {
             return false;
         }
-        if (!write_fat_entry(volume, tail, new_cluster)) {
+        entry.first_cluster = new_cluster;
+        if (!append_extent(map, new_cluster)) {
+            reset_extent_map(map);
             return false;
         }
-        tail = new_cluster;
-        ++length;
-    }
-
-    return true;
-}
-
-bool get_cluster_at_index(Fat32Volume& volume,
-                          uint32_t first_cluster,
-                          uint32_t index,
-                          uint32_t& out_cluster) {
-    if (first_cluster < 2) {
-        return false;
     }
 
-    uint32_t cluster = first_cluster;
-    for (uint32_t i = 0; i < index; ++i) {
-        uint32_t next = read_fat_entry(volume, cluster);
-        if (next == kFatBadCluster) {
-            log_message(LogLevel::Warn, "FAT32: bad cluster in chain");
+    while (map.mapped_clusters < required_clusters) {
+        uint32_t new_cluster = 0;
+        if (!allocate_cluster(volume, new_cluster)) {
             return false;
         }
-        if (next >= kFatEoc) {
+        if (!write_fat_entry(volume, last_mapped_cluster(map), new_cluster)) {
             return false;
         }
-        cluster = next;
-        if (i > volume.total_clusters + 1) {
-            log_message(LogLevel::Warn, "FAT32: cluster traversal overflow");
+        if (!append_extent(map, new_cluster)) {
+            // The chain is longer than the map now; walk it again later.
+            map.complete = false;
             return false;
         }
     }
 
-    out_cluster = cluster;
     return true;
 }
 
 bool zero_range(Fat32Volume& volume,
                 Fat32DirEntry& entry,
+                ExtentMap& map,
                 uint32_t start,
                 uint32_t length) {
     if (length == 0) {
@@ -725,16 +1298,15 @@ bool zero_range(Fat32Volume& volume,
     if (cluster_size == 0) {
         return false;
     }
-    if (cluster_size > sizeof(cluster_buffer)) {
+    if (cluster_size > kMaxClusterBytes) {
         log_message(LogLevel::Warn,
                     "FAT32: cluster size %zu exceeds buffer capacity",
                     cluster_size);
         return false;
     }
-    if (cluster_size > sizeof(cluster_buffer)) {
-        log_message(LogLevel::Warn,
-                    "FAT32: cluster size %zu exceeds buffer capacity",
-                    cluster_size);
+    ScratchBuffer scratch;
+    uint8_t* cluster_buffer = scratch.data();
+    if (cluster_buffer == nullptr) {
         return false;
     }
 
@@ -747,10 +1319,13 @@ bool zero_range(Fat32Volume& volume,
         uint32_t cluster_offset =
             offset % static_cast<uint32_t>(cluster_size);
         uint32_t cluster_number = 0;
-        if (!get_cluster_at_index(volume,
-                                  entry.first_cluster,
-                                  cluster_index,
-                                  cluster_number)) {
+        uint32_t run = 0;
+        if (!lookup_extent(volume,
+                           map,
+                           entry.first_cluster,
+                           cluster_index,
+                           cluster_number,
+                           run)) {
             return false;
         }
 
@@ -839,6 +1414,7 @@ bool update_directory_entry(Fat32Volume& volume,
     uint32_t sector_offset = entry_byte / 512;
     uint32_t byte_offset = entry_byte % 512;
 
+    alignas(16) uint8_t sector_buffer[512];
     if (!read_sector(volume.device, lba + sector_offset, sector_buffer)) {
         return false;
     }
@@ -900,10 +1476,18 @@ bool mark_directory_entry_deleted(Fat32Volume& volume,
                                      short_entry);
 }
 
+void mark_chain_freed(Fat32Volume& volume, uint32_t first_cluster);
+
 bool free_cluster_chain(Fat32Volume& volume, uint32_t first_cluster) {
     if (first_cluster < 2) {
         return true;
     }
+    mark_chain_freed(volume, first_cluster);
+    // Transfers started through the old map may still own these clusters.
+    // New ones cannot start while the caller holds the volume lock.
+    while (__atomic_load_n(&volume.data_io_pins, __ATOMIC_ACQUIRE) != 0) {
+        asm volatile("pause");
+    }
 
     uint32_t max_cluster = volume.total_clusters + 1;
     uint32_t cluster = first_cluster;
@@ -1211,6 +1795,7 @@ bool read_directory_raw_entry(Fat32Volume& volume,
     }
     uint32_t entry_byte = index * 32;
     uint32_t lba = cluster_to_lba(volume, cluster) + entry_byte / 512;
+    alignas(16) uint8_t sector_buffer[512];
     if (!read_sector(volume.device, lba, sector_buffer)) {
         return false;
     }
@@ -1233,6 +1818,7 @@ bool write_directory_raw_entry(Fat32Volume& volume,
     }
     uint32_t entry_byte = index * 32;
     uint32_t lba = cluster_to_lba(volume, cluster) + entry_byte / 512;
+    alignas(16) uint8_t sector_buffer[512];
     if (!read_sector(volume.device, lba, sector_buffer)) {
         return false;
     }
@@ -1250,6 +1836,11 @@ bool find_directory_slots(Fat32Volume& volume,
         return false;
     }
 
+    ScratchBuffer scratch;
+    uint8_t* cluster_buffer = scratch.data();
+    if (cluster_buffer == nullptr) {
+        return false;
+    }
     uint32_t current_cluster = directory_cluster;
     uint32_t raw_index = 0;
     uint32_t run_start = 0;
@@ -1557,12 +2148,17 @@ bool fat32_create_directory(Fat32Volume& volume,
     // Initialize directory cluster with "." and ".."
     size_t cluster_size =
         static_cast<size_t>(volume.sectors_per_cluster) * 512u;
-    if (cluster_size > sizeof(cluster_buffer)) {
+    if (cluster_size > kMaxClusterBytes) {
         log_message(LogLevel::Warn,
                     "FAT32: cluster size %zu exceeds buffer capacity",
                     cluster_size);
         return false;
     }
+    ScratchBuffer scratch;
+    uint8_t* cluster_buffer = scratch.data();
+    if (cluster_buffer == nullptr) {
+        return false;
+    }
     memset(cluster_buffer, 0, cluster_size);
     uint8_t* dot = reinterpret_cast<uint8_t*>(cluster_buffer);
     uint8_t* dotdot = reinterpret_cast<uint8_t*>(cluster_buffer + 32);
@@ -1639,6 +2235,7 @@ bool fat32_mount(Fat32Volume& volume, const fs::BlockDevice& device) {
         return false;
     }
 
+    alignas(16) uint8_t sector_buffer[512];
     if (!read_sector(volume.device, 0, sector_buffer)) {
         return false;
     }
@@ -1710,8 +2307,26 @@ bool fat32_mount(Fat32Volume& volume, const fs::BlockDevice& device) {
     volume.total_clusters = total_clusters;
     initialize_next_free(volume);
 
-    fat_cache_sector = 0xFFFFFFFF;
-    fat_cache_device = &volume.device;
+    if (volume.fat_cache == nullptr) {
+        volume.fat_cache = static_cast<Fat32FatCache*>(
+            memory::alloc_kernel(sizeof(Fat32FatCache)));
+        if (volume.fat_cache == nullptr) {
+            log_message(LogLevel::Warn,
+                        "FAT32: out of memory for FAT cache on %s",
+                        device_name);
+            return false;
+        }
+    } else {
+        memset(volume.fat_cache, 0, sizeof(Fat32FatCache));
+    }
+    volume.cluster_bitmap = nullptr;
+    volume.free_clusters = 0;
+    volume.data_io_pins = 0;
+    if (!build_cluster_bitmap(volume)) {
+        log_message(LogLevel::Warn,
+                    "FAT32: no cluster bitmap for %s, allocation scans the FAT",
+                    device_name);
+    }
 
     volume.mounted = true;
 
@@ -1814,67 +2429,38 @@ bool fat32_read_file_range(Fat32Volume& volume, const Fat32DirEntry& entry,
     if (cluster_size == 0) {
         return false;
     }
-    if (cluster_size > sizeof(cluster_buffer)) {
+    if (cluster_size > kMaxClusterBytes) {
         log_message(LogLevel::Warn,
                     "FAT32: cluster size %zu exceeds buffer capacity",
                     cluster_size);
         return false;
     }
 
-    uint32_t cluster_index = offset / static_cast<uint32_t>(cluster_size);
-    size_t cluster_offset =
-        static_cast<size_t>(offset % static_cast<uint32_t>(cluster_size));
-    uint32_t cluster = 0;
-    if (!get_cluster_at_index(volume, entry.first_cluster, cluster_index, cluster)) {
-        return false;
-    }
-
-    uint8_t* out_ptr = static_cast<uint8_t*>(buffer);
     size_t remaining_in_file = static_cast<size_t>(entry.size - offset);
     size_t remaining =
         (buffer_size < remaining_in_file) ? buffer_size : remaining_in_file;
 
-    while (remaining != 0) {
-        uint32_t lba = cluster_to_lba(volume, cluster);
-        if (!read_sectors(volume.device, lba, volume.sectors_per_cluster,
-                          cluster_buffer)) {
-            return false;
-        }
-
-        size_t available = cluster_size - cluster_offset;
-        if (available > remaining) {
-            available = remaining;
-        }
-
-        memcpy(out_ptr, cluster_buffer + cluster_offset, available);
-        out_ptr += available;
-        out_size += available;
-        remaining -= available;
-        cluster_offset = 0;
-        if (remaining == 0) {
-            return true;
-        }
-
-        uint32_t next = read_fat_entry(volume, cluster);
-        if (next >= kFatEoc) {
-            return true;
-        }
-        if (next == kFatBadCluster) {
-            log_message(LogLevel::Warn, "FAT32: bad cluster in chain");
-            return false;
-        }
-        cluster = next;
-    }
-
-    return true;
-}
-
-bool fat32_write_file_range(Fat32Volume& volume,
-                            Fat32DirEntry& entry,
-                            uint32_t offset,
-                            const void* buffer,
-                            size_t buffer_size,
-                            size_t& out_size) {
+    ExtentMap map{};
+    bool ok = read_mapped_range(volume,
+                                map,
+                                entry.first_cluster,
+                                offset,
+                                static_cast<uint8_t*>(buffer),
+                                remaining,
+                                out_size,
+                                nullptr);
+    reset_extent_map(map);
+    return ok;
+}
+
+bool write_file_range(Fat32Volume& volume,
+                      Fat32DirEntry& entry,
+                      ExtentMap& map,
+                      uint32_t offset,
+                      const void* buffer,
+                      size_t buffer_size,
+                      size_t& out_size,
+                      const VolumeLockHold* hold) {
     out_size = 0;
     if (!volume.mounted || buffer == nullptr) {
         return false;
@@ -1892,7 +2478,7 @@ bool fat32_write_file_range(Fat32Volume& volume,
     if (cluster_size == 0) {
         return false;
     }
-    if (cluster_size > sizeof(cluster_buffer)) {
+    if (cluster_size > kMaxClusterBytes) {
         log_message(LogLevel::Warn,
                     "FAT32: cluster size %zu exceeds buffer capacity",
                     cluster_size);
@@ -1916,68 +2502,27 @@ bool fat32_write_file_range(Fat32Volume& volume,
                   static_cast<uint32_t>(cluster_size));
 
     if (required_clusters > 0) {
-        if (!ensure_cluster_count(volume, entry, required_clusters)) {
+        if (!ensure_cluster_count(volume, entry, map, required_clusters)) {
             return false;
         }
     }
 
     if (offset > entry.size) {
         uint32_t gap = offset - entry.size;
-        if (!zero_range(volume, entry, entry.size, gap)) {
+        if (!zero_range(volume, entry, map, entry.size, gap)) {
             return false;
         }
     }
 
-    const uint8_t* src = static_cast<const uint8_t*>(buffer);
-    size_t remaining = buffer_size;
-    uint32_t current_offset = offset;
-
-    while (remaining > 0) {
-        uint32_t cluster_index =
-            current_offset / static_cast<uint32_t>(cluster_size);
-        uint32_t cluster_offset =
-            current_offset % static_cast<uint32_t>(cluster_size);
-        uint32_t cluster_number = 0;
-        if (!get_cluster_at_index(volume,
-                                  entry.first_cluster,
-                                  cluster_index,
-                                  cluster_number)) {
-            return false;
-        }
-
-        size_t chunk = cluster_size - cluster_offset;
-        if (chunk > remaining) {
-            chunk = remaining;
-        }
-
-        uint32_t lba = cluster_to_lba(volume, cluster_number);
-        if (chunk == cluster_size && cluster_offset == 0) {
-            if (!write_sectors(volume.device,
-                               lba,
-                               volume.sectors_per_cluster,
-                               src)) {
-                return false;
-            }
-        } else {
-            if (!read_sectors(volume.device,
-                              lba,
-                              volume.sectors_per_cluster,
-                              cluster_buffer)) {
-                return false;
-            }
-            memcpy(cluster_buffer + cluster_offset, src, chunk);
-            if (!write_sectors(volume.device,
-                               lba,
-                               volume.sectors_per_cluster,
-                               cluster_buffer)) {
-                return false;
-            }
-        }
-
-        src += chunk;
-        remaining -= chunk;
-        current_offset += static_cast<uint32_t>(chunk);
-        out_size += chunk;
+    if (!write_mapped_range(volume,
+                            map,
+                            entry.first_cluster,
+                            offset,
+                            static_cast<const uint8_t*>(buffer),
+                            buffer_size,
+                            out_size,
+                            hold)) {
+        return false;
     }
 
     if (end_offset > entry.size) {
@@ -1987,6 +2532,25 @@ bool fat32_write_file_range(Fat32Volume& volume,
     return update_directory_entry(volume, entry);
 }
 
+bool fat32_write_file_range(Fat32Volume& volume,
+                            Fat32DirEntry& entry,
+                            uint32_t offset,
+                            const void* buffer,
+                            size_t buffer_size,
+                            size_t& out_size) {
+    ExtentMap map{};
+    bool ok = write_file_range(volume,
+                               entry,
+                               map,
+                               offset,
+                               buffer,
+                               buffer_size,
+                               out_size,
+                               nullptr);
+    reset_extent_map(map);
+    return ok;
+}
+
 bool fat32_get_entry_by_index(Fat32Volume& volume, uint32_t directory_cluster,
                               size_t index, Fat32DirEntry& out_entry) {
     if (!volume.mounted) {
@@ -2016,12 +2580,15 @@ namespace {
 constexpr size_t kMaxOpenFiles = 64;
 constexpr size_t kMaxOpenDirectories = 32;
 
+// |lock| serializes operations on one open file, whose extent map and
+// entry both change as it is read and written. chain_freed is set, under
+// the volume write lock, once another handle removes the file.
 struct Fat32FileContext {
     Fat32Volume* volume;
     Fat32DirEntry entry;
-    uint32_t cached_cluster;
-    uint32_t cached_cluster_index;
-    bool cache_valid;
+    ExtentMap extents;
+    sync::SpinLock lock;
+    bool chain_freed;
 };
 
 struct Fat32DirectoryContext {
@@ -2035,72 +2602,53 @@ bool g_file_context_used[kMaxOpenFiles];
 
 Fat32DirectoryContext g_directory_contexts[kMaxOpenDirectories];
 bool g_directory_context_used[kMaxOpenDirectories];
+sync::SpinLock g_context_lock;
 
 Fat32FileContext* allocate_file_context() {
+    sync::IrqLockGuard guard(g_context_lock);
     for (size_t i = 0; i < kMaxOpenFiles; ++i) {
         if (!g_file_context_used[i]) {
             g_file_context_used[i] = true;
             g_file_contexts[i].volume = nullptr;
             memset(&g_file_contexts[i].entry, 0, sizeof(Fat32DirEntry));
-            g_file_contexts[i].cached_cluster = 0;
-            g_file_contexts[i].cached_cluster_index = 0;
-            g_file_contexts[i].cache_valid = false;
+            memset(&g_file_contexts[i].extents, 0, sizeof(ExtentMap));
+            g_file_contexts[i].chain_freed = false;
             return &g_file_contexts[i];
         }
     }
     return nullptr;
 }
 
-bool get_file_context_cluster_at_index(Fat32FileContext& ctx,
-                                       uint32_t index,
-                                       uint32_t& out_cluster) {
-    if (ctx.volume == nullptr) {
-        return false;
-    }
-
-    uint32_t cluster = ctx.entry.first_cluster;
-    uint32_t cluster_index = 0;
-    if (ctx.cache_valid && ctx.cached_cluster >= 2 &&
-        ctx.cached_cluster_index <= index) {
-        cluster = ctx.cached_cluster;
-        cluster_index = ctx.cached_cluster_index;
-    }
-
-    while (cluster_index < index) {
-        uint32_t next = read_fat_entry(*ctx.volume, cluster);
-        if (next == kFatBadCluster) {
-            log_message(LogLevel::Warn, "FAT32: bad cluster in chain");
-            return false;
-        }
-        if (next >= kFatEoc) {
-            return false;
-        }
-        cluster = next;
-        ++cluster_index;
-        if (cluster_index > ctx.volume->total_clusters + 1) {
-            log_message(LogLevel::Warn, "FAT32: cluster traversal overflow");
-            return false;
-        }
-    }
-
-    ctx.cached_cluster = cluster;
-    ctx.cached_cluster_index = cluster_index;
-    ctx.cache_valid = true;
-    out_cluster = cluster;
-    return true;
-}
-
 void release_file_context(Fat32FileContext* ctx) {
     if (ctx == nullptr) {
         return;
     }
     size_t index = static_cast<size_t>(ctx - g_file_contexts);
     if (index < kMaxOpenFiles) {
+        reset_extent_map(ctx->extents);
+        sync::IrqLockGuard guard(g_context_lock);
         g_file_context_used[index] = false;
     }
 }
 
+// Called with the volume write lock held. The freed clusters can go to
+// another file while handles to this one are still open; their extent maps
+// would read that file's data, so those handles are cut off instead. Their
+// maps are only touched under the volume lock, which makes the flag safe to
+// set without the per-file locks.
+void mark_chain_freed(Fat32Volume& volume, uint32_t first_cluster) {
+    sync::IrqLockGuard guard(g_context_lock);
+    for (size_t i = 0; i < kMaxOpenFiles; ++i) {
+        Fat32FileContext& ctx = g_file_contexts[i];
+        if (g_file_context_used[i] && ctx.volume == &volume &&
+            ctx.entry.first_cluster == first_cluster) {
+            ctx.chain_freed = true;
+        }
+    }
+}
+
 Fat32DirectoryContext* allocate_directory_context() {
+    sync::IrqLockGuard guard(g_context_lock);
     for (size_t i = 0; i < kMaxOpenDirectories; ++i) {
         if (!g_directory_context_used[i]) {
             g_directory_context_used[i] = true;
@@ -2119,6 +2667,7 @@ void release_directory_context(Fat32DirectoryContext* ctx) {
     }
     size_t index = static_cast<size_t>(ctx - g_directory_contexts);
     if (index < kMaxOpenDirectories) {
+        sync::IrqLockGuard guard(g_context_lock);
         g_directory_context_used[index] = false;
     }
 }
@@ -2134,6 +2683,7 @@ bool fat32_vfs_list_directory(void* fs_context,
     }
 
     auto* volume = static_cast<Fat32Volume*>(fs_context);
+    sync::ReadLockGuard guard(volume->lock);
     uint32_t cluster = 0;
     if (!resolve_directory_cluster(*volume, path, cluster)) {
         return false;
@@ -2163,8 +2713,11 @@ bool fat32_vfs_open_file(void* fs_context,
 
     auto* volume = static_cast<Fat32Volume*>(fs_context);
     Fat32DirEntry entry{};
-    if (!resolve_entry(*volume, path, entry)) {
-        return false;
+    {
+        sync::ReadLockGuard guard(volume->lock);
+        if (!resolve_entry(*volume, path, entry)) {
+            return false;
+        }
     }
     if ((entry.attributes & ATTR_DIRECTORY) != 0) {
         return false;
@@ -2195,8 +2748,11 @@ bool fat32_vfs_create_file(void* fs_context,
 
     auto* volume = static_cast<Fat32Volume*>(fs_context);
     Fat32DirEntry entry{};
-    if (!fat32_create_file(*volume, path, entry)) {
-        return false;
+    {
+        sync::WriteLockGuard guard(volume->lock);
+        if (!fat32_create_file(*volume, path, entry)) {
+            return false;
+        }
     }
 
     Fat32FileContext* ctx = allocate_file_context();
@@ -2220,6 +2776,7 @@ bool fat32_vfs_create_directory(void* fs_context, const char* path) {
     if (volume == nullptr || path == nullptr) {
         return false;
     }
+    sync::WriteLockGuard guard(volume->lock);
     Fat32DirEntry entry{};
     if (!fat32_create_directory(*volume, path, entry)) {
         return false;
@@ -2233,6 +2790,7 @@ bool fat32_vfs_remove_file(void* fs_context, const char* path) {
     if (volume == nullptr || path == nullptr || *path == '\0') {
         return false;
     }
+    sync::WriteLockGuard guard(volume->lock);
     return fat32_remove_file(*volume, path);
 }
 
@@ -2241,6 +2799,7 @@ bool fat32_vfs_remove_directory(void* fs_context, const char* path) {
     if (volume == nullptr || path == nullptr || *path == '\0') {
         return false;
     }
+    sync::WriteLockGuard guard(volume->lock);
     return fat32_remove_directory(*volume, path);
 }
 
@@ -2259,6 +2818,7 @@ bool fat32_vfs_read_file(void* file_context,
         return true;
     }
 
+    sync::LockGuard file_guard(ctx->lock);
     uint32_t offset32 = static_cast<uint32_t>(offset);
     if (offset32 >= ctx->entry.size) {
         return true;
@@ -2273,67 +2833,31 @@ bool fat32_vfs_read_file(void* file_context,
     if (cluster_size == 0) {
         return false;
     }
-    if (cluster_size > sizeof(cluster_buffer)) {
+    if (cluster_size > kMaxClusterBytes) {
         log_message(LogLevel::Warn,
                     "FAT32: cluster size %zu exceeds buffer capacity",
                     cluster_size);
         return false;
     }
 
-    uint32_t cluster_index = offset32 / static_cast<uint32_t>(cluster_size);
-    size_t cluster_offset =
-        static_cast<size_t>(offset32 % static_cast<uint32_t>(cluster_size));
-    uint32_t cluster = 0;
-    if (!get_file_context_cluster_at_index(*ctx, cluster_index, cluster)) {
-        return false;
-    }
-
-    auto* out_ptr = static_cast<uint8_t*>(buffer);
     size_t remaining_in_file = static_cast<size_t>(ctx->entry.size - offset32);
     size_t remaining =
         (buffer_size < remaining_in_file) ? buffer_size : remaining_in_file;
 
-    while (remaining != 0) {
-        uint32_t lba = cluster_to_lba(volume, cluster);
-        if (!read_sectors(volume.device, lba, volume.sectors_per_cluster,
-                          cluster_buffer)) {
-            return false;
-        }
-
-        size_t available = cluster_size - cluster_offset;
-        if (available > remaining) {
-            available = remaining;
-        }
-
-        memcpy(out_ptr, cluster_buffer + cluster_offset, available);
-        out_ptr += available;
-        out_size += available;
-        remaining -= available;
-        cluster_offset = 0;
-        ctx->cached_cluster = cluster;
-        ctx->cached_cluster_index = cluster_index;
-        ctx->cache_valid = true;
-        if (remaining == 0) {
-            return true;
-        }
-
-        uint32_t next = read_fat_entry(volume, cluster);
-        if (next >= kFatEoc) {
-            return true;
-        }
-        if (next == kFatBadCluster) {
-            log_message(LogLevel::Warn, "FAT32: bad cluster in chain");
-            return false;
-        }
-        cluster = next;
-        ++cluster_index;
-        if (cluster_index > volume.total_clusters + 1) {
-            log_message(LogLevel::Warn, "FAT32: cluster traversal overflow");
-            return false;
-        }
+    sync::ReadLockGuard volume_guard(volume.lock);
+    if (ctx->chain_freed) {
+        // Removed through another handle; read like the end of the chain.
+        return true;
     }
-
-    return true;
+    VolumeLockHold hold{false, &ctx->chain_freed};
+    return read_mapped_range(volume,
+                             ctx->extents,
+                             ctx->entry.first_cluster,
+                             offset32,
+                             static_cast<uint8_t*>(buffer),
+                             remaining,
+                             out_size,
+                             &hold);
 }
 
 bool fat32_vfs_write_file(void* file_context,
@@ -2352,13 +2876,20 @@ bool fat32_vfs_write_file(void* file_context,
     }
 
     uint32_t offset32 = static_cast<uint32_t>(offset);
-    ctx->cache_valid = false;
-    return fat32_write_file_range(*ctx->volume,
-                                  ctx->entry,
-                                  offset32,
-                                  buffer,
-                                  buffer_size,
-                                  out_size);
+    sync::LockGuard file_guard(ctx->lock);
+    sync::WriteLockGuard volume_guard(ctx->volume->lock);
+    if (ctx->chain_freed) {
+        return false;
+    }
+    VolumeLockHold hold{true, &ctx->chain_freed};
+    return write_file_range(*ctx->volume,
+                            ctx->entry,
+                            ctx->extents,
+                            offset32,
+                            buffer,
+                            buffer_size,
+                            out_size,
+                            &hold);
 }
 
 void fat32_vfs_close_file(void* file_context) {
@@ -2366,6 +2897,14 @@ void fat32_vfs_close_file(void* file_context) {
     release_file_context(ctx);
 }
 
+bool fat32_vfs_sync_file(void* file_context) {
+    auto* ctx = static_cast<Fat32FileContext*>(file_context);
+    if (ctx == nullptr || ctx->volume == nullptr) {
+        return false;
+    }
+    return fs::block_cache::flush_device(ctx->volume->device);
+}
+
 bool fat32_vfs_open_directory(void* fs_context,
                               const char* path,
                               void*& out_dir_context) {
@@ -2375,8 +2914,11 @@ bool fat32_vfs_open_directory(void* fs_context,
 
     auto* volume = static_cast<Fat32Volume*>(fs_context);
     uint32_t cluster = 0;
-    if (!resolve_directory_cluster(*volume, path, cluster)) {
-        return false;
+    {
+        sync::ReadLockGuard guard(volume->lock);
+        if (!resolve_directory_cluster(*volume, path, cluster)) {
+            return false;
+        }
     }
 
     Fat32DirectoryContext* ctx = allocate_directory_context();
@@ -2398,6 +2940,7 @@ bool fat32_vfs_directory_next(void* dir_context, vfs::DirEntry& out_entry) {
     }
 
     auto* ctx = static_cast<Fat32DirectoryContext*>(dir_context);
+    sync::ReadLockGuard guard(ctx->volume->lock);
     Fat32DirEntry entry{};
     if (!fat32_get_entry_by_index(*ctx->volume,
                                   ctx->cluster,
@@ -2433,6 +2976,7 @@ const vfs::FilesystemOps kFat32FilesystemOps{
     nullptr,
     nullptr,
     nullptr,
+    &fat32_vfs_sync_file,
 };
 
 }  // namespace
@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include "../block_device.hpp"
+#include "kernel/sync.hpp"
 
 namespace vfs {
 struct FilesystemOps;
@@ -17,6 +18,11 @@ struct Fat32DirEntry {
     uint32_t raw_entry_index;
 };
 
+struct Fat32FatCache;
+
+// Operations that only read the volume hold |lock| shared and run in
+// parallel; anything that changes the FAT or a directory holds it
+// exclusively. The fat32_* calls below expect the caller to hold it.
 struct Fat32Volume {
     bool mounted;
     fs::BlockDevice device;
@@ -31,6 +37,18 @@ struct Fat32Volume {
     uint32_t fs_info_sector;
     uint32_t total_clusters;
     uint32_t next_free_cluster;
+    // One bit per data cluster, set while the cluster is allocated. Built
+    // from the FAT at mount; null when that failed and allocation scans the
+    // FAT instead.
+    uint64_t* cluster_bitmap;
+    uint32_t free_clusters;
+    sync::RwLock lock;
+    // Whole-cluster data transfers running with |lock| dropped. Freeing a
+    // chain waits for this to drain so no cluster is reused mid-transfer.
+    uint32_t data_io_pins;
+    // Guards fat_cache, which shared holders of |lock| fill concurrently.
+    sync::SpinLock fat_lock;
+    Fat32FatCache* fat_cache;
 };
 
 bool fat32_mount(Fat32Volume& volume, const fs::BlockDevice& device);
@@ -44,7 +44,7 @@ bool neufs_probe(const fs::BlockDevice& device) {
     if (device.name == nullptr || device.name[0] == '\0') {
         log_message(LogLevel::Warn,
                     "NEUFS: device without name cannot be mounted");
-        volume->mounted = false;
+        neufs::neufs_unmount(*volume);
         return false;
     }
 
@@ -52,7 +52,7 @@ bool neufs_probe(const fs::BlockDevice& device) {
         log_message(LogLevel::Warn,
                     "NEUFS: failed to register VFS mount for %s",
                     device.name != nullptr ? device.name : "(unnamed)");
-        volume->mounted = false;
+        neufs::neufs_unmount(*volume);
         return false;
     }
 
@@ -3,7 +3,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "drivers/fs/block_cache.hpp"
 #include "drivers/log/logging.hpp"
+#include "kernel/memory/physical_allocator.hpp"
 #include "lib/mem.hpp"
 
 namespace neufs {
@@ -101,6 +103,7 @@ bool g_file_context_used[kMaxOpenFiles];
 
 NeufsDirectoryContext g_directory_contexts[kMaxOpenDirectories];
 bool g_directory_context_used[kMaxOpenDirectories];
+sync::SpinLock g_context_lock;
 
 inline uint64_t align_up(uint64_t value, uint64_t alignment) {
     if (alignment == 0) {
@@ -687,6 +690,426 @@ static bool bitmap_find_first_clear_from(const fs::BlockDevice& device,
     return false;
 }
 
+// In-memory allocation bitmaps. Bits are stored exactly as on disk (bit i is
+// bit i % 8 of byte i / 8), so leaves can be written back verbatim. Each leaf
+// covers 4096 bits, i.e. 512 bytes of the on-disk bitmap.
+constexpr uint64_t kLeafBits = 4096;
+constexpr uint64_t kLeafBytes = kLeafBits / 8;
+constexpr uint64_t kLeafWords = kLeafBits / 64;
+
+inline bool map_bit(const AllocationBitmap& map, uint64_t bit) {
+    return ((map.words[bit / 64] >> (bit % 64)) & 1) != 0;
+}
+
+inline uint64_t max_u64(uint64_t a, uint64_t b) {
+    return (a > b) ? a : b;
+}
+
+BitmapNode summarize_leaf(const AllocationBitmap& map, uint64_t leaf) {
+    BitmapNode node{0, 0, 0};
+    uint64_t first = leaf * kLeafBits;
+    if (first >= map.bits) {
+        return node;
+    }
+    uint64_t end = first + kLeafBits;
+    bool partial = end > map.bits;
+    if (partial) {
+        end = map.bits;
+    }
+
+    uint64_t run = 0;
+    bool in_prefix = true;
+    uint64_t bit = first;
+    while (bit < end) {
+        uint64_t word = map.words[bit / 64];
+        if ((bit % 64) == 0 && bit + 64 <= end && (word == 0 || word == ~0ull)) {
+            if (word == 0) {
+                run += 64;
+            } else {
+                if (in_prefix) {
+                    node.prefix = run;
+                    in_prefix = false;
+                }
+                node.best = max_u64(node.best, run);
+                run = 0;
+            }
+            bit += 64;
+            continue;
+        }
+        if (((word >> (bit % 64)) & 1) == 0) {
+            ++run;
+        } else {
+            if (in_prefix) {
+                node.prefix = run;
+                in_prefix = false;
+            }
+            node.best = max_u64(node.best, run);
+            run = 0;
+        }
+        ++bit;
+    }
+    if (in_prefix) {
+        node.prefix = run;
+    }
+    node.best = max_u64(node.best, run);
+    // Bits past the end of the bitmap count as used.
+    node.suffix = partial ? 0 : run;
+    return node;
+}
+
+void merge_nodes(AllocationBitmap& map, uint64_t index, uint64_t half_span) {
+    const BitmapNode& left = map.nodes[index * 2];
+    const BitmapNode& right = map.nodes[index * 2 + 1];
+    BitmapNode& node = map.nodes[index];
+    node.prefix = (left.prefix == half_span) ? half_span + right.prefix
+                                             : left.prefix;
+    node.suffix = (right.suffix == half_span) ? half_span + left.suffix
+                                              : right.suffix;
+    node.best = max_u64(max_u64(left.best, right.best),
+                        left.suffix + right.prefix);
+}
+
+void refresh_leaf(AllocationBitmap& map, uint64_t leaf) {
+    uint64_t index = map.tree_leaves + leaf;
+    map.nodes[index] = summarize_leaf(map, leaf);
+    uint64_t half_span = kLeafBits;
+    for (index /= 2; index >= 1; index /= 2) {
+        merge_nodes(map, index, half_span);
+        half_span *= 2;
+    }
+}
+
+void build_tree(AllocationBitmap& map) {
+    for (uint64_t leaf = 0; leaf < map.tree_leaves; ++leaf) {
+        map.nodes[map.tree_leaves + leaf] = summarize_leaf(map, leaf);
+    }
+    uint64_t level_start = map.tree_leaves / 2;
+    uint64_t half_span = kLeafBits;
+    while (level_start >= 1) {
+        for (uint64_t index = level_start; index < level_start * 2; ++index) {
+            merge_nodes(map, index, half_span);
+        }
+        level_start /= 2;
+        half_span *= 2;
+    }
+}
+
+// Updates bits [start, start + count) and the summaries of the leaves they
+// touch. The leaves are marked dirty for the next write-back.
+void map_assign_range(AllocationBitmap& map,
+                      uint64_t start,
+                      uint64_t count,
+                      bool used) {
+    uint64_t end = start + count;
+    uint64_t bit = start;
+    while (bit < end) {
+        uint64_t shift = bit % 64;
+        uint64_t span = 64 - shift;
+        if (span > end - bit) {
+            span = end - bit;
+        }
+        uint64_t mask = (span == 64) ? ~0ull : (((1ull << span) - 1) << shift);
+        if (used) {
+            map.words[bit / 64] |= mask;
+        } else {
+            map.words[bit / 64] &= ~mask;
+        }
+        bit += span;
+    }
+    for (uint64_t leaf = start / kLeafBits; leaf <= (end - 1) / kLeafBits;
+         ++leaf) {
+        refresh_leaf(map, leaf);
+        map.dirty[leaf] = 1;
+    }
+    map.has_dirty = true;
+}
+
+// Finds the leftmost run of count clear bits at or after from inside the
+// node covering [lo, lo + span). carry is the number of clear bits directly
+// before lo, all at or after from. Only nodes that straddle from or hold a
+// long enough run are descended, so a search visits O(log n) nodes plus at
+// most two leaves.
+bool map_find_in_node(const AllocationBitmap& map,
+                      uint64_t index,
+                      uint64_t lo,
+                      uint64_t span,
+                      uint64_t from,
+                      uint64_t count,
+                      uint64_t& carry,
+                      uint64_t& out_bit) {
+    uint64_t hi = lo + span;
+    if (hi <= from || lo >= map.bits) {
+        carry = 0;
+        return false;
+    }
+    const BitmapNode& node = map.nodes[index];
+    if (lo >= from) {
+        if (carry + node.prefix >= count) {
+            out_bit = lo - carry;
+            return true;
+        }
+        if (node.best < count) {
+            carry = (node.prefix == span) ? carry + span : node.suffix;
+            return false;
+        }
+    }
+
+    if (span == kLeafBits) {
+        uint64_t bit = (lo > from) ? lo : from;
+        uint64_t end = (hi < map.bits) ? hi : map.bits;
+        while (bit < end) {
+            uint64_t word = map.words[bit / 64];
+            if ((bit % 64) == 0 && bit + 64 <= end && word == ~0ull) {
+                carry = 0;
+                bit += 64;
+                continue;
+            }
+            if (((word >> (bit % 64)) & 1) != 0) {
+                carry = 0;
+            } else if (++carry >= count) {
+                out_bit = bit + 1 - count;
+                return true;
+            }
+            ++bit;
+        }
+        if (end < hi) {
+            carry = 0;
+        }
+        return false;
+    }
+
+    uint64_t half = span / 2;
+    if (map_find_in_node(map, index * 2, lo, half, from, count, carry,
+                         out_bit)) {
+        return true;
+    }
+    return map_find_in_node(map, index * 2 + 1, lo + half, half, from, count,
+                            carry, out_bit);
+}
+
+bool map_find_run_from(const AllocationBitmap& map,
+                       uint64_t from,
+                       uint64_t count,
+                       uint64_t& out_bit) {
+    if (from >= map.bits || count > map.bits - from) {
+        return false;
+    }
+    uint64_t carry = 0;
+    return map_find_in_node(map, 1, 0, map.tree_leaves * kLeafBits, from,
+                            count, carry, out_bit);
+}
+
+bool map_range_clear(const AllocationBitmap& map,
+                     uint64_t start,
+                     uint64_t count) {
+    if (start >= map.bits || count > map.bits - start) {
+        return false;
+    }
+    for (uint64_t bit = start; bit < start + count; ++bit) {
+        if ((bit % 64) == 0 && bit + 64 <= start + count) {
+            if (map.words[bit / 64] != 0) {
+                return false;
+            }
+            bit += 63;
+            continue;
+        }
+        if (map_bit(map, bit)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void release_map(AllocationBitmap& map) {
+    if (map.words != nullptr) {
+        memory::free_kernel(map.words);
+    }
+    if (map.nodes != nullptr) {
+        memory::free_kernel(map.nodes);
+    }
+    if (map.dirty != nullptr) {
+        memory::free_kernel(map.dirty);
+    }
+    map.words = nullptr;
+    map.nodes = nullptr;
+    map.dirty = nullptr;
+    map.has_dirty = false;
+}
+
+// Reads the whole on-disk bitmap into memory. Returns false when it does not
+// fit, in which case the map keeps working directly on disk.
+bool load_map(const fs::BlockDevice& device,
+              AllocationBitmap& map,
+              uint64_t disk_offset,
+              uint64_t disk_bytes,
+              uint64_t bits) {
+    map.disk_offset = disk_offset;
+    map.disk_bytes = disk_bytes;
+    map.bits = bits;
+    map.leaf_count = (bits + kLeafBits - 1) / kLeafBits;
+    map.tree_leaves = 1;
+    while (map.tree_leaves < map.leaf_count) {
+        map.tree_leaves *= 2;
+    }
+    map.has_dirty = false;
+    if (bits == 0) {
+        return false;
+    }
+
+    size_t word_bytes = static_cast<size_t>(map.leaf_count * kLeafBytes);
+    map.words = static_cast<uint64_t*>(memory::alloc_kernel(word_bytes, 4096));
+    map.nodes = static_cast<BitmapNode*>(memory::alloc_kernel(
+        static_cast<size_t>(map.tree_leaves * 2 * sizeof(BitmapNode))));
+    map.dirty = static_cast<uint8_t*>(
+        memory::alloc_kernel(static_cast<size_t>(map.leaf_count)));
+    if (map.words == nullptr || map.nodes == nullptr || map.dirty == nullptr) {
+        release_map(map);
+        return false;
+    }
+    if (!read_bytes(device, disk_offset, map.words,
+                    static_cast<size_t>(disk_bytes))) {
+        release_map(map);
+        return false;
+    }
+    // Bits past map.bits in the last on-disk byte are ignored by every search
+    // and never touched by updates, so they are written back unchanged.
+    build_tree(map);
+    return true;
+}
+
+// Writes dirty leaves back, coalescing adjacent ones into a single write.
+bool flush_map(const fs::BlockDevice& device, AllocationBitmap& map) {
+    if (map.words == nullptr || !map.has_dirty) {
+        return true;
+    }
+    bool ok = true;
+    const auto* bytes = reinterpret_cast<const uint8_t*>(map.words);
+    uint64_t leaf = 0;
+    while (leaf < map.leaf_count) {
+        if (map.dirty[leaf] == 0) {
+            ++leaf;
+            continue;
+        }
+        uint64_t first = leaf;
+        while (leaf < map.leaf_count && map.dirty[leaf] != 0) {
+            map.dirty[leaf] = 0;
+            ++leaf;
+        }
+        uint64_t offset = first * kLeafBytes;
+        uint64_t end = leaf * kLeafBytes;
+        if (end > map.disk_bytes) {
+            end = map.disk_bytes;
+        }
+        if (!write_bytes(device, map.disk_offset + offset, bytes + offset,
+                         static_cast<size_t>(end - offset))) {
+            ok = false;
+        }
+    }
+    map.has_dirty = false;
+    return ok;
+}
+
+// Entry points used by the allocators. They go through the in-memory copy
+// when there is one and fall back to the on-disk bitmap otherwise.
+bool volume_map_set_range(const fs::BlockDevice& device,
+                          AllocationBitmap& map,
+                          uint64_t start,
+                          uint64_t count) {
+    if (map.words == nullptr) {
+        return bitmap_set_range(device, map.disk_offset, start, count);
+    }
+    if (start >= map.bits || count > map.bits - start) {
+        return false;
+    }
+    if (count != 0) {
+        map_assign_range(map, start, count, true);
+    }
+    return true;
+}
+
+bool volume_map_clear_range(const fs::BlockDevice& device,
+                            AllocationBitmap& map,
+                            uint64_t start,
+                            uint64_t count) {
+    if (map.words == nullptr) {
+        return bitmap_clear_range(device, map.disk_offset, start, count);
+    }
+    if (start >= map.bits || count > map.bits - start) {
+        return false;
+    }
+    if (count != 0) {
+        map_assign_range(map, start, count, false);
+    }
+    return true;
+}
+
+bool volume_map_find_run(const fs::BlockDevice& device,
+                         const AllocationBitmap& map,
+                         uint64_t from,
+                         uint64_t count,
+                         uint64_t& out_bit) {
+    if (map.words == nullptr) {
+        return bitmap_find_run_from(device, map.disk_offset, map.bits, from,
+                                    count, out_bit) ||
+               bitmap_find_run(device, map.disk_offset, map.bits, count,
+                               out_bit);
+    }
+    return map_find_run_from(map, from, count, out_bit) ||
+           map_find_run_from(map, 0, count, out_bit);
+}
+
+bool volume_map_first_clear_from(const fs::BlockDevice& device,
+                                 const AllocationBitmap& map,
+                                 uint64_t from,
+                                 uint64_t& out_bit) {
+    if (map.words == nullptr) {
+        return bitmap_find_first_clear_from(device, map.disk_offset, map.bits,
+                                            from, out_bit);
+    }
+    return map_find_run_from(map, from, 1, out_bit);
+}
+
+bool volume_map_range_clear(const fs::BlockDevice& device,
+                            const AllocationBitmap& map,
+                            uint64_t start,
+                            uint64_t count,
+                            bool& out_clear) {
+    out_clear = false;
+    if (map.words == nullptr) {
+        for (uint64_t i = 0; i < count; ++i) {
+            bool used = true;
+            if (!bitmap_get_bit(device, map.disk_offset, start + i, used)) {
+                return false;
+            }
+            if (used) {
+                return true;
+            }
+        }
+        out_clear = true;
+        return true;
+    }
+    out_clear = map_range_clear(map, start, count);
+    return true;
+}
+
+bool flush_bitmaps(neufs::NeufsVolume& volume) {
+    bool data_ok = flush_map(volume.device, volume.data_map);
+    bool meta_ok = flush_map(volume.device, volume.meta_map);
+    return data_ok && meta_ok;
+}
+
+// Allocation updates accumulate in memory during one filesystem operation
+// and reach the disk as one batch when it returns.
+struct BitmapWriteback {
+    explicit BitmapWriteback(neufs::NeufsVolume& volume) : volume_(volume) {}
+    ~BitmapWriteback() {
+        if (!flush_bitmaps(volume_)) {
+            log_message(LogLevel::Warn, "NEUFS: bitmap write-back failed");
+        }
+    }
+    neufs::NeufsVolume& volume_;
+};
+
 [[maybe_unused]] static bool bitmap_reserved_ranges_valid(
     const neufs::NeufsVolume& volume) {
     if (!volume.has_bitmaps) {
@@ -762,7 +1185,7 @@ bool mark_metadata_bytes(neufs::NeufsVolume& volume, uint64_t offset, size_t siz
     }
     uint64_t start_block = offset / 8;
     uint64_t block_count = (size + 7) / 8;
-    return bitmap_set_range(volume.device, volume.meta_bitmap_offset, start_block, block_count);
+    return volume_map_set_range(volume.device, volume.meta_map, start_block, block_count);
 }
 
 bool mark_data_bytes(neufs::NeufsVolume& volume, uint64_t offset, size_t size) {
@@ -780,7 +1203,7 @@ bool mark_data_bytes(neufs::NeufsVolume& volume, uint64_t offset, size_t size) {
     uint64_t start_sector = offset / volume.device.sector_size;
     uint64_t sector_count = (size + volume.device.sector_size - 1) /
                             volume.device.sector_size;
-    return bitmap_set_range(volume.device, volume.data_bitmap_offset, start_sector, sector_count);
+    return volume_map_set_range(volume.device, volume.data_map, start_sector, sector_count);
 }
 
 bool mark_acl_entries(neufs::NeufsVolume& volume, const uint64_t* acl_entries) {
@@ -889,9 +1312,14 @@ static bool free_data_bytes(neufs::NeufsVolume& volume, uint64_t offset, size_t
     if (!volume.has_bitmaps || volume.data_bitmap_size_bytes == 0) {
         return false;
     }
+    // A reader may still be copying these bytes out with the lock dropped.
+    // The caller holds it exclusively, so no new reader can start.
+    while (__atomic_load_n(&volume.data_io_pins, __ATOMIC_ACQUIRE) != 0) {
+        asm volatile("pause");
+    }
     uint64_t start_sector = offset / volume.device.sector_size;
     uint64_t sector_count = (size + volume.device.sector_size - 1) / volume.device.sector_size;
-    return bitmap_clear_range(volume.device, volume.data_bitmap_offset, start_sector, sector_count);
+    return volume_map_clear_range(volume.device, volume.data_map, start_sector, sector_count);
 }
 
 static bool extend_data_bytes(neufs::NeufsVolume& volume,
@@ -921,20 +1349,19 @@ static bool extend_data_bytes(neufs::NeufsVolume& volume,
     uint64_t sector_count = extension_size / volume.device.sector_size;
 
     if (volume.has_bitmaps && volume.data_bitmap_size_bytes > 0) {
-        for (uint64_t sector = 0; sector < sector_count; ++sector) {
-            bool used = true;
-            if (!bitmap_get_bit(volume.device,
-                                volume.data_bitmap_offset,
-                                start_sector + sector,
-                                used) ||
-                used) {
-                return false;
-            }
+        bool clear = false;
+        if (!volume_map_range_clear(volume.device,
+                                    volume.data_map,
+                                    start_sector,
+                                    sector_count,
+                                    clear) ||
+            !clear) {
+            return false;
         }
-        if (!bitmap_set_range(volume.device,
-                              volume.data_bitmap_offset,
-                              start_sector,
-                              sector_count)) {
+        if (!volume_map_set_range(volume.device,
+                                  volume.data_map,
+                                  start_sector,
+                                  sector_count)) {
             return false;
         }
         uint64_t extension_end = extension_offset + extension_size;
@@ -957,7 +1384,7 @@ static bool free_metadata_bytes(neufs::NeufsVolume& volume, uint64_t offset, siz
     }
     uint64_t start_block = offset / 8;
     uint64_t block_count = (size + 7) / 8;
-    return bitmap_clear_range(volume.device, volume.meta_bitmap_offset, start_block, block_count);
+    return volume_map_clear_range(volume.device, volume.meta_map, start_block, block_count);
 }
 
 bool allocate_metadata_bytes(neufs::NeufsVolume& volume,
@@ -967,35 +1394,27 @@ bool allocate_metadata_bytes(neufs::NeufsVolume& volume,
 
     if (volume.has_bitmaps && volume.meta_bitmap_size_bytes > 0) {
         uint64_t blocks_needed = (size + 7) / 8;
-        uint64_t meta_bits = volume.meta_size / 8;
         uint64_t start_bit = 0;
         uint64_t cursor_bit = volume.next_free_metadata / 8;
-        if (!bitmap_find_run_from(volume.device,
-                                  volume.meta_bitmap_offset,
-                                  meta_bits,
-                                  cursor_bit,
-                                  blocks_needed,
-                                  start_bit) &&
-            !bitmap_find_run(volume.device,
-                             volume.meta_bitmap_offset,
-                             meta_bits,
-                             blocks_needed,
-                             start_bit)) {
+        if (!volume_map_find_run(volume.device,
+                                 volume.meta_map,
+                                 cursor_bit,
+                                 blocks_needed,
+                                 start_bit)) {
             return false;
         }
-        if (!bitmap_set_range(volume.device,
-                              volume.meta_bitmap_offset,
-                              start_bit,
-                              blocks_needed)) {
+        if (!volume_map_set_range(volume.device,
+                                  volume.meta_map,
+                                  start_bit,
+                                  blocks_needed)) {
             return false;
         }
         out_offset = start_bit * 8;
         uint64_t next_clear = 0;
-        if (bitmap_find_first_clear_from(volume.device,
-                                         volume.meta_bitmap_offset,
-                                         meta_bits,
-                                         start_bit + blocks_needed,
-                                         next_clear)) {
+        if (volume_map_first_clear_from(volume.device,
+                                        volume.meta_map,
+                                        start_bit + blocks_needed,
+                                        next_clear)) {
             volume.next_free_metadata = next_clear * 8;
         } else {
             volume.next_free_metadata = volume.meta_size;
@@ -1024,35 +1443,27 @@ bool allocate_data_bytes(neufs::NeufsVolume& volume,
 
     uint64_t total_bytes = volume.device.sector_size * volume.device.sector_count;
     if (volume.has_bitmaps && volume.data_bitmap_size_bytes > 0) {
-        uint64_t data_bits = volume.device.sector_count;
         uint64_t start_bit = 0;
         uint64_t cursor_bit = volume.next_free_data / volume.device.sector_size;
-        if (!bitmap_find_run_from(volume.device,
-                                  volume.data_bitmap_offset,
-                                  data_bits,
-                                  cursor_bit,
-                                  sector_count_needed,
-                                  start_bit) &&
-            !bitmap_find_run(volume.device,
-                             volume.data_bitmap_offset,
-                             data_bits,
-                             sector_count_needed,
-                             start_bit)) {
+        if (!volume_map_find_run(volume.device,
+                                 volume.data_map,
+                                 cursor_bit,
+                                 sector_count_needed,
+                                 start_bit)) {
             return false;
         }
-        if (!bitmap_set_range(volume.device,
-                              volume.data_bitmap_offset,
-                              start_bit,
-                              sector_count_needed)) {
+        if (!volume_map_set_range(volume.device,
+                                  volume.data_map,
+                                  start_bit,
+                                  sector_count_needed)) {
             return false;
         }
         out_offset = start_bit * volume.device.sector_size;
         uint64_t next_clear = 0;
-        if (bitmap_find_first_clear_from(volume.device,
-                                         volume.data_bitmap_offset,
-                                         data_bits,
-                                         start_bit + sector_count_needed,
-                                         next_clear)) {
+        if (volume_map_first_clear_from(volume.device,
+                                        volume.data_map,
+                                        start_bit + sector_count_needed,
+                                        next_clear)) {
             volume.next_free_data = next_clear * volume.device.sector_size;
         } else {
             volume.next_free_data = total_bytes;
@@ -1102,15 +1513,174 @@ bool read_entry_name(const neufs::NeufsVolume& volume,
     return true;
 }
 
-bool directory_contains_name(const neufs::NeufsVolume& volume,
-                             uint64_t dir_offset,
-                             const char* name,
-                             uint64_t& out_entry_offset,
-                             uint8_t& out_type) {
-    if (name == nullptr || *name == '\0') {
-        return false;
+// Dentry cache: (volume, directory, name) -> entry, including negative
+// results, so repeated path resolution does not rescan directories on disk.
+// Directories are keyed by the offset of their first ndir block. Names that
+// do not fit kDentryNameLength are never cached.
+constexpr size_t kDentryNameLength = 64;
+constexpr size_t kDentrySets = 128;
+constexpr size_t kDentryWays = 4;
+
+struct DentryCacheEntry {
+    const neufs::NeufsVolume* volume;
+    uint64_t parent;
+    uint64_t child;  // 0 for a negative entry
+    uint64_t hash;
+    uint64_t last_used;
+    uint8_t type;
+    bool in_use;
+    char name[kDentryNameLength];
+};
+
+DentryCacheEntry g_dentry_cache[kDentrySets][kDentryWays];
+uint64_t g_dentry_clock = 0;
+volatile int g_dentry_lock = 0;
+
+void lock_dentry_cache() {
+    while (__atomic_test_and_set(&g_dentry_lock, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+}
+
+void unlock_dentry_cache() {
+    __atomic_clear(&g_dentry_lock, __ATOMIC_RELEASE);
+}
+
+bool dentry_hash(const neufs::NeufsVolume& volume,
+                 uint64_t parent,
+                 const char* name,
+                 uint64_t& out_hash) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t value) {
+        for (size_t i = 0; i < 8; ++i) {
+            hash ^= (value >> (i * 8)) & 0xFF;
+            hash *= 1099511628211ull;
+        }
+    };
+    mix(reinterpret_cast<uint64_t>(&volume));
+    mix(parent);
+    size_t length = 0;
+    for (; name[length] != '\0'; ++length) {
+        if (length + 1 >= kDentryNameLength) {
+            return false;
+        }
+        hash ^= static_cast<uint8_t>(name[length]);
+        hash *= 1099511628211ull;
+    }
+    out_hash = hash;
+    return true;
+}
+
+DentryCacheEntry* dentry_find_locked(const neufs::NeufsVolume& volume,
+                                     uint64_t parent,
+                                     const char* name,
+                                     uint64_t hash) {
+    DentryCacheEntry* set = g_dentry_cache[hash % kDentrySets];
+    for (size_t way = 0; way < kDentryWays; ++way) {
+        DentryCacheEntry& entry = set[way];
+        if (entry.in_use && entry.hash == hash && entry.volume == &volume &&
+            entry.parent == parent && string_equals(entry.name, name)) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool dentry_lookup(const neufs::NeufsVolume& volume,
+                   uint64_t parent,
+                   const char* name,
+                   bool& out_found,
+                   uint64_t& out_child,
+                   uint8_t& out_type) {
+    uint64_t hash = 0;
+    if (!dentry_hash(volume, parent, name, hash)) {
+        return false;
+    }
+    lock_dentry_cache();
+    DentryCacheEntry* entry = dentry_find_locked(volume, parent, name, hash);
+    bool hit = entry != nullptr;
+    if (hit) {
+        entry->last_used = ++g_dentry_clock;
+        out_found = entry->child != 0;
+        out_child = entry->child;
+        out_type = entry->type;
+    }
+    unlock_dentry_cache();
+    return hit;
+}
+
+void dentry_insert(const neufs::NeufsVolume& volume,
+                   uint64_t parent,
+                   const char* name,
+                   uint64_t child,
+                   uint8_t type) {
+    uint64_t hash = 0;
+    if (!dentry_hash(volume, parent, name, hash)) {
+        return;
+    }
+    lock_dentry_cache();
+    DentryCacheEntry* entry = dentry_find_locked(volume, parent, name, hash);
+    if (entry == nullptr) {
+        DentryCacheEntry* set = g_dentry_cache[hash % kDentrySets];
+        entry = &set[0];
+        for (size_t way = 0; way < kDentryWays; ++way) {
+            if (!set[way].in_use) {
+                entry = &set[way];
+                break;
+            }
+            if (set[way].last_used < entry->last_used) {
+                entry = &set[way];
+            }
+        }
+        entry->volume = &volume;
+        entry->parent = parent;
+        entry->hash = hash;
+        ensure_name(entry->name, sizeof(entry->name), name);
+        entry->in_use = true;
+    }
+    entry->child = child;
+    entry->type = type;
+    entry->last_used = ++g_dentry_clock;
+    unlock_dentry_cache();
+}
+
+// Drops every entry that resolves to or lives under offset.
+void dentry_forget(const neufs::NeufsVolume& volume, uint64_t offset) {
+    lock_dentry_cache();
+    for (auto& set : g_dentry_cache) {
+        for (auto& entry : set) {
+            if (entry.in_use && entry.volume == &volume &&
+                (entry.child == offset || entry.parent == offset)) {
+                entry.in_use = false;
+            }
+        }
     }
+    unlock_dentry_cache();
+}
+
+void dentry_forget_volume(const neufs::NeufsVolume& volume) {
+    lock_dentry_cache();
+    for (auto& set : g_dentry_cache) {
+        for (auto& entry : set) {
+            if (entry.in_use && entry.volume == &volume) {
+                entry.in_use = false;
+            }
+        }
+    }
+    unlock_dentry_cache();
+}
 
+// Scans a directory chain for name. Returns false only on I/O errors;
+// out_found tells whether the name exists.
+bool scan_directory(const neufs::NeufsVolume& volume,
+                    uint64_t dir_offset,
+                    const char* name,
+                    bool& out_found,
+                    uint64_t& out_entry_offset,
+                    uint8_t& out_type) {
+    out_found = false;
+    // Type byte, padding and name of an ndir or file, read in one go.
+    constexpr size_t kEntryHeaderSize = 8 + kNeufsDirNameLength;
     uint64_t current = dir_offset;
     while (current != 0) {
         NeufsNdir dir{};
@@ -1124,19 +1694,19 @@ bool directory_contains_name(const neufs::NeufsVolume& volume,
                 continue;
             }
 
-            uint8_t entry_type = 0xFF;
-            if (!read_bytes(volume.device, candidate, &entry_type, 1)) {
+            uint8_t header[kEntryHeaderSize];
+            if (!read_bytes(volume.device, candidate, header, sizeof(header))) {
                 return false;
             }
+            uint8_t entry_type = header[0];
             if (entry_type != kTypeNdir && entry_type != kTypeFile) {
                 continue;
             }
 
-            char candidate_name[kNeufsDirNameLength];
-            if (!read_entry_name(volume, candidate, candidate_name, sizeof(candidate_name))) {
-                return false;
-            }
+            char* candidate_name = reinterpret_cast<char*>(header + 8);
+            candidate_name[kNeufsDirNameLength - 1] = '\0';
             if (string_equals(candidate_name, name)) {
+                out_found = true;
                 out_entry_offset = candidate;
                 out_type = entry_type;
                 return true;
@@ -1145,7 +1715,48 @@ bool directory_contains_name(const neufs::NeufsVolume& volume,
         current = dir.next;
     }
 
-    return false;
+    return true;
+}
+
+bool directory_contains_name(const neufs::NeufsVolume& volume,
+                             uint64_t dir_offset,
+                             const char* name,
+                             uint64_t& out_entry_offset,
+                             uint8_t& out_type) {
+    if (name == nullptr || *name == '\0') {
+        return false;
+    }
+
+    bool found = false;
+    if (dentry_lookup(volume, dir_offset, name, found, out_entry_offset,
+                      out_type)) {
+        return found;
+    }
+    if (!scan_directory(volume, dir_offset, name, found, out_entry_offset,
+                        out_type)) {
+        return false;
+    }
+    dentry_insert(volume,
+                  dir_offset,
+                  name,
+                  found ? out_entry_offset : 0,
+                  found ? out_type : 0);
+    return found;
+}
+
+// Replaces a cached negative lookup for a newly linked entry.
+void cache_new_entry(const neufs::NeufsVolume& volume,
+                     uint64_t dir_offset,
+                     uint64_t entry_offset) {
+    uint8_t entry_type = 0xFF;
+    char name[kNeufsDirNameLength];
+    if (!read_bytes(volume.device, entry_offset, &entry_type, 1) ||
+        !read_entry_name(volume, entry_offset, name, sizeof(name))) {
+        // Fall back to dropping everything cached under the directory.
+        dentry_forget(volume, dir_offset);
+        return;
+    }
+    dentry_insert(volume, dir_offset, name, entry_offset, entry_type);
 }
 
 bool add_entry_to_directory(neufs::NeufsVolume& volume,
@@ -1161,7 +1772,11 @@ bool add_entry_to_directory(neufs::NeufsVolume& volume,
         for (size_t index = 0; index < 64; ++index) {
             if (dir.contents[index] == 0) {
                 dir.contents[index] = entry_offset;
-                return persist_ndir(volume, current, dir);
+                if (!persist_ndir(volume, current, dir)) {
+                    return false;
+                }
+                cache_new_entry(volume, dir_offset, entry_offset);
+                return true;
             }
         }
 
@@ -1203,6 +1818,7 @@ bool remove_entry_from_directory(neufs::NeufsVolume& volume,
         for (size_t index = 0; index < 64; ++index) {
             if (dir.contents[index] == entry_offset) {
                 dir.contents[index] = 0;
+                dentry_forget(volume, entry_offset);
                 return persist_ndir(volume, current, dir);
             }
         }
@@ -1361,7 +1977,23 @@ bool to_vfs_entry(const neufs::NeufsVolume& volume,
     return false;
 }
 
-bool read_file_data(const neufs::NeufsVolume& volume,
+// Reads one extent's bytes with the shared volume lock dropped, so writers
+// are not held up behind the device. The pin is released before the lock is
+// taken back because free_data_bytes() waits for it with the lock held.
+bool read_extent_unlocked(neufs::NeufsVolume& volume,
+                          uint64_t source_offset,
+                          uint8_t* dst,
+                          size_t size) {
+    __atomic_add_fetch(&volume.data_io_pins, 1u, __ATOMIC_ACQUIRE);
+    volume.lock.unlock_shared();
+    bool ok = read_bytes(volume.device, source_offset, dst, size);
+    __atomic_sub_fetch(&volume.data_io_pins, 1u, __ATOMIC_RELEASE);
+    volume.lock.lock_shared();
+    return ok;
+}
+
+// Needs the volume lock held shared; it is dropped around each extent read.
+bool read_file_data(neufs::NeufsVolume& volume,
                     const NeufsFile& file,
                     uint64_t offset,
                     void* buffer,
@@ -1426,8 +2058,8 @@ bool read_file_data(const neufs::NeufsVolume& volume,
                 available = remaining;
             }
 
-            if (!read_bytes(volume.device, source_offset, dst,
-                            static_cast<size_t>(available))) {
+            if (!read_extent_unlocked(volume, source_offset, dst,
+                                      static_cast<size_t>(available))) {
                 return false;
             }
             dst += static_cast<size_t>(available);
@@ -1440,73 +2072,6 @@ bool read_file_data(const neufs::NeufsVolume& volume,
     return true;
 }
 
-bool copy_existing_file_data(const neufs::NeufsVolume& volume,
-                             const NeufsFile& file,
-                             uint64_t destination_offset,
-                             uint64_t copy_size) {
-    if (copy_size == 0) {
-        return true;
-    }
-    uint64_t current_position = 0;
-    uint8_t buffer[kSectorScratchSize];
-
-    for (size_t dcblk_index = 0; dcblk_index < 512 && copy_size > 0;
-         ++dcblk_index) {
-        uint64_t dcblk_pointer = file.content[dcblk_index];
-        if (dcblk_pointer == 0) {
-            continue;
-        }
-
-        NeufsDcblk dcblk{};
-        if (!load_dcblk(volume, dcblk_pointer, dcblk)) {
-            return false;
-        }
-
-        for (size_t dcptr_index = 0;
-             dcptr_index < 512 && copy_size > 0;
-             ++dcptr_index) {
-            uint64_t dcptr_pointer = dcblk.dcptrs[dcptr_index];
-            if (dcptr_pointer == 0) {
-                continue;
-            }
-
-            NeufsDcptr dcptr{};
-            if (!load_dcptr(volume, dcptr_pointer, dcptr)) {
-                return false;
-            }
-            if (dcptr.len == 0) {
-                continue;
-            }
-            uint64_t segment_end = current_position + dcptr.len;
-
-            uint64_t available = dcptr.len;
-            if (available > copy_size) {
-                available = copy_size;
-            }
-
-            uint64_t source_offset = dcptr.start;
-            uint64_t destination_cursor = destination_offset + current_position;
-            uint64_t remaining = available;
-            while (remaining > 0) {
-                size_t chunk = (remaining > sizeof(buffer)) ? sizeof(buffer) : static_cast<size_t>(remaining);
-                if (!read_bytes(volume.device, source_offset, buffer, chunk)) {
-                    return false;
-                }
-                if (!write_bytes(volume.device, destination_cursor, buffer, chunk)) {
-                    return false;
-                }
-                source_offset += chunk;
-                destination_cursor += chunk;
-                remaining -= chunk;
-            }
-            copy_size -= available;
-            current_position = segment_end;
-        }
-    }
-
-    return true;
-}
-
 bool free_file_storage(neufs::NeufsVolume& volume, const NeufsFile& file) {
     bool ok = true;
     for (size_t dcblk_index = 0; dcblk_index < 512; ++dcblk_index) {
@@ -1548,90 +2113,297 @@ bool free_file_storage(neufs::NeufsVolume& volume, const NeufsFile& file) {
     return ok;
 }
 
-bool load_single_extent(const neufs::NeufsVolume& volume,
-                        const NeufsFile& file,
-                        uint64_t& out_dcptr_offset,
-                        NeufsDcptr& out_dcptr) {
-    if (file.content[0] == 0) {
-        return false;
-    }
-    for (size_t index = 1; index < 512; ++index) {
-        if (file.content[index] != 0) {
+// Writes over bytes that already belong to the file, extent by extent, in
+// place. The range must lie inside file.size.
+bool overwrite_file_data(const neufs::NeufsVolume& volume,
+                         const NeufsFile& file,
+                         uint64_t offset,
+                         const uint8_t* src,
+                         size_t size) {
+    uint64_t current_position = 0;
+    uint64_t remaining = size;
+
+    for (size_t dcblk_index = 0; dcblk_index < 512 && remaining > 0;
+         ++dcblk_index) {
+        uint64_t dcblk_pointer = file.content[dcblk_index];
+        if (dcblk_pointer == 0) {
+            continue;
+        }
+
+        NeufsDcblk dcblk{};
+        if (!load_dcblk(volume, dcblk_pointer, dcblk)) {
             return false;
         }
+
+        for (size_t dcptr_index = 0;
+             dcptr_index < 512 && remaining > 0;
+             ++dcptr_index) {
+            uint64_t dcptr_pointer = dcblk.dcptrs[dcptr_index];
+            if (dcptr_pointer == 0) {
+                continue;
+            }
+
+            NeufsDcptr dcptr{};
+            if (!load_dcptr(volume, dcptr_pointer, dcptr)) {
+                return false;
+            }
+            if (dcptr.len == 0) {
+                continue;
+            }
+            uint64_t segment_end = current_position + dcptr.len;
+            if (segment_end <= offset) {
+                current_position = segment_end;
+                continue;
+            }
+
+            uint64_t segment_offset = offset - current_position;
+            uint64_t available = dcptr.len - segment_offset;
+            if (available > remaining) {
+                available = remaining;
+            }
+            if (!write_bytes(volume.device,
+                             dcptr.start + segment_offset,
+                             src,
+                             static_cast<size_t>(available))) {
+                return false;
+            }
+            src += static_cast<size_t>(available);
+            offset += available;
+            remaining -= available;
+            current_position = segment_end;
+        }
+    }
+
+    return remaining == 0;
+}
+
+// Position of the last extent of a file, i.e. where appends go.
+struct AppendCursor {
+    size_t dcblk_index;     // index in file.content, 512 if the file has none
+    uint64_t dcblk_offset;
+    size_t dcptr_index;     // index in the dcblk, 512 if the dcblk is empty
+    uint64_t dcptr_offset;
+    NeufsDcptr dcptr;
+};
+
+bool locate_last_extent(const neufs::NeufsVolume& volume,
+                        const NeufsFile& file,
+                        AppendCursor& cursor) {
+    cursor.dcblk_index = 512;
+    cursor.dcblk_offset = 0;
+    cursor.dcptr_index = 512;
+    cursor.dcptr_offset = 0;
+    cursor.dcptr = {};
+    for (size_t index = 512; index > 0; --index) {
+        if (file.content[index - 1] != 0) {
+            cursor.dcblk_index = index - 1;
+            cursor.dcblk_offset = file.content[index - 1];
+            break;
+        }
+    }
+    if (cursor.dcblk_offset == 0) {
+        return true;
     }
 
     NeufsDcblk dcblk{};
-    if (!load_dcblk(volume, file.content[0], dcblk)) {
+    if (!load_dcblk(volume, cursor.dcblk_offset, dcblk)) {
         return false;
     }
-    if (dcblk.dcptrs[0] == 0) {
-        return false;
+    for (size_t index = 512; index > 0; --index) {
+        if (dcblk.dcptrs[index - 1] != 0) {
+            cursor.dcptr_index = index - 1;
+            cursor.dcptr_offset = dcblk.dcptrs[index - 1];
+            return load_dcptr(volume, cursor.dcptr_offset, cursor.dcptr);
+        }
+    }
+    return true;
+}
+
+// Writes size bytes of src (zeros when src is nullptr) to the volume.
+bool store_bytes(const neufs::NeufsVolume& volume,
+                 uint64_t offset,
+                 const uint8_t* src,
+                 size_t size) {
+    if (src == nullptr) {
+        return zero_bytes(volume.device, offset, size);
+    }
+    return write_bytes(volume.device, offset, src, size);
+}
+
+// Appends to the last extent in place: first into the slack of its last
+// sector, then into free sectors directly after it.
+size_t grow_last_extent(neufs::NeufsVolume& volume,
+                        AppendCursor& cursor,
+                        const uint8_t* src,
+                        size_t size) {
+    if (cursor.dcptr_offset == 0 || size == 0) {
+        return 0;
+    }
+    NeufsDcptr& dcptr = cursor.dcptr;
+    uint64_t capacity = align_up(dcptr.len, volume.device.sector_size);
+    uint64_t grow = size;
+    if (dcptr.len + grow > capacity &&
+        !extend_data_bytes(volume,
+                           dcptr.start,
+                           static_cast<size_t>(dcptr.len),
+                           static_cast<size_t>(dcptr.len + grow))) {
+        grow = capacity - dcptr.len;
+    }
+    if (grow == 0) {
+        return 0;
+    }
+    if (!store_bytes(volume, dcptr.start + dcptr.len, src,
+                     static_cast<size_t>(grow))) {
+        return 0;
+    }
+    dcptr.len += grow;
+    if (!persist_dcptr(volume, cursor.dcptr_offset, dcptr)) {
+        dcptr.len -= grow;
+        return 0;
     }
-    for (size_t index = 1; index < 512; ++index) {
-        if (dcblk.dcptrs[index] != 0) {
+    return static_cast<size_t>(grow);
+}
+
+// Extents allocated for appends are followed by a soft reservation: the
+// data allocation cursor skips this far past them, so later appends to the
+// same file usually find free sectors to grow into instead of starting a
+// new extent. Nothing is marked used, so an idle reservation costs nothing
+// and is reclaimed by ordinary allocation once the cursor wraps.
+constexpr uint64_t kMaxAppendWindow = 8ull * 1024 * 1024;
+
+// Allocates data for a new extent of at most size bytes. When free space is
+// fragmented the request is halved until a run is found.
+bool allocate_extent_data(neufs::NeufsVolume& volume,
+                          size_t size,
+                          uint64_t window,
+                          uint64_t& out_offset,
+                          size_t& out_size) {
+    uint64_t sector_size = volume.device.sector_size;
+    size_t request = size;
+    while (!allocate_data_bytes(volume, request, out_offset)) {
+        if (request <= sector_size) {
             return false;
         }
+        request = static_cast<size_t>(align_up(request / 2, sector_size));
     }
+    out_size = request;
 
-    NeufsDcptr dcptr{};
-    if (!load_dcptr(volume, dcblk.dcptrs[0], dcptr)) {
-        return false;
+    uint64_t end = out_offset + align_up(request, sector_size);
+    uint64_t total_bytes = sector_size * volume.device.sector_count;
+    if (window > kMaxAppendWindow) {
+        window = kMaxAppendWindow;
     }
-    if (dcptr.len != file.size) {
-        return false;
+    if (volume.has_bitmaps && volume.next_free_data == end &&
+        end + window <= total_bytes) {
+        volume.next_free_data = end + window;
     }
-
-    out_dcptr_offset = dcblk.dcptrs[0];
-    out_dcptr = dcptr;
     return true;
 }
 
-bool write_single_extent_file(neufs::NeufsVolume& volume,
-                              uint64_t file_offset,
-                              NeufsFile& file,
-                              uint64_t write_offset,
-                              const void* buffer,
-                              size_t buffer_size,
-                              size_t& out_size) {
-    uint64_t target_end = write_offset + buffer_size;
-    if (target_end < write_offset) {
-        return false;
+// Records a new extent after the cursor, starting a new dcblk when the
+// current one is full. file.content is updated in memory only; the caller
+// persists the file.
+bool add_extent(neufs::NeufsVolume& volume,
+                NeufsFile& file,
+                AppendCursor& cursor,
+                const NeufsDcptr& dcptr) {
+    size_t dcblk_index = cursor.dcblk_index;
+    size_t dcptr_index = (cursor.dcptr_index == 512) ? 0
+                                                     : cursor.dcptr_index + 1;
+    bool new_dcblk = cursor.dcblk_offset == 0 || dcptr_index == 512;
+    if (new_dcblk) {
+        dcblk_index = (cursor.dcblk_offset == 0) ? 0 : dcblk_index + 1;
+        dcptr_index = 0;
+        if (dcblk_index >= 512) {
+            return false;
+        }
     }
 
     uint64_t dcptr_offset = 0;
-    NeufsDcptr dcptr{};
-    if (!load_single_extent(volume, file, dcptr_offset, dcptr)) {
+    if (!allocate_metadata_bytes(volume, sizeof(NeufsDcptr), dcptr_offset)) {
+        return false;
+    }
+    if (!persist_dcptr(volume, dcptr_offset, dcptr)) {
+        (void)free_metadata_bytes(volume, dcptr_offset, sizeof(NeufsDcptr));
         return false;
     }
 
-    if (target_end > file.size) {
-        if (write_offset != file.size) {
+    NeufsDcblk dcblk{};
+    uint64_t dcblk_offset = cursor.dcblk_offset;
+    if (new_dcblk) {
+        if (!allocate_metadata_bytes(volume, sizeof(NeufsDcblk),
+                                     dcblk_offset)) {
+            (void)free_metadata_bytes(volume, dcptr_offset,
+                                      sizeof(NeufsDcptr));
             return false;
         }
-        if (!extend_data_bytes(volume,
-                               dcptr.start,
-                               static_cast<size_t>(file.size),
-                               static_cast<size_t>(target_end))) {
-            return false;
+    } else if (!load_dcblk(volume, dcblk_offset, dcblk)) {
+        (void)free_metadata_bytes(volume, dcptr_offset, sizeof(NeufsDcptr));
+        return false;
+    }
+    dcblk.dcptrs[dcptr_index] = dcptr_offset;
+    if (!persist_dcblk(volume, dcblk_offset, dcblk)) {
+        if (new_dcblk) {
+            (void)free_metadata_bytes(volume, dcblk_offset,
+                                      sizeof(NeufsDcblk));
         }
+        (void)free_metadata_bytes(volume, dcptr_offset, sizeof(NeufsDcptr));
+        return false;
+    }
+    if (new_dcblk) {
+        file.content[dcblk_index] = dcblk_offset;
     }
 
-    if (!write_bytes(volume.device, dcptr.start + write_offset, buffer, buffer_size)) {
-        return false;
+    cursor.dcblk_index = dcblk_index;
+    cursor.dcblk_offset = dcblk_offset;
+    cursor.dcptr_index = dcptr_index;
+    cursor.dcptr_offset = dcptr_offset;
+    cursor.dcptr = dcptr;
+    return true;
+}
+
+// Appends size bytes (zeros when src is nullptr) to the end of the file.
+// Existing data is never moved: the last extent grows in place when the
+// sectors after it are free, otherwise new extents are added. Returns the
+// number of bytes appended, which is short only when space or extent slots
+// run out.
+size_t append_file_data(neufs::NeufsVolume& volume,
+                        NeufsFile& file,
+                        const uint8_t* src,
+                        size_t size) {
+    AppendCursor cursor{};
+    if (!locate_last_extent(volume, file, cursor)) {
+        return 0;
     }
 
-    if (target_end > file.size) {
-        dcptr.len = target_end;
-        file.size = target_end;
-        if (!persist_dcptr(volume, dcptr_offset, dcptr) ||
-            !persist_file(volume, file_offset, file)) {
-            return false;
+    size_t appended = grow_last_extent(volume, cursor, src, size);
+    file.size += appended;
+
+    while (appended < size) {
+        size_t remaining = size - appended;
+        uint64_t data_offset = 0;
+        size_t allocated = 0;
+        if (!allocate_extent_data(volume,
+                                  remaining,
+                                  file.size + remaining,
+                                  data_offset,
+                                  allocated)) {
+            break;
+        }
+        const uint8_t* chunk_src = (src != nullptr) ? src + appended : nullptr;
+        NeufsDcptr dcptr{};
+        dcptr.start = data_offset;
+        dcptr.len = allocated;
+        dcptr.crc64 = 0;
+        if (!store_bytes(volume, data_offset, chunk_src, allocated) ||
+            !add_extent(volume, file, cursor, dcptr)) {
+            (void)free_data_bytes(volume, data_offset, allocated);
+            break;
         }
+        appended += allocated;
+        file.size += allocated;
     }
-
-    out_size = buffer_size;
-    return true;
+    return appended;
 }
 
 bool write_file_contents(neufs::NeufsVolume& volume,
@@ -1652,96 +2424,52 @@ bool write_file_contents(neufs::NeufsVolume& volume,
     if (write_offset + buffer_size < write_offset) {
         return false;
     }
-
-    uint64_t current_size = file.size;
     uint64_t target_end = write_offset + buffer_size;
-    uint64_t new_size = current_size;
-    if (target_end > current_size) {
-        new_size = target_end;
-    }
-
-    if (new_size > static_cast<uint64_t>(static_cast<size_t>(new_size))) {
+    if (target_end > static_cast<uint64_t>(static_cast<size_t>(target_end))) {
         return false;
     }
 
-    if (current_size != 0 &&
-        write_single_extent_file(volume,
-                                 file_offset,
-                                 file,
-                                 write_offset,
-                                 buffer,
-                                 buffer_size,
-                                 out_size)) {
-        return true;
-    }
-
-    uint64_t data_offset = 0;
-    if (!allocate_data_bytes(volume, static_cast<size_t>(new_size), data_offset)) {
-        return false;
-    }
+    const auto* src = static_cast<const uint8_t*>(buffer);
+    uint64_t original_size = file.size;
 
-    if (current_size > 0) {
-        if (!copy_existing_file_data(volume, file, data_offset, current_size)) {
-            return false;
+    // Bytes inside the file are rewritten where they are.
+    if (write_offset < file.size) {
+        uint64_t overlap = file.size - write_offset;
+        if (overlap > buffer_size) {
+            overlap = buffer_size;
         }
-    }
-
-    if (current_size < write_offset) {
-        uint64_t gap_size = write_offset - current_size;
-        if (!zero_bytes(volume.device, data_offset + current_size,
-                        static_cast<size_t>(gap_size))) {
+        if (!overwrite_file_data(volume, file, write_offset, src,
+                                 static_cast<size_t>(overlap))) {
             return false;
         }
+        out_size = static_cast<size_t>(overlap);
     }
 
-    if (buffer_size > 0) {
-        if (!write_bytes(volume.device, data_offset + write_offset, buffer,
-                         buffer_size)) {
+    // A write past the end first fills the hole with zeros.
+    if (write_offset > file.size) {
+        size_t gap = static_cast<size_t>(write_offset - file.size);
+        if (append_file_data(volume, file, nullptr, gap) != gap) {
+            if (file.size != original_size) {
+                (void)persist_file(volume, file_offset, file);
+            }
             return false;
         }
     }
 
-    uint64_t dcblk_offset = 0;
-    if (!allocate_metadata_bytes(volume, sizeof(NeufsDcblk), dcblk_offset)) {
-        return false;
-    }
-    uint64_t dcptr_offset = 0;
-    if (!allocate_metadata_bytes(volume, sizeof(NeufsDcptr), dcptr_offset)) {
-        return false;
-    }
-
-    NeufsDcblk dcblk{};
-    NeufsDcptr first_ptr{};
-    first_ptr.start = data_offset;
-    first_ptr.len = new_size;
-    first_ptr.crc64 = 0;
-    dcblk.dcptrs[0] = dcptr_offset;
-
-    if (!persist_dcptr(volume, dcptr_offset, first_ptr)) {
-        return false;
-    }
-    if (!persist_dcblk(volume, dcblk_offset, dcblk)) {
-        return false;
+    if (out_size < buffer_size) {
+        out_size += append_file_data(volume, file, src + out_size,
+                                     buffer_size - out_size);
     }
 
-    NeufsFile old_file = file;
-    file.content[0] = dcblk_offset;
-    for (size_t index = 1; index < 512; ++index) {
-        file.content[index] = 0;
-    }
-    file.size = new_size;
-
-    if (!persist_file(volume, file_offset, file)) {
+    if (file.size != original_size &&
+        !persist_file(volume, file_offset, file)) {
         return false;
     }
-
-    free_file_storage(volume, old_file);
-
-    out_size = buffer_size;
-    return true;
+    return out_size != 0;
 }
 
 bool open_file_context(NeufsFileContext*& out_context) {
+    sync::IrqLockGuard guard(g_context_lock);
     for (size_t index = 0; index < kMaxOpenFiles; ++index) {
         if (!g_file_context_used[index]) {
             g_file_context_used[index] = true;
@@ -1761,11 +2489,13 @@ void close_file_context(NeufsFileContext* context) {
     }
     size_t index = static_cast<size_t>(context - g_file_contexts);
     if (index < kMaxOpenFiles) {
+        sync::IrqLockGuard guard(g_context_lock);
         g_file_context_used[index] = false;
     }
 }
 
 NeufsDirectoryContext* allocate_directory_context() {
+    sync::IrqLockGuard guard(g_context_lock);
     for (size_t index = 0; index < kMaxOpenDirectories; ++index) {
         if (!g_directory_context_used[index]) {
             g_directory_context_used[index] = true;
@@ -1784,6 +2514,7 @@ void release_directory_context(NeufsDirectoryContext* context) {
     }
     size_t index = static_cast<size_t>(context - g_directory_contexts);
     if (index < kMaxOpenDirectories) {
+        sync::IrqLockGuard guard(g_context_lock);
         g_directory_context_used[index] = false;
     }
 }
@@ -1853,6 +2584,7 @@ bool neufs_list_directory(void* fs_context,
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::ReadLockGuard guard(volume->lock);
     uint64_t directory_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, directory_offset, entry_type)) {
@@ -1895,6 +2627,7 @@ bool neufs_open_file(void* fs_context,
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::ReadLockGuard guard(volume->lock);
     uint64_t entry_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, entry_offset, entry_type)) {
@@ -1937,6 +2670,8 @@ bool neufs_create_file(void* fs_context,
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::WriteLockGuard guard(volume->lock);
+    BitmapWriteback writeback(*volume);
     uint64_t parent_offset = 0;
     char name[kNeufsFileNameLength];
     if (!resolve_parent(*volume, path, parent_offset, name, sizeof(name))) {
@@ -1996,6 +2731,8 @@ bool neufs_create_directory(void* fs_context, const char* path) {
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::WriteLockGuard guard(volume->lock);
+    BitmapWriteback writeback(*volume);
     uint64_t parent_offset = 0;
     char name[kNeufsDirNameLength];
     if (!resolve_parent(*volume, path, parent_offset, name, sizeof(name))) {
@@ -2031,6 +2768,8 @@ bool neufs_remove_file(void* fs_context, const char* path) {
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::WriteLockGuard guard(volume->lock);
+    BitmapWriteback writeback(*volume);
     uint64_t entry_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, entry_offset, entry_type)) {
@@ -2075,6 +2814,8 @@ bool neufs_remove_directory(void* fs_context, const char* path) {
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::WriteLockGuard guard(volume->lock);
+    BitmapWriteback writeback(*volume);
     uint64_t entry_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, entry_offset, entry_type)) {
@@ -2126,6 +2867,7 @@ bool neufs_read_file(void* file_context,
     }
 
     auto* context = static_cast<NeufsFileContext*>(file_context);
+    sync::ReadLockGuard guard(context->volume->lock);
     return read_file_data(*context->volume, context->entry, offset, buffer,
                           buffer_size, out_size);
 }
@@ -2141,6 +2883,8 @@ bool neufs_write_file(void* file_context,
     }
 
     auto* context = static_cast<NeufsFileContext*>(file_context);
+    sync::WriteLockGuard guard(context->volume->lock);
+    BitmapWriteback writeback(*context->volume);
     if (!write_file_contents(*context->volume, context->file_offset,
                              context->entry, offset, buffer, buffer_size,
                              out_size)) {
@@ -2161,6 +2905,14 @@ void neufs_close_file(void* file_context) {
     close_file_context(context);
 }
 
+bool neufs_sync_file(void* file_context) {
+    if (file_context == nullptr) {
+        return false;
+    }
+    auto* context = static_cast<NeufsFileContext*>(file_context);
+    return fs::block_cache::flush_device(context->volume->device);
+}
+
 bool neufs_open_directory(void* fs_context,
                           const char* path,
                           void*& out_dir_context) {
@@ -2169,6 +2921,7 @@ bool neufs_open_directory(void* fs_context,
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::ReadLockGuard guard(volume->lock);
     uint64_t directory_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, directory_offset, entry_type)) {
@@ -2196,6 +2949,7 @@ bool neufs_directory_next(void* dir_context, vfs::DirEntry& out_entry) {
     }
 
     auto* ctx = static_cast<NeufsDirectoryContext*>(dir_context);
+    sync::ReadLockGuard guard(ctx->volume->lock);
     while (ctx->current_dir_offset != 0) {
         NeufsNdir dir{};
         if (!load_ndir(*ctx->volume, ctx->current_dir_offset, dir)) {
@@ -2235,6 +2989,7 @@ bool neufs_get_open_file_acl(void* file_context,
         return false;
     }
     auto* context = static_cast<NeufsFileContext*>(file_context);
+    sync::ReadLockGuard guard(context->volume->lock);
     return load_acl_entries(*context->volume,
                             context->entry.acl,
                             entries,
@@ -2250,6 +3005,7 @@ bool neufs_get_open_directory_acl(void* dir_context,
         return false;
     }
     auto* context = static_cast<NeufsDirectoryContext*>(dir_context);
+    sync::ReadLockGuard guard(context->volume->lock);
     NeufsNdir dir{};
     if (!load_ndir(*context->volume,
                    context->current_dir_offset,
@@ -2273,6 +3029,7 @@ bool neufs_get_acl(void* fs_context,
         return false;
     }
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::ReadLockGuard guard(volume->lock);
     uint64_t entry_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, entry_offset, entry_type)) {
@@ -2327,6 +3084,8 @@ bool neufs_set_acl(void* fs_context,
     }
 
     auto* volume = static_cast<neufs::NeufsVolume*>(fs_context);
+    sync::WriteLockGuard guard(volume->lock);
+    BitmapWriteback writeback(*volume);
     uint64_t object_offset = 0;
     uint8_t entry_type = 0;
     if (!resolve_path(*volume, path, object_offset, entry_type)) {
@@ -2477,6 +3236,7 @@ bool neufs_mount(neufs::NeufsVolume& volume, const fs::BlockDevice& device) {
 
     // Compute and initialize bitmaps inside the meta section if there is space.
     volume.has_bitmaps = false;
+    volume.data_io_pins = 0;
     volume.data_bitmap_offset = 0;
     volume.data_bitmap_size_bytes = 0;
     volume.meta_bitmap_offset = 0;
@@ -2501,6 +3261,11 @@ bool neufs_mount(neufs::NeufsVolume& volume, const fs::BlockDevice& device) {
         volume.has_bitmaps = true;
     }
 
+    volume.data_map.disk_offset = volume.data_bitmap_offset;
+    volume.data_map.bits = device.sector_count;
+    volume.meta_map.disk_offset = volume.meta_bitmap_offset;
+    volume.meta_map.bits = meta_blocks;
+
     NeufsNdir root_dir{};
     if (!load_ndir(volume, volume.root_offset, root_dir)) {
         return false;
@@ -2510,19 +3275,38 @@ bool neufs_mount(neufs::NeufsVolume& volume, const fs::BlockDevice& device) {
     }
 
     if (volume.has_bitmaps) {
+        // Keep both bitmaps in memory so allocation never walks the disk.
+        // A bitmap too large for the kernel heap is used in place instead.
+        if (!load_map(device,
+                      volume.data_map,
+                      volume.data_bitmap_offset,
+                      volume.data_bitmap_size_bytes,
+                      device.sector_count)) {
+            log_message(LogLevel::Warn,
+                        "NEUFS: data bitmap not cached (%llu bytes)",
+                        volume.data_bitmap_size_bytes);
+        }
+        if (!load_map(device,
+                      volume.meta_map,
+                      volume.meta_bitmap_offset,
+                      volume.meta_bitmap_size_bytes,
+                      meta_blocks)) {
+            log_message(LogLevel::Warn,
+                        "NEUFS: meta bitmap not cached (%llu bytes)",
+                        volume.meta_bitmap_size_bytes);
+        }
+
         // The bitmap layout and bounds were validated above. Start at the
         // first legal allocation point instead of rescanning the large,
         // deliberately reserved prefix on every mount. On eMMC that prefix
         // scan dominated boot time.
         uint64_t next_meta_bit = 0;
-        uint64_t meta_bits = volume.meta_size / 8;
         uint64_t first_meta_bit =
             align_up(volume.root_offset + sizeof(NeufsNdir), 8) / 8;
-        if (bitmap_find_first_clear_from(volume.device,
-                                         volume.meta_bitmap_offset,
-                                         meta_bits,
-                                         first_meta_bit,
-                                         next_meta_bit)) {
+        if (volume_map_first_clear_from(volume.device,
+                                        volume.meta_map,
+                                        first_meta_bit,
+                                        next_meta_bit)) {
             volume.next_free_metadata = next_meta_bit * 8;
         } else {
             volume.next_free_metadata = volume.meta_size;
@@ -2532,11 +3316,10 @@ bool neufs_mount(neufs::NeufsVolume& volume, const fs::BlockDevice& device) {
         uint64_t first_data_bit =
             align_up(volume.meta_size, device.sector_size) /
             device.sector_size;
-        if (bitmap_find_first_clear_from(volume.device,
-                                         volume.data_bitmap_offset,
-                                         device.sector_count,
-                                         first_data_bit,
-                                         next_data_bit)) {
+        if (volume_map_first_clear_from(volume.device,
+                                        volume.data_map,
+                                        first_data_bit,
+                                        next_data_bit)) {
             volume.next_free_data = next_data_bit * device.sector_size;
         } else {
             volume.next_free_data = total_bytes;
@@ -2556,6 +3339,16 @@ bool neufs_mount(neufs::NeufsVolume& volume, const fs::BlockDevice& device) {
     return true;
 }
 
+void neufs_unmount(neufs::NeufsVolume& volume) {
+    if (!flush_bitmaps(volume)) {
+        log_message(LogLevel::Warn, "NEUFS: bitmap write-back failed");
+    }
+    release_map(volume.data_map);
+    release_map(volume.meta_map);
+    dentry_forget_volume(volume);
+    volume.mounted = false;
+}
+
 const vfs::FilesystemOps& neufs_vfs_ops() {
     static const vfs::FilesystemOps kOps = {
         &neufs_list_directory,
@@ -2574,6 +3367,7 @@ const vfs::FilesystemOps& neufs_vfs_ops() {
         &neufs_set_acl,
         &neufs_get_open_file_acl,
         &neufs_get_open_directory_acl,
+        &neufs_sync_file,
     };
     return kOps;
 }
@@ -5,9 +5,34 @@
 
 #include "../block_device.hpp"
 #include "fs/vfs.hpp"
+#include "kernel/sync.hpp"
 
 namespace neufs {
 
+// Free-run summary for one span of an allocation bitmap.
+struct BitmapNode {
+    uint64_t prefix;  // clear bits at the start of the span
+    uint64_t suffix;  // clear bits at the end of the span
+    uint64_t best;    // longest run of clear bits inside the span
+};
+
+// In-memory copy of an on-disk allocation bitmap, loaded at mount. words is
+// nullptr when it did not fit in memory; the bitmap is then used in place.
+struct AllocationBitmap {
+    uint64_t* words;
+    BitmapNode* nodes;     // segment tree over the leaves, root at index 1
+    uint8_t* dirty;        // one flag per leaf not yet written back
+    uint64_t bits;
+    uint64_t leaf_count;
+    uint64_t tree_leaves;  // leaf_count rounded up to a power of two
+    uint64_t disk_offset;  // same as the volume's *_bitmap_offset
+    uint64_t disk_bytes;
+    bool has_dirty;
+};
+
+// Lookups and reads hold |lock| shared; anything that allocates, frees or
+// rewrites metadata holds it exclusively, since the bitmaps and the
+// allocation cursors are updated without further locking.
 struct NeufsVolume {
     bool mounted;
     fs::BlockDevice device;
@@ -22,9 +47,17 @@ struct NeufsVolume {
     uint64_t meta_bitmap_offset;      // offset from start of volume where meta bitmap lives
     uint64_t meta_bitmap_size_bytes;  // size in bytes of the meta bitmap
     bool has_bitmaps;
+    AllocationBitmap data_map;
+    AllocationBitmap meta_map;
+    sync::RwLock lock;
+    // File data reads running with |lock| dropped. Freeing data waits for
+    // this to drain so no extent is reused mid-read.
+    uint32_t data_io_pins;
 };
 
 bool neufs_mount(NeufsVolume& volume, const fs::BlockDevice& device);
+// Releases in-memory state of a volume that will not be registered.
+void neufs_unmount(NeufsVolume& volume);
 const vfs::FilesystemOps& neufs_vfs_ops();
 
 }  // namespace neufs
@@ -26,6 +26,7 @@ struct SlotBuffer {
     size_t head;
     size_t tail;
     sync::SpinLock lock;
+    descriptor::WaitQueue waiters;
 };
 
 SlotBuffer g_buffers[kInputSlots];
@@ -140,6 +141,7 @@ void process_scancode(uint8_t scancode, bool extended, bool pressed) {
     bool select_framebuffer = false;
     uint32_t framebuffer_index = 0;
     bool queued = false;
+    uint32_t queued_slot = 0;
     {
         sync::IrqLockGuard guard(g_state_lock);
         if (!extended) {
@@ -193,6 +195,7 @@ void process_scancode(uint8_t scancode, bool extended, bool pressed) {
                 slot = 0;
             }
             queued = enqueue(slot, event);
+            queued_slot = slot;
         }
     }
 
@@ -201,7 +204,7 @@ void process_scancode(uint8_t scancode, bool extended, bool pressed) {
         return;
     }
     if (queued) {
-        descriptor::wake_waiters();
+        descriptor::wait_queue_wake(g_buffers[queued_slot].waiters);
     }
 }
 
@@ -288,6 +291,13 @@ bool has_data(uint32_t slot) {
     return buf.head != buf.tail;
 }
 
+descriptor::WaitQueue* wait_queue(uint32_t slot) {
+    if (slot >= kInputSlots) {
+        return nullptr;
+    }
+    return &g_buffers[slot].waiters;
+}
+
 void inject_scancode(uint8_t scancode, bool extended, bool pressed) {
     process_scancode(scancode, extended, pressed);
 }
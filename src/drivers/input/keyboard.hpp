@@ -5,6 +5,10 @@
 
 #include "descriptors.hpp"
 
+namespace descriptor {
+struct WaitQueue;
+}  // namespace descriptor
+
 namespace keyboard {
 
 void init();
@@ -13,6 +17,8 @@ size_t read(uint32_t slot,
             descriptor_defs::KeyboardEvent* buffer,
             size_t max_events);
 bool has_data(uint32_t slot);
+// Signalled whenever an event is queued for slot.
+descriptor::WaitQueue* wait_queue(uint32_t slot);
 void inject_scancode(uint8_t scancode, bool extended, bool pressed);
 
 }  // namespace keyboard
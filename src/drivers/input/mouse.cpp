@@ -34,6 +34,7 @@ struct SlotBuffer {
     size_t head;
     size_t tail;
     sync::SpinLock lock;
+    descriptor::WaitQueue waiters;
 };
 
 SlotBuffer g_buffers[kInputSlots];
@@ -105,7 +106,7 @@ void enqueue(uint32_t slot, const Event& ev) {
         }
     }
     if (queued) {
-        descriptor::wake_waiters();
+        descriptor::wait_queue_wake(buf.waiters);
     }
 }
 
@@ -231,4 +232,11 @@ bool has_data(uint32_t slot) {
     return buf.head != buf.tail;
 }
 
+descriptor::WaitQueue* wait_queue(uint32_t slot) {
+    if (slot >= kInputSlots) {
+        return nullptr;
+    }
+    return &g_buffers[slot].waiters;
+}
+
 }  // namespace mouse
@@ -5,6 +5,10 @@
 
 #include "descriptors.hpp"
 
+namespace descriptor {
+struct WaitQueue;
+}  // namespace descriptor
+
 namespace mouse {
 
 using Event = descriptor_defs::MouseEvent;
@@ -13,5 +17,7 @@ void init();
 void handle_irq();
 size_t read(uint32_t slot, Event* buffer, size_t max_events);
 bool has_data(uint32_t slot);
+// Signalled whenever an event is queued for slot.
+descriptor::WaitQueue* wait_queue(uint32_t slot);
 
 }  // namespace mouse
@@ -4,14 +4,55 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arch/x86_64/percpu.hpp"
 #include "drivers/console/console.hpp"
 #include "../serial/serial.hpp"
+#include "kernel/process.hpp"
+#include "kernel/scheduler.hpp"
+#include "kernel/sync.hpp"
+#include "kernel/time.hpp"
 #include "lib/mem.hpp"
 
 namespace {
 
 constexpr size_t LOG_BUFFER_CAPACITY = 32 * 1024;
 constexpr size_t LOG_LINE_MAX = 512;
+constexpr size_t LOG_MESSAGE_MAX = 256;
+// Per CPU; a full ring drops new lines and counts them.
+constexpr size_t LOG_RING_RECORDS = 64;
+// Lines the drain task writes before it checks for other work again.
+constexpr size_t LOG_DRAIN_BATCH = 32;
+constexpr uint64_t LOG_DRAIN_INTERVAL_NS = 20ull * 1000 * 1000;
+constexpr size_t LOG_RATE_SITES = 128;
+// Lines one call site may queue per second before it is suppressed.
+constexpr uint32_t LOG_RATE_BURST = 20;
+
+static_assert((LOG_RING_RECORDS & (LOG_RING_RECORDS - 1)) == 0,
+              "LOG_RING_RECORDS must be a power of two");
+
+struct LogRecord {
+    uint64_t ready;  // ticket + 1 once text is complete
+    uint64_t sequence;
+    LogLevel level;
+    char text[LOG_MESSAGE_MAX];
+};
+
+// Any CPU may reserve a ticket (a task can migrate between picking the
+// ring and reserving), only the drain side advances tail.
+struct LogRing {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    LogRecord records[LOG_RING_RECORDS];
+};
+
+// Call sites are told apart by their format string.
+struct RateSite {
+    const char* fmt;
+    uint64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+};
 
 char g_buffer[LOG_BUFFER_CAPACITY];
 volatile int g_console_lock = 0;
@@ -21,6 +62,14 @@ size_t g_size = 0;
 bool g_initialized = false;
 bool g_console_enabled = true;
 
+LogRing g_rings[percpu::kMaxCpus];
+uint64_t g_sequence = 0;
+RateSite g_rate_sites[LOG_RATE_SITES];
+uint64_t g_rate_window_ticks = 0;
+process::Process* g_drain_task = nullptr;
+// Set once the drain task runs; cleared for good by log_enter_panic().
+bool g_async = false;
+
 const char* level_tag(LogLevel level) {
     switch (level) {
         case LogLevel::Debug:
@@ -59,6 +108,16 @@ void unlock_console() {
     __atomic_clear(&g_console_lock, __ATOMIC_RELEASE);
 }
 
+// The panic path cannot wait on a CPU that died holding the lock.
+void lock_console_for_panic() {
+    for (uint32_t spins = 0; spins < (1u << 24); ++spins) {
+        if (!__atomic_test_and_set(&g_console_lock, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        asm volatile("pause");
+    }
+}
+
 void push_char(char c) {
     g_buffer[g_write_pos] = c;
     g_write_pos = (g_write_pos + 1) % LOG_BUFFER_CAPACITY;
@@ -366,6 +425,190 @@ void emit_to_serial(const char* tag, const char* message) {
     serial::write_string("\n");
 }
 
+// Caller holds the console lock.
+void emit_line(LogLevel level, const char* message) {
+    const char* tag = level_tag(level);
+    emit_to_serial(tag, message);
+    emit_to_console(level, tag, message);
+    store_log_line(tag, message);
+}
+
+LogRing& current_ring() {
+    percpu::Cpu* cpu = percpu::current_cpu();
+    return g_rings[cpu != nullptr ? cpu->index % percpu::kMaxCpus : 0];
+}
+
+// The slot and the sequence number are taken together with interrupts off,
+// so nothing on this CPU can get between them: within a ring, slot order
+// is sequence order. Across CPUs drain_one() merges by sequence only over
+// records already published; one still being formatted elsewhere can be
+// overtaken by a later line.
+bool enqueue_record(LogLevel level, const char* fmt, va_list args) {
+    uint64_t flags = sync::disable_interrupts();
+    LogRing& ring = current_ring();
+    uint64_t ticket = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    do {
+        if (ticket - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) >=
+            LOG_RING_RECORDS) {
+            __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+            sync::restore_interrupts(flags);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&ring.head,
+                                          &ticket,
+                                          ticket + 1,
+                                          true,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    uint64_t sequence = __atomic_fetch_add(&g_sequence, 1, __ATOMIC_RELAXED);
+    sync::restore_interrupts(flags);
+
+    LogRecord& record = ring.records[ticket & (LOG_RING_RECORDS - 1)];
+    record.sequence = sequence;
+    record.level = level;
+    format_message(record.text, sizeof(record.text), fmt, args);
+    __atomic_store_n(&record.ready, ticket + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool enqueue_line(LogLevel level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    bool queued = enqueue_record(level, fmt, args);
+    va_end(args);
+    return queued;
+}
+
+// Lets LOG_RATE_BURST lines per second through for each call site. What a
+// site had suppressed is reported with its next line in a later second.
+bool rate_limit_allows(const char* fmt) {
+    uint64_t window_ticks =
+        __atomic_load_n(&g_rate_window_ticks, __ATOMIC_RELAXED);
+    if (window_ticks == 0) {
+        return true;
+    }
+    uint64_t window = timekeeping::tick_count() / window_ticks;
+    RateSite& site =
+        g_rate_sites[(reinterpret_cast<uintptr_t>(fmt) >> 3) % LOG_RATE_SITES];
+    const char* owner = nullptr;
+    if (!__atomic_compare_exchange_n(&site.fmt,
+                                     &owner,
+                                     fmt,
+                                     false,
+                                     __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE) &&
+        owner != fmt) {
+        // Slot taken by another call site; leave this one unlimited.
+        return true;
+    }
+
+    uint64_t seen = __atomic_load_n(&site.window, __ATOMIC_RELAXED);
+    if (seen != window &&
+        __atomic_compare_exchange_n(&site.window,
+                                    &seen,
+                                    window,
+                                    false,
+                                    __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site.count, 0, __ATOMIC_RELAXED);
+        uint32_t suppressed =
+            __atomic_exchange_n(&site.suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed != 0) {
+            enqueue_line(LogLevel::Warn,
+                         "Log: suppressed %u lines like \"%s\"",
+                         suppressed,
+                         fmt);
+        }
+    }
+    if (__atomic_fetch_add(&site.count, 1, __ATOMIC_RELAXED) <
+        LOG_RATE_BURST) {
+        return true;
+    }
+    __atomic_fetch_add(&site.suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+// Writes the ready record with the lowest sequence number across all
+// rings. Caller holds the console lock, which makes it the only consumer.
+bool drain_one() {
+    LogRing* best = nullptr;
+    uint64_t best_tail = 0;
+    for (auto& ring : g_rings) {
+        uint64_t tail = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+        const LogRecord& record = ring.records[tail & (LOG_RING_RECORDS - 1)];
+        if (__atomic_load_n(&record.ready, __ATOMIC_ACQUIRE) != tail + 1) {
+            continue;
+        }
+        if (best == nullptr ||
+            record.sequence <
+                best->records[best_tail & (LOG_RING_RECORDS - 1)].sequence) {
+            best = &ring;
+            best_tail = tail;
+        }
+    }
+    if (best == nullptr) {
+        return false;
+    }
+    const LogRecord& record = best->records[best_tail & (LOG_RING_RECORDS - 1)];
+    emit_line(record.level, record.text);
+    __atomic_store_n(&best->tail, best_tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void report_drops() {
+    for (size_t i = 0; i < percpu::kMaxCpus; ++i) {
+        uint64_t dropped =
+            __atomic_exchange_n(&g_rings[i].dropped, 0, __ATOMIC_RELAXED);
+        if (dropped == 0) {
+            continue;
+        }
+        char line[LOG_MESSAGE_MAX];
+        char* cursor = line;
+        char* end = line + sizeof(line) - 1;
+        append_string(cursor, end, "Log: ring full on cpu ");
+        append_unsigned(cursor, end, i, 0, ' ');
+        append_string(cursor, end, ", dropped ");
+        append_unsigned(cursor, end, dropped, 0, ' ');
+        append_string(cursor, end, " lines");
+        *(cursor <= end ? cursor : end) = '\0';
+        emit_line(LogLevel::Warn, line);
+    }
+}
+
+// Drains up to max_lines; interrupts stay off only for one line at a time.
+size_t drain_rings(size_t max_lines) {
+    size_t drained = 0;
+    while (drained < max_lines) {
+        uint64_t flags = sync::disable_interrupts();
+        lock_console();
+        bool emitted = drain_one();
+        if (!emitted) {
+            report_drops();
+        }
+        unlock_console();
+        sync::restore_interrupts(flags);
+        if (!emitted) {
+            break;
+        }
+        ++drained;
+    }
+    return drained;
+}
+
+void drain_worker(process::Process& worker) {
+    size_t drained = drain_rings(LOG_DRAIN_BATCH);
+    uint64_t now = timekeeping::tick_count();
+    uint64_t interval =
+        drained == LOG_DRAIN_BATCH
+            ? 1
+            : timekeeping::ticks_for_duration_ns(LOG_DRAIN_INTERVAL_NS);
+    if (interval == 0) {
+        interval = 1;
+    }
+    worker.waiting_on = nullptr;
+    process::block_until(worker, now + interval);
+}
+
 }  // namespace
 
 void log_init() {
@@ -382,18 +625,56 @@ void log_message(LogLevel level, const char* fmt, ...) {
         log_init();
     }
 
-    char buffer[256];
     va_list args;
+    if (__atomic_load_n(&g_async, __ATOMIC_ACQUIRE)) {
+        if (!rate_limit_allows(fmt)) {
+            return;
+        }
+        va_start(args, fmt);
+        enqueue_record(level, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    char buffer[LOG_MESSAGE_MAX];
     va_start(args, fmt);
     format_message(buffer, sizeof(buffer), fmt, args);
     va_end(args);
 
-    const char* tag = level_tag(level);
-
     lock_console();
-    emit_to_serial(tag, buffer);
-    emit_to_console(level, tag, buffer);
-    store_log_line(tag, buffer);
+    emit_line(level, buffer);
+    unlock_console();
+}
+
+void log_start_drain() {
+    if (__atomic_load_n(&g_drain_task, __ATOMIC_ACQUIRE) != nullptr) {
+        return;
+    }
+    process::Process* worker = process::allocate_kernel_task(drain_worker);
+    if (worker == nullptr) {
+        log_message(LogLevel::Warn,
+                    "Log: no drain task; logging stays synchronous");
+        return;
+    }
+    __atomic_store_n(&g_rate_window_ticks,
+                     timekeeping::ticks_for_duration_ns(1000ull * 1000 * 1000),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&g_drain_task, worker, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_async, true, __ATOMIC_RELEASE);
+    scheduler::enqueue(worker);
+}
+
+void log_flush() {
+    while (drain_rings(LOG_DRAIN_BATCH) == LOG_DRAIN_BATCH) {
+    }
+}
+
+void log_enter_panic() {
+    __atomic_store_n(&g_async, false, __ATOMIC_RELEASE);
+    lock_console_for_panic();
+    while (drain_one()) {
+    }
+    report_drops();
     unlock_console();
 }
 
@@ -10,7 +10,16 @@ enum class LogLevel : uint8_t {
 };
 
 void log_init();
+// Until log_start_drain() this formats and writes the line synchronously.
+// Afterwards the line goes into the calling CPU's ring for the drain task,
+// and each call site, keyed by fmt, is limited to a burst per second.
 void log_message(LogLevel level, const char* fmt, ...);
+void log_start_drain();
+// Writes out everything queued so far, e.g. before a reset.
+void log_flush();
+// Drains the rings on the current CPU and makes every later line
+// synchronous again, for fatal error paths.
+void log_enter_panic();
 void log_set_console_enabled(bool enabled);
 bool log_console_enabled();
 size_t log_copy_recent(char* out, size_t max_len);
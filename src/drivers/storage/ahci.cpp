@@ -1,9 +1,12 @@
 #include "drivers/storage/ahci.hpp"
 
+#include "arch/x86_64/lapic.hpp"
 #include "arch/x86_64/memory/paging.hpp"
 #include "drivers/log/logging.hpp"
 #include "drivers/pci/pci.hpp"
+#include "kernel/interrupts.hpp"
 #include "kernel/memory/physical_allocator.hpp"
+#include "kernel/sync.hpp"
 #include "lib/mem.hpp"
 
 namespace ahci {
@@ -15,6 +18,15 @@ constexpr size_t kMaxDevices = 32;
 constexpr size_t kPortCount = 32;
 constexpr size_t kCommandSlotCount = 32;
 constexpr size_t kPrdtEntryCount = 32;
+// Command tables are 128-byte aligned; each slot gets its own.
+constexpr size_t kCommandTableStride = 1024;
+constexpr size_t kCommandTablePages =
+    kCommandSlotCount * kCommandTableStride / 4096;
+// Spins a waiter allows before declaring the port hung. With MSI the waiter
+// only checks the port itself every kInterruptPollInterval spins, in case
+// the interrupt is routed to a CPU that has them disabled.
+constexpr uint64_t kCommandTimeoutSpins = 16000000;
+constexpr uint64_t kInterruptPollInterval = 4096;
 constexpr size_t kPageSize = 4096;
 constexpr uint64_t kPageMask = kPageSize - 1;
 constexpr uint64_t kMmioVirtBase = 0xFFFFE30000000000ull;
@@ -26,6 +38,10 @@ constexpr uint8_t kPciCommandMemorySpace = 1u << 1;
 constexpr uint8_t kPciCommandBusMaster = 1u << 2;
 
 constexpr uint32_t kGhcAe = 1u << 31;
+constexpr uint32_t kGhcIe = 1u << 1;
+constexpr uint32_t kCapSncq = 1u << 30;
+constexpr uint32_t kCapNcsShift = 8;
+constexpr uint32_t kCapNcsMask = 0x1Fu;
 constexpr uint32_t kBohcBos = 1u << 0;
 constexpr uint32_t kBohcOos = 1u << 1;
 constexpr uint32_t kBohcBb = 1u << 4;
@@ -35,6 +51,12 @@ constexpr uint32_t kPortCmdFre = 1u << 4;
 constexpr uint32_t kPortCmdFr = 1u << 14;
 constexpr uint32_t kPortCmdCr = 1u << 15;
 
+constexpr uint32_t kPortSctlDetMask = 0x0Fu;
+constexpr uint32_t kPortSctlDetComreset = 0x01u;
+// DET must stay at 1 for at least 1 ms; this is comfortably longer on any
+// CPU the kernel runs on. Interrupts are off here, so no timer can help.
+constexpr uint32_t kComresetHoldSpins = 200000;
+
 constexpr uint32_t kPortSstsDetMask = 0x0Fu;
 constexpr uint32_t kPortSstsDetPresent = 0x03u;
 constexpr uint32_t kPortSstsIpmMask = 0x0F00u;
@@ -45,11 +67,28 @@ constexpr uint32_t kPortSigAta = 0x00000101u;
 constexpr uint32_t kPortTfdBusy = 1u << 7;
 constexpr uint32_t kPortTfdDrq = 1u << 3;
 constexpr uint32_t kPortIsTfes = 1u << 30;
+constexpr uint32_t kPortIsHbfs = 1u << 29;
+constexpr uint32_t kPortIsHbds = 1u << 28;
+constexpr uint32_t kPortIsIfs = 1u << 27;
+constexpr uint32_t kPortIsErrorMask =
+    kPortIsTfes | kPortIsHbfs | kPortIsHbds | kPortIsIfs;
+constexpr uint32_t kPortIsDhrs = 1u << 0;
+constexpr uint32_t kPortIsPss = 1u << 1;
+constexpr uint32_t kPortIsSdbs = 1u << 3;
+constexpr uint32_t kPortIeMask =
+    kPortIsDhrs | kPortIsPss | kPortIsSdbs | kPortIsErrorMask;
 
 constexpr uint8_t kFisTypeRegH2d = 0x27;
 constexpr uint8_t kAtaCmdIdentify = 0xEC;
 constexpr uint8_t kAtaCmdReadDmaExt = 0x25;
 constexpr uint8_t kAtaCmdWriteDmaExt = 0x35;
+constexpr uint8_t kAtaCmdReadFpdmaQueued = 0x60;
+constexpr uint8_t kAtaCmdWriteFpdmaQueued = 0x61;
+constexpr uint8_t kAtaCmdReadLogExt = 0x2F;
+constexpr uint8_t kAtaLogNcqError = 0x10;
+constexpr uint8_t kNcqErrorLogNq = 1u << 7;
+constexpr uint8_t kNcqErrorLogTagMask = 0x1Fu;
+constexpr uint16_t kIdentifySataCapNcq = 1u << 8;
 
 struct [[gnu::packed]] HbaPort {
     uint32_t clb;
@@ -147,6 +186,8 @@ struct [[gnu::packed]] FisRegH2d {
 
 struct ControllerState {
     bool used;
+    bool msi_enabled;
+    uint8_t vector;
     pci::PciDevice pci_device;
     volatile HbaMemory* abar;
     uint64_t abar_phys;
@@ -164,11 +205,17 @@ struct DeviceState {
     uint8_t* command_list_virt;
     uint64_t fis_phys;
     uint8_t* fis_virt;
-    uint64_t command_table_phys;
-    HbaCommandTable* command_table;
+    uint64_t command_tables_phys;
+    uint8_t* command_tables_virt;
     uint64_t identify_buffer_phys;
     uint16_t* identify_buffer;
-    volatile int lock;
+    // Slots in use and the request each one completes. Taken from interrupt
+    // context, so always held with interrupts disabled.
+    sync::SpinLock lock;
+    uint32_t outstanding;
+    Request* slot_requests[kCommandSlotCount];
+    uint32_t queue_depth;
+    bool ncq;
 };
 
 ControllerState g_controllers[kMaxControllers]{};
@@ -191,15 +238,6 @@ void cpu_relax() {
     asm volatile("pause");
 }
 
-void lock_device(DeviceState& device) {
-    while (__atomic_test_and_set(&device.lock, __ATOMIC_ACQUIRE)) {
-        cpu_relax();
-    }
-}
-
-void unlock_device(DeviceState& device) {
-    __atomic_clear(&device.lock, __ATOMIC_RELEASE);
-}
 
 uint64_t pci_bar_base(const pci::PciDevice& device, uint8_t bar_index) {
     if (bar_index >= 6) {
@@ -395,55 +433,249 @@ bool build_prdt(HbaCommandTable& table,
     return true;
 }
 
-bool issue_command(DeviceState& device,
-                   uint8_t command,
-                   uint64_t lba,
-                   uint16_t sector_count,
-                   void* buffer,
-                   bool is_write) {
-    if (device.port == nullptr || sector_count == 0 || buffer == nullptr) {
-        return false;
+HbaCommandTable& slot_table(DeviceState& device, uint32_t slot) {
+    return *reinterpret_cast<HbaCommandTable*>(
+        device.command_tables_virt + slot * kCommandTableStride);
+}
+
+void complete_request(Request& request, Status status) {
+    request.status = status;
+    __atomic_store_n(&request.done, true, __ATOMIC_RELEASE);
+}
+
+uint8_t rw_command(const DeviceState& device, bool is_write) {
+    if (device.ncq) {
+        return is_write ? kAtaCmdWriteFpdmaQueued : kAtaCmdReadFpdmaQueued;
     }
+    return is_write ? kAtaCmdWriteDmaExt : kAtaCmdReadDmaExt;
+}
 
-    volatile HbaPort& port = *device.port;
-    if (!wait_port_idle(port)) {
-        log_message(LogLevel::Warn,
-                    "AHCI: port %u busy before %s lba=%llu count=%u tfd=%08x is=%08x serr=%08x ci=%08x",
-                    device.port_index,
-                    is_write ? "write" : "read",
-                    static_cast<unsigned long long>(lba),
-                    static_cast<unsigned>(sector_count),
-                    port.tfd,
-                    port.is,
-                    port.serr,
-                    port.ci);
+Status start_command_locked(DeviceState& device,
+                            uint8_t command,
+                            Request& request);
+
+// Link reset: DET=1, then back to 0, then wait for the device to come back
+// and post its first status. The command engine must be stopped.
+bool comreset_port(volatile HbaPort& port) {
+    port.sctl = (port.sctl & ~kPortSctlDetMask) | kPortSctlDetComreset;
+    for (uint32_t spins = 0; spins < kComresetHoldSpins; ++spins) {
+        cpu_relax();
+    }
+    port.sctl = port.sctl & ~kPortSctlDetMask;
+    bool linked = false;
+    for (uint32_t spins = 0; spins < 1000000; ++spins) {
+        if ((port.ssts & kPortSstsDetMask) == kPortSstsDetPresent) {
+            linked = true;
+            break;
+        }
+        cpu_relax();
+    }
+    if (!linked) {
         return false;
     }
-
-    port.is = 0xFFFFFFFFu;
+    // The device's first D2H FIS only reaches tfd with FIS receive on.
+    port.cmd |= kPortCmdFre;
     port.serr = 0xFFFFFFFFu;
+    bool idle = wait_port_idle(port);
+    port.is = 0xFFFFFFFFu;
+    return idle;
+}
+
+// Reads the NCQ Command Error log in slot 0, polled, and returns the tag
+// of the queued command that failed, or -1 when the log cannot be read or
+// does not name one. Reading the log is also what lets the drive take
+// queued commands again. Needs an empty, running port.
+int read_ncq_error_tag_locked(DeviceState& device) {
+    volatile HbaPort& port = *device.port;
+    // IDENTIFY data is parsed once at init; the page doubles as the buffer.
+    uint8_t* log = reinterpret_cast<uint8_t*>(device.identify_buffer);
+    memset(log, 0, 512);
 
+    HbaCommandTable& table = slot_table(device, 0);
+    memset(&table, 0, sizeof(table));
+    uint16_t prdt_count = 0;
+    if (!build_prdt(table, log, 512, prdt_count)) {
+        return -1;
+    }
     auto* headers =
         reinterpret_cast<HbaCommandHeader*>(device.command_list_virt);
     HbaCommandHeader& header = headers[0];
     header = {};
     header.cfl = sizeof(FisRegH2d) / sizeof(uint32_t);
-    header.w = is_write ? 1u : 0u;
+    header.prdtl = prdt_count;
+    header.ctba = static_cast<uint32_t>(device.command_tables_phys & 0xFFFFFFFFu);
+    header.ctbau = static_cast<uint32_t>(device.command_tables_phys >> 32);
 
-    HbaCommandTable& table = *device.command_table;
-    memset(&table, 0, sizeof(table));
+    auto* fis = reinterpret_cast<FisRegH2d*>(table.cfis);
+    fis->fis_type = kFisTypeRegH2d;
+    fis->command_control = 1;
+    fis->command = kAtaCmdReadLogExt;
+    fis->lba0 = kAtaLogNcqError;
+    fis->countl = 1;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    port.ci = 1u;
+    bool finished = false;
+    for (uint32_t spins = 0; spins < 1000000; ++spins) {
+        if ((port.is & kPortIsErrorMask) != 0) {
+            break;
+        }
+        if ((port.ci & 1u) == 0) {
+            finished = true;
+            break;
+        }
+        cpu_relax();
+    }
+    port.is = 0xFFFFFFFFu;
+    if (!finished) {
+        return -1;
+    }
+
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < 512; ++i) {
+        checksum = static_cast<uint8_t>(checksum + log[i]);
+    }
+    if (checksum != 0 || (log[0] & kNcqErrorLogNq) != 0) {
+        return -1;
+    }
+    return log[0] & kNcqErrorLogTagMask;
+}
+
+// An error aborts every command on the port. For a queued command that
+// failed, the NCQ error log names its tag: only that request fails and the
+// rest are queued again. Otherwise, or when the port will not come back
+// cleanly, the link is reset and every request fails.
+void recover_port_locked(DeviceState& device,
+                         const char* reason,
+                         bool command_error) {
+    volatile HbaPort& port = *device.port;
+    log_message(LogLevel::Warn,
+                "AHCI: %s %s outstanding=%08x tfd=%08x is=%08x serr=%08x sact=%08x ci=%08x",
+                device.name,
+                reason,
+                device.outstanding,
+                port.tfd,
+                port.is,
+                port.serr,
+                port.sact,
+                port.ci);
+
+    // Stopping the engine clears ci and sact, so every slot comes back.
+    uint32_t slots = device.outstanding;
+    Request* requests[kCommandSlotCount];
+    for (uint32_t slot = 0; slot < kCommandSlotCount; ++slot) {
+        requests[slot] = device.slot_requests[slot];
+        device.slot_requests[slot] = nullptr;
+    }
+    device.outstanding = 0;
+
+    stop_port(port);
+    port.serr = 0xFFFFFFFFu;
+    port.is = 0xFFFFFFFFu;
+    bool clean = wait_port_idle(port);
+    int tag = -1;
+    if (clean && command_error && device.ncq) {
+        start_port(port);
+        tag = read_ncq_error_tag_locked(device);
+        if (tag < 0 || (slots & (1u << tag)) == 0) {
+            tag = -1;
+            stop_port(port);
+        }
+    }
+    if (tag < 0) {
+        if (!comreset_port(port)) {
+            log_message(LogLevel::Warn,
+                        "AHCI: %s still busy after COMRESET tfd=%08x",
+                        device.name,
+                        port.tfd);
+        }
+        start_port(port);
+    }
+
+    for (uint32_t slot = 0; slot < kCommandSlotCount; ++slot) {
+        Request* request = requests[slot];
+        if ((slots & (1u << slot)) == 0 || request == nullptr) {
+            continue;
+        }
+        if (tag < 0 || static_cast<uint32_t>(tag) == slot ||
+            start_command_locked(device,
+                                 rw_command(device, request->is_write),
+                                 *request) != Status::Ok) {
+            complete_request(*request, Status::IoError);
+        }
+    }
+}
+
+// Completes requests whose slots the HBA has finished with: ci clears when
+// a command completes, and sact when a queued command does.
+void reap_locked(DeviceState& device) {
+    volatile HbaPort& port = *device.port;
+    uint32_t status = port.is;
+    port.is = status;
+    if ((status & kPortIsErrorMask) != 0) {
+        recover_port_locked(device, "command failed", true);
+        return;
+    }
+    uint32_t active = port.ci | port.sact;
+    uint32_t finished = device.outstanding & ~active;
+    if (finished == 0) {
+        return;
+    }
+    device.outstanding &= ~finished;
+    for (uint32_t slot = 0; slot < kCommandSlotCount; ++slot) {
+        if ((finished & (1u << slot)) == 0) {
+            continue;
+        }
+        Request* request = device.slot_requests[slot];
+        device.slot_requests[slot] = nullptr;
+        if (request != nullptr) {
+            complete_request(*request, Status::Ok);
+        }
+    }
+}
+
+// Builds the command in a free slot and hands it to the HBA. Returns Busy
+// when every slot up to the queue depth is taken.
+Status start_command_locked(DeviceState& device,
+                            uint8_t command,
+                            Request& request) {
+    volatile HbaPort& port = *device.port;
+    uint32_t slot = kCommandSlotCount;
+    for (uint32_t i = 0; i < device.queue_depth; ++i) {
+        if ((device.outstanding & (1u << i)) == 0 && (port.ci & (1u << i)) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == kCommandSlotCount) {
+        return Status::Busy;
+    }
 
+    HbaCommandTable& table = slot_table(device, slot);
+    memset(&table, 0, sizeof(table));
     uint16_t prdt_count = 0;
-    size_t byte_count = static_cast<size_t>(sector_count) * 512;
-    if (!build_prdt(table, buffer, byte_count, prdt_count)) {
-        return false;
+    size_t byte_count = static_cast<size_t>(request.sector_count) * 512;
+    if (!build_prdt(table, request.buffer, byte_count, prdt_count)) {
+        return Status::IoError;
     }
-    header.prdtl = prdt_count;
-    header.ctba = static_cast<uint32_t>(device.command_table_phys & 0xFFFFFFFFu);
-    header.ctbau = static_cast<uint32_t>(device.command_table_phys >> 32);
 
+    auto* headers =
+        reinterpret_cast<HbaCommandHeader*>(device.command_list_virt);
+    HbaCommandHeader& header = headers[slot];
+    header = {};
+    header.cfl = sizeof(FisRegH2d) / sizeof(uint32_t);
+    header.w = request.is_write ? 1u : 0u;
+    header.prdtl = prdt_count;
+    uint64_t table_phys =
+        device.command_tables_phys + slot * kCommandTableStride;
+    header.ctba = static_cast<uint32_t>(table_phys & 0xFFFFFFFFu);
+    header.ctbau = static_cast<uint32_t>(table_phys >> 32);
+
+    bool queued = command == kAtaCmdReadFpdmaQueued ||
+                  command == kAtaCmdWriteFpdmaQueued;
+    uint64_t lba = request.lba;
+    uint16_t count = request.sector_count;
     auto* fis = reinterpret_cast<FisRegH2d*>(table.cfis);
-    memset(fis, 0, sizeof(FisRegH2d));
     fis->fis_type = kFisTypeRegH2d;
     fis->command_control = 1;
     fis->command = command;
@@ -454,53 +686,90 @@ bool issue_command(DeviceState& device,
     fis->lba3 = static_cast<uint8_t>(lba >> 24);
     fis->lba4 = static_cast<uint8_t>(lba >> 32);
     fis->lba5 = static_cast<uint8_t>(lba >> 40);
-    fis->countl = static_cast<uint8_t>(sector_count);
-    fis->counth = static_cast<uint8_t>(sector_count >> 8);
+    if (queued) {
+        // FPDMA QUEUED carries the count in the feature field and the tag
+        // in bits 7:3 of the count field.
+        fis->featurel = static_cast<uint8_t>(count);
+        fis->featureh = static_cast<uint8_t>(count >> 8);
+        fis->countl = static_cast<uint8_t>(slot << 3);
+    } else {
+        fis->countl = static_cast<uint8_t>(count);
+        fis->counth = static_cast<uint8_t>(count >> 8);
+    }
 
-    port.ci = 1u;
-    for (uint32_t spins = 0; spins < 4000000; ++spins) {
-        if ((port.ci & 1u) == 0) {
-            if ((port.is & kPortIsTfes) != 0) {
-                log_message(LogLevel::Warn,
-                            "AHCI: %s failed lba=%llu count=%u tfd=%08x is=%08x serr=%08x sact=%08x",
-                            is_write ? "write" : "read",
-                            static_cast<unsigned long long>(lba),
-                            static_cast<unsigned>(sector_count),
-                            port.tfd,
-                            port.is,
-                            port.serr,
-                            port.sact);
-                return false;
-            }
-            return true;
+    request.done = false;
+    request.status = Status::Busy;
+    device.slot_requests[slot] = &request;
+    device.outstanding |= 1u << slot;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (queued) {
+        port.sact = 1u << slot;
+    }
+    port.ci = 1u << slot;
+    return Status::Ok;
+}
+
+Status submit_request(DeviceState& device, uint8_t command, Request& request) {
+    if (device.port == nullptr || request.sector_count == 0 ||
+        request.buffer == nullptr) {
+        return Status::IoError;
+    }
+    sync::IrqLockGuard guard(device.lock);
+    Status status = start_command_locked(device, command, request);
+    if (status == Status::Busy) {
+        reap_locked(device);
+        status = start_command_locked(device, command, request);
+    }
+    return status;
+}
+
+Status wait_request(DeviceState& device, Request& request) {
+    bool interrupts = device.controller->msi_enabled;
+    for (uint64_t spins = 0;; ++spins) {
+        if (__atomic_load_n(&request.done, __ATOMIC_ACQUIRE)) {
+            return request.status;
         }
-        if ((port.is & kPortIsTfes) != 0) {
-            log_message(LogLevel::Warn,
-                        "AHCI: %s taskfile error lba=%llu count=%u tfd=%08x is=%08x serr=%08x sact=%08x ci=%08x",
-                        is_write ? "write" : "read",
-                        static_cast<unsigned long long>(lba),
-                        static_cast<unsigned>(sector_count),
-                        port.tfd,
-                        port.is,
-                        port.serr,
-                        port.sact,
-                        port.ci);
-            return false;
+        if (!interrupts || (spins % kInterruptPollInterval) == 0) {
+            sync::IrqLockGuard guard(device.lock);
+            reap_locked(device);
+        }
+        if (spins >= kCommandTimeoutSpins) {
+            sync::IrqLockGuard guard(device.lock);
+            if (!__atomic_load_n(&request.done, __ATOMIC_ACQUIRE)) {
+                recover_port_locked(device, "command timeout", false);
+            }
+            return request.status;
         }
         cpu_relax();
     }
+}
 
-    log_message(LogLevel::Warn,
-                "AHCI: %s timeout lba=%llu count=%u tfd=%08x is=%08x serr=%08x sact=%08x ci=%08x",
-                is_write ? "write" : "read",
-                static_cast<unsigned long long>(lba),
-                static_cast<unsigned>(sector_count),
-                port.tfd,
-                port.is,
-                port.serr,
-                port.sact,
-                port.ci);
-    return false;
+// Runs one command to completion, waiting for a free slot if necessary.
+bool issue_command(DeviceState& device,
+                   uint8_t command,
+                   uint64_t lba,
+                   uint16_t sector_count,
+                   void* buffer,
+                   bool is_write) {
+    Request request{};
+    request.lba = lba;
+    request.buffer = buffer;
+    request.sector_count = static_cast<uint8_t>(sector_count);
+    request.is_write = is_write;
+    Status status = Status::Busy;
+    for (uint64_t spins = 0; status == Status::Busy; ++spins) {
+        status = submit_request(device, command, request);
+        if (status == Status::Busy) {
+            if (spins >= kCommandTimeoutSpins) {
+                return false;
+            }
+            cpu_relax();
+        }
+    }
+    if (status != Status::Ok) {
+        return false;
+    }
+    return wait_request(device, request) == Status::Ok;
 }
 
 bool init_device(DeviceState& device) {
@@ -512,30 +781,37 @@ bool init_device(DeviceState& device) {
 
     device.command_list_phys = alloc_zeroed_pages(1);
     device.fis_phys = alloc_zeroed_pages(1);
-    device.command_table_phys = alloc_zeroed_pages(1);
+    device.command_tables_phys = alloc_zeroed_pages(kCommandTablePages);
     device.identify_buffer_phys = alloc_zeroed_pages(1);
     if (device.command_list_phys == 0 || device.fis_phys == 0 ||
-        device.command_table_phys == 0 || device.identify_buffer_phys == 0) {
+        device.command_tables_phys == 0 || device.identify_buffer_phys == 0) {
         return false;
     }
 
     device.command_list_virt = static_cast<uint8_t*>(
         paging_phys_to_virt(device.command_list_phys));
     device.fis_virt = static_cast<uint8_t*>(paging_phys_to_virt(device.fis_phys));
-    device.command_table = static_cast<HbaCommandTable*>(
-        paging_phys_to_virt(device.command_table_phys));
+    device.command_tables_virt = static_cast<uint8_t*>(
+        paging_phys_to_virt(device.command_tables_phys));
     device.identify_buffer = static_cast<uint16_t*>(
         paging_phys_to_virt(device.identify_buffer_phys));
     if (device.command_list_virt == nullptr || device.fis_virt == nullptr ||
-        device.command_table == nullptr || device.identify_buffer == nullptr) {
+        device.command_tables_virt == nullptr ||
+        device.identify_buffer == nullptr) {
         return false;
     }
 
     memset(device.command_list_virt, 0, kPageSize);
     memset(device.fis_virt, 0, kPageSize);
-    memset(device.command_table, 0, kPageSize);
     memset(device.identify_buffer, 0, kPageSize);
 
+    // Until IDENTIFY says otherwise, issue one unqueued command at a time.
+    uint32_t cap = device.controller->abar->cap;
+    uint32_t hba_slots = ((cap >> kCapNcsShift) & kCapNcsMask) + 1;
+    device.queue_depth = 1;
+    device.ncq = false;
+    device.outstanding = 0;
+
     port.clb = static_cast<uint32_t>(device.command_list_phys & 0xFFFFFFFFu);
     port.clbu = static_cast<uint32_t>(device.command_list_phys >> 32);
     port.fb = static_cast<uint32_t>(device.fis_phys & 0xFFFFFFFFu);
@@ -562,6 +838,18 @@ bool init_device(DeviceState& device) {
     device.identify.sector_count = identify_sector_count(device.identify_buffer);
     device.identify.present = device.identify.sector_count != 0;
     device.present = device.identify.present;
+
+    // Word 76 advertises NCQ, word 75 the drive's queue depth minus one.
+    bool drive_ncq = (device.identify_buffer[76] & kIdentifySataCapNcq) != 0;
+    if ((cap & kCapSncq) != 0 && drive_ncq) {
+        uint32_t drive_depth = (device.identify_buffer[75] & 0x1Fu) + 1;
+        device.ncq = true;
+        device.queue_depth = drive_depth < hba_slots ? drive_depth : hba_slots;
+    } else {
+        // Unqueued commands still fill several slots; the HBA runs them in
+        // order.
+        device.queue_depth = hba_slots;
+    }
     return device.present;
 }
 
@@ -614,6 +902,60 @@ void format_device_name(char* buffer, size_t buffer_size, size_t index) {
     buffer[pos] = '\0';
 }
 
+void handle_interrupt() {
+    for (auto& controller : g_controllers) {
+        if (!controller.used || !controller.msi_enabled) {
+            continue;
+        }
+        uint32_t pending = controller.abar->is;
+        if (pending == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < g_device_count; ++i) {
+            DeviceState& device = g_devices[i];
+            if (!device.present || device.controller != &controller ||
+                (pending & (1u << device.port_index)) == 0) {
+                continue;
+            }
+            sync::IrqLockGuard guard(device.lock);
+            reap_locked(device);
+        }
+        controller.abar->is = pending;
+    }
+}
+
+// Switches the controller's ports from polling to MSI completion. Ports
+// keep polling when MSI is unavailable.
+void enable_interrupts(ControllerState& controller) {
+    uint8_t vector = interrupts::allocate_vector();
+    if (vector == 0) {
+        return;
+    }
+    if (!interrupts::register_vector(vector, handle_interrupt)) {
+        interrupts::free_vector(vector);
+        return;
+    }
+    if (!pci::enable_msi(controller.pci_device,
+                         vector,
+                         static_cast<uint8_t>(lapic::id()))) {
+        interrupts::unregister_vector(vector);
+        interrupts::free_vector(vector);
+        return;
+    }
+    controller.vector = vector;
+    for (size_t i = 0; i < g_device_count; ++i) {
+        DeviceState& device = g_devices[i];
+        if (device.present && device.controller == &controller) {
+            device.port->is = 0xFFFFFFFFu;
+            device.port->ie = kPortIeMask;
+        }
+    }
+    controller.abar->is = 0xFFFFFFFFu;
+    uint32_t ghc = controller.abar->ghc;
+    controller.abar->ghc = ghc | kGhcIe;
+    controller.msi_enabled = true;
+}
+
 void probe_controller(const pci::PciDevice& pci_device) {
     if (g_device_count >= kMaxDevices) {
         return;
@@ -696,17 +1038,21 @@ void probe_controller(const pci::PciDevice& pci_device) {
         }
 
         log_message(LogLevel::Info,
-                    "AHCI: disk %s controller=%02u:%02u.%u port=%u model='%s' sectors=%llu",
+                    "AHCI: disk %s controller=%02u:%02u.%u port=%u model='%s' sectors=%llu queue=%u%s",
                     device.name,
                     static_cast<unsigned int>(pci_device.bus),
                     static_cast<unsigned int>(pci_device.slot),
                     static_cast<unsigned int>(pci_device.function),
                     static_cast<unsigned int>(port_index),
                     device.identify.model,
-                    static_cast<unsigned long long>(device.identify.sector_count));
+                    static_cast<unsigned long long>(device.identify.sector_count),
+                    static_cast<unsigned int>(device.queue_depth),
+                    device.ncq ? " ncq" : "");
 
         ++g_device_count;
     }
+
+    enable_interrupts(*controller);
 }
 
 void probe_controllers() {
@@ -731,29 +1077,34 @@ DeviceState* get_device(size_t device_index) {
     return &g_devices[device_index];
 }
 
+bool request_in_range(const DeviceState& device, const Request& request) {
+    if (request.sector_count == 0 || request.buffer == nullptr) {
+        return false;
+    }
+    uint64_t last_lba = request.lba + static_cast<uint64_t>(request.sector_count);
+    return request.lba < device.identify.sector_count &&
+           last_lba <= device.identify.sector_count;
+}
+
 Status do_rw(DeviceState& device, uint64_t lba, uint8_t sector_count,
              void* buffer, bool is_write) {
     if (!device.present) {
         return Status::NoDevice;
     }
-    if (sector_count == 0 || buffer == nullptr) {
-        return Status::IoError;
-    }
-
-    uint64_t last_lba = lba + static_cast<uint64_t>(sector_count);
-    if (lba >= device.identify.sector_count ||
-        last_lba > device.identify.sector_count) {
+    Request request{};
+    request.lba = lba;
+    request.buffer = buffer;
+    request.sector_count = sector_count;
+    request.is_write = is_write;
+    if (!request_in_range(device, request)) {
         return Status::IoError;
     }
-
-    lock_device(device);
     bool ok = issue_command(device,
-                            is_write ? kAtaCmdWriteDmaExt : kAtaCmdReadDmaExt,
+                            rw_command(device, is_write),
                             lba,
                             sector_count,
                             buffer,
                             is_write);
-    unlock_device(device);
     return ok ? Status::Ok : Status::IoError;
 }
 
@@ -821,4 +1172,34 @@ Status write_sectors(size_t device_index, uint64_t lba, uint8_t sector_count,
                  true);
 }
 
+Status submit(size_t device_index, Request& request) {
+    init();
+    DeviceState* device = get_device(device_index);
+    if (device == nullptr) {
+        return Status::NoDevice;
+    }
+    if (!request_in_range(*device, request)) {
+        return Status::IoError;
+    }
+    return submit_request(*device, rw_command(*device, request.is_write),
+                          request);
+}
+
+Status wait(size_t device_index, Request& request) {
+    DeviceState* device = get_device(device_index);
+    if (device == nullptr) {
+        return Status::NoDevice;
+    }
+    return wait_request(*device, request);
+}
+
+size_t queue_depth(size_t device_index) {
+    init();
+    DeviceState* device = get_device(device_index);
+    if (device == nullptr) {
+        return 0;
+    }
+    return device->queue_depth;
+}
+
 }  // namespace ahci
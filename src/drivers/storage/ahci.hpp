@@ -19,6 +19,18 @@ struct IdentifyInfo {
     uint64_t sector_count;
 };
 
+// A transfer queued on one of the port's command slots. The driver owns it
+// from a successful submit() until done is set, which may happen in the
+// controller's interrupt handler.
+struct Request {
+    uint64_t lba;
+    void* buffer;  // kernel virtual address
+    uint8_t sector_count;
+    bool is_write;
+    volatile bool done;
+    volatile Status status;
+};
+
 bool init();
 
 size_t device_count();
@@ -30,4 +42,12 @@ Status read_sectors(size_t device_index, uint64_t lba, uint8_t sector_count,
 Status write_sectors(size_t device_index, uint64_t lba, uint8_t sector_count,
                      const void* buffer);
 
+// Queues a transfer without waiting for it. Returns Busy when every slot is
+// in use; the request is untouched in that case.
+Status submit(size_t device_index, Request& request);
+// Waits for a submitted request and returns its status.
+Status wait(size_t device_index, Request& request);
+// Commands the port can have in flight at once.
+size_t queue_depth(size_t device_index);
+
 }  // namespace ahci
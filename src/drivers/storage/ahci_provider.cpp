@@ -4,6 +4,7 @@
 #include "drivers/fs/mount_manager.hpp"
 #include "drivers/log/logging.hpp"
 #include "drivers/storage/ahci.hpp"
+#include "kernel/sync.hpp"
 
 namespace {
 
@@ -25,7 +26,19 @@ constexpr size_t kMaxExportedDevices =
     kMaxAhciDevices * (kMaxPartitionsPerDevice + 1);
 constexpr size_t kMaxNameLen = 24;
 
+// Backing for fs::BlockRequests queued on AHCI ports, enough to keep every
+// port of a few disks busy.
+constexpr size_t kMaxQueuedRequests = 128;
+
+struct QueuedRequest {
+    ahci::Request request;
+    size_t device_index;
+    bool in_use;
+};
+
 alignas(512) uint8_t g_partition_buffer[512];
+QueuedRequest g_queued_requests[kMaxQueuedRequests];
+sync::SpinLock g_queued_lock;
 AhciPartitionContext g_partition_contexts[kMaxExportedDevices];
 char g_name_storage[kMaxExportedDevices][kMaxNameLen];
 
@@ -100,13 +113,7 @@ bool append_suffix(char* buffer, size_t buffer_size, uint32_t value) {
     return true;
 }
 
-fs::BlockIoStatus ahci_partition_read(void* context,
-                                      uint32_t lba,
-                                      uint8_t count,
-                                      void* buffer) {
-    auto* ctx = static_cast<AhciPartitionContext*>(context);
-    ahci::Status status =
-        ahci::read_sectors(ctx->device_index, ctx->lba_base + lba, count, buffer);
+fs::BlockIoStatus to_block_status(ahci::Status status) {
     switch (status) {
         case ahci::Status::Ok:
             return fs::BlockIoStatus::Ok;
@@ -119,23 +126,80 @@ fs::BlockIoStatus ahci_partition_read(void* context,
     }
 }
 
+fs::BlockIoStatus ahci_partition_read(void* context,
+                                      uint32_t lba,
+                                      uint8_t count,
+                                      void* buffer) {
+    auto* ctx = static_cast<AhciPartitionContext*>(context);
+    return to_block_status(ahci::read_sectors(ctx->device_index,
+                                              ctx->lba_base + lba,
+                                              count,
+                                              buffer));
+}
+
 fs::BlockIoStatus ahci_partition_write(void* context,
                                        uint32_t lba,
                                        uint8_t count,
                                        const void* buffer) {
     auto* ctx = static_cast<AhciPartitionContext*>(context);
-    ahci::Status status = ahci::write_sectors(
-        ctx->device_index, ctx->lba_base + lba, count, buffer);
-    switch (status) {
-        case ahci::Status::Ok:
-            return fs::BlockIoStatus::Ok;
-        case ahci::Status::Busy:
-            return fs::BlockIoStatus::Busy;
-        case ahci::Status::NoDevice:
-            return fs::BlockIoStatus::NoDevice;
-        default:
-            return fs::BlockIoStatus::IoError;
+    return to_block_status(ahci::write_sectors(ctx->device_index,
+                                               ctx->lba_base + lba,
+                                               count,
+                                               buffer));
+}
+
+QueuedRequest* acquire_queued_request() {
+    g_queued_lock.lock();
+    QueuedRequest* found = nullptr;
+    for (auto& entry : g_queued_requests) {
+        if (!entry.in_use) {
+            entry.in_use = true;
+            found = &entry;
+            break;
+        }
+    }
+    g_queued_lock.unlock();
+    return found;
+}
+
+void release_queued_request(QueuedRequest& entry) {
+    g_queued_lock.lock();
+    entry.in_use = false;
+    g_queued_lock.unlock();
+}
+
+fs::BlockIoStatus ahci_partition_submit(void* context,
+                                        fs::BlockRequest& request) {
+    auto* ctx = static_cast<AhciPartitionContext*>(context);
+    QueuedRequest* entry = acquire_queued_request();
+    if (entry == nullptr) {
+        return fs::BlockIoStatus::Busy;
+    }
+    entry->device_index = ctx->device_index;
+    entry->request = {};
+    entry->request.lba = ctx->lba_base + request.lba;
+    entry->request.buffer = request.buffer;
+    entry->request.sector_count = request.sector_count;
+    entry->request.is_write = request.is_write;
+    ahci::Status status = ahci::submit(ctx->device_index, entry->request);
+    if (status != ahci::Status::Ok) {
+        release_queued_request(*entry);
+        return to_block_status(status);
+    }
+    request.driver_data = entry;
+    return fs::BlockIoStatus::Ok;
+}
+
+fs::BlockIoStatus ahci_partition_wait(void*, fs::BlockRequest& request) {
+    auto* entry = static_cast<QueuedRequest*>(request.driver_data);
+    if (entry == nullptr) {
+        return request.status;
     }
+    request.status =
+        to_block_status(ahci::wait(entry->device_index, entry->request));
+    request.driver_data = nullptr;
+    release_queued_request(*entry);
+    return request.status;
 }
 
 size_t scan_mbr_partitions(size_t device_index,
@@ -293,6 +357,8 @@ size_t enumerate_ahci_devices(fs::BlockDevice* out_devices, size_t max_devices)
         disk.read = ahci_partition_read;
         disk.write = ahci_partition_write;
         disk.context = &disk_context;
+        disk.submit = ahci_partition_submit;
+        disk.wait = ahci_partition_wait;
         ++exported_count;
 
         PartitionInfo partitions[kMaxPartitionsPerDevice]{};
@@ -345,6 +411,8 @@ size_t enumerate_ahci_devices(fs::BlockDevice* out_devices, size_t max_devices)
             device.read = ahci_partition_read;
             device.write = ahci_partition_write;
             device.context = &context;
+            device.submit = ahci_partition_submit;
+            device.wait = ahci_partition_wait;
 
             ++exported_count;
         }
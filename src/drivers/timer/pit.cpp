@@ -1,13 +1,30 @@
 #include "pit.hpp"
 
 #include "arch/x86_64/io.hpp"
+#include "arch/x86_64/registers.hpp"
 #include "../interrupts/pic.hpp"
 
 namespace {
 
 constexpr uint32_t PIT_INPUT_FREQUENCY = 1193182;
 constexpr uint8_t PIT_CHANNEL0 = 0x40;
+constexpr uint8_t PIT_CHANNEL2 = 0x42;
 constexpr uint8_t PIT_COMMAND  = 0x43;
+constexpr uint8_t PIT_GATE_PORT = 0x61;
+constexpr uint8_t PIT_GATE2 = 0x01;
+constexpr uint8_t PIT_SPEAKER = 0x02;
+constexpr uint8_t PIT_OUT2 = 0x20;
+constexpr uint32_t PIT_MAX_COUNT = 0xFFFF;
+constexpr uint8_t PIT_READ_BACK_STATUS0 = 0xE2;
+constexpr uint8_t PIT_STATUS_OUT = 0x80;
+
+uint32_t g_divisor = 0;
+
+void load_channel0(uint8_t command, uint32_t count) {
+    outb(PIT_COMMAND, command);
+    outb(PIT_CHANNEL0, static_cast<uint8_t>(count & 0xFF));
+    outb(PIT_CHANNEL0, static_cast<uint8_t>((count >> 8) & 0xFF));
+}
 
 }  // namespace
 
@@ -23,12 +40,61 @@ void init(uint32_t frequency_hz) {
         divisor = 1;
     }
 
-    outb(PIT_COMMAND, 0x36);
-    outb(PIT_CHANNEL0, static_cast<uint8_t>(divisor & 0xFF));
-    outb(PIT_CHANNEL0, static_cast<uint8_t>((divisor >> 8) & 0xFF));
+    g_divisor = divisor;
+    load_channel0(0x36, divisor);
 
     pic::set_mask(0, false);  // ensure timer IRQ is unmasked
 }
 
-}  // namespace pit
+void arm_oneshot(uint64_t delay_ns) {
+    if (delay_ns > max_oneshot_ns()) {
+        delay_ns = max_oneshot_ns();
+    }
+    uint64_t count = delay_ns * PIT_INPUT_FREQUENCY / 1000000000ull;
+    if (count == 0) {
+        count = 1;
+    }
+    // Mode 0 counts down once and raises OUT0, and with it IRQ 0, at zero.
+    load_channel0(0x30, static_cast<uint32_t>(count));
+}
+
+bool resume_periodic() {
+    outb(PIT_COMMAND, PIT_READ_BACK_STATUS0);
+    bool raised = (inb(PIT_CHANNEL0) & PIT_STATUS_OUT) != 0;
+    load_channel0(0x36, g_divisor);
+    return raised;
+}
 
+uint64_t max_oneshot_ns() {
+    return static_cast<uint64_t>(PIT_MAX_COUNT) * 1000000000ull /
+           PIT_INPUT_FREQUENCY;
+}
+
+uint64_t measure_tsc_hz(uint32_t window_ms) {
+    if (window_ms == 0 || window_ms > 54) {
+        return 0;
+    }
+    uint32_t count = PIT_INPUT_FREQUENCY * window_ms / 1000;
+
+    // Gate channel 2 on with the speaker off, then load a mode 0 one-shot;
+    // OUT2 goes high when the count reaches zero.
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, static_cast<uint8_t>((gate & ~PIT_SPEAKER) | PIT_GATE2));
+    outb(PIT_COMMAND, 0xB0);
+    outb(PIT_CHANNEL2, static_cast<uint8_t>(count & 0xFF));
+    outb(PIT_CHANNEL2, static_cast<uint8_t>((count >> 8) & 0xFF));
+
+    uint64_t start = cpu::read_tsc();
+    uint64_t spins = 0;
+    while ((inb(PIT_GATE_PORT) & PIT_OUT2) == 0) {
+        if (++spins > 100000000ull) {
+            outb(PIT_GATE_PORT, gate);
+            return 0;
+        }
+    }
+    uint64_t end = cpu::read_tsc();
+    outb(PIT_GATE_PORT, gate);
+    return (end - start) * 1000 / window_ms;
+}
+
+}  // namespace pit
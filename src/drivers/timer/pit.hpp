@@ -5,6 +5,15 @@
 namespace pit {
 
 void init(uint32_t frequency_hz);
+// Replaces channel 0's periodic interrupt with a single IRQ 0 delay_ns from
+// now, capped at max_oneshot_ns(). resume_periodic() restores the rate set
+// by init() and returns true when the one-shot had already raised IRQ 0.
+void arm_oneshot(uint64_t delay_ns);
+bool resume_periodic();
+uint64_t max_oneshot_ns();
+// Counts TSC cycles across a window_ms one-shot on channel 2 (at most 54 ms)
+// and returns the TSC frequency in Hz. Leaves channel 0 untouched.
+uint64_t measure_tsc_hz(uint32_t window_ms);
 
 }  // namespace pit
 
@@ -35,12 +35,19 @@ constexpr uint8_t kScsiInquiry = 0x12;
 constexpr uint8_t kScsiReadCapacity10 = 0x25;
 constexpr uint8_t kScsiRead10 = 0x28;
 constexpr uint8_t kScsiWrite10 = 0x2A;
+constexpr uint8_t kScsiRead16 = 0x88;
+constexpr uint8_t kScsiWrite16 = 0x8A;
+constexpr uint8_t kScsiServiceActionIn16 = 0x9E;
+constexpr uint8_t kServiceActionReadCapacity16 = 0x10;
 
 constexpr size_t kMaxDevices = 8;
 constexpr size_t kNameLen = 16;
 constexpr size_t kInquiryLen = 36;
 constexpr size_t kSenseLen = 18;
-constexpr size_t kIoBounceSize = 4096;
+constexpr size_t kReadCapacity16Len = 32;
+// Data moved by one CBW. The xHCI driver DMAs it straight into the caller's
+// buffer as a single chained TD.
+constexpr uint32_t kMaxTransferBytes = 1024 * 1024;
 
 struct [[gnu::packed]] CommandBlockWrapper {
     uint32_t signature;
@@ -69,11 +76,10 @@ struct DeviceState {
     char name[kNameLen];
     uint32_t next_tag;
     bool last_command_failed;
+    // The disk has more than 2^32 sectors, so READ/WRITE(10) cannot
+    // address all of it.
+    bool long_lba;
     volatile int lock;
-    // Keep xHCI DMA away from stack and filesystem buffers.  Some real xHCI
-    // controllers time out when handed virtual buffers with an unsuitable
-    // physical layout even though small, page-aligned discovery reads work.
-    alignas(4096) uint8_t io_bounce[kIoBounceSize];
 };
 
 DeviceState g_devices[kMaxDevices]{};
@@ -101,6 +107,16 @@ uint32_t read_be32(const uint8_t* data) {
            static_cast<uint32_t>(data[3]);
 }
 
+uint64_t read_be64(const uint8_t* data) {
+    return (static_cast<uint64_t>(read_be32(data)) << 32) |
+           static_cast<uint64_t>(read_be32(data + 4));
+}
+
+void store_be16(uint8_t* data, uint16_t value) {
+    data[0] = static_cast<uint8_t>((value >> 8) & 0xFFu);
+    data[1] = static_cast<uint8_t>(value & 0xFFu);
+}
+
 void store_be32(uint8_t* data, uint32_t value) {
     data[0] = static_cast<uint8_t>((value >> 24) & 0xFFu);
     data[1] = static_cast<uint8_t>((value >> 16) & 0xFFu);
@@ -108,6 +124,11 @@ void store_be32(uint8_t* data, uint32_t value) {
     data[3] = static_cast<uint8_t>(value & 0xFFu);
 }
 
+void store_be64(uint8_t* data, uint64_t value) {
+    store_be32(data, static_cast<uint32_t>(value >> 32));
+    store_be32(data + 4, static_cast<uint32_t>(value));
+}
+
 size_t copy_padded_ascii(char* dest,
                          size_t dest_size,
                          const uint8_t* src,
@@ -371,6 +392,28 @@ Status inquiry(DeviceState& state) {
     return Status::Ok;
 }
 
+Status read_capacity16(DeviceState& state) {
+    uint8_t cdb[16]{};
+    uint8_t data[kReadCapacity16Len]{};
+    cdb[0] = kScsiServiceActionIn16;
+    cdb[1] = kServiceActionReadCapacity16;
+    store_be32(cdb + 10, sizeof(data));
+    Status status = bot_command(state, cdb, 16, data, sizeof(data), true);
+    if (status != Status::Ok) {
+        return status;
+    }
+    uint64_t last_lba = read_be64(data);
+    uint32_t block_len = read_be32(data + 8);
+    if (block_len == 0 || last_lba == ~0ull) {
+        return Status::IoError;
+    }
+    state.identify.sector_count = last_lba + 1;
+    state.identify.sector_size = block_len;
+    state.long_lba = state.identify.sector_count > 0x100000000ull;
+    state.identify.present = true;
+    return Status::Ok;
+}
+
 Status read_capacity(DeviceState& state) {
     uint8_t cdb[10]{};
     uint8_t data[8]{};
@@ -381,15 +424,95 @@ Status read_capacity(DeviceState& state) {
     }
     uint32_t last_lba = read_be32(data);
     uint32_t block_len = read_be32(data + 4);
+    if (last_lba == 0xFFFFFFFFu) {
+        // Too large for the 10-byte form; the device reports the real
+        // capacity through READ CAPACITY(16).
+        return read_capacity16(state);
+    }
     if (block_len == 0) {
         return Status::IoError;
     }
     state.identify.sector_count = static_cast<uint64_t>(last_lba) + 1;
     state.identify.sector_size = block_len;
+    state.long_lba = false;
     state.identify.present = true;
     return Status::Ok;
 }
 
+// Fills cdb with a READ or WRITE for count sectors at lba and returns its
+// length. The 10-byte forms carry a 32-bit LBA, so larger disks use the
+// 16-byte ones throughout.
+uint8_t build_rw_cdb(const DeviceState& state,
+                     uint8_t* cdb,
+                     uint64_t lba,
+                     uint32_t count,
+                     bool is_write) {
+    memset(cdb, 0, 16);
+    if (state.long_lba) {
+        cdb[0] = is_write ? kScsiWrite16 : kScsiRead16;
+        store_be64(cdb + 2, lba);
+        store_be32(cdb + 10, count);
+        return 16;
+    }
+    cdb[0] = is_write ? kScsiWrite10 : kScsiRead10;
+    store_be32(cdb + 2, static_cast<uint32_t>(lba));
+    store_be16(cdb + 7, static_cast<uint16_t>(count));
+    return 10;
+}
+
+const char* rw_command_name(uint8_t opcode) {
+    switch (opcode) {
+        case kScsiRead10:
+            return "READ(10)";
+        case kScsiWrite10:
+            return "WRITE(10)";
+        case kScsiRead16:
+            return "READ(16)";
+        default:
+            return "WRITE(16)";
+    }
+}
+
+// Moves sector_count sectors with one CBW per kMaxTransferBytes, directly
+// to or from buffer. Called with the device lock held.
+Status transfer_sectors(DeviceState& state,
+                        uint64_t lba,
+                        uint32_t sector_count,
+                        uint8_t* buffer,
+                        bool is_write) {
+    Status status = Status::Ok;
+    uint32_t max_chunk = kMaxTransferBytes / state.identify.sector_size;
+    while (sector_count != 0) {
+        uint32_t chunk = sector_count < max_chunk ? sector_count : max_chunk;
+        uint32_t byte_count = chunk * state.identify.sector_size;
+        uint8_t cdb[16];
+        uint8_t cdb_length = build_rw_cdb(state, cdb, lba, chunk, is_write);
+
+        status = bot_command(state, cdb, cdb_length, buffer, byte_count,
+                             !is_write);
+        if (status != Status::Ok && state.last_command_failed) {
+            request_sense(state);
+        }
+        if (status != Status::Ok && bot_reset_recovery(state)) {
+            log_message(LogLevel::Info,
+                        "usb-storage %s: retrying %s lba=%llu count=%u after BOT recovery",
+                        state.name,
+                        rw_command_name(cdb[0]),
+                        static_cast<unsigned long long>(lba),
+                        static_cast<unsigned int>(chunk));
+            status = bot_command(state, cdb, cdb_length, buffer, byte_count,
+                                 !is_write);
+        }
+        if (status != Status::Ok) {
+            break;
+        }
+        buffer += byte_count;
+        lba += chunk;
+        sector_count -= chunk;
+    }
+    return status;
+}
+
 Status initialize_device(DeviceState& state) {
     if (state.device.transport.bulk == nullptr) {
         log_message(LogLevel::Warn,
@@ -532,7 +655,7 @@ const char* device_name(size_t device_index) {
 
 Status read_sectors(size_t device_index,
                     uint64_t lba,
-                    uint8_t sector_count,
+                    uint32_t sector_count,
                     void* buffer) {
     if (device_index >= g_device_count || buffer == nullptr ||
         sector_count == 0) {
@@ -541,60 +664,26 @@ Status read_sectors(size_t device_index,
     DeviceState& state = g_devices[device_index];
     if (!state.used || !state.identify.present ||
         state.identify.sector_size == 0 ||
-        state.identify.sector_size > kIoBounceSize) {
+        state.identify.sector_size > kMaxTransferBytes) {
         return Status::NoDevice;
     }
-    if (lba > 0xFFFFFFFFull ||
-        lba + sector_count > state.identify.sector_count) {
+    if (lba + sector_count > state.identify.sector_count) {
         return Status::IoError;
     }
 
     lock_device(state);
-    Status status = Status::Ok;
-    auto* out = static_cast<uint8_t*>(buffer);
-    uint8_t remaining = sector_count;
-    uint64_t current_lba = lba;
-    uint8_t max_chunk = static_cast<uint8_t>(
-        kIoBounceSize / state.identify.sector_size);
-    while (remaining != 0) {
-        uint8_t chunk = remaining < max_chunk ? remaining : max_chunk;
-        uint32_t byte_count =
-            static_cast<uint32_t>(chunk) * state.identify.sector_size;
-        uint8_t cdb[10]{};
-        cdb[0] = kScsiRead10;
-        store_be32(cdb + 2, static_cast<uint32_t>(current_lba));
-        cdb[7] = 0;
-        cdb[8] = chunk;
-
-        status = bot_command(state, cdb, 10, state.io_bounce,
-                             byte_count, true);
-        if (status != Status::Ok && state.last_command_failed) {
-            request_sense(state);
-        }
-        if (status != Status::Ok && bot_reset_recovery(state)) {
-            log_message(LogLevel::Info,
-                        "usb-storage %s: retrying READ(10) lba=%llu count=%u after BOT recovery",
-                        state.name,
-                        static_cast<unsigned long long>(current_lba),
-                        static_cast<unsigned int>(chunk));
-            status = bot_command(state, cdb, 10, state.io_bounce,
-                                 byte_count, true);
-        }
-        if (status != Status::Ok) {
-            break;
-        }
-        memcpy(out, state.io_bounce, byte_count);
-        out += byte_count;
-        current_lba += chunk;
-        remaining = static_cast<uint8_t>(remaining - chunk);
-    }
+    Status status = transfer_sectors(state,
+                                     lba,
+                                     sector_count,
+                                     static_cast<uint8_t*>(buffer),
+                                     false);
     unlock_device(state);
     return status;
 }
 
 Status write_sectors(size_t device_index,
                      uint64_t lba,
-                     uint8_t sector_count,
+                     uint32_t sector_count,
                      const void* buffer) {
     if (device_index >= g_device_count || buffer == nullptr ||
         sector_count == 0) {
@@ -603,53 +692,21 @@ Status write_sectors(size_t device_index,
     DeviceState& state = g_devices[device_index];
     if (!state.used || !state.identify.present ||
         state.identify.sector_size == 0 ||
-        state.identify.sector_size > kIoBounceSize) {
+        state.identify.sector_size > kMaxTransferBytes) {
         return Status::NoDevice;
     }
-    if (lba > 0xFFFFFFFFull ||
-        lba + sector_count > state.identify.sector_count) {
+    if (lba + sector_count > state.identify.sector_count) {
         return Status::IoError;
     }
 
     lock_device(state);
-    Status status = Status::Ok;
-    const auto* in = static_cast<const uint8_t*>(buffer);
-    uint8_t remaining = sector_count;
-    uint64_t current_lba = lba;
-    uint8_t max_chunk = static_cast<uint8_t>(
-        kIoBounceSize / state.identify.sector_size);
-    while (remaining != 0) {
-        uint8_t chunk = remaining < max_chunk ? remaining : max_chunk;
-        uint32_t byte_count =
-            static_cast<uint32_t>(chunk) * state.identify.sector_size;
-        memcpy(state.io_bounce, in, byte_count);
-
-        uint8_t cdb[10]{};
-        cdb[0] = kScsiWrite10;
-        store_be32(cdb + 2, static_cast<uint32_t>(current_lba));
-        cdb[7] = 0;
-        cdb[8] = chunk;
-        status = bot_command(state, cdb, 10, state.io_bounce,
-                             byte_count, false);
-        if (status != Status::Ok && state.last_command_failed) {
-            request_sense(state);
-        }
-        if (status != Status::Ok && bot_reset_recovery(state)) {
-            log_message(LogLevel::Info,
-                        "usb-storage %s: retrying WRITE(10) lba=%llu count=%u after BOT recovery",
-                        state.name,
-                        static_cast<unsigned long long>(current_lba),
-                        static_cast<unsigned int>(chunk));
-            status = bot_command(state, cdb, 10, state.io_bounce,
-                                 byte_count, false);
-        }
-        if (status != Status::Ok) {
-            break;
-        }
-        in += byte_count;
-        current_lba += chunk;
-        remaining = static_cast<uint8_t>(remaining - chunk);
-    }
+    // The OUT data phase only reads the buffer.
+    Status status = transfer_sectors(
+        state,
+        lba,
+        sector_count,
+        const_cast<uint8_t*>(static_cast<const uint8_t*>(buffer)),
+        true);
     unlock_device(state);
     return status;
 }
@@ -29,14 +29,15 @@ size_t device_count();
 const IdentifyInfo& identify(size_t device_index);
 const char* device_name(size_t device_index);
 
+// Transfers up to 1 MiB per SCSI command, straight to or from buffer.
 Status read_sectors(size_t device_index,
                     uint64_t lba,
-                    uint8_t sector_count,
+                    uint32_t sector_count,
                     void* buffer);
 
 Status write_sectors(size_t device_index,
                      uint64_t lba,
-                     uint8_t sector_count,
+                     uint32_t sector_count,
                      const void* buffer);
 
 }  // namespace usb::mass_storage
@@ -3,15 +3,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arch/x86_64/lapic.hpp"
 #include "arch/x86_64/memory/paging.hpp"
 #include "drivers/driver_registry.hpp"
 #include "drivers/log/logging.hpp"
 #include "drivers/pci/pci.hpp"
 #include "drivers/usb/usb_core.hpp"
+#include "kernel/interrupts.hpp"
 #include "kernel/memory/physical_allocator.hpp"
 #include "kernel/module.hpp"
 #include "kernel/process.hpp"
 #include "kernel/scheduler.hpp"
+#include "kernel/sync.hpp"
 #include "lib/mem.hpp"
 
 namespace xhci {
@@ -26,16 +29,24 @@ constexpr uint32_t kSpinTimeout = 5000000;
 constexpr uint32_t kHaltSpinTimeout = 10000;
 constexpr uint32_t kCommandSpinTimeout = kSpinTimeout * 2;
 constexpr uint32_t kTransferSpinTimeout = kSpinTimeout * 4;
+// With MSI the waiter only drains the event ring itself every this many
+// spins, in case the interrupt is routed to a CPU that has them disabled.
+constexpr uint32_t kInterruptPollInterval = 4096;
 
 constexpr uint32_t kUsbCmdRunStop = 1u << 0;
 constexpr uint32_t kUsbCmdHostControllerReset = 1u << 1;
+constexpr uint32_t kUsbCmdInterrupterEnable = 1u << 2;
 constexpr uint32_t kUsbStsHalted = 1u << 0;
+constexpr uint32_t kUsbStsEventInterrupt = 1u << 3;
 constexpr uint32_t kUsbStsControllerNotReady = 1u << 11;
 constexpr uint8_t kXhciExtCapLegacySupport = 1;
 constexpr uint8_t kPciCapabilityPowerManagement = 0x01;
 constexpr uint32_t kUsbLegacyBiosOwned = 1u << 16;
 constexpr uint32_t kUsbLegacyOsOwned = 1u << 24;
 
+constexpr uint32_t kImanInterruptPending = 1u << 0;
+constexpr uint32_t kImanInterruptEnable = 1u << 1;
+
 constexpr uint32_t kPortScCurrentConnectStatus = 1u << 0;
 constexpr uint32_t kPortScPortEnabled = 1u << 1;
 constexpr uint32_t kPortScPortReset = 1u << 4;
@@ -54,6 +65,7 @@ constexpr uint32_t kTrbTypeAddressDeviceCommand = 11;
 constexpr uint32_t kTrbTypeConfigureEndpointCommand = 12;
 constexpr uint32_t kTrbTypeEvaluateContextCommand = 13;
 constexpr uint32_t kTrbTypeResetEndpointCommand = 14;
+constexpr uint32_t kTrbTypeStopEndpointCommand = 15;
 constexpr uint32_t kTrbTypeSetTrDequeuePointerCommand = 16;
 constexpr uint32_t kTrbTypeTransferEvent = 32;
 constexpr uint32_t kTrbTypeCommandCompletionEvent = 33;
@@ -69,8 +81,17 @@ constexpr uint8_t kCompletionSuccess = 1;
 constexpr uint8_t kCompletionStall = 6;
 constexpr uint8_t kCompletionShortPacket = 13;
 
-constexpr size_t kRingPageCount = 1;
+constexpr size_t kRingPageCount = 2;
 constexpr size_t kTrbsPerPage = kPageSize / 16;
+constexpr size_t kRingTrbCount = kRingPageCount * kTrbsPerPage;
+// No TRB data buffer may cross a 64 KiB boundary.
+constexpr uint64_t kTrbBoundary = 0x10000;
+// One TD must fit in a ring together with its link TRB. A 1 MiB transfer
+// over scattered pages needs 257.
+constexpr size_t kMaxTransferTrbs = kRingTrbCount - 2;
+// Shorter bulk transfers are staged in a DMA block; longer ones go straight
+// to the caller's pages.
+constexpr size_t kDirectDmaMinBytes = kPageSize;
 // HCSParams2 encodes up to 1023 scratchpad buffers. Current hardware in the
 // field already exceeds 32 (Intel 9d2f reports 34), while the pointer array
 // still fits comfortably in one page at this limit.
@@ -101,6 +122,24 @@ struct CapabilityInfo {
     uint16_t extended_capabilities_offset;
 };
 
+struct Trb {
+    uint64_t parameter;
+    uint32_t status;
+    uint32_t control;
+};
+
+// Commands and transfers are serialized by the controller I/O lock, so at
+// most one completion is awaited at a time. Whoever drains the event ring,
+// the waiter or the interrupt handler, hands the matching event over here.
+struct PendingCompletion {
+    uint32_t type;  // 0 when nothing is awaited
+    uint64_t trb_phys;
+    uint8_t slot_id;
+    uint8_t endpoint_id;
+    volatile uint8_t done;
+    Trb event;
+};
+
 struct Controller {
     pci::PciDevice pci_device;
     volatile uint8_t* capability;
@@ -118,18 +157,16 @@ struct Controller {
     size_t command_enqueue;
     uint8_t event_cycle;
     size_t event_dequeue;
+    sync::SpinLock event_lock;
+    PendingCompletion pending;
+    bool msi_enabled;
+    uint8_t vector;
     volatile int io_lock;
     volatile uint8_t command_quarantined;
     bool port_enumeration_attempted[256];
     bool active;
 };
 
-struct Trb {
-    uint64_t parameter;
-    uint32_t status;
-    uint32_t control;
-};
-
 struct EventRingSegmentTableEntry {
     uint64_t base_address;
     uint32_t segment_size;
@@ -550,9 +587,9 @@ void enable_pci_device(const pci::PciDevice& device) {
 
     uint16_t command = pci::read_config16(device, 0x04);
     command |= static_cast<uint16_t>((1u << 1) | (1u << 2));
-    // This driver polls the event ring and has no IRQ handler yet. Disable
-    // legacy INTx so pending port-change events cannot storm as soon as the
-    // scheduler enables interrupts.
+    // Completions are signalled through MSI when the controller has it and
+    // polled otherwise. Keep legacy INTx disabled so pending port-change
+    // events cannot storm as soon as the scheduler enables interrupts.
     command |= static_cast<uint16_t>(1u << 10);
     pci::write_config16(device, 0x04, command);
 }
@@ -639,7 +676,7 @@ bool setup_rings(Controller& controller) {
 
     auto* command_ring =
         static_cast<Trb*>(paging_phys_to_virt(controller.command_ring_phys));
-    Trb& link = command_ring[kTrbsPerPage - 1];
+    Trb& link = command_ring[kRingTrbCount - 1];
     link.parameter = controller.command_ring_phys;
     link.status = 0;
     link.control = (kTrbTypeLink << 10) | (1u << 1);
@@ -649,7 +686,7 @@ bool setup_rings(Controller& controller) {
     auto* erst = static_cast<EventRingSegmentTableEntry*>(
         paging_phys_to_virt(controller.erst_phys));
     erst[0].base_address = controller.event_ring_phys;
-    erst[0].segment_size = static_cast<uint32_t>(kTrbsPerPage);
+    erst[0].segment_size = static_cast<uint32_t>(kRingTrbCount);
     erst[0].reserved = 0;
 
     write64(controller.operational, 0x30, controller.dcbaa_phys);
@@ -660,8 +697,8 @@ bool setup_rings(Controller& controller) {
     write32(interrupter0, 0x08, 1);
     write64(interrupter0, 0x10, controller.erst_phys);
     write64(interrupter0, 0x18, controller.event_ring_phys);
-    // Clear a pending interrupt, but leave Interrupt Enable clear. Command,
-    // transfer, and port events are consumed through polling.
+    // Clear a pending interrupt, but leave Interrupt Enable clear until
+    // enable_interrupts() has an MSI vector for the controller.
     write32(interrupter0, 0x00, 0x1u);
     controller.event_cycle = 1;
     controller.event_dequeue = 0;
@@ -716,11 +753,13 @@ uint64_t enqueue_ring_trb(Ring& ring,
     uint64_t trb_phys = ring.phys + index * sizeof(Trb);
 
     ++ring.enqueue;
-    if (ring.enqueue == kTrbsPerPage - 1) {
-        Trb& link = trbs[kTrbsPerPage - 1];
+    if (ring.enqueue == kRingTrbCount - 1) {
+        // A link TRB inside a TD carries the chain bit of the TRB before it.
+        Trb& link = trbs[kRingTrbCount - 1];
         link.parameter = ring.phys;
         link.status = 0;
         link.control = (kTrbTypeLink << 10) | kTrbToggleCycle |
+                       (control & kTrbChain) |
                        (ring.cycle ? kTrbCycle : 0);
         ring.enqueue = 0;
         ring.cycle ^= 1;
@@ -741,8 +780,8 @@ uint64_t enqueue_command_trb(Controller& controller,
     uint64_t trb_phys = controller.command_ring_phys + index * sizeof(Trb);
 
     ++controller.command_enqueue;
-    if (controller.command_enqueue == kTrbsPerPage - 1) {
-        Trb& link = trbs[kTrbsPerPage - 1];
+    if (controller.command_enqueue == kRingTrbCount - 1) {
+        Trb& link = trbs[kRingTrbCount - 1];
         link.parameter = controller.command_ring_phys;
         link.status = 0;
         link.control = (kTrbTypeLink << 10) | kTrbToggleCycle |
@@ -781,7 +820,7 @@ bool poll_event(Controller& controller, Trb& out) {
 
     out = event;
     ++controller.event_dequeue;
-    if (controller.event_dequeue == kTrbsPerPage) {
+    if (controller.event_dequeue == kRingTrbCount) {
         controller.event_dequeue = 0;
         controller.event_cycle ^= 1;
     }
@@ -789,68 +828,150 @@ bool poll_event(Controller& controller, Trb& out) {
     return true;
 }
 
-bool wait_command_completion(Controller& controller,
-                             uint64_t command_trb_phys,
-                             Trb& out_event) {
-    for (uint32_t spins = 0; spins < kCommandSpinTimeout; ++spins) {
-        Trb event{};
-        if (!poll_event(controller, event)) {
-            cpu_relax();
+// Consumes every posted event and completes the awaited one, if any. Port
+// status changes are left to the hotplug poller, which reads PORTSC.
+void drain_events_locked(Controller& controller) {
+    PendingCompletion& pending = controller.pending;
+    Trb event{};
+    while (poll_event(controller, event)) {
+        uint32_t type = trb_type(event);
+        if (pending.type == 0 || type != pending.type ||
+            event.parameter != pending.trb_phys) {
             continue;
         }
-        uint32_t type = trb_type(event);
-        if (type == kTrbTypeCommandCompletionEvent &&
-            event.parameter == command_trb_phys) {
-            out_event = event;
+        if (type == kTrbTypeTransferEvent) {
+            uint8_t event_slot =
+                static_cast<uint8_t>((event.control >> 24) & 0xFFu);
+            uint8_t event_ep =
+                static_cast<uint8_t>((event.control >> 16) & 0x1Fu);
+            if (event_slot != pending.slot_id ||
+                event_ep != pending.endpoint_id) {
+                continue;
+            }
+        }
+        pending.event = event;
+        pending.type = 0;
+        __atomic_store_n(&pending.done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Must be called before the doorbell: the interrupt handler may complete
+// the TRB as soon as the controller sees it.
+void arm_completion(Controller& controller,
+                    uint32_t type,
+                    uint64_t trb_phys,
+                    uint8_t slot_id,
+                    uint8_t endpoint_id) {
+    sync::IrqLockGuard guard(controller.event_lock);
+    controller.pending.type = type;
+    controller.pending.trb_phys = trb_phys;
+    controller.pending.slot_id = slot_id;
+    controller.pending.endpoint_id = endpoint_id;
+    controller.pending.done = 0;
+}
+
+void arm_transfer_completion(DeviceSlot& slot,
+                             uint8_t endpoint_id,
+                             uint64_t trb_phys) {
+    arm_completion(*slot.controller,
+                   kTrbTypeTransferEvent,
+                   trb_phys,
+                   slot.slot_id,
+                   endpoint_id);
+}
+
+bool wait_completion(Controller& controller,
+                     uint32_t spin_limit,
+                     Trb& out_event) {
+    bool interrupts = controller.msi_enabled;
+    for (uint32_t spins = 0; spins < spin_limit; ++spins) {
+        if (__atomic_load_n(&controller.pending.done, __ATOMIC_ACQUIRE) != 0) {
+            out_event = controller.pending.event;
             return true;
         }
-        if (type == kTrbTypePortStatusChangeEvent) {
-            continue;
+        if (!interrupts || (spins % kInterruptPollInterval) == 0) {
+            sync::IrqLockGuard guard(controller.event_lock);
+            drain_events_locked(controller);
         }
+        cpu_relax();
+    }
+    // Disarm so a late event cannot complete a later waiter.
+    sync::IrqLockGuard guard(controller.event_lock);
+    drain_events_locked(controller);
+    controller.pending.type = 0;
+    if (controller.pending.done != 0) {
+        out_event = controller.pending.event;
+        return true;
     }
     return false;
 }
 
 bool wait_transfer_completion(DeviceSlot& slot,
-                              uint8_t endpoint_id,
-                              uint64_t expected_trb_phys,
                               size_t requested,
                               size_t& transferred,
                               usb::TransferStatus& status) {
-    Controller& controller = *slot.controller;
-    for (uint32_t spins = 0; spins < kTransferSpinTimeout; ++spins) {
-        Trb event{};
-        if (!poll_event(controller, event)) {
-            cpu_relax();
-            continue;
-        }
-        if (trb_type(event) != kTrbTypeTransferEvent) {
-            continue;
-        }
-        uint8_t event_slot = static_cast<uint8_t>((event.control >> 24) & 0xFFu);
-        uint8_t event_ep = static_cast<uint8_t>((event.control >> 16) & 0x1Fu);
-        if (event_slot != slot.slot_id || event_ep != endpoint_id) {
-            continue;
-        }
-        if (event.parameter != expected_trb_phys) {
-            continue;
-        }
+    Trb event{};
+    if (!wait_completion(*slot.controller, kTransferSpinTimeout, event)) {
+        transferred = 0;
+        status = usb::TransferStatus::Timeout;
+        return false;
+    }
+    uint8_t code = completion_code(event);
+    uint32_t residue = event.status & 0xFFFFFFu;
+    transferred = requested >= residue ? requested - residue : 0;
+    if (code == kCompletionSuccess || code == kCompletionShortPacket) {
+        status = usb::TransferStatus::Ok;
+    } else if (code == kCompletionStall) {
+        status = usb::TransferStatus::Stall;
+    } else {
+        status = usb::TransferStatus::IoError;
+    }
+    return true;
+}
 
-        uint8_t code = completion_code(event);
-        uint32_t residue = event.status & 0xFFFFFFu;
-        transferred = requested >= residue ? requested - residue : 0;
-        if (code == kCompletionSuccess || code == kCompletionShortPacket) {
-            status = usb::TransferStatus::Ok;
-        } else if (code == kCompletionStall) {
-            status = usb::TransferStatus::Stall;
-        } else {
-            status = usb::TransferStatus::IoError;
+void handle_interrupt() {
+    for (size_t i = 0; i < g_controller_count; ++i) {
+        Controller& controller = g_controllers[i];
+        if (!controller.active || !controller.msi_enabled) {
+            continue;
         }
-        return true;
+        // With MSI the controller clears IMAN.IP itself; acknowledge both
+        // status bits anyway so a lost clear cannot mask the next event.
+        volatile uint8_t* interrupter0 = controller.runtime + 0x20;
+        write32(controller.operational, 0x04, kUsbStsEventInterrupt);
+        write32(interrupter0,
+                0x00,
+                kImanInterruptPending | kImanInterruptEnable);
+        sync::IrqLockGuard guard(controller.event_lock);
+        drain_events_locked(controller);
+    }
+}
+
+// Switches command and transfer completion to the event ring interrupt.
+// Waiters keep polling when MSI is unavailable.
+void enable_interrupts(Controller& controller) {
+    uint8_t vector = interrupts::allocate_vector();
+    if (vector == 0) {
+        return;
     }
-    transferred = 0;
-    status = usb::TransferStatus::Timeout;
-    return false;
+    if (!interrupts::register_vector(vector, handle_interrupt)) {
+        interrupts::free_vector(vector);
+        return;
+    }
+    if (!pci::enable_msi(controller.pci_device,
+                         vector,
+                         static_cast<uint8_t>(lapic::id()))) {
+        interrupts::unregister_vector(vector);
+        interrupts::free_vector(vector);
+        return;
+    }
+    controller.vector = vector;
+    controller.msi_enabled = true;
+    volatile uint8_t* interrupter0 = controller.runtime + 0x20;
+    write32(interrupter0, 0x00, kImanInterruptPending | kImanInterruptEnable);
+    write32(controller.operational,
+            0x00,
+            read32(controller.operational, 0x00) | kUsbCmdInterrupterEnable);
 }
 
 bool issue_command_locked(Controller& controller,
@@ -863,8 +984,9 @@ bool issue_command_locked(Controller& controller,
         return false;
     }
     uint64_t trb_phys = enqueue_command_trb(controller, parameter, status, control);
+    arm_completion(controller, kTrbTypeCommandCompletionEvent, trb_phys, 0, 0);
     ring_command_doorbell(controller);
-    if (!wait_command_completion(controller, trb_phys, event)) {
+    if (!wait_completion(controller, kCommandSpinTimeout, event)) {
         // The controller can still own this command TRB and may report its
         // completion later.  Never wrap/reuse the command ring or submit a
         // command whose completion could be confused with that late event.
@@ -904,9 +1026,9 @@ bool allocate_ring(Ring& ring) {
     ring.enqueue = 0;
 
     Trb* trbs = ring_trbs(ring);
-    trbs[kTrbsPerPage - 1].parameter = ring.phys;
-    trbs[kTrbsPerPage - 1].status = 0;
-    trbs[kTrbsPerPage - 1].control =
+    trbs[kRingTrbCount - 1].parameter = ring.phys;
+    trbs[kRingTrbCount - 1].status = 0;
+    trbs[kRingTrbCount - 1].control =
         (kTrbTypeLink << 10) | kTrbToggleCycle | kTrbCycle;
     return true;
 }
@@ -1230,12 +1352,13 @@ usb::TransferStatus control_transfer(void* context,
     }
     uint64_t status_trb = enqueue_ring_trb(
         ring, 0, 0, status_control | kTrbInterruptOnCompletion);
+    arm_transfer_completion(*slot, 1, status_trb);
     ring_endpoint_doorbell(*slot, 1);
 
     size_t transferred = 0;
     usb::TransferStatus status = usb::TransferStatus::Ok;
     bool completed = wait_transfer_completion(
-        *slot, 1, status_trb, request.length, transferred, status);
+        *slot, request.length, transferred, status);
     if (dma_buffer != nullptr) {
         if (completed && status == usb::TransferStatus::Ok &&
             (request.request_type & 0x80u) != 0) {
@@ -1261,6 +1384,138 @@ usb::TransferStatus control_transfer(void* context,
     return status;
 }
 
+// Walks a buffer as TRB-sized runs of physical memory: physically adjacent
+// pages merge and no run crosses a 64 KiB boundary. A staged buffer passes
+// its block's physical base; otherwise pages resolve through the kernel
+// page tables.
+class DmaCursor {
+public:
+    DmaCursor(uint64_t virt, uint64_t phys_base, size_t length)
+        : virt_(virt), phys_base_(phys_base), length_(length) {}
+
+    bool next(uint64_t& phys, size_t& chunk) {
+        if (offset_ >= length_) {
+            return false;
+        }
+        if (!resolve(offset_, phys)) {
+            failed_ = true;
+            return false;
+        }
+        size_t limit =
+            static_cast<size_t>(kTrbBoundary - (phys & (kTrbBoundary - 1)));
+        if (limit > length_ - offset_) {
+            limit = length_ - offset_;
+        }
+        chunk = static_cast<size_t>(
+            kPageSize - ((virt_ + offset_) & (kPageSize - 1)));
+        if (chunk > limit) {
+            chunk = limit;
+        }
+        while (chunk < limit) {
+            uint64_t next_phys = 0;
+            if (!resolve(offset_ + chunk, next_phys) ||
+                next_phys != phys + chunk) {
+                break;
+            }
+            chunk += limit - chunk < kPageSize ? limit - chunk : kPageSize;
+        }
+        offset_ += chunk;
+        return true;
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    bool resolve(size_t offset, uint64_t& phys) const {
+        if (phys_base_ != 0) {
+            phys = phys_base_ + offset;
+            return true;
+        }
+        return paging_resolve_cr3(paging_kernel_cr3(), virt_ + offset, phys);
+    }
+
+    uint64_t virt_;
+    uint64_t phys_base_;
+    size_t length_;
+    size_t offset_ = 0;
+    bool failed_ = false;
+};
+
+// Number of Normal TRBs the buffer needs, or 0 when a page cannot be
+// resolved or the TD would not fit in a ring.
+size_t count_transfer_trbs(uint64_t virt, uint64_t phys_base, size_t length) {
+    DmaCursor cursor(virt, phys_base, length);
+    size_t count = 0;
+    uint64_t phys = 0;
+    size_t chunk = 0;
+    while (cursor.next(phys, chunk)) {
+        if (++count > kMaxTransferTrbs) {
+            return 0;
+        }
+    }
+    return cursor.failed() ? 0 : count;
+}
+
+// Queues the buffer as one TD of chained Normal TRBs, interrupting only on
+// the last. Returns that TRB's address for completion matching.
+uint64_t enqueue_transfer_trbs(Ring& ring,
+                               uint64_t virt,
+                               uint64_t phys_base,
+                               size_t length) {
+    if (length == 0) {
+        return enqueue_ring_trb(
+            ring, 0, 0, (kTrbTypeNormal << 10) | kTrbInterruptOnCompletion);
+    }
+    DmaCursor cursor(virt, phys_base, length);
+    uint64_t phys = 0;
+    size_t chunk = 0;
+    uint64_t last_trb_phys = 0;
+    bool have = cursor.next(phys, chunk);
+    while (have) {
+        uint64_t next_phys = 0;
+        size_t next_chunk = 0;
+        bool more = cursor.next(next_phys, next_chunk);
+        uint32_t control = kTrbTypeNormal << 10;
+        control |= more ? kTrbChain : kTrbInterruptOnCompletion;
+        last_trb_phys = enqueue_ring_trb(
+            ring, phys, static_cast<uint32_t>(chunk), control);
+        phys = next_phys;
+        chunk = next_chunk;
+        have = more;
+    }
+    return last_trb_phys;
+}
+
+// Stops the endpoint so the controller lets go of its TD. Returns false
+// when the controller may still be working through it.
+bool stop_endpoint_locked(Controller& controller,
+                          DeviceSlot& slot,
+                          uint8_t endpoint_id) {
+    Trb event{};
+    uint32_t stop_control =
+        (kTrbTypeStopEndpointCommand << 10) |
+        (static_cast<uint32_t>(endpoint_id) << 16) |
+        (static_cast<uint32_t>(slot.slot_id) << 24);
+    if (issue_command_locked(controller, 0, 0, stop_control, event)) {
+        return true;
+    }
+    if (!controller_commands_quarantined(controller)) {
+        // Refused with a context state error: it already halted or stopped.
+        uint32_t* ep_context =
+            device_context(controller, slot.output_context_phys, endpoint_id);
+        constexpr uint32_t kEndpointStateMask = 0x7u;
+        constexpr uint32_t kEndpointStateRunning = 1u;
+        if ((ep_context[0] & kEndpointStateMask) != kEndpointStateRunning) {
+            return true;
+        }
+    }
+    log_message(LogLevel::Warn,
+                "xhci: failed to stop slot %u endpoint %u after timeout",
+                static_cast<unsigned int>(slot.slot_id),
+                static_cast<unsigned int>(endpoint_id));
+    return false;
+}
+
 usb::TransferStatus bulk_transfer(void* context,
                                   uint8_t endpoint,
                                   void* data,
@@ -1284,9 +1539,15 @@ usb::TransferStatus bulk_transfer(void* context,
         return usb::TransferStatus::IoError;
     }
 
+    // Large transfers DMA straight into the caller's pages. Small ones, and
+    // buffers the kernel page tables cannot describe, go through a staging
+    // block so wrappers on the stack never become DMA targets.
+    uint64_t data_virt = reinterpret_cast<uint64_t>(data);
+    bool direct = length >= kDirectDmaMinBytes &&
+                  count_transfer_trbs(data_virt, 0, length) != 0;
     uint64_t data_phys = 0;
     uint8_t* dma_buffer = nullptr;
-    if (length != 0) {
+    if (length != 0 && !direct) {
         size_t page_count = length / kPageSize;
         if ((length % kPageSize) != 0) {
             ++page_count;
@@ -1296,7 +1557,10 @@ usb::TransferStatus bulk_transfer(void* context,
             return usb::TransferStatus::IoError;
         }
         dma_buffer = static_cast<uint8_t*>(paging_phys_to_virt(data_phys));
-        if (dma_buffer == nullptr) {
+        if (dma_buffer == nullptr ||
+            count_transfer_trbs(reinterpret_cast<uint64_t>(dma_buffer),
+                                data_phys,
+                                length) == 0) {
             memory::free_kernel_block(data_phys);
             return usb::TransferStatus::IoError;
         }
@@ -1304,6 +1568,7 @@ usb::TransferStatus bulk_transfer(void* context,
         if ((endpoint & 0x80u) == 0) {
             memcpy(dma_buffer, data, length);
         }
+        data_virt = reinterpret_cast<uint64_t>(dma_buffer);
     }
 
     usb::TransferStatus status = usb::TransferStatus::Ok;
@@ -1319,42 +1584,29 @@ usb::TransferStatus bulk_transfer(void* context,
             return usb::TransferStatus::NoDevice;
         }
         Ring& ring = slot->endpoint_rings[endpoint_id];
-        size_t remaining = length;
-        size_t dma_offset = 0;
-        uint64_t last_trb_phys = 0;
-
-        if (length == 0) {
-            last_trb_phys = enqueue_ring_trb(
-                ring,
-                0,
-                0,
-                (kTrbTypeNormal << 10) | kTrbInterruptOnCompletion);
-        }
-
-        while (remaining > 0) {
-            uint64_t phys = data_phys + dma_offset;
-            size_t page_remaining =
-                static_cast<size_t>(kPageSize - (phys & (kPageSize - 1)));
-            size_t chunk = remaining < page_remaining ? remaining
-                                                      : page_remaining;
-
-            remaining -= chunk;
-            uint32_t control = kTrbTypeNormal << 10;
-            if (remaining != 0) {
-                control |= kTrbChain;
-            } else {
-                control |= kTrbInterruptOnCompletion;
-            }
-            last_trb_phys = enqueue_ring_trb(
-                ring, phys, static_cast<uint32_t>(chunk), control);
-            dma_offset += chunk;
-        }
-
+        uint64_t last_trb_phys =
+            enqueue_transfer_trbs(ring, data_virt, data_phys, length);
+        arm_transfer_completion(*slot, endpoint_id, last_trb_phys);
         ring_endpoint_doorbell(*slot, endpoint_id);
         completed = wait_transfer_completion(
-            *slot, endpoint_id, last_trb_phys, length, transferred, status);
+            *slot, length, transferred, status);
         if (!completed) {
             quarantine_timed_out_transfer(*slot, data_phys);
+            if (direct &&
+                !stop_endpoint_locked(*controller, *slot, endpoint_id)) {
+                // The TD points into memory the caller gets back and the
+                // endpoint would not stop. Halting the controller is the only
+                // way left to keep it from writing there; it takes no more
+                // commands afterwards.
+                __atomic_store_n(&controller->command_quarantined,
+                                 1,
+                                 __ATOMIC_RELEASE);
+                if (!halt_controller(controller->operational)) {
+                    log_message(LogLevel::Error,
+                                "xhci: controller did not halt; DMA may "
+                                "still reach a released buffer");
+                }
+            }
         }
     }
 
@@ -1366,12 +1618,9 @@ usb::TransferStatus bulk_transfer(void* context,
         }
         if (completed) {
             memory::free_kernel_block(data_phys);
-        } else {
-            log_message(LogLevel::Warn,
-                        "xhci: quarantining slot %u after bulk timeout",
-                        static_cast<unsigned int>(slot->slot_id));
         }
-    } else if (!completed) {
+    }
+    if (!completed) {
         log_message(LogLevel::Warn,
                     "xhci: quarantining slot %u after bulk timeout",
                     static_cast<unsigned int>(slot->slot_id));
@@ -1434,9 +1683,9 @@ usb::TransferStatus reset_endpoint(void* context, uint8_t endpoint) {
     ring.enqueue = 0;
     ring.cycle = 1;
     Trb* trbs = ring_trbs(ring);
-    trbs[kTrbsPerPage - 1].parameter = ring.phys;
-    trbs[kTrbsPerPage - 1].status = 0;
-    trbs[kTrbsPerPage - 1].control =
+    trbs[kRingTrbCount - 1].parameter = ring.phys;
+    trbs[kRingTrbCount - 1].status = 0;
+    trbs[kRingTrbCount - 1].control =
         (kTrbTypeLink << 10) | kTrbToggleCycle | kTrbCycle;
 
     uint32_t dequeue_control =
@@ -2169,6 +2418,10 @@ bool init_controller(const pci::PciDevice& device) {
     controller.command_enqueue = 0;
     controller.event_cycle = 1;
     controller.event_dequeue = 0;
+    controller.pending.type = 0;
+    controller.pending.done = 0;
+    controller.msi_enabled = false;
+    controller.vector = 0;
     controller.io_lock = 0;
     controller.command_quarantined = 0;
     for (size_t i = 0; i < 256; ++i) {
@@ -2230,6 +2483,10 @@ bool init_controller(const pci::PciDevice& device) {
 
     controller.active = true;
     ++g_controller_count;
+    enable_interrupts(controller);
+    log_message(LogLevel::Info,
+                "xhci: completions via %s",
+                controller.msi_enabled ? "MSI" : "polling");
 
     log_message(LogLevel::Info, "xhci: powering ports");
     power_ports(controller);
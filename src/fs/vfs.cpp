@@ -12,6 +12,7 @@ namespace {
 
 constexpr size_t kMaxMounts = 16;
 constexpr size_t kMaxRootDirHandles = 8;
+constexpr size_t kChangeStampSlots = 64;
 
 struct MountEntry {
     const char* name;
@@ -29,6 +30,10 @@ struct RootDirectoryContext {
     const char* names[kMaxMounts];
 };
 
+// Paths hash into a small table of change counters. A collision can only
+// make an unchanged file look modified, never the other way round.
+uint64_t g_change_stamps[kChangeStampSlots]{};
+
 RootDirectoryContext g_root_dir_contexts[kMaxRootDirHandles]{};
 bool g_root_dir_in_use[kMaxRootDirHandles]{};
 volatile int g_vfs_lock = 0;
@@ -180,6 +185,34 @@ void release_root_dir_context(RootDirectoryContext* ctx) {
     }
 }
 
+uint32_t hash_path_chars(uint32_t hash, const char* text) {
+    for (size_t i = 0; text != nullptr && text[i] != '\0'; ++i) {
+        char ch = text[i];
+        // FAT lookups ignore case, so spellings of one file share a slot.
+        if (ch >= 'A' && ch <= 'Z') {
+            ch = static_cast<char>(ch - 'A' + 'a');
+        }
+        hash ^= static_cast<uint8_t>(ch);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t change_slot_for(const MountEntry* mount, const char* relative) {
+    uint32_t hash = hash_path_chars(2166136261u, mount->name);
+    hash = hash_path_chars(hash, "/");
+    hash = hash_path_chars(hash, relative);
+    return hash % kChangeStampSlots;
+}
+
+uint64_t load_change_stamp(uint32_t slot) {
+    return __atomic_load_n(&g_change_stamps[slot], __ATOMIC_ACQUIRE);
+}
+
+void bump_change_stamp(uint32_t slot) {
+    __atomic_fetch_add(&g_change_stamps[slot], 1, __ATOMIC_RELEASE);
+}
+
 void populate_entry_from_mount(const char* name, DirEntry& entry) {
     memset(&entry, 0, sizeof(DirEntry));
     if (name == nullptr) {
@@ -436,6 +469,8 @@ bool open_file(const char* path,
     out_handle.fs_context = mount->fs_context;
     out_handle.file_context = file_context;
     out_handle.size = metadata.size;
+    out_handle.change_slot = change_slot_for(mount, relative);
+    out_handle.change_stamp = load_change_stamp(out_handle.change_slot);
     return true;
 }
 
@@ -475,6 +510,9 @@ bool create_file(const char* path, FileHandle& out_handle) {
     out_handle.fs_context = mount->fs_context;
     out_handle.file_context = file_context;
     out_handle.size = metadata.size;
+    out_handle.change_slot = change_slot_for(mount, relative);
+    bump_change_stamp(out_handle.change_slot);
+    out_handle.change_stamp = load_change_stamp(out_handle.change_slot);
     return true;
 }
 
@@ -513,7 +551,11 @@ bool remove_file(const char* path) {
     if (relative == nullptr || *relative == '\0') {
         return false;
     }
-    return mount->ops->remove_file(mount->fs_context, relative);
+    if (!mount->ops->remove_file(mount->fs_context, relative)) {
+        return false;
+    }
+    bump_change_stamp(change_slot_for(mount, relative));
+    return true;
 }
 
 bool remove_directory(const char* path) {
@@ -596,9 +638,24 @@ bool write_file(FileHandle& handle,
     if (end_offset > handle.size) {
         handle.size = end_offset;
     }
+    if (out_size != 0) {
+        bump_change_stamp(handle.change_slot);
+    }
     return true;
 }
 
+bool can_sync_file(const FileHandle& handle) {
+    return handle.ops != nullptr && handle.ops->sync_file != nullptr &&
+           handle.file_context != nullptr;
+}
+
+bool sync_file(FileHandle& handle) {
+    if (!can_sync_file(handle)) {
+        return false;
+    }
+    return handle.ops->sync_file(handle.file_context);
+}
+
 bool open_directory(const char* path, DirectoryHandle& out_handle) {
     return open_directory(path, out_handle, nullptr);
 }
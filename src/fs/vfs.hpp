@@ -56,6 +56,11 @@ struct FileHandle {
     void* fs_context;
     void* file_context;
     uint64_t size;
+    // Neither filesystem keeps modification times, so the VFS counts writes,
+    // creates and removals per path instead. change_stamp is the count seen
+    // when the file was opened.
+    uint64_t change_stamp;
+    uint32_t change_slot;
 };
 
 struct DirectoryHandle {
@@ -115,6 +120,8 @@ struct FilesystemOps {
                                    AclEntry* entries,
                                    size_t max_entries,
                                    size_t& out_count);
+    // Writes back cached data the file depends on.
+    bool (*sync_file)(void* file_context);
 };
 
 void init();
@@ -154,6 +161,8 @@ bool write_file(FileHandle& handle,
                 const void* buffer,
                 size_t buffer_size,
                 size_t& out_size);
+bool can_sync_file(const FileHandle& handle);
+bool sync_file(FileHandle& handle);
 
 bool open_directory(const char* path, DirectoryHandle& out_handle);
 bool open_directory(const char* path,
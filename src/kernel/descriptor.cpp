@@ -4,6 +4,8 @@
 #include "arch/x86_64/memory/paging.hpp"
 #include "scheduler.hpp"
 #include "string_util.hpp"
+#include "sync.hpp"
+#include "time.hpp"
 #include "vm.hpp"
 #include "../lib/mem.hpp"
 
@@ -11,26 +13,38 @@ namespace descriptor {
 
 namespace descriptor_pipe {
 bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
 }
 
 namespace descriptor_net_endpoint {
 bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
 }
 
 namespace descriptor_net_device {
 bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
 }
 
 namespace descriptor_keyboard {
 bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
 }
 
 namespace descriptor_mouse {
 bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
 }
 
 namespace descriptor_vty {
 bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
+}
+
+namespace descriptor_wait_set {
+bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents);
+WaitQueue* wait_queue(DescriptorEntry& entry);
+void forget_handle(Table& table, uint32_t handle);
 }
 
 namespace {
@@ -38,7 +52,11 @@ namespace {
 process::Process g_kernel_process{};
 bool g_kernel_process_initialized = false;
 process::Process* g_waiter_worker = nullptr;
-uint32_t g_waiters_pending = 0;
+
+// One bit per process table slot whose DescriptorWait was signalled by a wait
+// queue since the waiter worker last looked at it.
+constexpr size_t kPendingWaiterWords = (process::kMaxProcesses + 63) / 64;
+uint64_t g_pending_waiters[kPendingWaiterWords];
 
 process::Process& kernel_process() {
     if (!g_kernel_process_initialized) {
@@ -147,6 +165,8 @@ bool query_entry_wait(DescriptorEntry& entry,
             return descriptor_mouse::query_wait(entry, events, revents);
         case kTypeVty:
             return descriptor_vty::query_wait(entry, events, revents);
+        case kTypeWaitSet:
+            return descriptor_wait_set::query_wait(entry, events, revents);
         case kTypeConsole:
         case kTypeSerial:
         case kTypeFramebuffer:
@@ -157,6 +177,40 @@ bool query_entry_wait(DescriptorEntry& entry,
     }
 }
 
+WaitQueue* entry_wait_queue(DescriptorEntry& entry) {
+    switch (entry.type) {
+        case kTypePipe:
+            return descriptor_pipe::wait_queue(entry);
+        case kTypeNetEndpoint:
+            return descriptor_net_endpoint::wait_queue(entry);
+        case kTypeNetDevice:
+            return descriptor_net_device::wait_queue(entry);
+        case kTypeKeyboard:
+            return descriptor_keyboard::wait_queue(entry);
+        case kTypeMouse:
+            return descriptor_mouse::wait_queue(entry);
+        case kTypeVty:
+            return descriptor_vty::wait_queue(entry);
+        case kTypeWaitSet:
+            return descriptor_wait_set::wait_queue(entry);
+        default:
+            return nullptr;
+    }
+}
+
+uint64_t lock_queue(WaitQueue& queue) {
+    uint64_t flags = sync::disable_interrupts();
+    while (__atomic_test_and_set(&queue.lock, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    return flags;
+}
+
+void unlock_queue(WaitQueue& queue, uint64_t flags) {
+    __atomic_clear(&queue.lock, __ATOMIC_RELEASE);
+    sync::restore_interrupts(flags);
+}
+
 int evaluate_waits(Table& table,
                    descriptor_defs::DescriptorWait* items,
                    size_t count) {
@@ -256,13 +310,17 @@ void init_table(Table& table) {
 }
 
 void destroy_table(process::Process& proc, Table& table) {
-    (void)proc;
+    if (&table == &proc.descriptors) {
+        cancel_wait(proc);
+    }
     for (size_t i = 0; i < kMaxDescriptors; ++i) {
         DescriptorEntry& entry = table.entries[i];
         if (!entry.in_use) {
             reset_entry(entry, false);
             continue;
         }
+        descriptor_wait_set::forget_handle(
+            table, make_handle(static_cast<uint16_t>(i), entry.generation));
         if (entry.close != nullptr) {
             entry.close(entry);
         }
@@ -295,6 +353,8 @@ uint32_t install_at(process::Process& proc,
     }
     DescriptorEntry& entry = table.entries[index];
     if (entry.in_use) {
+        descriptor_wait_set::forget_handle(
+            table, make_handle(index, entry.generation));
         if (entry.close != nullptr) {
             entry.close(entry);
         }
@@ -495,6 +555,7 @@ bool close(process::Process& proc, Table& table, uint32_t handle) {
     if (entry == nullptr) {
         return false;
     }
+    descriptor_wait_set::forget_handle(table, handle);
     if (entry->close != nullptr) {
         entry->close(*entry);
     }
@@ -619,10 +680,144 @@ int set_property(process::Process& proc,
     return entry->ops->set_property(*entry, property, in, static_cast<size_t>(size));
 }
 
+namespace {
+
+void kick_waiter_worker() {
+    process::Process* worker =
+        __atomic_load_n(&g_waiter_worker, __ATOMIC_ACQUIRE);
+    if (worker != nullptr) {
+        (void)process::wake(*worker);
+    }
+}
+
+void notify_process_waiter(WaitLink& link) {
+    auto* proc = static_cast<process::Process*>(link.owner);
+    size_t index = process::table_index(*proc);
+    if (index >= process::kMaxProcesses) {
+        return;
+    }
+    __atomic_fetch_or(&g_pending_waiters[index / 64],
+                      1ull << (index % 64),
+                      __ATOMIC_RELEASE);
+    kick_waiter_worker();
+}
+
+void link_waits(process::Process& proc, Table& table, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        WaitLink& link = proc.wait_links[i];
+        link.notify = notify_process_waiter;
+        link.owner = &proc;
+        DescriptorEntry* entry =
+            lookup_entry(table, proc.wait_descriptors[i].handle);
+        WaitQueue* queue =
+            (entry != nullptr) ? entry_wait_queue(*entry) : nullptr;
+        if (queue != nullptr) {
+            wait_queue_add(*queue, link);
+        }
+    }
+}
+
+void unlink_waits(process::Process& proc) {
+    for (size_t i = 0; i < kMaxWaitDescriptors; ++i) {
+        wait_queue_remove(proc.wait_links[i]);
+    }
+}
+
+bool waiters_pending() {
+    for (size_t i = 0; i < kPendingWaiterWords; ++i) {
+        if (__atomic_load_n(&g_pending_waiters[i], __ATOMIC_ACQUIRE) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void service_waiter(process::Process& proc) {
+    if (process::load_state(proc) != process::State::Blocked ||
+        proc.wait_descriptor_count == 0) {
+        return;
+    }
+
+    size_t count = static_cast<size_t>(proc.wait_descriptor_count);
+    int ready = evaluate_waits(proc.descriptors, proc.wait_descriptors, count);
+    if (ready <= 0) {
+        return;
+    }
+    if (!process::begin_wake(proc)) {
+        return;
+    }
+    unlink_waits(proc);
+
+    int result = ready;
+    if (!vm::copy_to_user(proc.cr3,
+                          proc.wait_descriptors_user,
+                          proc.wait_descriptors,
+                          count * sizeof(proc.wait_descriptors[0]))) {
+        result = -1;
+    }
+
+    proc.wait_descriptors_user = 0;
+    proc.wait_descriptor_count = 0;
+    proc.waiting_on = nullptr;
+    process::finish_wake_with_result(proc, result);
+}
+
+void wait_timed_out(void* context) {
+    auto* proc = static_cast<process::Process*>(context);
+    if (proc->sleep_until_tick == 0 ||
+        timekeeping::tick_count() < proc->sleep_until_tick ||
+        process::load_state(*proc) != process::State::Blocked ||
+        proc->wait_descriptor_count == 0) {
+        return;
+    }
+    if (!process::begin_wake(*proc)) {
+        return;
+    }
+    unlink_waits(*proc);
+    proc->wait_descriptors_user = 0;
+    proc->wait_descriptor_count = 0;
+    proc->waiting_on = nullptr;
+    process::finish_wake_with_result(*proc, 0);
+}
+
+void service_waiters() {
+    for (size_t word = 0; word < kPendingWaiterWords; ++word) {
+        uint64_t bits = __atomic_exchange_n(&g_pending_waiters[word],
+                                            static_cast<uint64_t>(0),
+                                            __ATOMIC_ACQ_REL);
+        while (bits != 0) {
+            size_t bit = static_cast<size_t>(__builtin_ctzll(bits));
+            bits &= bits - 1;
+            process::Process* proc = process::table_entry(word * 64 + bit);
+            if (proc != nullptr) {
+                service_waiter(*proc);
+            }
+        }
+    }
+}
+
+void waiter_worker(process::Process& worker) {
+    while (waiters_pending()) {
+        service_waiters();
+    }
+
+    // Publish Blocked before the final pending check.  A concurrent notify
+    // either observes Blocked and enqueues us, or its pending bit makes us
+    // remain Ready when this callback returns.
+    worker.waiting_on = nullptr;
+    process::store_state(worker, process::State::Blocked);
+    if (waiters_pending()) {
+        (void)process::wake(worker);
+    }
+}
+
+}  // namespace
+
 int wait(process::Process& proc,
          Table& table,
          uint64_t user_address,
-         size_t count) {
+         size_t count,
+         uint64_t timeout_ns) {
     if (user_address == 0 || count == 0 || count > kMaxWaitDescriptors) {
         return -1;
     }
@@ -655,13 +850,31 @@ int wait(process::Process& proc,
     proc.wait_descriptors_user = user_address;
     proc.wait_descriptor_count = static_cast<uint32_t>(count);
     proc.waiting_on = nullptr;
+    link_waits(proc, table, count);
+    // The timeout is armed before Blocked is published: a waker that runs
+    // right after the store must find it to cancel, or it would fire later
+    // into an unrelated wait.
+    if (timeout_ns != 0) {
+        uint64_t ticks = timekeeping::ticks_for_duration_ns(timeout_ns);
+        uint64_t now = timekeeping::tick_count();
+        if (ticks == 0) {
+            ticks = 1;
+        }
+        process::arm_timeout(proc,
+                             ticks > UINT64_MAX - now ? UINT64_MAX : now + ticks,
+                             wait_timed_out);
+    }
     process::store_state(proc, process::State::Blocked);
+    if (timeout_ns != 0 && !timer_wheel::pending(proc.sleep_timer)) {
+        // Expired before the store; the callback found us not Blocked.
+        wait_timed_out(&proc);
+    }
 
     // Close the registration race with an IRQ or another producer.  An event
     // can become ready after the first evaluation but before the process is
-    // visibly Blocked; a waiter-worker pass in that window cannot wake us.
-    // Once Blocked is published, rechecking either observes that event or
-    // leaves any later producer able to wake the registered waiter normally.
+    // visibly Blocked; the waiter worker skips us in that window.  Once
+    // Blocked is published, rechecking either observes that event or leaves
+    // any later signal on our wait queues able to wake us normally.
     ready = evaluate_waits(table, proc.wait_descriptors, count);
     if (ready != 0) {
         process::State expected = process::State::Blocked;
@@ -670,6 +883,8 @@ int wait(process::Process& proc,
                                              process::State::Running)) {
             return kWouldBlock;
         }
+        process::cancel_timeout(proc);
+        unlink_waits(proc);
         int result = ready;
         if (ready > 0 &&
             !vm::copy_to_user(proc.cr3,
@@ -685,67 +900,78 @@ int wait(process::Process& proc,
     return kWouldBlock;
 }
 
-void service_waiters() {
-    for (size_t i = 0; i < process::kMaxProcesses; ++i) {
-        process::Process* proc = process::table_entry(i);
-        if (proc == nullptr ||
-            process::load_state(*proc) != process::State::Blocked ||
-            proc->wait_descriptor_count == 0) {
-            continue;
-        }
-
-        size_t count = static_cast<size_t>(proc->wait_descriptor_count);
-        int ready = evaluate_waits(proc->descriptors,
-                                   proc->wait_descriptors,
-                                   count);
-        if (ready <= 0) {
-            continue;
-        }
-        if (!process::begin_wake(*proc)) {
-            continue;
-        }
+void cancel_wait(process::Process& proc) {
+    unlink_waits(proc);
+    proc.wait_descriptors_user = 0;
+    proc.wait_descriptor_count = 0;
+}
 
-        int result = ready;
-        if (!vm::copy_to_user(proc->cr3,
-                              proc->wait_descriptors_user,
-                              proc->wait_descriptors,
-                              count * sizeof(proc->wait_descriptors[0]))) {
-            result = -1;
-        }
+void wait_queue_add(WaitQueue& queue, WaitLink& link) {
+    uint64_t flags = lock_queue(queue);
+    link.queue = &queue;
+    link.prev = nullptr;
+    link.next = queue.head;
+    if (queue.head != nullptr) {
+        queue.head->prev = &link;
+    }
+    __atomic_store_n(&queue.head, &link, __ATOMIC_RELEASE);
+    unlock_queue(queue, flags);
+}
 
-        proc->wait_descriptors_user = 0;
-        proc->wait_descriptor_count = 0;
-        proc->waiting_on = nullptr;
-        process::finish_wake_with_result(*proc, result);
+void wait_queue_remove(WaitLink& link) {
+    WaitQueue* queue = link.queue;
+    if (queue == nullptr) {
+        return;
+    }
+    uint64_t flags = lock_queue(*queue);
+    if (link.prev != nullptr) {
+        link.prev->next = link.next;
+    } else {
+        __atomic_store_n(&queue->head, link.next, __ATOMIC_RELEASE);
     }
+    if (link.next != nullptr) {
+        link.next->prev = link.prev;
+    }
+    link.queue = nullptr;
+    link.prev = nullptr;
+    link.next = nullptr;
+    unlock_queue(*queue, flags);
 }
 
-void waiter_worker(process::Process& worker) {
-    while (__atomic_exchange_n(&g_waiters_pending,
-                               static_cast<uint32_t>(0),
-                               __ATOMIC_ACQ_REL) != 0) {
-        service_waiters();
+void wait_queue_wake(WaitQueue& queue) {
+    // Order the producer's state change before the empty check; a waiter
+    // links itself before rechecking that state.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue.head, __ATOMIC_ACQUIRE) == nullptr) {
+        return;
+    }
+    uint64_t flags = lock_queue(queue);
+    for (WaitLink* link = queue.head; link != nullptr; link = link->next) {
+        if (link->notify != nullptr) {
+            link->notify(*link);
+        }
     }
+    unlock_queue(queue, flags);
+}
 
-    // Publish Blocked before the final pending check.  A concurrent IRQ either
-    // observes Blocked and enqueues us, or its pending bit makes us remain
-    // Ready when this callback returns.
-    worker.waiting_on = nullptr;
-    process::store_state(worker, process::State::Blocked);
-    if (__atomic_load_n(&g_waiters_pending, __ATOMIC_ACQUIRE) != 0) {
-        (void)process::wake(worker);
+bool query_wait(Table& table,
+                uint32_t handle,
+                uint32_t events,
+                uint32_t& revents) {
+    revents = 0;
+    DescriptorEntry* entry = lookup_entry(table, handle);
+    if (entry == nullptr) {
+        return false;
     }
+    return query_entry_wait(*entry, events, revents);
 }
 
-void wake_waiters() {
-    __atomic_store_n(&g_waiters_pending,
-                     static_cast<uint32_t>(1),
-                     __ATOMIC_RELEASE);
-    process::Process* worker =
-        __atomic_load_n(&g_waiter_worker, __ATOMIC_ACQUIRE);
-    if (worker != nullptr) {
-        (void)process::wake(*worker);
+WaitQueue* wait_queue_for(Table& table, uint32_t handle) {
+    DescriptorEntry* entry = lookup_entry(table, handle);
+    if (entry == nullptr) {
+        return nullptr;
     }
+    return entry_wait_queue(*entry);
 }
 
 void start_waiter_worker() {
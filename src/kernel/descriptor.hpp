@@ -55,6 +55,10 @@ constexpr uint32_t kTypeTaskStats =
     static_cast<uint32_t>(descriptor_defs::Type::TaskStats);
 constexpr uint32_t kTypeKernelLog =
     static_cast<uint32_t>(descriptor_defs::Type::KernelLog);
+constexpr uint32_t kTypeKernelHeap =
+    static_cast<uint32_t>(descriptor_defs::Type::KernelHeap);
+constexpr uint32_t kTypeTrace =
+    static_cast<uint32_t>(descriptor_defs::Type::Trace);
 constexpr uint32_t kTypeNetDevice =
     static_cast<uint32_t>(descriptor_defs::Type::NetDevice);
 constexpr uint32_t kTypeNetEndpoint =
@@ -65,6 +69,8 @@ constexpr uint32_t kTypeAudioOutput =
     static_cast<uint32_t>(descriptor_defs::Type::AudioOutput);
 constexpr uint32_t kTypeSensor =
     static_cast<uint32_t>(descriptor_defs::Type::Sensor);
+constexpr uint32_t kTypeWaitSet =
+    static_cast<uint32_t>(descriptor_defs::Type::WaitSet);
 
 constexpr int64_t kWouldBlock = -2;
 
@@ -81,6 +87,26 @@ enum class Flag : uint64_t {
 };
 
 struct DescriptorEntry;
+struct WaitLink;
+
+// Embedded in every object a DescriptorWait can block on. Producers call
+// wait_queue_wake() after a state change so only the waiters registered on
+// that object are re-evaluated. Queues live in static or never-freed storage
+// and are zero-initialised; they must not be reset while links may exist.
+struct WaitQueue {
+    WaitLink* head;
+    volatile int lock;
+};
+
+// A registration on a WaitQueue, owned by the waiter. notify runs with the
+// queue lock held and interrupts disabled, possibly from IRQ context.
+struct WaitLink {
+    WaitQueue* queue;
+    WaitLink* prev;
+    WaitLink* next;
+    void (*notify)(WaitLink& link);
+    void* owner;
+};
 
 struct DescriptorExt {
     uint64_t flags;
@@ -226,14 +252,31 @@ int set_property(process::Process& proc,
                  uint32_t property,
                  uint64_t in_ptr,
                  uint64_t size);
+// Blocks until one of count DescriptorWait entries is ready. A non-zero
+// timeout_ns ends the wait with 0 once it passes.
 int wait(process::Process& proc,
          Table& table,
          uint64_t user_address,
-         size_t count);
-void wake_waiters();
+         size_t count,
+         uint64_t timeout_ns);
+// Drops a blocked DescriptorWait registration; used when reclaiming a process.
+void cancel_wait(process::Process& proc);
 // Starts the kernel task that evaluates deferred descriptor wakeups.
 void start_waiter_worker();
 
+void wait_queue_add(WaitQueue& queue, WaitLink& link);
+void wait_queue_remove(WaitLink& link);
+// Must not be called with the signalled object's own lock held: waiters
+// re-query readiness, which takes that lock.
+void wait_queue_wake(WaitQueue& queue);
+// Readiness of a handle and the queue that announces changes to it. Objects
+// without a queue (console, framebuffer) report a fixed readiness.
+bool query_wait(Table& table,
+                uint32_t handle,
+                uint32_t events,
+                uint32_t& revents);
+WaitQueue* wait_queue_for(Table& table, uint32_t handle);
+
 void register_framebuffer_device(Framebuffer& framebuffer,
                                  uint64_t physical_base);
 void framebuffer_select(uint32_t index);
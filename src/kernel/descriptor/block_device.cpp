@@ -1,5 +1,6 @@
 #include "../descriptor.hpp"
 
+#include "../../drivers/fs/block_cache.hpp"
 #include "../../drivers/fs/block_device.hpp"
 #include "../../drivers/log/logging.hpp"
 #include "../process.hpp"
@@ -286,6 +287,91 @@ bool copy_to_caller(const process::Process& proc,
     return vm::copy_to_user(proc.cr3, dest, src, length);
 }
 
+// Transfer for devices with queued I/O. The bounce buffer is split in two so
+// the next chunk's command is already on the device while the previous one
+// is copied to or from the caller. The lock is held by the caller.
+bool transfer_queued(process::Process& proc,
+                     const fs::BlockDevice& device,
+                     uint64_t user_address,
+                     uint64_t lba,
+                     uint64_t sector_count,
+                     bool is_write) {
+    uint64_t sector_size = device.sector_size;
+    uint64_t half_sectors = (sizeof(g_sync_block_io_buffer) / 2) / sector_size;
+    if (half_sectors > 0xFFu) {
+        half_sectors = 0xFFu;
+    }
+    if (half_sectors == 0) {
+        return false;
+    }
+
+    fs::BlockRequest requests[2]{};
+    bool pending[2]{};
+    uint64_t next_lba = lba;
+    uint64_t remaining = sector_count;
+    bool ok = true;
+
+    auto start = [&](size_t half) {
+        uint64_t chunk = remaining < half_sectors ? remaining : half_sectors;
+        uint8_t* buffer = g_sync_block_io_buffer +
+                          half * (sizeof(g_sync_block_io_buffer) / 2);
+        size_t bytes = static_cast<size_t>(chunk * sector_size);
+        uint64_t caller = user_address + (next_lba - lba) * sector_size;
+        if (is_write && !copy_from_caller(proc, buffer, caller, bytes)) {
+            return false;
+        }
+        fs::BlockRequest& request = requests[half];
+        request = {};
+        request.lba = static_cast<uint32_t>(next_lba);
+        request.sector_count = static_cast<uint8_t>(chunk);
+        request.is_write = is_write;
+        request.buffer = buffer;
+        if (fs::block_submit(device, request) != fs::BlockIoStatus::Ok) {
+            // The queue is full elsewhere; run this chunk synchronously.
+            request.status =
+                is_write ? fs::block_write(device, request.lba,
+                                           request.sector_count, buffer)
+                         : fs::block_read(device, request.lba,
+                                          request.sector_count, buffer);
+            request.driver_data = nullptr;
+        }
+        pending[half] = true;
+        next_lba += chunk;
+        remaining -= chunk;
+        return true;
+    };
+
+    size_t current = 0;
+    ok = start(current);
+    while (ok && pending[current]) {
+        if (remaining > 0 && !start(current ^ 1)) {
+            ok = false;
+        }
+        fs::BlockRequest& request = requests[current];
+        pending[current] = false;
+        if (fs::block_wait(device, request) != fs::BlockIoStatus::Ok) {
+            ok = false;
+        } else if (!is_write) {
+            uint64_t caller = user_address + (request.lba - lba) * sector_size;
+            if (!copy_to_caller(proc,
+                                caller,
+                                request.buffer,
+                                static_cast<size_t>(request.sector_count *
+                                                    sector_size))) {
+                ok = false;
+            }
+        }
+        current ^= 1;
+    }
+    // The driver owns a queued buffer until its request is waited on.
+    for (size_t half = 0; half < 2; ++half) {
+        if (pending[half]) {
+            (void)fs::block_wait(device, requests[half]);
+        }
+    }
+    return ok;
+}
+
 int64_t block_device_read(process::Process& proc,
                           DescriptorEntry& entry,
                           uint64_t user_address,
@@ -332,6 +418,13 @@ int64_t block_device_read(process::Process& proc,
     if (user_address == 0) {
         return -1;
     }
+    if (record->device.submit != nullptr) {
+        lock_sync_io();
+        bool ok = transfer_queued(proc, record->device, user_address, lba,
+                                  sector_count, false);
+        unlock_sync_io();
+        return ok ? static_cast<int64_t>(length) : -1;
+    }
     size_t max_sectors =
         static_cast<size_t>(sizeof(g_sync_block_io_buffer) / sector_size);
     if (max_sectors == 0) {
@@ -416,6 +509,13 @@ int64_t block_device_write(process::Process& proc,
     if (user_address == 0) {
         return -1;
     }
+    if (record->device.submit != nullptr) {
+        lock_sync_io();
+        bool ok = transfer_queued(proc, record->device, user_address, lba,
+                                  sector_count, true);
+        unlock_sync_io();
+        return ok ? static_cast<int64_t>(length) : -1;
+    }
     size_t max_sectors =
         static_cast<size_t>(sizeof(g_sync_block_io_buffer) / sector_size);
     if (max_sectors == 0) {
@@ -456,6 +556,15 @@ int64_t block_device_write(process::Process& proc,
     return static_cast<int64_t>(length);
 }
 
+int get_cache_stats(void* out, size_t size) {
+    if (out == nullptr || size < sizeof(descriptor_defs::BlockCacheStats)) {
+        return -1;
+    }
+    fs::block_cache::snapshot(
+        *reinterpret_cast<descriptor_defs::BlockCacheStats*>(out));
+    return 0;
+}
+
 int block_device_get_property(DescriptorEntry& entry,
                               uint32_t property,
                               void* out,
@@ -474,6 +583,10 @@ int block_device_get_property(DescriptorEntry& entry,
         geom->sector_count = record->device.sector_count;
         return 0;
     }
+    if (property ==
+        static_cast<uint32_t>(descriptor_defs::Property::BlockCacheStats)) {
+        return get_cache_stats(out, size);
+    }
     return -1;
 }
 
@@ -499,6 +612,10 @@ int disk_get_property(DescriptorEntry& entry,
         }
         return 0;
     }
+    if (property ==
+        static_cast<uint32_t>(descriptor_defs::Property::BlockCacheStats)) {
+        return get_cache_stats(out, size);
+    }
     return -1;
 }
 
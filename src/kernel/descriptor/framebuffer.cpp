@@ -202,6 +202,22 @@ bool copy_rect_to_hardware(const FramebufferSlot& slot,
     return true;
 }
 
+// Removes a slot mapping, 2 MiB leaves first. The caller flushes the TLB.
+void unmap_slot_pages(uint64_t cr3, uint64_t base, uint64_t bytes) {
+    uint64_t offset = 0;
+    while (offset < bytes) {
+        uint64_t ignored = 0;
+        if (((base + offset) & (PAGING_LARGE_PAGE_SIZE - 1)) == 0 &&
+            bytes - offset >= PAGING_LARGE_PAGE_SIZE &&
+            paging_unmap_large_page_cr3(cr3, base + offset, ignored)) {
+            offset += PAGING_LARGE_PAGE_SIZE;
+            continue;
+        }
+        (void)paging_unmap_page_cr3(cr3, base + offset, ignored);
+        offset += kPageSize;
+    }
+}
+
 bool map_slot_into_process(process::Process& proc,
                            FramebufferSlot& slot,
                            uint64_t& out_base) {
@@ -216,18 +232,26 @@ bool map_slot_into_process(process::Process& proc,
     uint64_t total = region.length;
     uint64_t physical_base = slot.physical_base;
     uint64_t flags = PAGE_FLAG_WRITE | PAGE_FLAG_USER | PAGE_FLAG_NO_EXECUTE;
-    for (uint64_t offset = 0; offset < total; offset += kPageSize) {
+    uint64_t offset = 0;
+    while (offset < total) {
         uint64_t phys = physical_base + offset;
+        // Slot buffers come from the buddy allocator, so frames past 2 MiB
+        // are naturally aligned and whole frames fit in large pages.
+        if ((((base + offset) | phys) & (PAGING_LARGE_PAGE_SIZE - 1)) == 0 &&
+            total - offset >= PAGING_LARGE_PAGE_SIZE &&
+            paging_map_large_page_cr3(proc.cr3, base + offset, phys, flags)) {
+            offset += PAGING_LARGE_PAGE_SIZE;
+            continue;
+        }
         if (!paging_map_page_cr3(proc.cr3,
                                  base + offset,
                                  phys,
                                  flags)) {
-            for (uint64_t rollback = 0; rollback < offset; rollback += kPageSize) {
-                uint64_t freed = 0;
-                paging_unmap_page_cr3(proc.cr3, base + rollback, freed);
-            }
+            unmap_slot_pages(proc.cr3, base, offset);
+            (void)paging_flush_tlb_cr3(proc.cr3);
             return false;
         }
+        offset += kPageSize;
     }
     out_base = base;
     return true;
@@ -408,13 +432,9 @@ void framebuffer_close(DescriptorEntry& entry) {
     if (owner != nullptr && !is_kernel_process(*owner) &&
         entry.subsystem_data != nullptr) {
         uint64_t base = reinterpret_cast<uint64_t>(entry.subsystem_data);
-        for (uint64_t offset = 0; offset < slot->buffer_bytes;
-             offset += kPageSize) {
-            uint64_t ignored = 0;
-            (void)paging_unmap_page_cr3(owner->cr3,
-                                        base + offset,
-                                        ignored);
-        }
+        unmap_slot_pages(owner->cr3, base, slot->buffer_bytes);
+        // The owner may be running on another CPU right now.
+        (void)paging_flush_tlb_cr3(owner->cr3);
     }
 }
 
@@ -0,0 +1,79 @@
+#include "../descriptor.hpp"
+
+#include "../memory/physical_allocator.hpp"
+
+namespace descriptor {
+
+namespace kernel_heap_descriptor {
+
+int64_t read(process::Process&,
+             DescriptorEntry&,
+             uint64_t user_address,
+             uint64_t length,
+             uint64_t offset) {
+    if (offset != 0) {
+        return -1;
+    }
+    if (user_address == 0 ||
+        length < sizeof(descriptor_defs::KernelHeapCacheStats)) {
+        return -1;
+    }
+    auto* out =
+        reinterpret_cast<descriptor_defs::KernelHeapCacheStats*>(user_address);
+    size_t max_entries = static_cast<size_t>(
+        length / sizeof(descriptor_defs::KernelHeapCacheStats));
+    size_t written = memory::kernel_heap_snapshot(out, max_entries);
+    return static_cast<int64_t>(written *
+                                sizeof(descriptor_defs::KernelHeapCacheStats));
+}
+
+int64_t write(process::Process&,
+              DescriptorEntry&,
+              uint64_t,
+              uint64_t,
+              uint64_t) {
+    return -1;
+}
+
+int get_property(DescriptorEntry&,
+                 uint32_t,
+                 void*,
+                 size_t) {
+    return -1;
+}
+
+const Ops kKernelHeapOps{
+    .read = read,
+    .write = write,
+    .get_property = get_property,
+    .set_property = nullptr,
+};
+
+bool open(process::Process&,
+          uint64_t,
+          uint64_t,
+          uint64_t,
+          Allocation& alloc) {
+    alloc.type = kTypeKernelHeap;
+    alloc.flags = static_cast<uint64_t>(Flag::Readable) |
+                 static_cast<uint64_t>(Flag::Device);
+    alloc.extended_flags = 0;
+    alloc.has_extended_flags = false;
+    alloc.object = nullptr;
+    alloc.subsystem_data = nullptr;
+    alloc.name = "kernel_heap";
+    alloc.ops = &kKernelHeapOps;
+    alloc.ext = nullptr;
+    alloc.close = nullptr;
+    return true;
+}
+
+}  // namespace kernel_heap_descriptor
+
+bool register_kernel_heap_descriptor() {
+    return register_type(kTypeKernelHeap,
+                         kernel_heap_descriptor::open,
+                         &kernel_heap_descriptor::kKernelHeapOps);
+}
+
+}  // namespace descriptor
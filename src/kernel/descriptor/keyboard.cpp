@@ -104,6 +104,14 @@ bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents) {
     return true;
 }
 
+WaitQueue* wait_queue(DescriptorEntry& entry) {
+    uintptr_t slot_raw = reinterpret_cast<uintptr_t>(entry.subsystem_data);
+    if (slot_raw == 0) {
+        return nullptr;
+    }
+    return keyboard::wait_queue(static_cast<uint32_t>(slot_raw - 1));
+}
+
 }  // namespace descriptor_keyboard
 
 bool register_keyboard_descriptor() {
@@ -1,18 +1,243 @@
 #include "../descriptor.hpp"
 
+#include "arch/x86_64/memory/paging.hpp"
 #include "../../net/network.hpp"
+#include "../memory/physical_allocator.hpp"
+#include "../process.hpp"
 #include "../string_util.hpp"
+#include "../vm.hpp"
 #include "../../lib/mem.hpp"
 
 namespace descriptor {
 
 namespace descriptor_net_device {
 
+constexpr size_t kPageSize = 0x1000;
+constexpr size_t kMaxRings = 4;
+constexpr size_t kRingSlotPages =
+    (descriptor_defs::kNetRingBytes - descriptor_defs::kNetRingControlBytes) /
+    kPageSize;
+
+// A packet ring owned by one NetDevice descriptor. The control page and the
+// slot block are separate allocations so the slots stay a power-of-two
+// buddy block; the owner sees them back to back.
+struct RingState {
+    bool in_use;
+    net::LinkDevice* device;
+    process::Process* owner;
+    uint64_t control_phys;
+    uint64_t slots_phys;
+    uint64_t user_base;
+    net::PacketRing ring;
+};
+
+RingState g_rings[kMaxRings]{};
+volatile int g_rings_lock = 0;
+
+class RingPoolGuard {
+public:
+    RingPoolGuard() {
+        while (__atomic_test_and_set(&g_rings_lock, __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+    ~RingPoolGuard() { __atomic_clear(&g_rings_lock, __ATOMIC_RELEASE); }
+    RingPoolGuard(const RingPoolGuard&) = delete;
+    RingPoolGuard& operator=(const RingPoolGuard&) = delete;
+};
+
+RingState* claim_ring() {
+    RingPoolGuard guard;
+    for (auto& state : g_rings) {
+        if (!state.in_use) {
+            memset(&state, 0, sizeof(state));
+            state.in_use = true;
+            return &state;
+        }
+    }
+    return nullptr;
+}
+
+void unmap_ring_pages(uint64_t cr3, uint64_t base, uint64_t bytes) {
+    for (uint64_t offset = 0; offset < bytes; offset += kPageSize) {
+        uint64_t ignored = 0;
+        (void)paging_unmap_page_cr3(cr3, base + offset, ignored);
+    }
+}
+
+bool map_ring_into_process(process::Process& proc, RingState& state) {
+    vm::Region region =
+        vm::reserve_user_region(proc.cr3, descriptor_defs::kNetRingBytes);
+    if (region.base == 0 || region.length < descriptor_defs::kNetRingBytes) {
+        return false;
+    }
+    uint64_t flags = PAGE_FLAG_WRITE | PAGE_FLAG_USER | PAGE_FLAG_NO_EXECUTE;
+    if (!paging_map_page_cr3(proc.cr3, region.base, state.control_phys, flags)) {
+        return false;
+    }
+    uint64_t slots_base = region.base + descriptor_defs::kNetRingControlBytes;
+    for (size_t page = 0; page < kRingSlotPages; ++page) {
+        if (!paging_map_page_cr3(proc.cr3,
+                                 slots_base + page * kPageSize,
+                                 state.slots_phys + page * kPageSize,
+                                 flags)) {
+            unmap_ring_pages(proc.cr3,
+                             region.base,
+                             descriptor_defs::kNetRingControlBytes +
+                                 page * kPageSize);
+            (void)paging_flush_tlb_cr3(proc.cr3);
+            return false;
+        }
+    }
+    state.user_base = region.base;
+    return true;
+}
+
+// Detaches the ring from its link, then takes the pages away from the owner
+// and frees them. Frames the owner had not consumed are lost.
+void release_ring(RingState& state) {
+    if (state.device != nullptr) {
+        net::detach_packet_ring(*state.device, state.ring);
+    }
+    if (state.owner != nullptr && state.user_base != 0) {
+        unmap_ring_pages(state.owner->cr3,
+                         state.user_base,
+                         descriptor_defs::kNetRingBytes);
+        // The owner may be running on another CPU right now.
+        (void)paging_flush_tlb_cr3(state.owner->cr3);
+    }
+    if (state.slots_phys != 0) {
+        memory::free_kernel_block(state.slots_phys);
+    }
+    if (state.control_phys != 0) {
+        memory::free_kernel_page(state.control_phys);
+    }
+    RingPoolGuard guard;
+    memset(&state, 0, sizeof(state));
+}
+
+int attach_ring(DescriptorEntry& entry, net::LinkDevice& device) {
+    process::Process* proc = process::current();
+    if (proc == nullptr || proc->cr3 == 0 || is_kernel_process(*proc) ||
+        entry.subsystem_data != nullptr) {
+        return -1;
+    }
+    RingState* state = claim_ring();
+    if (state == nullptr) {
+        return -1;
+    }
+    state->control_phys = memory::alloc_kernel_page();
+    state->slots_phys = memory::alloc_kernel_block_pages(kRingSlotPages);
+    if (state->control_phys == 0 || state->slots_phys == 0) {
+        release_ring(*state);
+        return -1;
+    }
+    // Both come back zeroed, so every index starts at 0.
+    state->ring.control = static_cast<descriptor_defs::NetRingControl*>(
+        paging_phys_to_virt(state->control_phys));
+    state->ring.rx_slots =
+        static_cast<uint8_t*>(paging_phys_to_virt(state->slots_phys));
+    state->ring.tx_slots =
+        state->ring.rx_slots + static_cast<size_t>(descriptor_defs::kNetRingSlots) *
+                                   descriptor_defs::kNetRingSlotSize;
+    if (!map_ring_into_process(*proc, *state)) {
+        release_ring(*state);
+        return -1;
+    }
+    state->owner = proc;
+    if (!net::attach_packet_ring(device, state->ring)) {
+        release_ring(*state);
+        return -1;
+    }
+    state->device = &device;
+    entry.subsystem_data = state;
+    return 0;
+}
+
+void net_device_close(DescriptorEntry& entry) {
+    auto* state = static_cast<RingState*>(entry.subsystem_data);
+    if (state != nullptr) {
+        entry.subsystem_data = nullptr;
+        release_ring(*state);
+    }
+}
+
+int64_t read_batch(net::LinkDevice& device,
+                   uint64_t user_address,
+                   uint64_t length) {
+    if (length < sizeof(descriptor_defs::NetFrameBatch)) {
+        return -1;
+    }
+    auto* batch =
+        reinterpret_cast<descriptor_defs::NetFrameBatch*>(user_address);
+    size_t max_frames = batch->count;
+    if (max_frames == 0 || max_frames > descriptor_defs::kNetFrameBatchMax) {
+        max_frames = descriptor_defs::kNetFrameBatchMax;
+    }
+    uint16_t lengths[descriptor_defs::kNetFrameBatchMax];
+    int count = net::read_frames(
+        device,
+        reinterpret_cast<uint8_t*>(user_address) + sizeof(*batch),
+        static_cast<size_t>(length) - sizeof(*batch),
+        lengths,
+        max_frames);
+    if (count < 0) {
+        return -1;
+    }
+    if (count == 0) {
+        return kWouldBlock;
+    }
+    batch->count = static_cast<uint32_t>(count);
+    batch->reserved = 0;
+    for (int i = 0; i < count; ++i) {
+        batch->lengths[i] = lengths[i];
+    }
+    return static_cast<int64_t>(count);
+}
+
+int64_t write_batch(net::LinkDevice& device,
+                    uint64_t user_address,
+                    uint64_t length) {
+    if (length < sizeof(descriptor_defs::NetFrameBatch)) {
+        return -1;
+    }
+    descriptor_defs::NetFrameBatch batch;
+    memcpy(&batch, reinterpret_cast<const void*>(user_address), sizeof(batch));
+    if (batch.count == 0 || batch.count > descriptor_defs::kNetFrameBatchMax) {
+        return -1;
+    }
+    // Check the whole layout first so a bad length sends nothing.
+    uint64_t total = sizeof(batch);
+    for (uint32_t i = 0; i < batch.count; ++i) {
+        if (batch.lengths[i] == 0 || batch.lengths[i] > net::kMaxQueuedFrameSize) {
+            return -1;
+        }
+        total += batch.lengths[i];
+    }
+    if (total > length) {
+        return -1;
+    }
+    const auto* frame =
+        reinterpret_cast<const uint8_t*>(user_address) + sizeof(batch);
+    uint32_t sent = 0;
+    while (sent < batch.count &&
+           net::write_frame(device, frame, batch.lengths[sent])) {
+        frame += batch.lengths[sent];
+        ++sent;
+    }
+    return (sent == 0) ? kWouldBlock : static_cast<int64_t>(sent);
+}
+
 int64_t net_device_read(process::Process&,
                         DescriptorEntry& entry,
                         uint64_t user_address,
                         uint64_t length,
                         uint64_t offset) {
+    if (offset == descriptor_defs::kNetFrameBatchOffset && user_address != 0) {
+        auto* device = static_cast<net::LinkDevice*>(entry.object);
+        return (device != nullptr) ? read_batch(*device, user_address, length)
+                                   : -1;
+    }
     if (offset != 0 || user_address == 0 || length == 0) {
         return (offset == 0 && length == 0) ? 0 : -1;
     }
@@ -44,6 +269,11 @@ int64_t net_device_write(process::Process&,
                          uint64_t user_address,
                          uint64_t length,
                          uint64_t offset) {
+    if (offset == descriptor_defs::kNetFrameBatchOffset && user_address != 0) {
+        auto* device = static_cast<net::LinkDevice*>(entry.object);
+        return (device != nullptr) ? write_batch(*device, user_address, length)
+                                   : -1;
+    }
     if (offset != 0 || user_address == 0 || length == 0) {
         return (offset == 0 && length == 0) ? 0 : -1;
     }
@@ -140,6 +370,20 @@ int get_property(DescriptorEntry& entry,
             debug->rx_frames_dropped = device->rx_frames_dropped;
             return 0;
         }
+        case descriptor_defs::Property::NetPacketRing: {
+            auto* state = static_cast<RingState*>(entry.subsystem_data);
+            if (state == nullptr ||
+                size < sizeof(descriptor_defs::NetPacketRingInfo)) {
+                return -1;
+            }
+            auto* info =
+                reinterpret_cast<descriptor_defs::NetPacketRingInfo*>(out);
+            info->base = state->user_base;
+            info->length = descriptor_defs::kNetRingBytes;
+            info->slot_count = descriptor_defs::kNetRingSlots;
+            info->slot_size = descriptor_defs::kNetRingSlotSize;
+            return 0;
+        }
         default:
             return -1;
     }
@@ -154,6 +398,35 @@ int set_property(DescriptorEntry& entry,
         return -1;
     }
 
+    if (static_cast<descriptor_defs::Property>(property) ==
+        descriptor_defs::Property::NetPacketRing) {
+        if (size < sizeof(descriptor_defs::NetPacketRingControl)) {
+            return -1;
+        }
+        const auto* control =
+            reinterpret_cast<const descriptor_defs::NetPacketRingControl*>(in);
+        auto* state = static_cast<RingState*>(entry.subsystem_data);
+        switch (control->command) {
+            case descriptor_defs::kNetPacketRingAttach:
+                return attach_ring(entry, *device);
+            case descriptor_defs::kNetPacketRingDetach:
+                if (state == nullptr) {
+                    return -1;
+                }
+                entry.subsystem_data = nullptr;
+                release_ring(*state);
+                return 0;
+            case descriptor_defs::kNetPacketRingKick:
+                if (state == nullptr) {
+                    return -1;
+                }
+                return net::transmit_packet_ring(*device, state->ring) < 0 ? -1
+                                                                           : 0;
+            default:
+                return -1;
+        }
+    }
+
     if (static_cast<descriptor_defs::Property>(property) !=
             descriptor_defs::Property::NetIpv4Config ||
         size < sizeof(descriptor_defs::NetIpv4Config)) {
@@ -214,7 +487,7 @@ bool open_net_device(process::Process&,
     alloc.has_extended_flags = true;
     alloc.object = device;
     alloc.subsystem_data = nullptr;
-    alloc.close = nullptr;
+    alloc.close = net_device_close;
     alloc.name = device->name;
     alloc.ops = &kNetDeviceOps;
     return true;
@@ -236,6 +509,14 @@ bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents) {
     return true;
 }
 
+WaitQueue* wait_queue(DescriptorEntry& entry) {
+    auto* device = static_cast<net::LinkDevice*>(entry.object);
+    if (device == nullptr) {
+        return nullptr;
+    }
+    return &device->waiters;
+}
+
 }  // namespace descriptor_net_device
 
 bool register_net_device_descriptor() {
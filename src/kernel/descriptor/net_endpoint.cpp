@@ -51,6 +51,7 @@ struct NetEndpoint {
     EndpointWaiter* app_write_waiters;
     EndpointWaiter* service_read_waiters;
     EndpointWaiter* service_write_waiters;
+    WaitQueue waiters;  // DescriptorWait registrations; never reset
 };
 
 struct EndpointHandle {
@@ -432,7 +433,7 @@ int64_t endpoint_read(process::Process& proc,
         int64_t copied = ring_copy_out_to_user(ring, proc, user_address, requested);
         pump_waiters_locked(endpoint);
         unlock_endpoint(endpoint, irq_flags);
-        descriptor::wake_waiters();
+        wait_queue_wake(endpoint.waiters);
         return copied;
     }
     if (peer_handles(endpoint, handle->role) == 0) {
@@ -495,7 +496,7 @@ int64_t endpoint_write(process::Process& proc,
         int64_t copied = ring_copy_in_from_user(ring, proc, user_address, requested);
         pump_waiters_locked(endpoint);
         unlock_endpoint(endpoint, irq_flags);
-        descriptor::wake_waiters();
+        wait_queue_wake(endpoint.waiters);
         return copied;
     }
     if (async) {
@@ -581,12 +582,13 @@ void close_endpoint(DescriptorEntry& entry) {
         return;
     }
     bool notify_waiters = false;
+    NetEndpoint* endpoint = nullptr;
     {
         sync::IrqLockGuard pool_guard(g_endpoint_pool_lock);
         if (!__atomic_load_n(&handle->in_use, __ATOMIC_ACQUIRE)) {
             return;
         }
-        NetEndpoint* endpoint = handle->endpoint;
+        endpoint = handle->endpoint;
         if (endpoint == nullptr ||
             !__atomic_load_n(&endpoint->in_use, __ATOMIC_ACQUIRE)) {
             release_handle_locked(handle);
@@ -642,7 +644,7 @@ void close_endpoint(DescriptorEntry& entry) {
         unlock_endpoint(*endpoint, irq_flags);
     }
     if (notify_waiters) {
-        descriptor::wake_waiters();
+        wait_queue_wake(endpoint->waiters);
     }
 }
 
@@ -670,6 +672,14 @@ bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents) {
     return true;
 }
 
+WaitQueue* wait_queue(DescriptorEntry& entry) {
+    auto* handle = static_cast<EndpointHandle*>(entry.subsystem_data);
+    if (handle == nullptr || handle->endpoint == nullptr) {
+        return nullptr;
+    }
+    return &handle->endpoint->waiters;
+}
+
 const Ops kEndpointOps{
     .read = endpoint_read,
     .write = endpoint_write,
@@ -720,7 +730,7 @@ bool open_endpoint(process::Process& proc,
         }
         unlock_endpoint(*endpoint, irq_flags);
     }
-    descriptor::wake_waiters();
+    wait_queue_wake(endpoint->waiters);
 
     uint64_t descriptor_flags =
         static_cast<uint64_t>(Flag::Readable) |
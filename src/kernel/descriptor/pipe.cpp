@@ -37,6 +37,7 @@ struct Pipe {
     volatile int lock;
     PipeWaiter* read_waiters;
     PipeWaiter* write_waiters;
+    WaitQueue waiters;  // DescriptorWait registrations; never reset
     uint32_t id;
 };
 
@@ -448,7 +449,7 @@ int64_t pipe_read(process::Process& proc,
     if (read_count > 0) {
         wake_write_waiters_locked(*pipe);
         unlock_pipe(*pipe, irq_flags);
-        descriptor::wake_waiters();
+        wait_queue_wake(pipe->waiters);
         return static_cast<int64_t>(read_count);
     }
 
@@ -528,7 +529,7 @@ int64_t pipe_write(process::Process& proc,
     if (written > 0) {
         wake_read_waiters_locked(*pipe);
         unlock_pipe(*pipe, irq_flags);
-        descriptor::wake_waiters();
+        wait_queue_wake(pipe->waiters);
         return static_cast<int64_t>(written);
     }
 
@@ -588,12 +589,13 @@ void close_pipe(DescriptorEntry& entry) {
         return;
     }
     bool notify_waiters = false;
+    Pipe* pipe = nullptr;
     {
         sync::IrqLockGuard pool_guard(g_pipe_pool_lock);
         if (!__atomic_load_n(&endpoint->in_use, __ATOMIC_ACQUIRE)) {
             return;
         }
-        Pipe* pipe = endpoint->pipe;
+        pipe = endpoint->pipe;
         if (pipe == nullptr ||
             !__atomic_load_n(&pipe->in_use, __ATOMIC_ACQUIRE)) {
             release_pipe_endpoint_locked(endpoint);
@@ -658,7 +660,7 @@ void close_pipe(DescriptorEntry& entry) {
         unlock_pipe(*pipe, irq_flags);
     }
     if (notify_waiters) {
-        descriptor::wake_waiters();
+        wait_queue_wake(pipe->waiters);
     }
 }
 
@@ -685,6 +687,14 @@ bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents) {
     return true;
 }
 
+WaitQueue* wait_queue(DescriptorEntry& entry) {
+    auto* endpoint = static_cast<PipeEndpoint*>(entry.subsystem_data);
+    if (endpoint == nullptr || endpoint->pipe == nullptr) {
+        return nullptr;
+    }
+    return &endpoint->pipe->waiters;
+}
+
 const Ops kPipeOps{
     .read = pipe_read,
     .write = pipe_write,
@@ -737,7 +747,7 @@ bool open_pipe(process::Process& proc,
         }
         unlock_pipe(*pipe, irq_flags);
     }
-    descriptor::wake_waiters();
+    wait_queue_wake(pipe->waiters);
 
     uint64_t descriptor_flags = 0;
     if (want_read) {
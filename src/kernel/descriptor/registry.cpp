@@ -17,11 +17,14 @@ bool register_vty_descriptor();
 bool register_cpu_stats_descriptor();
 bool register_task_stats_descriptor();
 bool register_kernel_log_descriptor();
+bool register_kernel_heap_descriptor();
+bool register_trace_descriptor();
 bool register_net_device_descriptor();
 bool register_net_endpoint_descriptor();
 bool register_pci_descriptor();
 bool register_audio_output_descriptor();
 bool register_sensor_descriptor();
+bool register_wait_set_descriptor();
 
 void register_builtin_types() {
     reset_block_device_registry();
@@ -78,6 +81,14 @@ void register_builtin_types() {
         log_message(LogLevel::Warn,
                     "Descriptor: failed to register kernel log descriptor type");
     }
+    if (!register_kernel_heap_descriptor()) {
+        log_message(LogLevel::Warn,
+                    "Descriptor: failed to register kernel heap descriptor type");
+    }
+    if (!register_trace_descriptor()) {
+        log_message(LogLevel::Warn,
+                    "Descriptor: failed to register trace descriptor type");
+    }
     if (!register_net_device_descriptor()) {
         log_message(LogLevel::Warn,
                     "Descriptor: failed to register net device descriptor type");
@@ -98,6 +109,10 @@ void register_builtin_types() {
         log_message(LogLevel::Warn,
                     "Descriptor: failed to register sensor descriptor type");
     }
+    if (!register_wait_set_descriptor()) {
+        log_message(LogLevel::Warn,
+                    "Descriptor: failed to register wait set descriptor type");
+    }
 }
 
 }  // namespace descriptor
@@ -17,6 +17,7 @@ constexpr size_t kMaxNameLength = 48;
 constexpr size_t kDefaultSegmentSize = 0x1000;
 constexpr size_t kPageSize = 0x1000;
 constexpr size_t kMaxSegmentPages = 4096;  // Allow larger shared buffers (e.g., full-screen surfaces).
+constexpr size_t kLargePagePages = PAGING_LARGE_PAGE_SIZE / kPageSize;
 
 struct SegmentMapping {
     process::Process* proc;
@@ -103,6 +104,40 @@ SegmentMapping* allocate_mapping(SharedSegment& segment,
     return nullptr;
 }
 
+// True when pages [first, first + 512) form one 2 MiB aligned frame run that
+// can be mapped with a single large page.
+bool large_run_at(const SharedSegment& segment, size_t first) {
+    if (first % kLargePagePages != 0 ||
+        segment.page_count - first < kLargePagePages ||
+        (segment.pages[first] & (PAGING_LARGE_PAGE_SIZE - 1)) != 0) {
+        return false;
+    }
+    for (size_t i = 1; i < kLargePagePages; ++i) {
+        if (segment.pages[first + i] != segment.pages[first] + i * kPageSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Unmaps the first page_count pages of a mapping. The caller flushes the TLB.
+void unmap_segment_pages(const SharedSegment& segment,
+                         uint64_t cr3,
+                         uint64_t base,
+                         size_t page_count) {
+    size_t i = 0;
+    while (i < page_count) {
+        uint64_t ignored = 0;
+        if (page_count - i >= kLargePagePages && large_run_at(segment, i) &&
+            paging_unmap_large_page_cr3(cr3, base + i * kPageSize, ignored)) {
+            i += kLargePagePages;
+            continue;
+        }
+        (void)paging_unmap_page_cr3(cr3, base + i * kPageSize, ignored);
+        ++i;
+    }
+}
+
 bool map_segment_into_process(SharedSegment& segment,
                               process::Process& proc,
                               SegmentMapping& mapping) {
@@ -119,28 +154,32 @@ bool map_segment_into_process(SharedSegment& segment,
             return false;
         }
     }
-    for (size_t i = 0; i < segment.page_count; ++i) {
+    const uint64_t flags =
+        PAGE_FLAG_WRITE | PAGE_FLAG_USER | PAGE_FLAG_NO_EXECUTE;
+    size_t i = 0;
+    while (i < segment.page_count) {
         uint64_t virt = mapping.region.base + (i * kPageSize);
         uint64_t phys = segment.pages[i];
+        if ((virt & (PAGING_LARGE_PAGE_SIZE - 1)) == 0 &&
+            large_run_at(segment, i) &&
+            paging_map_large_page_cr3(proc.cr3, virt, phys, flags)) {
+            i += kLargePagePages;
+            continue;
+        }
         if (!paging_map_page_cr3(proc.cr3,
                                  virt,
                                  phys,
-                                 PAGE_FLAG_WRITE | PAGE_FLAG_USER |
-                                     PAGE_FLAG_NO_EXECUTE)) {
+                                 flags)) {
             log_message(LogLevel::Error,
                         "SHM map failed pid=%u virt=%llx phys=%llx",
                         static_cast<unsigned int>(proc.pid),
                         static_cast<unsigned long long>(virt),
                         static_cast<unsigned long long>(phys));
-            for (size_t rollback = 0; rollback < i; ++rollback) {
-                uint64_t ignored = 0;
-                (void)paging_unmap_page_cr3(
-                    proc.cr3,
-                    mapping.region.base + (rollback * kPageSize),
-                    ignored);
-            }
+            unmap_segment_pages(segment, proc.cr3, mapping.region.base, i);
+            (void)paging_flush_tlb_cr3(proc.cr3);
             return false;
         }
+        ++i;
     }
     return true;
 }
@@ -151,11 +190,11 @@ void unmap_segment_from_process(SharedSegment& segment,
     if (mapping.region.base == 0 || segment.page_count == 0 || proc.cr3 == 0) {
         return;
     }
-    for (size_t i = 0; i < segment.page_count; ++i) {
-        uint64_t virt = mapping.region.base + (i * kPageSize);
-        uint64_t phys = 0;
-        paging_unmap_page_cr3(proc.cr3, virt, phys);
-    }
+    unmap_segment_pages(segment,
+                        proc.cr3,
+                        mapping.region.base,
+                        segment.page_count);
+    (void)paging_flush_tlb_cr3(proc.cr3);
 }
 
 void release_segment_pages(SharedSegment& segment) {
@@ -197,7 +236,21 @@ SharedSegment* allocate_segment_locked(const char* name,
     slot->in_use = true;
     slot->length = padded;
     slot->page_count = pages;
-    for (size_t i = 0; i < pages; ++i) {
+    size_t i = 0;
+    while (i < pages) {
+        // Whole 2 MiB chunks come from one aligned block when available so
+        // every mapping of the segment can use large pages.
+        if (i % kLargePagePages == 0 && pages - i >= kLargePagePages) {
+            uint64_t block = memory::alloc_user_huge_page();
+            if (block != 0) {
+                memset(paging_phys_to_virt(block), 0, PAGING_LARGE_PAGE_SIZE);
+                for (size_t j = 0; j < kLargePagePages; ++j) {
+                    slot->pages[i + j] = block + j * kPageSize;
+                }
+                i += kLargePagePages;
+                continue;
+            }
+        }
         uint64_t phys = memory::alloc_user_page();
         if (phys == 0) {
             log_message(LogLevel::Warn,
@@ -213,6 +266,7 @@ SharedSegment* allocate_segment_locked(const char* name,
         auto* page = static_cast<uint8_t*>(paging_phys_to_virt(phys));
         memset(page, 0, kPageSize);
         slot->pages[i] = phys;
+        ++i;
     }
     string_util::copy(slot->name, sizeof(slot->name), name);
     return slot;
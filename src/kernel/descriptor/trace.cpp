@@ -0,0 +1,95 @@
+#include "../descriptor.hpp"
+
+#include "../trace.hpp"
+
+namespace descriptor {
+
+namespace trace_descriptor {
+
+int64_t read(process::Process&,
+             DescriptorEntry&,
+             uint64_t user_address,
+             uint64_t length,
+             uint64_t) {
+    if (user_address == 0 || length < sizeof(descriptor_defs::TraceRecord)) {
+        return -1;
+    }
+    auto* out = reinterpret_cast<descriptor_defs::TraceRecord*>(user_address);
+    size_t max_records =
+        static_cast<size_t>(length / sizeof(descriptor_defs::TraceRecord));
+    size_t taken = trace::read(out, max_records);
+    return static_cast<int64_t>(taken * sizeof(descriptor_defs::TraceRecord));
+}
+
+int64_t write(process::Process&,
+              DescriptorEntry&,
+              uint64_t,
+              uint64_t,
+              uint64_t) {
+    return -1;
+}
+
+int get_property(DescriptorEntry&,
+                 uint32_t property,
+                 void* out,
+                 size_t size) {
+    if (property !=
+            static_cast<uint32_t>(descriptor_defs::Property::TraceStatus) ||
+        out == nullptr || size < sizeof(descriptor_defs::TraceStatus)) {
+        return -1;
+    }
+    *reinterpret_cast<descriptor_defs::TraceStatus*>(out) = trace::status();
+    return 0;
+}
+
+int set_property(DescriptorEntry&,
+                 uint32_t property,
+                 const void* in,
+                 size_t size) {
+    if (property !=
+            static_cast<uint32_t>(descriptor_defs::Property::TraceControl) ||
+        in == nullptr || size < sizeof(descriptor_defs::TraceControl)) {
+        return -1;
+    }
+    descriptor_defs::TraceControl request =
+        *reinterpret_cast<const descriptor_defs::TraceControl*>(in);
+    trace::configure(request.enable_mask,
+                     (request.flags & descriptor_defs::kTraceControlClear) != 0);
+    return 0;
+}
+
+const Ops kTraceOps{
+    .read = read,
+    .write = write,
+    .get_property = get_property,
+    .set_property = set_property,
+};
+
+bool open(process::Process&,
+          uint64_t,
+          uint64_t,
+          uint64_t,
+          Allocation& alloc) {
+    alloc.type = kTypeTrace;
+    alloc.flags = static_cast<uint64_t>(Flag::Readable) |
+                 static_cast<uint64_t>(Flag::Device);
+    alloc.extended_flags = 0;
+    alloc.has_extended_flags = false;
+    alloc.object = nullptr;
+    alloc.subsystem_data = nullptr;
+    alloc.name = "trace";
+    alloc.ops = &kTraceOps;
+    alloc.ext = nullptr;
+    alloc.close = nullptr;
+    return true;
+}
+
+}  // namespace trace_descriptor
+
+bool register_trace_descriptor() {
+    return register_type(kTypeTrace,
+                         trace_descriptor::open,
+                         &trace_descriptor::kTraceOps);
+}
+
+}  // namespace descriptor
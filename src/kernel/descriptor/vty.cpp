@@ -34,6 +34,7 @@ struct Vty {
     size_t input_head;
     size_t input_tail;
     volatile int lock;
+    WaitQueue waiters;  // DescriptorWait registrations; never reset
 };
 
 Vty g_vtys[kMaxVtys]{};
@@ -413,7 +414,7 @@ int vty_set_property(DescriptorEntry& entry,
         }
         unlock_vty(*vty);
         if (changed) {
-            descriptor::wake_waiters();
+            wait_queue_wake(vty->waiters);
         }
         return 0;
     }
@@ -499,6 +500,14 @@ bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents) {
     return true;
 }
 
+WaitQueue* wait_queue(DescriptorEntry& entry) {
+    auto* vty = static_cast<Vty*>(entry.object);
+    if (vty == nullptr) {
+        return nullptr;
+    }
+    return &vty->waiters;
+}
+
 bool open_vty(process::Process& proc,
               uint64_t resource_selector,
               uint64_t requested_flags,
@@ -675,12 +684,16 @@ int vty_set_property(uint32_t id,
         if (in == nullptr || size == 0) {
             return 0;
         }
+        bool changed = false;
         const uint8_t* bytes = reinterpret_cast<const uint8_t*>(in);
         lock_vty(*vty);
         for (size_t i = 0; i < size; ++i) {
-            enqueue_input(*vty, bytes[i]);
+            changed = enqueue_input(*vty, bytes[i]) || changed;
         }
         unlock_vty(*vty);
+        if (changed) {
+            wait_queue_wake(vty->waiters);
+        }
         return 0;
     }
     return -1;
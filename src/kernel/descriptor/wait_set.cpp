@@ -0,0 +1,424 @@
+#include "../descriptor.hpp"
+
+#include "../process.hpp"
+#include "../sync.hpp"
+#include "../vm.hpp"
+
+namespace descriptor {
+
+namespace descriptor_wait_set {
+
+constexpr size_t kMaxWaitSets = 16;
+constexpr size_t kMaxWaitSetMembers = 256;
+
+struct WaitSet;
+
+// A member stays linked on its target's wait queue for as long as it is in
+// the set. A signal moves it onto the ready list; readiness is re-queried
+// when the list is drained, so members that are still ready stay listed
+// (level-triggered) and stale ones drop off.
+struct Member {
+    WaitLink link;
+    WaitSet* set;
+    Member* ready_next;
+    uint32_t handle;
+    uint32_t events;
+    bool in_use;
+    bool ready;
+};
+
+struct WaitSet {
+    WaitQueue waiters;  // DescriptorWait registrations on the set itself
+    Table* table;
+    Member* ready_head;
+    Member* ready_tail;
+    sync::SpinLock lock;
+    bool in_use;
+    Member members[kMaxWaitSetMembers];
+};
+
+WaitSet g_wait_sets[kMaxWaitSets]{};
+sync::SpinLock g_wait_set_pool_lock;
+
+constexpr uint32_t kValidEvents =
+    descriptor_defs::kWaitRead | descriptor_defs::kWaitWrite;
+
+void push_ready_locked(WaitSet& set, Member& member) {
+    if (member.ready) {
+        return;
+    }
+    member.ready = true;
+    member.ready_next = nullptr;
+    if (set.ready_tail != nullptr) {
+        set.ready_tail->ready_next = &member;
+    } else {
+        set.ready_head = &member;
+    }
+    set.ready_tail = &member;
+}
+
+void remove_ready_locked(WaitSet& set, Member& member) {
+    if (!member.ready) {
+        return;
+    }
+    Member* prev = nullptr;
+    for (Member* cur = set.ready_head; cur != nullptr; cur = cur->ready_next) {
+        if (cur != &member) {
+            prev = cur;
+            continue;
+        }
+        if (prev != nullptr) {
+            prev->ready_next = cur->ready_next;
+        } else {
+            set.ready_head = cur->ready_next;
+        }
+        if (set.ready_tail == cur) {
+            set.ready_tail = prev;
+        }
+        break;
+    }
+    member.ready = false;
+    member.ready_next = nullptr;
+}
+
+void notify_member(WaitLink& link) {
+    auto* member = static_cast<Member*>(link.owner);
+    WaitSet& set = *member->set;
+    bool signal = false;
+    {
+        sync::IrqLockGuard guard(set.lock);
+        if (member->in_use && !member->ready) {
+            push_ready_locked(set, *member);
+            signal = true;
+        }
+    }
+    if (signal) {
+        wait_queue_wake(set.waiters);
+    }
+}
+
+Member* find_member(WaitSet& set, uint32_t handle) {
+    for (auto& member : set.members) {
+        if (member.in_use && member.handle == handle) {
+            return &member;
+        }
+    }
+    return nullptr;
+}
+
+void drop_member(WaitSet& set, Member& member) {
+    wait_queue_remove(member.link);
+    sync::IrqLockGuard guard(set.lock);
+    remove_ready_locked(set, member);
+    member.in_use = false;
+}
+
+// Walks the ready list, writing up to max_out ready members to out (when
+// non-null). Members that are no longer ready leave the list; members whose
+// handle was closed are returned in stale for the caller to drop once the
+// set lock is released, since unlinking takes their target's queue lock.
+size_t drain_ready(WaitSet& set,
+                   descriptor_defs::DescriptorWait* out,
+                   size_t max_out,
+                   Member** stale,
+                   size_t& stale_count) {
+    stale_count = 0;
+    size_t found = 0;
+    sync::IrqLockGuard guard(set.lock);
+    Member* cur = set.ready_head;
+    Member* kept_head = nullptr;
+    Member* kept_tail = nullptr;
+    set.ready_head = nullptr;
+    set.ready_tail = nullptr;
+
+    while (cur != nullptr && found < max_out) {
+        Member* next = cur->ready_next;
+        cur->ready_next = nullptr;
+        uint32_t revents = 0;
+        bool valid = descriptor::query_wait(*set.table,
+                                            cur->handle,
+                                            cur->events,
+                                            revents);
+        if (!valid && stale_count < kMaxWaitDescriptors) {
+            cur->ready = false;
+            stale[stale_count++] = cur;
+        } else if (!valid || revents == 0) {
+            cur->ready = false;
+        } else {
+            if (out != nullptr) {
+                out[found].handle = cur->handle;
+                out[found].events = cur->events;
+                out[found].revents = revents;
+                out[found].reserved = 0;
+            }
+            ++found;
+            if (kept_tail != nullptr) {
+                kept_tail->ready_next = cur;
+            } else {
+                kept_head = cur;
+            }
+            kept_tail = cur;
+        }
+        cur = next;
+    }
+
+    // Unexamined members go first next time; reported ones rotate behind.
+    if (cur != nullptr) {
+        set.ready_head = cur;
+        Member* tail = cur;
+        while (tail->ready_next != nullptr) {
+            tail = tail->ready_next;
+        }
+        tail->ready_next = kept_head;
+        set.ready_tail = (kept_tail != nullptr) ? kept_tail : tail;
+    } else {
+        set.ready_head = kept_head;
+        set.ready_tail = kept_tail;
+    }
+    return found;
+}
+
+void drop_stale(WaitSet& set, Member** stale, size_t stale_count) {
+    for (size_t i = 0; i < stale_count; ++i) {
+        drop_member(set, *stale[i]);
+    }
+}
+
+int control(WaitSet& set, const descriptor_defs::WaitSetControl& request) {
+    Table& table = *set.table;
+    if (request.op == descriptor_defs::kWaitSetRemove) {
+        Member* member = find_member(set, request.handle);
+        if (member == nullptr) {
+            return -1;
+        }
+        drop_member(set, *member);
+        return 0;
+    }
+
+    if (request.events == 0 || (request.events & ~kValidEvents) != 0) {
+        return -1;
+    }
+    uint16_t type = 0;
+    if (!get_type(table, request.handle, type) || type == kTypeWaitSet) {
+        return -1;
+    }
+    uint32_t probe = 0;
+    if (!descriptor::query_wait(table,
+                                request.handle,
+                                request.events,
+                                probe)) {
+        return -1;
+    }
+
+    Member* member = find_member(set, request.handle);
+    if (request.op == descriptor_defs::kWaitSetModify) {
+        if (member == nullptr) {
+            return -1;
+        }
+        sync::IrqLockGuard guard(set.lock);
+        member->events = request.events;
+        push_ready_locked(set, *member);
+    } else if (request.op == descriptor_defs::kWaitSetAdd) {
+        if (member != nullptr) {
+            return -1;
+        }
+        for (auto& candidate : set.members) {
+            if (!candidate.in_use) {
+                member = &candidate;
+                break;
+            }
+        }
+        if (member == nullptr) {
+            return -1;
+        }
+        member->set = &set;
+        member->handle = request.handle;
+        member->events = request.events;
+        member->ready = false;
+        member->ready_next = nullptr;
+        member->link.notify = notify_member;
+        member->link.owner = member;
+        WaitQueue* queue = wait_queue_for(table, request.handle);
+        if (queue != nullptr) {
+            wait_queue_add(*queue, member->link);
+        }
+        // Report the initial state on the next drain, like a fresh signal.
+        sync::IrqLockGuard guard(set.lock);
+        member->in_use = true;
+        push_ready_locked(set, *member);
+    } else {
+        return -1;
+    }
+    wait_queue_wake(set.waiters);
+    return 0;
+}
+
+int64_t wait_set_read(process::Process& proc,
+                      DescriptorEntry& entry,
+                      uint64_t user_address,
+                      uint64_t length,
+                      uint64_t offset) {
+    auto* set = static_cast<WaitSet*>(entry.object);
+    if (set == nullptr || offset != 0 || user_address == 0) {
+        return -1;
+    }
+    size_t max_out =
+        static_cast<size_t>(length / sizeof(descriptor_defs::DescriptorWait));
+    if (max_out == 0) {
+        return -1;
+    }
+    if (max_out > kMaxWaitDescriptors) {
+        max_out = kMaxWaitDescriptors;
+    }
+
+    descriptor_defs::DescriptorWait out[kMaxWaitDescriptors];
+    Member* stale[kMaxWaitDescriptors];
+    size_t stale_count = 0;
+    size_t found = drain_ready(*set, out, max_out, stale, stale_count);
+    drop_stale(*set, stale, stale_count);
+    if (found == 0) {
+        return 0;
+    }
+    size_t bytes = found * sizeof(out[0]);
+    if (!vm::copy_to_user(proc.cr3, user_address, out, bytes)) {
+        return -1;
+    }
+    return static_cast<int64_t>(bytes);
+}
+
+int64_t wait_set_write(process::Process&,
+                       DescriptorEntry&,
+                       uint64_t,
+                       uint64_t,
+                       uint64_t) {
+    return -1;
+}
+
+int wait_set_set_property(DescriptorEntry& entry,
+                          uint32_t property,
+                          const void* in,
+                          size_t size) {
+    auto* set = static_cast<WaitSet*>(entry.object);
+    if (set == nullptr || set->table == nullptr) {
+        return -1;
+    }
+    if (property !=
+            static_cast<uint32_t>(descriptor_defs::Property::WaitSetControl) ||
+        in == nullptr || size < sizeof(descriptor_defs::WaitSetControl)) {
+        return -1;
+    }
+    descriptor_defs::WaitSetControl request =
+        *reinterpret_cast<const descriptor_defs::WaitSetControl*>(in);
+    return control(*set, request);
+}
+
+void close_wait_set(DescriptorEntry& entry) {
+    auto* set = static_cast<WaitSet*>(entry.object);
+    if (set == nullptr) {
+        return;
+    }
+    for (auto& member : set->members) {
+        if (member.in_use) {
+            drop_member(*set, member);
+        }
+    }
+    sync::IrqLockGuard pool_guard(g_wait_set_pool_lock);
+    set->table = nullptr;
+    set->ready_head = nullptr;
+    set->ready_tail = nullptr;
+    set->in_use = false;
+}
+
+// Called before a descriptor of table is closed: its members leave every
+// set, so none stays linked on the old object's wait queue.
+void forget_handle(Table& table, uint32_t handle) {
+    for (auto& set : g_wait_sets) {
+        if (!set.in_use || set.table != &table) {
+            continue;
+        }
+        Member* member = find_member(set, handle);
+        if (member != nullptr) {
+            drop_member(set, *member);
+        }
+    }
+}
+
+const Ops kWaitSetOps{
+    .read = wait_set_read,
+    .write = wait_set_write,
+    .get_property = nullptr,
+    .set_property = wait_set_set_property,
+};
+
+bool query_wait(DescriptorEntry& entry, uint32_t events, uint32_t& revents) {
+    revents = 0;
+    auto* set = static_cast<WaitSet*>(entry.object);
+    if (set == nullptr || set->table == nullptr) {
+        return false;
+    }
+    if ((events & descriptor_defs::kWaitRead) == 0) {
+        return true;
+    }
+    Member* stale[kMaxWaitDescriptors];
+    size_t stale_count = 0;
+    size_t found = drain_ready(*set, nullptr, 1, stale, stale_count);
+    drop_stale(*set, stale, stale_count);
+    if (found != 0) {
+        revents |= descriptor_defs::kWaitRead;
+    }
+    return true;
+}
+
+WaitQueue* wait_queue(DescriptorEntry& entry) {
+    auto* set = static_cast<WaitSet*>(entry.object);
+    if (set == nullptr) {
+        return nullptr;
+    }
+    return &set->waiters;
+}
+
+bool open_wait_set(process::Process& proc,
+                   uint64_t,
+                   uint64_t,
+                   uint64_t,
+                   Allocation& alloc) {
+    WaitSet* set = nullptr;
+    {
+        sync::IrqLockGuard pool_guard(g_wait_set_pool_lock);
+        for (auto& candidate : g_wait_sets) {
+            if (!candidate.in_use) {
+                set = &candidate;
+                break;
+            }
+        }
+        if (set == nullptr) {
+            return false;
+        }
+        set->in_use = true;
+        set->table = &proc.descriptors;
+        set->ready_head = nullptr;
+        set->ready_tail = nullptr;
+    }
+
+    alloc.type = kTypeWaitSet;
+    alloc.flags = static_cast<uint64_t>(Flag::Readable) |
+                  static_cast<uint64_t>(Flag::EventSource);
+    alloc.extended_flags = 0;
+    alloc.has_extended_flags = false;
+    alloc.object = set;
+    alloc.subsystem_data = nullptr;
+    alloc.name = "wait_set";
+    alloc.ops = &kWaitSetOps;
+    alloc.close = close_wait_set;
+    return true;
+}
+
+}  // namespace descriptor_wait_set
+
+bool register_wait_set_descriptor() {
+    return register_type(kTypeWaitSet,
+                         descriptor_wait_set::open_wait_set,
+                         &descriptor_wait_set::kWaitSetOps);
+}
+
+}  // namespace descriptor
@@ -83,6 +83,7 @@ namespace error_screen {
                          const InterruptFrame* regs) {
     const char* main_message = primary ? primary : "";
     const char* info_message = secondary ? secondary : "";
+    log_enter_panic();
 
     if (kconsole != nullptr) {
         kconsole->set_color(kErrorForeground, kErrorBackground);
@@ -7,6 +7,7 @@
 #include "drivers/fs/block_cache.hpp"
 #include "fs/vfs.hpp"
 #include "lib/mem.hpp"
+#include "memory/physical_allocator.hpp"
 #include "capabilities.hpp"
 #include "path_util.hpp"
 #include "string_util.hpp"
@@ -14,20 +15,16 @@
 
 namespace {
 
-// Match the largest filesystem cluster so sequential writes reach the VFS as
-// full-cluster operations instead of repeated partial-cluster updates.
-constexpr size_t kFileIoBounceSize = 32768;
-alignas(4096) uint8_t g_file_io_bounce[kFileIoBounceSize];
-volatile int g_file_io_bounce_lock = 0;
+// Each pass hands the VFS at most this much of a user buffer; it matches the
+// largest filesystem cluster.
+constexpr size_t kFileIoChunkSize = 32768;
+constexpr size_t kFileIoMaxSegments = kFileIoChunkSize / 4096 + 1;
 
-void lock_file_io_bounce() {
-    while (__atomic_test_and_set(&g_file_io_bounce_lock, __ATOMIC_ACQUIRE)) {
-        asm volatile("pause");
-    }
-}
-
-void unlock_file_io_bounce() {
-    __atomic_clear(&g_file_io_bounce_lock, __ATOMIC_RELEASE);
+// Writes made of page-sized fragments are staged into one contiguous buffer
+// so they reach the VFS as full-cluster operations instead of repeated
+// partial-cluster updates.
+bool needs_write_staging(const vm::UserSegment* segments, size_t count) {
+    return count > 1 && segments[0].length < kFileIoChunkSize;
 }
 
 process::FileHandle* get_file_handle(process::Process& proc, uint32_t handle) {
@@ -318,6 +315,10 @@ bool sync_file(process::Process& proc, uint32_t handle) {
     if (entry == nullptr) {
         return false;
     }
+    // Filesystems that know their device only write back that device.
+    if (vfs::can_sync_file(entry->handle)) {
+        return vfs::sync_file(entry->handle);
+    }
     return fs::block_cache::flush_all();
 }
 
@@ -338,37 +339,52 @@ int64_t read_file(process::Process& proc, uint32_t handle, uint64_t user_addr,
         return -1;
     }
 
+    // Read straight into the caller's pages through the HHDM; there is no
+    // intermediate kernel copy.
     size_t total_read = 0;
     while (total_read < requested) {
         size_t chunk = requested - total_read;
-        if (chunk > kFileIoBounceSize) {
-            chunk = kFileIoBounceSize;
+        if (chunk > kFileIoChunkSize) {
+            chunk = kFileIoChunkSize;
         }
-
-        size_t out_size = 0;
-        lock_file_io_bounce();
-        if (!vfs::read_file(entry->handle,
-                            entry->position + total_read,
-                            g_file_io_bounce,
-                            chunk,
-                            out_size)) {
-            unlock_file_io_bounce();
-            return total_read == 0 ? -1 : static_cast<int64_t>(total_read);
-        }
-        if (out_size == 0) {
-            unlock_file_io_bounce();
+        vm::UserSegment segments[kFileIoMaxSegments];
+        size_t segment_count = 0;
+        size_t covered = vm::resolve_user_segments(proc.cr3,
+                                                   user_addr + total_read,
+                                                   chunk,
+                                                   true,
+                                                   segments,
+                                                   kFileIoMaxSegments,
+                                                   segment_count);
+        if (covered == 0) {
+            if (total_read == 0) {
+                return -1;
+            }
             break;
         }
-        if (!vm::copy_to_user(proc.cr3,
-                              user_addr + total_read,
-                              g_file_io_bounce,
-                              out_size)) {
-            unlock_file_io_bounce();
-            return total_read == 0 ? -1 : static_cast<int64_t>(total_read);
+
+        bool failed = false;
+        bool short_read = false;
+        for (size_t i = 0; i < segment_count; ++i) {
+            size_t out_size = 0;
+            if (!vfs::read_file(entry->handle,
+                                entry->position + total_read,
+                                segments[i].data,
+                                segments[i].length,
+                                out_size)) {
+                failed = true;
+                break;
+            }
+            total_read += out_size;
+            if (out_size < segments[i].length) {
+                short_read = true;
+                break;
+            }
+        }
+        if (failed && total_read == 0) {
+            return -1;
         }
-        unlock_file_io_bounce();
-        total_read += out_size;
-        if (out_size < chunk) {
+        if (failed || short_read || covered < chunk) {
             break;
         }
     }
@@ -398,41 +414,78 @@ int64_t write_file(process::Process& proc, uint32_t handle, uint64_t user_addr,
         return -1;
     }
 
+    // Large, physically contiguous runs go to the VFS straight from the
+    // caller's pages. Fragmented buffers are gathered into a staging buffer
+    // owned by this call, so concurrent writers never serialize on it.
+    uint8_t* staging = nullptr;
     size_t total_written = 0;
+    bool failed = false;
     while (total_written < requested) {
         size_t chunk = requested - total_written;
-        if (chunk > kFileIoBounceSize) {
-            chunk = kFileIoBounceSize;
+        if (chunk > kFileIoChunkSize) {
+            chunk = kFileIoChunkSize;
         }
-
-        lock_file_io_bounce();
-        if (!vm::copy_from_user(proc.cr3,
-                                g_file_io_bounce,
-                                user_addr + total_written,
-                                chunk)) {
-            unlock_file_io_bounce();
-            return total_written == 0 ? -1 : static_cast<int64_t>(total_written);
+        vm::UserSegment segments[kFileIoMaxSegments];
+        size_t segment_count = 0;
+        size_t covered = vm::resolve_user_segments(proc.cr3,
+                                                   user_addr + total_written,
+                                                   chunk,
+                                                   false,
+                                                   segments,
+                                                   kFileIoMaxSegments,
+                                                   segment_count);
+        if (covered == 0) {
+            failed = true;
+            break;
         }
 
-        size_t out_size = 0;
-        if (!vfs::write_file(entry->handle,
-                             entry->position + total_written,
-                             g_file_io_bounce,
-                             chunk,
-                             out_size)) {
-            unlock_file_io_bounce();
-            return total_written == 0 ? -1 : static_cast<int64_t>(total_written);
+        if (needs_write_staging(segments, segment_count)) {
+            if (staging == nullptr) {
+                staging = static_cast<uint8_t*>(
+                    memory::alloc_kernel_uninitialized(kFileIoChunkSize,
+                                                       4096));
+            }
+            if (staging != nullptr) {
+                size_t staged = 0;
+                for (size_t i = 0; i < segment_count; ++i) {
+                    memcpy(staging + staged,
+                           segments[i].data,
+                           segments[i].length);
+                    staged += segments[i].length;
+                }
+                segments[0].data = staging;
+                segments[0].length = staged;
+                segment_count = 1;
+            }
         }
-        if (out_size == 0) {
-            unlock_file_io_bounce();
-            break;
+
+        bool short_write = false;
+        for (size_t i = 0; i < segment_count; ++i) {
+            size_t out_size = 0;
+            if (!vfs::write_file(entry->handle,
+                                 entry->position + total_written,
+                                 segments[i].data,
+                                 segments[i].length,
+                                 out_size)) {
+                failed = true;
+                break;
+            }
+            total_written += out_size;
+            if (out_size < segments[i].length) {
+                short_write = true;
+                break;
+            }
         }
-        unlock_file_io_bounce();
-        total_written += out_size;
-        if (out_size < chunk) {
+        if (failed || short_write || covered < chunk) {
             break;
         }
     }
+    if (staging != nullptr) {
+        memory::free_kernel(staging);
+    }
+    if (failed && total_written == 0) {
+        return -1;
+    }
 
     entry->position += static_cast<uint64_t>(total_written);
     return static_cast<int64_t>(total_written);
@@ -0,0 +1,211 @@
+#include "image_cache.hpp"
+
+#include "drivers/log/logging.hpp"
+#include "fs/vfs.hpp"
+#include "kernel/memory/physical_allocator.hpp"
+#include "kernel/sync.hpp"
+#include "lib/mem.hpp"
+#include "string_util.hpp"
+
+namespace image_cache {
+
+namespace {
+
+constexpr size_t kMaxImages = 32;
+
+Image g_images[kMaxImages]{};
+uint64_t g_use_clock = 0;
+sync::SpinLock g_lock;
+
+bool matches(const Image& image,
+             const char* path,
+             uint64_t change_stamp,
+             size_t size) {
+    return image.in_use && image.cached && image.change_stamp == change_stamp &&
+           image.size == size && string_util::equals(image.path, path);
+}
+
+void destroy(Image& image) {
+    if (image.frames != nullptr) {
+        for (size_t i = 0; i < image.page_count; ++i) {
+            if (image.frames[i] != 0) {
+                memory::free_user_page(image.frames[i]);
+            }
+        }
+        memory::free_kernel(image.frames);
+    }
+    if (image.data != nullptr) {
+        memory::free_kernel(image.data);
+    }
+    memset(&image, 0, sizeof(image));
+}
+
+// Drops every cached copy of path that no longer matches the file. Copies
+// still mapped somewhere are freed by their last release().
+void forget_stale_locked(const char* path,
+                         uint64_t change_stamp,
+                         size_t size) {
+    for (auto& image : g_images) {
+        if (!image.in_use || !image.cached ||
+            !string_util::equals(image.path, path) ||
+            matches(image, path, change_stamp, size)) {
+            continue;
+        }
+        image.cached = false;
+        if (image.refs == 0) {
+            destroy(image);
+        }
+    }
+}
+
+Image* claim_slot_locked() {
+    Image* victim = nullptr;
+    for (auto& image : g_images) {
+        if (!image.in_use) {
+            return &image;
+        }
+        if (image.refs == 0 &&
+            (victim == nullptr || image.last_use < victim->last_use)) {
+            victim = &image;
+        }
+    }
+    if (victim != nullptr) {
+        destroy(*victim);
+    }
+    return victim;
+}
+
+bool read_whole_file(vfs::FileHandle& handle, uint8_t* buffer, size_t total) {
+    size_t offset = 0;
+    while (offset < total) {
+        size_t read = 0;
+        if (!vfs::read_file(handle,
+                            offset,
+                            buffer + offset,
+                            total - offset,
+                            read)) {
+            return false;
+        }
+        if (read == 0) {
+            break;
+        }
+        offset += read;
+    }
+    return offset == total;
+}
+
+}  // namespace
+
+bool reserve_pages(Image& image, size_t page_count) {
+    if (page_count == 0 ||
+        page_count > static_cast<size_t>(-1) / sizeof(uint64_t)) {
+        return false;
+    }
+    image.frames = static_cast<uint64_t*>(
+        memory::alloc_kernel(page_count * sizeof(uint64_t)));
+    if (image.frames == nullptr) {
+        return false;
+    }
+    memset(image.frames, 0, page_count * sizeof(uint64_t));
+    image.page_count = page_count;
+    return true;
+}
+
+Image* acquire(const char* path, size_t max_size, LayoutFn layout) {
+    if (path == nullptr || layout == nullptr ||
+        string_util::length(path) >= kMaxPathLength) {
+        return nullptr;
+    }
+    vfs::FileHandle handle{};
+    if (!vfs::open_file(path, handle)) {
+        return nullptr;
+    }
+    if (handle.size == 0 || handle.size > max_size) {
+        vfs::close_file(handle);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(handle.size);
+    uint64_t change_stamp = handle.change_stamp;
+
+    Image* hit = nullptr;
+    {
+        sync::IrqLockGuard guard(g_lock);
+        for (auto& image : g_images) {
+            if (matches(image, path, change_stamp, size)) {
+                ++image.refs;
+                image.last_use = ++g_use_clock;
+                hit = &image;
+                break;
+            }
+        }
+    }
+    if (hit != nullptr) {
+        vfs::close_file(handle);
+        return hit;
+    }
+
+    // Miss: read and lay out outside the lock, then publish.
+    Image fresh{};
+    string_util::copy(fresh.path, sizeof(fresh.path), path);
+    fresh.change_stamp = change_stamp;
+    fresh.size = size;
+    fresh.data = static_cast<uint8_t*>(memory::alloc_kernel(size, 16));
+    if (fresh.data == nullptr) {
+        vfs::close_file(handle);
+        return nullptr;
+    }
+    bool read_ok = read_whole_file(handle, fresh.data, size);
+    vfs::close_file(handle);
+    if (!read_ok || !layout(fresh)) {
+        destroy(fresh);
+        return nullptr;
+    }
+
+    sync::IrqLockGuard guard(g_lock);
+    forget_stale_locked(path, change_stamp, size);
+    for (auto& image : g_images) {
+        if (matches(image, path, change_stamp, size)) {
+            // Another exec published the same file first.
+            destroy(fresh);
+            ++image.refs;
+            image.last_use = ++g_use_clock;
+            return &image;
+        }
+    }
+    Image* slot = claim_slot_locked();
+    if (slot == nullptr) {
+        log_message(LogLevel::Warn,
+                    "ImageCache: all %zu slots mapped, cannot load %s",
+                    kMaxImages,
+                    path);
+        destroy(fresh);
+        return nullptr;
+    }
+    *slot = fresh;
+    slot->in_use = true;
+    slot->cached = true;
+    slot->refs = 1;
+    slot->last_use = ++g_use_clock;
+    log_message(LogLevel::Debug,
+                "ImageCache: cached %s (%zu bytes, %zu pages)",
+                path,
+                size,
+                slot->page_count);
+    return slot;
+}
+
+void release(Image* image) {
+    if (image == nullptr) {
+        return;
+    }
+    sync::IrqLockGuard guard(g_lock);
+    if (image->refs == 0) {
+        return;
+    }
+    --image->refs;
+    if (image->refs == 0 && !image->cached) {
+        destroy(*image);
+    }
+}
+
+}  // namespace image_cache
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace image_cache {
+
+constexpr size_t kMaxPathLength = 128;
+
+// A file read once and kept in memory together with the physical pages its
+// loadable segments occupy, so every process that maps it can share them.
+struct Image {
+    char path[kMaxPathLength];
+    uint64_t change_stamp;
+    uint8_t* data;
+    size_t size;
+    // One frame per page of the load span, 0 where the page holds no file
+    // data. Filled by the layout callback passed to acquire().
+    uint64_t* frames;
+    size_t page_count;
+    uint32_t refs;
+    uint64_t last_use;
+    bool in_use;
+    bool cached;  // still returned by lookups of path
+};
+
+// Lays out a freshly read image: calls reserve_pages() and fills frames.
+// Runs without the cache lock held.
+using LayoutFn = bool (*)(Image& image);
+
+// Returns path's image with a reference held, reading and laying it out
+// again when it is not cached or the file changed since. nullptr when the
+// file cannot be read, is empty or larger than max_size, or layout fails.
+Image* acquire(const char* path, size_t max_size, LayoutFn layout);
+void release(Image* image);
+
+// Allocates image.frames with page_count zero entries.
+bool reserve_pages(Image& image, size_t page_count);
+
+}  // namespace image_cache
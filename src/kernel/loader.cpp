@@ -3,8 +3,11 @@
 #include "drivers/log/logging.hpp"
 #include "lib/mem.hpp"
 #include "arch/x86_64/memory/paging.hpp"
+#include "arch/x86_64/syscall_table.hpp"
 #include "fs/vfs.hpp"
 #include "kernel/memory/physical_allocator.hpp"
+#include "kernel/sync.hpp"
+#include "image_cache.hpp"
 #include "vm.hpp"
 
 namespace {
@@ -16,6 +19,9 @@ constexpr size_t kMaxNeeded = 8;
 constexpr size_t kMaxSharedObjectImageSize = 2 * 1024 * 1024;
 constexpr size_t kMaxSharedObjectName = 64;
 constexpr size_t kMaxSharedObjectPath = 128;
+constexpr size_t kResolutionCacheEntries = 512;
+// Longest symbol name a lazily bound PLT slot may reference.
+constexpr size_t kMaxLazySymbolName = 512;
 
 enum class ElfIdent : size_t {
     Class = 4,
@@ -98,6 +104,15 @@ enum : int64_t {
     DT_SYMENT = 11,
     DT_PLTREL = 20,
     DT_JMPREL = 23,
+    DT_BIND_NOW = 24,
+    DT_FLAGS = 30,
+    DT_GNU_HASH = 0x6ffffef5,
+    DT_FLAGS_1 = 0x6ffffffb,
+};
+
+enum : uint64_t {
+    DF_BIND_NOW = 0x8,
+    DF_1_NOW = 0x1,
 };
 
 enum : uint32_t {
@@ -139,11 +154,37 @@ struct DynamicInfo {
     uint64_t symtab_addr;
     uint64_t syment;
     size_t dynsym_count;
+    uint64_t hash_addr;
+    uint64_t gnu_hash_addr;
+    uint64_t pltgot_addr;
+    uint64_t pltrel;
+    bool bind_now;
+};
+
+enum class HashKind : uint8_t {
+    None,
+    Elf,
+    Gnu,
+};
+
+// Decoded DT_GNU_HASH or DT_HASH header. The bloom fields are GNU only.
+struct SymbolHashTable {
+    HashKind kind;
+    uint32_t bucket_count;
+    uint32_t symoffset;
+    uint32_t bloom_words;
+    uint32_t bloom_shift;
+    uint64_t bloom_addr;
+    uint64_t buckets_addr;
+    uint64_t chains_addr;
 };
 
 struct LoadedObject {
+    // Image the object was mapped from. Null once exec has returned: lazy
+    // binding then reads the tables from the mapped object through cr3.
     const uint8_t* data;
     size_t size;
+    uint64_t cr3;
     char name[kMaxSharedObjectName];
     vm::Region region;
     uint64_t load_bias;
@@ -151,9 +192,52 @@ struct LoadedObject {
     uint64_t max_vaddr;
     uint64_t entry;
     DynamicInfo dynamic;
+    SymbolHashTable hash;
     bool main_object;
 };
 
+struct SymbolName {
+    const char* text;
+    size_t length;
+    uint32_t gnu_hash;
+    uint32_t elf_hash;
+};
+
+struct ResolvedSymbol {
+    const char* name;
+    size_t length;
+    uint32_t hash;
+    bool in_use;
+    bool found;
+    uint64_t value;
+};
+
+// Per-exec memo of symbol lookups. Names point into the images being
+// loaded, so it must not outlive load_dynamic_elf_binary().
+struct ResolutionCache {
+    ResolvedSymbol* entries;
+    size_t used;
+    size_t hits;
+    size_t lookups;
+};
+
+sync::SpinLock g_trampoline_lock;
+uint64_t g_trampoline_frame = 0;
+
+}  // namespace
+
+namespace loader {
+
+// Everything bind_lazy_slot() needs after exec has dropped the images.
+struct LazyBindings {
+    LoadedObject objects[kMaxSharedObjects];
+    size_t object_count;
+};
+
+}  // namespace loader
+
+namespace {
+
 constexpr uint64_t align_up(uint64_t value, uint64_t alignment) {
     return (value + alignment - 1) & ~(alignment - 1);
 }
@@ -283,58 +367,6 @@ const uint8_t* image_ptr_at_vaddr(const loader::ProgramImage& image,
     return nullptr;
 }
 
-bool read_shared_object_image(const char* path,
-                              loader::ProgramImage& out_image,
-                              uint8_t*& out_buffer) {
-    out_image = {};
-    out_buffer = nullptr;
-    if (path == nullptr) {
-        return false;
-    }
-    vfs::FileHandle handle{};
-    if (!vfs::open_file(path, handle)) {
-        return false;
-    }
-    if (handle.size == 0 || handle.size > kMaxSharedObjectImageSize) {
-        vfs::close_file(handle);
-        return false;
-    }
-
-    size_t total = static_cast<size_t>(handle.size);
-    auto* buffer = static_cast<uint8_t*>(memory::alloc_kernel(total, 16));
-    if (buffer == nullptr) {
-        vfs::close_file(handle);
-        return false;
-    }
-    size_t offset = 0;
-    while (offset < total) {
-        size_t read = 0;
-        if (!vfs::read_file(handle,
-                            offset,
-                            buffer + offset,
-                            total - offset,
-                            read)) {
-            vfs::close_file(handle);
-            memory::free_kernel(buffer);
-            return false;
-        }
-        if (read == 0) {
-            break;
-        }
-        offset += read;
-    }
-    vfs::close_file(handle);
-    if (offset != total) {
-        memory::free_kernel(buffer);
-        return false;
-    }
-    out_buffer = buffer;
-    out_image.data = buffer;
-    out_image.size = total;
-    out_image.entry_offset = 0;
-    return true;
-}
-
 bool looks_like_elf(const uint8_t* data, size_t size) {
     if (data == nullptr || size < sizeof(Elf64Ehdr)) {
         return false;
@@ -475,6 +507,31 @@ bool parse_dynamic_info(const loader::ProgramImage& image,
             case DT_SYMENT:
                 info.syment = dyn.val;
                 break;
+            case DT_HASH:
+                info.hash_addr = dyn.val;
+                break;
+            case DT_GNU_HASH:
+                info.gnu_hash_addr = dyn.val;
+                break;
+            case DT_PLTGOT:
+                info.pltgot_addr = dyn.val;
+                break;
+            case DT_PLTREL:
+                info.pltrel = dyn.val;
+                break;
+            case DT_BIND_NOW:
+                info.bind_now = true;
+                break;
+            case DT_FLAGS:
+                if ((dyn.val & DF_BIND_NOW) != 0) {
+                    info.bind_now = true;
+                }
+                break;
+            case DT_FLAGS_1:
+                if ((dyn.val & DF_1_NOW) != 0) {
+                    info.bind_now = true;
+                }
+                break;
             default:
                 break;
         }
@@ -579,85 +636,421 @@ bool needed_name_at(const LoadedObject& object,
     return true;
 }
 
-bool symbol_name_at(const LoadedObject& object,
-                    const Elf64Sym& sym,
-                    const char*& out_name) {
-    out_name = nullptr;
-    size_t ignored_length = 0;
-    out_name = dynamic_string_at(object, sym.name, ignored_length);
-    return out_name != nullptr;
+// Returns length bytes at an object's link-time vaddr. While loading they
+// come straight from the image; lazy binding runs after exec has dropped
+// the image and copies them out of the mapped object into scratch.
+const uint8_t* object_bytes(const LoadedObject& object,
+                            uint64_t vaddr,
+                            size_t length,
+                            void* scratch) {
+    if (object.data != nullptr) {
+        loader::ProgramImage image{object.data, object.size, 0};
+        const auto* header = reinterpret_cast<const Elf64Ehdr*>(object.data);
+        return image_ptr_at_vaddr(image, *header, vaddr, length);
+    }
+    if (vaddr < object.min_vaddr || vaddr > object.max_vaddr ||
+        length > object.max_vaddr - vaddr ||
+        !vm::copy_from_user(object.cr3,
+                            scratch,
+                            object.load_bias + vaddr,
+                            length)) {
+        return nullptr;
+    }
+    return static_cast<const uint8_t*>(scratch);
+}
+
+template <typename T>
+bool read_object(const LoadedObject& object, uint64_t vaddr, T& out) {
+    const uint8_t* ptr = object_bytes(object, vaddr, sizeof(T), &out);
+    if (ptr == nullptr) {
+        return false;
+    }
+    if (ptr != reinterpret_cast<const uint8_t*>(&out)) {
+        memcpy(&out, ptr, sizeof(T));
+    }
+    return true;
+}
+
+uint32_t gnu_hash(const char* name, size_t length) {
+    uint32_t hash = 5381;
+    for (size_t i = 0; i < length; ++i) {
+        hash = hash * 33 + static_cast<uint8_t>(name[i]);
+    }
+    return hash;
 }
 
-const Elf64Sym* dynsym_at(const LoadedObject& object, size_t index) {
+uint32_t elf_hash(const char* name, size_t length) {
+    uint32_t hash = 0;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash << 4) + static_cast<uint8_t>(name[i]);
+        uint32_t high = hash & 0xF0000000u;
+        if (high != 0) {
+            hash ^= high >> 24;
+        }
+        hash &= ~high;
+    }
+    return hash;
+}
+
+bool dynsym_at(const LoadedObject& object, size_t index, Elf64Sym& out) {
     if (object.dynamic.symtab_addr == 0 ||
         object.dynamic.syment < sizeof(Elf64Sym) ||
         index >= object.dynamic.dynsym_count) {
-        return nullptr;
+        return false;
     }
-    loader::ProgramImage image{object.data, object.size, 0};
-    const auto* header = reinterpret_cast<const Elf64Ehdr*>(object.data);
-    const uint8_t* ptr =
-        image_ptr_at_vaddr(image,
-                           *header,
-                           object.dynamic.symtab_addr +
-                               index * object.dynamic.syment,
-                           sizeof(Elf64Sym));
-    return reinterpret_cast<const Elf64Sym*>(ptr);
+    return read_object(object,
+                       object.dynamic.symtab_addr +
+                           index * object.dynamic.syment,
+                       out);
 }
 
-bool resolve_symbol(const char* name,
-                    const LoadedObject* objects,
-                    size_t object_count,
-                    uint64_t& out_value) {
-    if (name == nullptr || name[0] == '\0') {
+// Fills out with the name of sym. Lazy binding copies it into scratch.
+bool symbol_name_at(const LoadedObject& object,
+                    const Elf64Sym& sym,
+                    char* scratch,
+                    size_t scratch_size,
+                    SymbolName& out) {
+    memset(&out, 0, sizeof(out));
+    if (object.data != nullptr) {
+        out.text = dynamic_string_at(object, sym.name, out.length);
+    } else if (object.dynamic.strtab_addr != 0 &&
+               sym.name < object.dynamic.strsz &&
+               vm::copy_user_string(
+                   object.cr3,
+                   reinterpret_cast<const char*>(object.load_bias +
+                                                 object.dynamic.strtab_addr +
+                                                 sym.name),
+                   scratch,
+                   scratch_size)) {
+        out.text = scratch;
+        out.length = cstring_length(scratch);
+    }
+    if (out.text == nullptr) {
         return false;
     }
-    for (size_t obj_index = 0; obj_index < object_count; ++obj_index) {
-        const LoadedObject& object = objects[obj_index];
-        for (size_t sym_index = 0;
-             sym_index < object.dynamic.dynsym_count;
-             ++sym_index) {
-            const Elf64Sym* sym = dynsym_at(object, sym_index);
-            if (sym == nullptr || sym->shndx == SHN_UNDEF ||
-                sym->name == 0) {
-                continue;
-            }
-            uint32_t bind = elf_symbol_bind(*sym);
-            if (bind != STB_GLOBAL && bind != STB_WEAK) {
-                continue;
+    out.gnu_hash = gnu_hash(out.text, out.length);
+    out.elf_hash = elf_hash(out.text, out.length);
+    return true;
+}
+
+bool symbol_defines(const LoadedObject& object,
+                    const Elf64Sym& sym,
+                    const SymbolName& name) {
+    if (sym.shndx == SHN_UNDEF || sym.name == 0) {
+        return false;
+    }
+    uint32_t bind = elf_symbol_bind(sym);
+    if (bind != STB_GLOBAL && bind != STB_WEAK) {
+        return false;
+    }
+    if (sym.name >= object.dynamic.strsz ||
+        name.length >= object.dynamic.strsz - sym.name) {
+        return false;
+    }
+    char scratch[kMaxLazySymbolName];
+    if (object.data == nullptr && name.length + 1 > sizeof(scratch)) {
+        return false;
+    }
+    const uint8_t* candidate = object_bytes(object,
+                                            object.dynamic.strtab_addr +
+                                                sym.name,
+                                            name.length + 1,
+                                            scratch);
+    return candidate != nullptr && candidate[name.length] == '\0' &&
+           memcmp(candidate, name.text, name.length) == 0;
+}
+
+// Decodes the object's hash table and takes the symbol count from it; the
+// strtab - symtab estimate only stays for objects that have neither table.
+void load_symbol_hash_table(LoadedObject& object) {
+    SymbolHashTable& table = object.hash;
+    memset(&table, 0, sizeof(table));
+    const DynamicInfo& info = object.dynamic;
+    if (info.gnu_hash_addr != 0) {
+        uint32_t header[4] = {};
+        if (read_object(object, info.gnu_hash_addr, header) &&
+            header[0] != 0 && header[2] != 0 &&
+            (header[2] & (header[2] - 1)) == 0 && header[3] < 64) {
+            table.kind = HashKind::Gnu;
+            table.bucket_count = header[0];
+            table.symoffset = header[1];
+            table.bloom_words = header[2];
+            table.bloom_shift = header[3];
+            table.bloom_addr = info.gnu_hash_addr + sizeof(header);
+            table.buckets_addr =
+                table.bloom_addr +
+                static_cast<uint64_t>(table.bloom_words) * sizeof(uint64_t);
+            table.chains_addr =
+                table.buckets_addr +
+                static_cast<uint64_t>(table.bucket_count) * sizeof(uint32_t);
+
+            // The last symbol ends the chain of the highest bucket.
+            uint32_t last = 0;
+            for (uint32_t i = 0; i < table.bucket_count; ++i) {
+                uint32_t index = 0;
+                if (!read_object(object,
+                                 table.buckets_addr + i * sizeof(uint32_t),
+                                 index)) {
+                    table.kind = HashKind::None;
+                    break;
+                }
+                if (index > last) {
+                    last = index;
+                }
             }
-            const char* candidate = nullptr;
-            if (!symbol_name_at(object, *sym, candidate)) {
-                continue;
+            if (table.kind == HashKind::Gnu) {
+                if (last < table.symoffset) {
+                    object.dynamic.dynsym_count = table.symoffset;
+                    return;
+                }
+                for (;;) {
+                    uint32_t chain = 0;
+                    if (!read_object(object,
+                                     table.chains_addr +
+                                         static_cast<uint64_t>(
+                                             last - table.symoffset) *
+                                             sizeof(uint32_t),
+                                     chain)) {
+                        table.kind = HashKind::None;
+                        break;
+                    }
+                    if ((chain & 1) != 0) {
+                        object.dynamic.dynsym_count =
+                            static_cast<size_t>(last) + 1;
+                        return;
+                    }
+                    ++last;
+                }
             }
-            if (!cstring_equal(name, candidate)) {
-                continue;
+        }
+    }
+    if (info.hash_addr != 0) {
+        uint32_t header[2] = {};
+        if (read_object(object, info.hash_addr, header) && header[0] != 0) {
+            table.kind = HashKind::Elf;
+            table.bucket_count = header[0];
+            table.buckets_addr = info.hash_addr + sizeof(header);
+            table.chains_addr =
+                table.buckets_addr +
+                static_cast<uint64_t>(table.bucket_count) * sizeof(uint32_t);
+            object.dynamic.dynsym_count = header[1];
+            return;
+        }
+    }
+    memset(&table, 0, sizeof(table));
+}
+
+bool lookup_gnu_hash(const LoadedObject& object,
+                     const SymbolName& name,
+                     uint64_t& out_value) {
+    const SymbolHashTable& table = object.hash;
+    uint32_t hash = name.gnu_hash;
+    uint64_t word = 0;
+    if (!read_object(object,
+                     table.bloom_addr +
+                         static_cast<uint64_t>((hash / 64) &
+                                               (table.bloom_words - 1)) *
+                             sizeof(uint64_t),
+                     word)) {
+        return false;
+    }
+    uint64_t mask = (1ull << (hash % 64)) |
+                    (1ull << ((hash >> table.bloom_shift) % 64));
+    if ((word & mask) != mask) {
+        return false;
+    }
+
+    uint32_t index = 0;
+    if (!read_object(object,
+                     table.buckets_addr +
+                         static_cast<uint64_t>(hash % table.bucket_count) *
+                             sizeof(uint32_t),
+                     index) ||
+        index < table.symoffset) {
+        return false;
+    }
+    for (; index < object.dynamic.dynsym_count; ++index) {
+        uint32_t chain = 0;
+        if (!read_object(object,
+                         table.chains_addr +
+                             static_cast<uint64_t>(index - table.symoffset) *
+                                 sizeof(uint32_t),
+                         chain)) {
+            return false;
+        }
+        if ((chain | 1) == (hash | 1)) {
+            Elf64Sym sym{};
+            if (dynsym_at(object, index, sym) &&
+                symbol_defines(object, sym, name)) {
+                out_value = object.load_bias + sym.value;
+                return true;
             }
-            out_value = object.load_bias + sym->value;
+        }
+        if ((chain & 1) != 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+bool lookup_elf_hash(const LoadedObject& object,
+                     const SymbolName& name,
+                     uint64_t& out_value) {
+    const SymbolHashTable& table = object.hash;
+    uint32_t index = 0;
+    if (!read_object(object,
+                     table.buckets_addr +
+                         static_cast<uint64_t>(name.elf_hash %
+                                               table.bucket_count) *
+                             sizeof(uint32_t),
+                     index)) {
+        return false;
+    }
+    // Bounded by the chain length so a corrupt table cannot loop forever.
+    for (size_t steps = 0;
+         index != 0 && steps < object.dynamic.dynsym_count;
+         ++steps) {
+        Elf64Sym sym{};
+        if (dynsym_at(object, index, sym) &&
+            symbol_defines(object, sym, name)) {
+            out_value = object.load_bias + sym.value;
             return true;
         }
+        if (!read_object(object,
+                         table.chains_addr +
+                             static_cast<uint64_t>(index) * sizeof(uint32_t),
+                         index)) {
+            return false;
+        }
     }
     return false;
 }
 
-bool map_elf_object(const loader::ProgramImage& image,
-                    process::Process& proc,
-                    const char* name,
-                    bool main_object,
-                    LoadedObject& object) {
-    if (image.data == nullptr || image.size < sizeof(Elf64Ehdr)) {
+bool lookup_in_object(const LoadedObject& object,
+                      const SymbolName& name,
+                      uint64_t& out_value) {
+    switch (object.hash.kind) {
+        case HashKind::Gnu:
+            return lookup_gnu_hash(object, name, out_value);
+        case HashKind::Elf:
+            return lookup_elf_hash(object, name, out_value);
+        case HashKind::None:
+            break;
+    }
+    for (size_t sym_index = 0;
+         sym_index < object.dynamic.dynsym_count;
+         ++sym_index) {
+        Elf64Sym sym{};
+        if (dynsym_at(object, sym_index, sym) &&
+            symbol_defines(object, sym, name)) {
+            out_value = object.load_bias + sym.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+ResolvedSymbol* cache_slot(ResolutionCache* cache, const SymbolName& name) {
+    if (cache == nullptr || cache->entries == nullptr) {
+        return nullptr;
+    }
+    size_t slot = name.gnu_hash & (kResolutionCacheEntries - 1);
+    for (size_t probe = 0; probe < kResolutionCacheEntries; ++probe) {
+        ResolvedSymbol& entry = cache->entries[slot];
+        if (!entry.in_use ||
+            (entry.hash == name.gnu_hash && entry.length == name.length &&
+             memcmp(entry.name, name.text, name.length) == 0)) {
+            return &entry;
+        }
+        slot = (slot + 1) & (kResolutionCacheEntries - 1);
+    }
+    return nullptr;
+}
+
+bool resolve_symbol(const SymbolName& name,
+                    const LoadedObject* objects,
+                    size_t object_count,
+                    ResolutionCache* cache,
+                    uint64_t& out_value) {
+    if (name.length == 0) {
+        return false;
+    }
+    ResolvedSymbol* cached = cache_slot(cache, name);
+    if (cached != nullptr) {
+        ++cache->lookups;
+        if (cached->in_use) {
+            ++cache->hits;
+            out_value = cached->value;
+            return cached->found;
+        }
+    }
+
+    bool found = false;
+    for (size_t obj_index = 0; obj_index < object_count; ++obj_index) {
+        if (lookup_in_object(objects[obj_index], name, out_value)) {
+            found = true;
+            break;
+        }
+    }
+
+    // Leave a few slots free so probing always reaches an empty one.
+    if (cached != nullptr &&
+        cache->used + 1 < kResolutionCacheEntries) {
+        cached->name = name.text;
+        cached->length = name.length;
+        cached->hash = name.gnu_hash;
+        cached->in_use = true;
+        cached->found = found;
+        cached->value = found ? out_value : 0;
+        ++cache->used;
+    }
+    return found;
+}
+
+// Resolves the symbol a relocation of object refers to. Undefined weak
+// symbols resolve to 0.
+bool resolve_relocation_symbol(const LoadedObject& object,
+                               uint32_t sym_index,
+                               const LoadedObject* objects,
+                               size_t object_count,
+                               ResolutionCache* cache,
+                               uint64_t& out_value) {
+    Elf64Sym sym{};
+    if (!dynsym_at(object, sym_index, sym)) {
         log_message(LogLevel::Error,
-                    "Loader: ELF image too small for object");
+                    "Loader: relocation references missing symbol");
         return false;
     }
-    const auto* header = reinterpret_cast<const Elf64Ehdr*>(image.data);
-    if (!validate_elf_header(*header)) {
+    char scratch[kMaxLazySymbolName];
+    SymbolName name{};
+    if (!symbol_name_at(object, sym, scratch, sizeof(scratch), name)) {
+        log_message(LogLevel::Error,
+                    "Loader: relocation symbol has no name");
         return false;
     }
+    if (resolve_symbol(name, objects, object_count, cache, out_value)) {
+        return true;
+    }
+    if (elf_symbol_bind(sym) == STB_WEAK) {
+        out_value = 0;
+        return true;
+    }
+    log_message(LogLevel::Error,
+                "Loader: unresolved symbol %s",
+                name.text);
+    return false;
+}
 
+// Validates the PT_LOAD segments of an object image and returns the virtual
+// range they cover.
+bool object_load_span(const loader::ProgramImage& image,
+                      const Elf64Ehdr& header,
+                      uint64_t& out_min_vaddr,
+                      uint64_t& out_max_vaddr,
+                      const Elf64Phdr*& out_dynamic_phdr) {
     uint64_t ph_table_end =
-        header->phoff + static_cast<uint64_t>(header->phnum) * header->phentsize;
-    if (ph_table_end > image.size || ph_table_end < header->phoff) {
+        header.phoff + static_cast<uint64_t>(header.phnum) * header.phentsize;
+    if (ph_table_end > image.size || ph_table_end < header.phoff) {
         log_message(LogLevel::Error,
                     "Loader: ELF program headers exceed object image");
         return false;
@@ -666,15 +1059,15 @@ bool map_elf_object(const loader::ProgramImage& image,
     uint64_t min_vaddr = UINT64_MAX;
     uint64_t max_vaddr = 0;
     size_t loadable_segments = 0;
-    const Elf64Phdr* dynamic_phdr = nullptr;
+    out_dynamic_phdr = nullptr;
 
-    for (uint16_t i = 0; i < header->phnum; ++i) {
-        const Elf64Phdr* ph = program_header_at(image, *header, i);
+    for (uint16_t i = 0; i < header.phnum; ++i) {
+        const Elf64Phdr* ph = program_header_at(image, header, i);
         if (ph == nullptr) {
             return false;
         }
         if (ph->type == PT_DYNAMIC) {
-            dynamic_phdr = ph;
+            out_dynamic_phdr = ph;
         }
         if (ph->type != PT_LOAD) {
             continue;
@@ -716,6 +1109,132 @@ bool map_elf_object(const loader::ProgramImage& image,
                     "Loader: ELF object has no loadable segments");
         return false;
     }
+
+    out_min_vaddr = min_vaddr;
+    out_max_vaddr = max_vaddr;
+    return true;
+}
+
+// Copies the file-backed bytes of every PT_LOAD segment into frames laid out
+// page by page from the first loadable page. Runs once per cached object;
+// pages past the end of the file data get no frame.
+bool layout_shared_object(image_cache::Image& cached) {
+    loader::ProgramImage image{cached.data, cached.size, 0};
+    if (!looks_like_elf(image.data, image.size)) {
+        log_message(LogLevel::Error,
+                    "Loader: shared object is not ELF: %s",
+                    cached.path);
+        return false;
+    }
+    const auto* header = reinterpret_cast<const Elf64Ehdr*>(image.data);
+    uint64_t min_vaddr = 0;
+    uint64_t max_vaddr = 0;
+    const Elf64Phdr* dynamic_phdr = nullptr;
+    if (!validate_elf_header(*header) ||
+        !object_load_span(image, *header, min_vaddr, max_vaddr, dynamic_phdr)) {
+        return false;
+    }
+    uint64_t aligned_min = align_down(min_vaddr, kPageSize);
+    uint64_t aligned_max = align_up(max_vaddr, kPageSize);
+    if (!image_cache::reserve_pages(
+            cached,
+            static_cast<size_t>((aligned_max - aligned_min) / kPageSize))) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < header->phnum; ++i) {
+        const Elf64Phdr* ph = program_header_at(image, *header, i);
+        if (ph == nullptr || ph->type != PT_LOAD || ph->filesz == 0) {
+            continue;
+        }
+        uint64_t start = ph->vaddr;
+        uint64_t end = start + ph->filesz;
+        for (uint64_t page = align_down(start, kPageSize); page < end;
+             page += kPageSize) {
+            uint64_t& frame =
+                cached.frames[static_cast<size_t>((page - aligned_min) /
+                                                  kPageSize)];
+            if (frame == 0) {
+                frame = memory::alloc_user_page();
+                if (frame == 0) {
+                    return false;
+                }
+                memset(paging_phys_to_virt(frame), 0, kPageSize);
+            }
+            uint64_t copy_start = page > start ? page : start;
+            uint64_t copy_end = page + kPageSize < end ? page + kPageSize : end;
+            auto* dest = static_cast<uint8_t*>(paging_phys_to_virt(frame));
+            memcpy(dest + (copy_start - page),
+                   image.data + ph->offset + (copy_start - start),
+                   static_cast<size_t>(copy_end - copy_start));
+        }
+    }
+    return true;
+}
+
+// Maps a cached object's frames copy-on-write and backs the pages without
+// file data, the tail of .bss, with fresh zeroed memory.
+vm::Region map_cached_object(const image_cache::Image& cached,
+                             process::Process& proc,
+                             uint64_t span) {
+    size_t pages = static_cast<size_t>(span / kPageSize);
+    if (pages != cached.page_count) {
+        return vm::Region{0, 0};
+    }
+    vm::Region region =
+        vm::reserve_user_region(proc.cr3, static_cast<size_t>(span));
+    if (region.base == 0) {
+        return region;
+    }
+    size_t i = 0;
+    while (i < pages) {
+        uint64_t virt = region.base + static_cast<uint64_t>(i) * kPageSize;
+        if (cached.frames[i] != 0) {
+            if (!vm::map_copy_on_write(proc.cr3, virt, cached.frames[i])) {
+                return vm::Region{0, 0};
+            }
+            ++i;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < pages && cached.frames[i + run] == 0) {
+            ++run;
+        }
+        if (vm::map_at(proc.cr3,
+                       virt,
+                       run * kPageSize,
+                       vm::kMapWrite | vm::kMapPopulate) != virt) {
+            return vm::Region{0, 0};
+        }
+        i += run;
+    }
+    return region;
+}
+
+// Maps an object into proc. Objects from the image cache share its frames;
+// others get private copies of their segments.
+bool map_elf_object(const loader::ProgramImage& image,
+                    process::Process& proc,
+                    const char* name,
+                    bool main_object,
+                    const image_cache::Image* cached,
+                    LoadedObject& object) {
+    if (image.data == nullptr || image.size < sizeof(Elf64Ehdr)) {
+        log_message(LogLevel::Error,
+                    "Loader: ELF image too small for object");
+        return false;
+    }
+    const auto* header = reinterpret_cast<const Elf64Ehdr*>(image.data);
+    if (!validate_elf_header(*header)) {
+        return false;
+    }
+
+    uint64_t min_vaddr = 0;
+    uint64_t max_vaddr = 0;
+    const Elf64Phdr* dynamic_phdr = nullptr;
+    if (!object_load_span(image, *header, min_vaddr, max_vaddr, dynamic_phdr)) {
+        return false;
+    }
     if (main_object &&
         (header->entry < min_vaddr || header->entry >= max_vaddr)) {
         log_message(LogLevel::Error,
@@ -728,7 +1247,10 @@ bool map_elf_object(const loader::ProgramImage& image,
     uint64_t aligned_max = align_up(max_vaddr, kPageSize);
     uint64_t aligned_span = aligned_max - aligned_min;
     vm::Region region =
-        vm::allocate_user_region(proc.cr3, static_cast<size_t>(aligned_span));
+        cached != nullptr
+            ? map_cached_object(*cached, proc, aligned_span)
+            : vm::allocate_user_region(proc.cr3,
+                                       static_cast<size_t>(aligned_span));
     if (region.base == 0) {
         log_message(LogLevel::Error,
                     "Loader: failed to allocate ELF object region");
@@ -736,7 +1258,7 @@ bool map_elf_object(const loader::ProgramImage& image,
     }
 
     uint64_t load_bias = region.base - aligned_min;
-    for (uint16_t i = 0; i < header->phnum; ++i) {
+    for (uint16_t i = 0; cached == nullptr && i < header->phnum; ++i) {
         const Elf64Phdr* ph = program_header_at(image, *header, i);
         if (ph == nullptr || ph->type != PT_LOAD || ph->memsz == 0) {
             continue;
@@ -780,6 +1302,7 @@ bool map_elf_object(const loader::ProgramImage& image,
     if (!parse_dynamic_info(image, *header, dynamic_phdr, object.dynamic)) {
         return false;
     }
+    load_symbol_hash_table(object);
     return true;
 }
 
@@ -842,6 +1365,7 @@ bool apply_relocation(const LoadedObject& object,
                       const Elf64Rela& rela,
                       const LoadedObject* objects,
                       size_t object_count,
+                      ResolutionCache* cache,
                       process::Process& proc) {
     uint32_t type = static_cast<uint32_t>(rela.info & 0xFFFFFFFFu);
     uint32_t sym_index = static_cast<uint32_t>(rela.info >> 32);
@@ -854,28 +1378,14 @@ bool apply_relocation(const LoadedObject& object,
         case R_X86_64_64:
         case R_X86_64_GLOB_DAT:
         case R_X86_64_JUMP_SLOT: {
-            const Elf64Sym* sym = dynsym_at(object, sym_index);
-            if (sym == nullptr) {
-                log_message(LogLevel::Error,
-                            "Loader: relocation references missing symbol");
+            if (!resolve_relocation_symbol(object,
+                                           sym_index,
+                                           objects,
+                                           object_count,
+                                           cache,
+                                           value)) {
                 return false;
             }
-            const char* name = nullptr;
-            if (!symbol_name_at(object, *sym, name)) {
-                log_message(LogLevel::Error,
-                            "Loader: relocation symbol has no name");
-                return false;
-            }
-            if (!resolve_symbol(name, objects, object_count, value)) {
-                if (elf_symbol_bind(*sym) == STB_WEAK) {
-                    value = 0;
-                } else {
-                    log_message(LogLevel::Error,
-                                "Loader: unresolved symbol %s",
-                                name);
-                    return false;
-                }
-            }
             value += static_cast<uint64_t>(rela.addend);
             break;
         }
@@ -901,6 +1411,7 @@ bool apply_relocation_table(const LoadedObject& object,
                             uint64_t rela_ent,
                             const LoadedObject* objects,
                             size_t object_count,
+                            ResolutionCache* cache,
                             process::Process& proc) {
     if (rela_addr == 0 || rela_size == 0) {
         return true;
@@ -914,35 +1425,164 @@ bool apply_relocation_table(const LoadedObject& object,
         return false;
     }
 
-    loader::ProgramImage image{object.data, object.size, 0};
-    const auto* header = reinterpret_cast<const Elf64Ehdr*>(object.data);
     size_t rela_count = static_cast<size_t>(rela_size / rela_ent);
     for (size_t i = 0; i < rela_count; ++i) {
-        const uint8_t* ptr =
-            image_ptr_at_vaddr(image,
-                               *header,
-                               rela_addr + i * rela_ent,
-                               sizeof(Elf64Rela));
-        if (ptr == nullptr) {
+        Elf64Rela rela{};
+        if (!read_object(object, rela_addr + i * rela_ent, rela)) {
             log_message(LogLevel::Error,
                         "Loader: relocation table exceeds image");
             return false;
         }
-        const auto* rela = reinterpret_cast<const Elf64Rela*>(ptr);
         if (!apply_relocation(object,
-                              *rela,
+                              rela,
+                              objects,
+                              object_count,
+                              cache,
+                              proc)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool plt_binds_lazily(const LoadedObject& object) {
+    const DynamicInfo& info = object.dynamic;
+    return !info.bind_now && info.pltgot_addr != 0 &&
+           info.pltrel == static_cast<uint64_t>(DT_RELA) &&
+           info.jmprel_addr != 0 && info.pltrel_size >= sizeof(Elf64Rela);
+}
+
+// Shared by every process that binds lazily. PLT0 pushes GOT[1] and jumps
+// to GOT[2], which points here; the stub saves rax (the vector count of a
+// variadic call) and rcx (the fourth argument), both clobbered by syscall,
+// and BindLazySymbol returns straight into the bound function.
+uint64_t lazy_trampoline_frame() {
+    {
+        sync::IrqLockGuard guard(g_trampoline_lock);
+        if (g_trampoline_frame != 0) {
+            return g_trampoline_frame;
+        }
+    }
+    uint64_t frame = memory::alloc_user_page();
+    if (frame == 0) {
+        return 0;
+    }
+    auto* code = static_cast<uint8_t*>(paging_phys_to_virt(frame));
+    memset(code, 0xCC, kPageSize);
+    uint32_t number =
+        static_cast<uint32_t>(syscall::SystemCall::BindLazySymbol);
+    const uint8_t stub[] = {
+        0x51,                                    // push rcx
+        0x50,                                    // push rax
+        0xB8,                                    // mov eax, imm32
+        static_cast<uint8_t>(number),
+        static_cast<uint8_t>(number >> 8),
+        static_cast<uint8_t>(number >> 16),
+        static_cast<uint8_t>(number >> 24),
+        0x0F, 0x05,                              // syscall
+        0x0F, 0x0B,                              // ud2
+    };
+    memcpy(code, stub, sizeof(stub));
+
+    sync::IrqLockGuard guard(g_trampoline_lock);
+    if (g_trampoline_frame != 0) {
+        memory::free_user_page(frame);
+        return g_trampoline_frame;
+    }
+    g_trampoline_frame = frame;
+    return frame;
+}
+
+uint64_t map_lazy_trampoline(process::Process& proc) {
+    uint64_t frame = lazy_trampoline_frame();
+    if (frame == 0) {
+        return 0;
+    }
+    vm::Region region = vm::reserve_user_region(proc.cr3, kPageSize);
+    if (region.base == 0 ||
+        !vm::map_copy_on_write(proc.cr3, region.base, frame) ||
+        !vm::set_user_region_writable(proc.cr3,
+                                      region.base,
+                                      kPageSize,
+                                      false) ||
+        !vm::set_user_region_executable(proc.cr3,
+                                        region.base,
+                                        kPageSize,
+                                        true)) {
+        return 0;
+    }
+    return region.base;
+}
+
+// Rebases the JUMP_SLOT entries of object instead of binding them: each
+// still points back into its PLT entry, so the first call goes through
+// PLT0 to the trampoline. Anything else in DT_JMPREL is bound now.
+bool prepare_lazy_plt(const LoadedObject& object,
+                      uint64_t object_id,
+                      uint64_t trampoline,
+                      const LoadedObject* objects,
+                      size_t object_count,
+                      ResolutionCache* cache,
+                      process::Process& proc,
+                      size_t& lazy_slots) {
+    size_t rela_count =
+        static_cast<size_t>(object.dynamic.pltrel_size / sizeof(Elf64Rela));
+    for (size_t i = 0; i < rela_count; ++i) {
+        Elf64Rela rela{};
+        if (!read_object(object,
+                         object.dynamic.jmprel_addr + i * sizeof(Elf64Rela),
+                         rela)) {
+            log_message(LogLevel::Error,
+                        "Loader: relocation table exceeds image");
+            return false;
+        }
+        uint32_t type = static_cast<uint32_t>(rela.info & 0xFFFFFFFFu);
+        uint64_t slot = 0;
+        if (type == R_X86_64_JUMP_SLOT &&
+            read_object(object, rela.offset, slot) && slot != 0) {
+            uint64_t value = object.load_bias + slot;
+            if (!vm::copy_to_user(proc.cr3,
+                                  object.load_bias + rela.offset,
+                                  &value,
+                                  sizeof(value))) {
+                log_message(LogLevel::Error,
+                            "Loader: failed to apply dynamic relocation");
+                return false;
+            }
+            ++lazy_slots;
+            continue;
+        }
+        if (!apply_relocation(object,
+                              rela,
                               objects,
                               object_count,
+                              cache,
                               proc)) {
             return false;
         }
     }
+
+    // GOT[1] names the object for BindLazySymbol, GOT[2] is the resolver.
+    uint64_t got[2] = {object_id, trampoline};
+    if (!vm::copy_to_user(proc.cr3,
+                          object.load_bias + object.dynamic.pltgot_addr +
+                              sizeof(uint64_t),
+                          got,
+                          sizeof(got))) {
+        log_message(LogLevel::Error,
+                    "Loader: failed to set up lazy PLT binding");
+        return false;
+    }
     return true;
 }
 
+// trampoline is 0 when every PLT slot must be bound up front.
 bool apply_dynamic_relocations(const LoadedObject* objects,
                                size_t object_count,
-                               process::Process& proc) {
+                               ResolutionCache* cache,
+                               uint64_t trampoline,
+                               process::Process& proc,
+                               size_t& lazy_slots) {
     for (size_t i = 0; i < object_count; ++i) {
         const LoadedObject& object = objects[i];
         if (!apply_relocation_table(object,
@@ -951,15 +1591,30 @@ bool apply_dynamic_relocations(const LoadedObject* objects,
                                     object.dynamic.rela_ent,
                                     objects,
                                     object_count,
+                                    cache,
                                     proc)) {
             return false;
         }
+        if (trampoline != 0 && plt_binds_lazily(object)) {
+            if (!prepare_lazy_plt(object,
+                                  i,
+                                  trampoline,
+                                  objects,
+                                  object_count,
+                                  cache,
+                                  proc,
+                                  lazy_slots)) {
+                return false;
+            }
+            continue;
+        }
         if (!apply_relocation_table(object,
                                     object.dynamic.jmprel_addr,
                                     object.dynamic.pltrel_size,
                                     sizeof(Elf64Rela),
                                     objects,
                                     object_count,
+                                    cache,
                                     proc)) {
             return false;
         }
@@ -978,6 +1633,16 @@ bool object_already_loaded(const LoadedObject* objects,
     return false;
 }
 
+bool remember_image(process::Process& proc, image_cache::Image* image) {
+    for (auto*& slot : proc.mapped_images) {
+        if (slot == nullptr) {
+            slot = image;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool load_needed_object(const char* name,
                         LoadedObject* objects,
                         size_t& object_count,
@@ -1001,25 +1666,27 @@ bool load_needed_object(const char* name,
         return false;
     }
 
-    loader::ProgramImage image{};
-    uint8_t* image_buffer = nullptr;
-    if (!read_shared_object_image(path, image, image_buffer)) {
+    image_cache::Image* cached = image_cache::acquire(
+        path, kMaxSharedObjectImageSize, layout_shared_object);
+    if (cached == nullptr) {
         log_message(LogLevel::Error,
                     "Loader: failed to read shared object %s",
                     path);
         return false;
     }
-    if (!looks_like_elf(image.data, image.size)) {
+    // The process holds the reference until it is reclaimed, which keeps
+    // both the frames and the object data used for symbol lookup alive.
+    if (!remember_image(proc, cached)) {
+        image_cache::release(cached);
         log_message(LogLevel::Error,
-                    "Loader: shared object is not ELF: %s",
+                    "Loader: too many mapped images for %s",
                     path);
-        memory::free_kernel(image_buffer);
         return false;
     }
 
+    loader::ProgramImage image{cached->data, cached->size, 0};
     LoadedObject object{};
-    if (!map_elf_object(image, proc, name, false, object)) {
-        memory::free_kernel(image_buffer);
+    if (!map_elf_object(image, proc, name, false, cached, object)) {
         return false;
     }
     objects[object_count++] = object;
@@ -1042,20 +1709,17 @@ bool load_needed_object(const char* name,
     return true;
 }
 
-void free_dependency_images(LoadedObject* objects, size_t object_count) {
-    for (size_t i = 1; i < object_count; ++i) {
-        memory::free_kernel(const_cast<uint8_t*>(objects[i].data));
-        objects[i].data = nullptr;
-        objects[i].size = 0;
-    }
-}
-
 bool load_dynamic_elf_binary(const loader::ProgramImage& image,
                              process::Process& proc) {
     LoadedObject objects[kMaxSharedObjects]{};
     size_t object_count = 0;
 
-    if (!map_elf_object(image, proc, "(main)", true, objects[object_count])) {
+    if (!map_elf_object(image,
+                        proc,
+                        "(main)",
+                        true,
+                        nullptr,
+                        objects[object_count])) {
         return false;
     }
     ++object_count;
@@ -1068,22 +1732,57 @@ bool load_dynamic_elf_binary(const loader::ProgramImage& image,
                             sizeof(needed))) {
             log_message(LogLevel::Error,
                         "Loader: failed to read dependency name");
-            free_dependency_images(objects, object_count);
             return false;
         }
         if (!load_needed_object(needed, objects, object_count, proc)) {
-            free_dependency_images(objects, object_count);
             return false;
         }
     }
 
-    if (!apply_dynamic_relocations(objects, object_count, proc)) {
-        free_dependency_images(objects, object_count);
+    bool lazy = false;
+    for (size_t i = 0; i < object_count; ++i) {
+        lazy = lazy || plt_binds_lazily(objects[i]);
+    }
+    auto* bindings = lazy ? static_cast<loader::LazyBindings*>(
+                                memory::alloc_kernel(
+                                    sizeof(loader::LazyBindings)))
+                          : nullptr;
+    uint64_t trampoline = bindings != nullptr ? map_lazy_trampoline(proc) : 0;
+
+    // Without the cache every relocation of a common symbol (memcpy from
+    // each object, say) would walk every object again.
+    ResolutionCache cache{};
+    cache.entries = static_cast<ResolvedSymbol*>(memory::alloc_kernel(
+        kResolutionCacheEntries * sizeof(ResolvedSymbol)));
+    size_t lazy_slots = 0;
+    bool relocated = apply_dynamic_relocations(
+        objects, object_count, &cache, trampoline, proc, lazy_slots);
+    memory::free_kernel(cache.entries);
+    if (!relocated) {
+        memory::free_kernel(bindings);
         return false;
     }
+    log_message(LogLevel::Debug,
+                "Loader: %zu symbol lookups (%zu cached), %zu PLT slots lazy",
+                cache.lookups,
+                cache.hits,
+                lazy_slots);
+
+    if (lazy_slots != 0) {
+        for (size_t i = 0; i < object_count; ++i) {
+            bindings->objects[i] = objects[i];
+            bindings->objects[i].data = nullptr;
+            bindings->objects[i].size = 0;
+            bindings->objects[i].cr3 = proc.cr3;
+        }
+        bindings->object_count = object_count;
+        proc.lazy_bindings = bindings;
+    } else {
+        memory::free_kernel(bindings);
+    }
+
     for (size_t i = 0; i < object_count; ++i) {
         if (!protect_elf_object_pages(objects[i], proc)) {
-            free_dependency_images(objects, object_count);
             return false;
         }
     }
@@ -1102,14 +1801,12 @@ bool load_dynamic_elf_binary(const loader::ProgramImage& image,
                                           entry_page,
                                           kPageSize,
                                           false)) {
-            free_dependency_images(objects, object_count);
             return false;
         }
     }
 
     proc.code_region = objects[0].region;
     proc.user_ip = entry_va;
-    free_dependency_images(objects, object_count);
     return true;
 }
 
@@ -1446,4 +2143,50 @@ bool load_into_process(const ProgramImage& image, process::Process& proc) {
     return true;
 }
 
+bool bind_lazy_slot(process::Process& proc,
+                    uint64_t object_id,
+                    uint64_t reloc_index,
+                    uint64_t& out_target) {
+    const LazyBindings* bindings = proc.lazy_bindings;
+    if (bindings == nullptr || object_id >= bindings->object_count) {
+        return false;
+    }
+    const LoadedObject& object = bindings->objects[object_id];
+    if (!plt_binds_lazily(object) ||
+        reloc_index >= object.dynamic.pltrel_size / sizeof(Elf64Rela)) {
+        return false;
+    }
+    Elf64Rela rela{};
+    if (!read_object(object,
+                     object.dynamic.jmprel_addr +
+                         reloc_index * sizeof(Elf64Rela),
+                     rela) ||
+        static_cast<uint32_t>(rela.info & 0xFFFFFFFFu) != R_X86_64_JUMP_SLOT) {
+        return false;
+    }
+    uint64_t value = 0;
+    if (!resolve_relocation_symbol(object,
+                                   static_cast<uint32_t>(rela.info >> 32),
+                                   bindings->objects,
+                                   bindings->object_count,
+                                   nullptr,
+                                   value)) {
+        return false;
+    }
+    value += static_cast<uint64_t>(rela.addend);
+    if (!vm::copy_to_user(proc.cr3,
+                          object.load_bias + rela.offset,
+                          &value,
+                          sizeof(value))) {
+        return false;
+    }
+    out_target = value;
+    return true;
+}
+
+void release_lazy_bindings(process::Process& proc) {
+    memory::free_kernel(proc.lazy_bindings);
+    proc.lazy_bindings = nullptr;
+}
+
 }  // namespace loader
@@ -14,6 +14,13 @@ struct ProgramImage {
 };
 
 bool load_into_process(const ProgramImage& image, process::Process& proc);
+// Binds PLT slot reloc_index of the object the lazy-binding trampoline was
+// entered for, patches its GOT entry and returns the function address.
+bool bind_lazy_slot(process::Process& proc,
+                    uint64_t object_id,
+                    uint64_t reloc_index,
+                    uint64_t& out_target);
+void release_lazy_bindings(process::Process& proc);
 
 }  // namespace loader
 
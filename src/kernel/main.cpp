@@ -4,6 +4,7 @@
 
 #include "../drivers/console/console.hpp"
 #include "../drivers/driver_registry.hpp"
+#include "../drivers/fs/block_cache.hpp"
 #include "../drivers/fs/mount_manager.hpp"
 #include "../drivers/input/keyboard.hpp"
 #include "../drivers/input/mouse.hpp"
@@ -34,6 +35,7 @@
 #include "descriptor.hpp"
 #include "capabilities.hpp"
 #include "debug_heartbeat.hpp"
+#include "mem_benchmark.hpp"
 #include "users.hpp"
 #include "error.hpp"
 #include "loader.hpp"
@@ -46,6 +48,8 @@
 #include "settings.hpp"
 #include "string_util.hpp"
 #include "time.hpp"
+#include "timer_wheel.hpp"
+#include "trace.hpp"
 
 static void hcf(void) {
     for (;;) asm("hlt");
@@ -573,6 +577,11 @@ static void kernel_main_stage2() {
 
     log_message(LogLevel::Info, "Initializing physical memory pools");
     memory::init();
+    mem_benchmark::run();
+    uint64_t tsc_hz = pit::measure_tsc_hz(10);
+    trace::init(tsc_hz);
+    percpu::set_tsc_hz(tsc_hz);
+    lapic::calibrate_timer(tsc_hz);
 
     uint64_t entropy_probe = 0;
     bool secure_random_available =
@@ -589,6 +598,7 @@ static void kernel_main_stage2() {
     if (!timekeeping::init_from_rtc(1000)) {
         log_message(LogLevel::Warn, "Wall clock unavailable");
     }
+    timekeeping::set_tsc_hz(tsc_hz);
 
     if (kconsole != nullptr) {
         log_message(LogLevel::Info, "Enabling console back buffer");
@@ -816,9 +826,14 @@ static void kernel_main_stage2() {
         load_module_list_file(boot_cwd);
     }
 
+    if (!timer_wheel::self_check()) {
+        log_message(LogLevel::Error, "Timer wheel self-check failed");
+    }
     process::init();
     scheduler::init();
     descriptor::start_waiter_worker();
+    fs::block_cache::start_writeback();
+    log_start_drain();
     // Namespace initialization may install SCI handlers and queue deferred AML
     // work, so it must follow process and scheduler initialization.
     if (!acpi::initialize(cmdline)) {
@@ -940,6 +955,7 @@ static void kernel_main_stage2() {
     // prompts. Logging continues to serial and the kernel ring buffer, where
     // it remains available through dmesg.
     log_set_console_enabled(false);
+    scheduler::enable_tickless();
     smp::release_aps();
     scheduler::run();
 
@@ -0,0 +1,139 @@
+#include "mem_benchmark.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arch/x86_64/memory/paging.hpp"
+#include "arch/x86_64/registers.hpp"
+#include "drivers/log/logging.hpp"
+#include "drivers/timer/pit.hpp"
+#include "kernel/memory/physical_allocator.hpp"
+#include "lib/mem.hpp"
+
+namespace mem_benchmark {
+namespace {
+
+constexpr size_t kBufferPages = 128;  // 512 KiB, past most per-core caches
+constexpr size_t kBufferBytes = kBufferPages * 4096;
+constexpr uint32_t kRounds = 8;
+constexpr uint32_t kCalibrationMs = 10;
+
+constexpr mem::Variant kVariants[] = {
+    mem::Variant::Bytes,
+    mem::Variant::Qwords,
+    mem::Variant::Erms,
+};
+
+// Keeps the compare results observable so the calls are not dropped.
+volatile int g_compare_sink = 0;
+
+enum class Op {
+    Copy,
+    Fill,
+    FillNonTemporal,
+    Compare,
+};
+
+void run_once(Op op, mem::Variant variant, uint8_t* dst, const uint8_t* src) {
+    switch (op) {
+    case Op::Copy:
+        mem::copy_with(variant, dst, src, kBufferBytes);
+        break;
+    case Op::Fill:
+        mem::fill_with(variant, dst, 0, kBufferBytes);
+        break;
+    case Op::FillNonTemporal:
+        mem::fill_nontemporal(dst, 0, kBufferBytes);
+        break;
+    case Op::Compare:
+        g_compare_sink = mem::compare_with(variant, dst, src, kBufferBytes);
+        break;
+    }
+}
+
+// Returns MiB/s, or bytes per kilocycle when the TSC could not be timed.
+uint64_t measure(Op op,
+                 mem::Variant variant,
+                 uint8_t* dst,
+                 const uint8_t* src,
+                 uint64_t tsc_hz) {
+    run_once(op, variant, dst, src);
+    uint64_t start = cpu::read_tsc();
+    for (uint32_t i = 0; i < kRounds; ++i) {
+        run_once(op, variant, dst, src);
+    }
+    uint64_t cycles = cpu::read_tsc() - start;
+    if (cycles == 0) {
+        cycles = 1;
+    }
+    uint64_t bytes = static_cast<uint64_t>(kBufferBytes) * kRounds;
+    if (tsc_hz == 0) {
+        return bytes * 1000 / cycles;
+    }
+    return bytes * (tsc_hz / 1024) / cycles / 1024;
+}
+
+void report(const char* name,
+            Op op,
+            uint8_t* dst,
+            const uint8_t* src,
+            uint64_t tsc_hz,
+            const char* unit) {
+    uint64_t results[sizeof(kVariants) / sizeof(kVariants[0])]{};
+    for (size_t i = 0; i < sizeof(kVariants) / sizeof(kVariants[0]); ++i) {
+        results[i] = measure(op, kVariants[i], dst, src, tsc_hz);
+    }
+    log_message(LogLevel::Info,
+                "membench: %s bytes=%llu qwords=%llu erms=%llu %s",
+                name,
+                static_cast<unsigned long long>(results[0]),
+                static_cast<unsigned long long>(results[1]),
+                static_cast<unsigned long long>(results[2]),
+                unit);
+}
+
+}  // namespace
+
+void run() {
+    uint64_t src_phys = memory::alloc_kernel_block_pages_uninitialized(kBufferPages);
+    uint64_t dst_phys = memory::alloc_kernel_block_pages_uninitialized(kBufferPages);
+    if (src_phys == 0 || dst_phys == 0) {
+        log_message(LogLevel::Warn, "membench: skipped (no scratch memory)");
+        if (src_phys != 0) {
+            memory::free_kernel_block(src_phys);
+        }
+        if (dst_phys != 0) {
+            memory::free_kernel_block(dst_phys);
+        }
+        return;
+    }
+    auto* src = static_cast<uint8_t*>(paging_phys_to_virt(src_phys));
+    auto* dst = static_cast<uint8_t*>(paging_phys_to_virt(dst_phys));
+    for (size_t i = 0; i < kBufferBytes; ++i) {
+        src[i] = static_cast<uint8_t>(i * 131u + 7u);
+    }
+
+    uint64_t tsc_hz = pit::measure_tsc_hz(kCalibrationMs);
+    const char* unit = tsc_hz != 0 ? "MiB/s" : "B/kcycle";
+
+    report("memcpy", Op::Copy, dst, src, tsc_hz, unit);
+    report("memset", Op::Fill, dst, src, tsc_hz, unit);
+    log_message(LogLevel::Info,
+                "membench: memset non-temporal=%llu %s",
+                static_cast<unsigned long long>(
+                    measure(Op::FillNonTemporal, mem::Variant::Qwords,
+                            dst, src, tsc_hz)),
+                unit);
+    mem::copy_with(mem::Variant::Qwords, dst, src, kBufferBytes);
+    report("memcmp", Op::Compare, dst, src, tsc_hz, unit);
+    log_message(LogLevel::Info,
+                "membench: active=%s non-temporal clears %s (TSC %llu kHz)",
+                mem::variant_name(mem::active_variant()),
+                mem::nontemporal_clear_enabled() ? "on" : "off",
+                static_cast<unsigned long long>(tsc_hz / 1000));
+
+    memory::free_kernel_block(src_phys);
+    memory::free_kernel_block(dst_phys);
+}
+
+}  // namespace mem_benchmark
@@ -0,0 +1,9 @@
+#pragma once
+
+namespace mem_benchmark {
+
+// Times every memcpy/memset/memcmp variant on a scratch buffer and logs the
+// throughput of each. Needs the kernel page allocator and the PIT.
+void run();
+
+}  // namespace mem_benchmark
@@ -145,6 +145,36 @@ uint64_t BuddyAllocator::alloc_order(uint8_t order) {
     return phys;
 }
 
+bool BuddyAllocator::has_free_order(uint8_t order) const {
+    for (uint8_t current = order; current <= max_order_; ++current) {
+        if (free_lists_[current] != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BuddyAllocator::split_allocated(uint64_t phys) {
+    Range* range = find_range(phys);
+    if (range == nullptr) {
+        return false;
+    }
+    size_t index = index_for_phys(*range, phys);
+    if (index >= range->pages) {
+        return false;
+    }
+    int8_t entry = range->order_map[index];
+    if (entry == kMapNonHead || entry >= 0) {
+        return false;
+    }
+    uint8_t order = static_cast<uint8_t>(-entry - 2);
+    size_t pages = 1ull << order;
+    for (size_t i = 0; i < pages && (index + i) < range->pages; ++i) {
+        range->order_map[index + i] = kMapAllocatedBase;
+    }
+    return true;
+}
+
 void BuddyAllocator::free(uint64_t phys) {
     if (phys == 0) {
         return;
@@ -19,6 +19,12 @@ public:
 
     uint64_t alloc_pages(size_t pages);
     uint64_t alloc_order(uint8_t order);
+    // True when alloc_order(order) would succeed; lets opportunistic callers
+    // skip the failure log.
+    bool has_free_order(uint8_t order) const;
+    // Turns an allocated block into single-page allocations, so each page
+    // can be freed on its own and the block re-coalesces as they return.
+    bool split_allocated(uint64_t phys);
     void free(uint64_t phys);
     bool owns(uint64_t phys) const;
     size_t free_pages() const { return free_pages_; }
@@ -4,6 +4,8 @@
 #include "drivers/limine/limine_requests.hpp"
 #include "drivers/log/logging.hpp"
 #include "kernel/memory/buddy.hpp"
+#include "kernel/memory/slab.hpp"
+#include "kernel/string_util.hpp"
 #include "lib/mem.hpp"
 
 namespace memory {
@@ -11,7 +13,7 @@ namespace memory {
 namespace {
 
 constexpr uint64_t kPageSize = BuddyAllocator::kPageSize;
-constexpr uint64_t kKernelPoolTargetSize = 64ull * 1024 * 1024;
+constexpr uint64_t kKernelPoolTargetSize = kKernelPoolMaxSize;
 constexpr size_t kKernelPoolPages = kKernelPoolTargetSize / kPageSize;
 
 BuddyAllocator g_kernel_buddy;
@@ -20,6 +22,11 @@ int8_t g_kernel_order_map[kKernelPoolPages];
 
 uint64_t g_kernel_pool_base = 0;
 uint64_t g_kernel_pool_size = 0;
+uint64_t g_large_allocations = 0;
+uint64_t g_large_pages = 0;
+uint64_t g_large_alloc_count = 0;
+uint64_t g_large_free_count = 0;
+uint64_t g_user_huge_alloc_count = 0;
 bool g_initialized = false;
 bool g_kernel_ready = false;
 
@@ -32,9 +39,10 @@ struct Range {
 
 struct AllocationHeader {
     uint64_t phys;
-    uint64_t magic;
+    uint32_t pages;
+    uint32_t magic;
 };
-constexpr uint64_t kAllocationMagic = 0x4E45555452494E4Full;
+constexpr uint32_t kAllocationMagic = 0x4E45554Fu;
 
 constexpr uint64_t align_up(uint64_t value, uint64_t alignment) {
     return (value + alignment - 1) & ~(alignment - 1);
@@ -202,6 +210,7 @@ void init() {
         return;
     }
     g_kernel_ready = true;
+    slab_init();
 
     log_pool("Kernel", g_kernel_pool_base, g_kernel_pool_size);
 
@@ -355,13 +364,18 @@ bool kernel_allocator_ready() {
     return g_kernel_ready;
 }
 
-uint64_t alloc_kernel_block_pages(size_t pages) {
+uint64_t alloc_kernel_block_pages_uninitialized(size_t pages) {
     if (!g_kernel_ready || pages == 0) {
         return 0;
     }
     lock_alloc();
     uint64_t phys = g_kernel_buddy.alloc_pages(pages);
     unlock_alloc();
+    return phys;
+}
+
+uint64_t alloc_kernel_block_pages(size_t pages) {
+    uint64_t phys = alloc_kernel_block_pages_uninitialized(pages);
     if (phys != 0) {
         memset(paging_phys_to_virt(phys), 0, pages * kPageSize);
     }
@@ -385,32 +399,98 @@ void free_kernel_page(uint64_t phys) {
     free_kernel_block(phys);
 }
 
-void* alloc_kernel(size_t bytes, size_t alignment) {
+namespace {
+
+void* alloc_kernel_impl(size_t bytes, size_t alignment, bool zero) {
     if (bytes == 0) return nullptr;
     if (alignment < alignof(AllocationHeader)) alignment = alignof(AllocationHeader);
     if ((alignment & (alignment - 1)) != 0) return nullptr;
+    if (bytes <= kSlabMaxObjectSize && alignment <= kSlabMaxObjectSize) {
+        if (void* object = slab_alloc_sized(bytes, alignment, zero)) {
+            return object;
+        }
+    }
     if (bytes > static_cast<size_t>(-1) - alignment - sizeof(AllocationHeader)) return nullptr;
     const size_t total = bytes + alignment - 1 + sizeof(AllocationHeader);
     const size_t pages = static_cast<size_t>(align_up(total, kPageSize) / kPageSize);
-    uint64_t phys = alloc_kernel_block_pages(pages);
+    uint64_t phys = zero ? alloc_kernel_block_pages(pages)
+                         : alloc_kernel_block_pages_uninitialized(pages);
     if (phys == 0) return nullptr;
     uintptr_t start = reinterpret_cast<uintptr_t>(paging_phys_to_virt(phys));
     uintptr_t result = align_up(start + sizeof(AllocationHeader), alignment);
     auto* header = reinterpret_cast<AllocationHeader*>(result - sizeof(AllocationHeader));
     header->phys = phys;
+    header->pages = static_cast<uint32_t>(pages);
     header->magic = kAllocationMagic;
+    __atomic_fetch_add(&g_large_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_large_pages, pages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_large_alloc_count, 1, __ATOMIC_RELAXED);
     return reinterpret_cast<void*>(result);
 }
 
+}  // namespace
+
+void* alloc_kernel(size_t bytes, size_t alignment) {
+    return alloc_kernel_impl(bytes, alignment, true);
+}
+
+void* alloc_kernel_uninitialized(size_t bytes, size_t alignment) {
+    return alloc_kernel_impl(bytes, alignment, false);
+}
+
 void free_kernel(void* ptr) {
     if (ptr == nullptr) return;
+    if (slab_owns(ptr)) {
+        slab_free_any(ptr);
+        return;
+    }
     auto* header = reinterpret_cast<AllocationHeader*>(reinterpret_cast<uintptr_t>(ptr) - sizeof(AllocationHeader));
     if (header->magic != kAllocationMagic) return;
     uint64_t phys = header->phys;
+    uint32_t pages = header->pages;
     header->magic = 0;
+    __atomic_fetch_sub(&g_large_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&g_large_pages, pages, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_large_free_count, 1, __ATOMIC_RELAXED);
     free_kernel_block(phys);
 }
 
+size_t kernel_heap_snapshot(descriptor_defs::KernelHeapCacheStats* out,
+                            size_t max_entries) {
+    if (out == nullptr || max_entries == 0) {
+        return 0;
+    }
+    size_t written =
+        slab_stats_snapshot(out, max_entries > 2 ? max_entries - 2 : 0);
+    descriptor_defs::KernelHeapCacheStats& large = out[written++];
+    memset(&large, 0, sizeof(large));
+    string_util::copy(large.name, sizeof(large.name), "kmalloc-large");
+    large.object_size = static_cast<uint32_t>(kPageSize);
+    large.objects_per_slab = 1;
+    large.slabs = __atomic_load_n(&g_large_pages, __ATOMIC_RELAXED);
+    large.objects_total = large.slabs;
+    large.objects_in_use = __atomic_load_n(&g_large_allocations, __ATOMIC_RELAXED);
+    large.alloc_count = __atomic_load_n(&g_large_alloc_count, __ATOMIC_RELAXED);
+    large.free_count = __atomic_load_n(&g_large_free_count, __ATOMIC_RELAXED);
+    if (written == max_entries) {
+        return written;
+    }
+
+    PagingLargePageStats paging_stats = paging_large_page_stats();
+    descriptor_defs::KernelHeapCacheStats& huge = out[written++];
+    memset(&huge, 0, sizeof(huge));
+    string_util::copy(huge.name, sizeof(huge.name), "pages-2m");
+    huge.object_size = static_cast<uint32_t>(kHugePageSize);
+    huge.objects_per_slab = 1;
+    huge.slabs = paging_stats.kernel_pages;
+    huge.objects_total = paging_stats.kernel_pages + paging_stats.user_pages;
+    huge.objects_in_use = paging_stats.user_pages;
+    huge.alloc_count =
+        __atomic_load_n(&g_user_huge_alloc_count, __ATOMIC_RELAXED);
+    huge.free_count = paging_stats.splits;
+    return written;
+}
+
 uint64_t alloc_user_page() {
     if (!g_initialized) {
         return 0;
@@ -428,6 +508,25 @@ uint64_t alloc_user_page() {
     return phys;
 }
 
+uint64_t alloc_user_huge_page() {
+    if (!g_initialized) {
+        return 0;
+    }
+    lock_alloc();
+    uint64_t phys = 0;
+    if (g_user_buddy.has_free_order(kHugePageOrder)) {
+        phys = g_user_buddy.alloc_order(kHugePageOrder);
+        if (phys != 0) {
+            (void)g_user_buddy.split_allocated(phys);
+        }
+    }
+    unlock_alloc();
+    if (phys != 0) {
+        __atomic_fetch_add(&g_user_huge_alloc_count, 1, __ATOMIC_RELAXED);
+    }
+    return phys;
+}
+
 void free_user_page(uint64_t phys) {
     if (!g_initialized || phys == 0) {
         return;
@@ -3,21 +3,40 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "descriptors.hpp"
+
 namespace memory {
 
+constexpr uint64_t kKernelPoolMaxSize = 64ull * 1024 * 1024;
+constexpr uint8_t kHugePageOrder = 9;
+constexpr uint64_t kHugePageSize = 4096ull << kHugePageOrder;
+constexpr size_t kHugePagePages = size_t{1} << kHugePageOrder;
+
 void init();
 bool kernel_allocator_ready();
 
 uint64_t alloc_kernel_block_pages(size_t pages);
+// Same as alloc_kernel_block_pages() but leaves the contents undefined.
+uint64_t alloc_kernel_block_pages_uninitialized(size_t pages);
 uint64_t alloc_kernel_page();
 void free_kernel_block(uint64_t phys);
 void free_kernel_page(uint64_t phys);
 
-// General-purpose, aligned kernel heap backed by the kernel buddy allocator.
+// General-purpose, aligned kernel heap.  Requests up to 1 KiB are served from
+// slab size classes; larger ones take whole buddy pages.  Memory is zeroed.
 void* alloc_kernel(size_t bytes, size_t alignment = alignof(uint64_t));
+// Like alloc_kernel() for callers that overwrite the whole object anyway.
+void* alloc_kernel_uninitialized(size_t bytes,
+                                 size_t alignment = alignof(uint64_t));
 void free_kernel(void* ptr);
+size_t kernel_heap_snapshot(descriptor_defs::KernelHeapCacheStats* out,
+                            size_t max_entries);
 
 uint64_t alloc_user_page();
+// Returns 512 contiguous, 2 MiB-aligned user pages taken from one order-9
+// block, or 0 (without logging) when none is free. Each page is a separate
+// allocation afterwards and goes back through free_user_page().
+uint64_t alloc_user_huge_page();
 void free_user_page(uint64_t phys);
 
 uint64_t kernel_pool_base();
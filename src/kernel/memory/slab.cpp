@@ -0,0 +1,420 @@
+#include "kernel/memory/slab.hpp"
+
+#include "arch/x86_64/memory/paging.hpp"
+#include "drivers/log/logging.hpp"
+#include "kernel/memory/physical_allocator.hpp"
+#include "kernel/string_util.hpp"
+#include "lib/mem.hpp"
+
+namespace memory {
+
+// Slab bookkeeping. Small classes keep it at the start of the page; the
+// rest keep it off the page, in a small-class object, so their objects tile
+// the page exactly.
+struct SlabPage {
+    uint64_t magic;
+    SlabCache* cache;
+    SlabPage* next;
+    SlabPage* prev;
+    void* free_list;
+    uint32_t in_use;
+    uint32_t pool_index;
+};
+
+namespace {
+
+constexpr uint64_t kPageSize = 0x1000;
+constexpr uint64_t kSlabMagic = 0x534C4142504147ull;
+constexpr size_t kMaxTrackedPages = kKernelPoolMaxSize / kPageSize;
+constexpr size_t kMaxEmptySlabs = 2;
+// From here on an in-page header would cost at least an eighth of the page.
+constexpr size_t kOffSlabMinObjectSize = kPageSize / 8;
+static_assert(sizeof(SlabPage) < kOffSlabMinObjectSize,
+              "off-page headers must come from an in-page class");
+constexpr size_t kSizeClassCount = 7;  // 16 .. 1024
+static_assert(kSizeClassCount <= kSlabMaxCaches, "cache table too small");
+constexpr size_t kSizeClasses[kSizeClassCount] = {
+    16, 32, 64, 128, 256, 512, 1024,
+};
+constexpr const char* kSizeClassNames[kSizeClassCount] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+SlabCache g_caches[kSlabMaxCaches];
+SlabCache* g_size_caches[kSizeClassCount]{};
+sync::SpinLock g_cache_table_lock;
+// Header of each kernel pool page that backs a slab, null otherwise.
+// free_kernel() uses this to route a pointer without trusting bytes around
+// it, and objects find their header through it wherever that lives.
+SlabPage* g_slab_pages[kMaxTrackedPages];
+bool g_ready = false;
+
+constexpr uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+bool pool_page_index(uint64_t phys, size_t& out_index) {
+    uint64_t base = kernel_pool_base();
+    uint64_t size = kernel_pool_size();
+    if (phys < base || phys >= base + size) {
+        return false;
+    }
+    size_t index = static_cast<size_t>((phys - base) / kPageSize);
+    if (index >= kMaxTrackedPages) {
+        return false;
+    }
+    out_index = index;
+    return true;
+}
+
+uint64_t virt_to_phys(const void* ptr) {
+    return reinterpret_cast<uint64_t>(ptr) - paging_hhdm_offset();
+}
+
+// Null for pointers outside the kernel pool or pages that are no slab.
+SlabPage* page_for_object(const void* ptr) {
+    size_t index = 0;
+    if (!pool_page_index(virt_to_phys(ptr), index)) {
+        return nullptr;
+    }
+    return __atomic_load_n(&g_slab_pages[index], __ATOMIC_ACQUIRE);
+}
+
+void list_remove(SlabPage*& head, SlabPage* page) {
+    if (page->prev != nullptr) {
+        page->prev->next = page->next;
+    } else {
+        head = page->next;
+    }
+    if (page->next != nullptr) {
+        page->next->prev = page->prev;
+    }
+    page->next = nullptr;
+    page->prev = nullptr;
+}
+
+void list_push(SlabPage*& head, SlabPage* page) {
+    page->prev = nullptr;
+    page->next = head;
+    if (head != nullptr) {
+        head->prev = page;
+    }
+    head = page;
+}
+
+SlabPage* grow_locked(SlabCache& cache) {
+    uint64_t phys = alloc_kernel_block_pages_uninitialized(1);
+    if (phys == 0) {
+        return nullptr;
+    }
+    size_t index = 0;
+    if (!pool_page_index(phys, index)) {
+        free_kernel_block(phys);
+        return nullptr;
+    }
+    auto* base = static_cast<uint8_t*>(paging_phys_to_virt(phys));
+    SlabPage* page = reinterpret_cast<SlabPage*>(base);
+    if (cache.first_offset == 0) {
+        page = static_cast<SlabPage*>(
+            slab_alloc_sized(sizeof(SlabPage), alignof(SlabPage), false));
+        if (page == nullptr) {
+            free_kernel_block(phys);
+            return nullptr;
+        }
+    }
+    page->magic = kSlabMagic;
+    page->cache = &cache;
+    page->next = nullptr;
+    page->prev = nullptr;
+    page->in_use = 0;
+    page->pool_index = static_cast<uint32_t>(index);
+
+    void* head = nullptr;
+    for (size_t i = cache.objects_per_slab; i-- > 0;) {
+        void* object = base + cache.first_offset + i * cache.object_size;
+        *static_cast<void**>(object) = head;
+        head = object;
+    }
+    page->free_list = head;
+    __atomic_store_n(&g_slab_pages[index], page, __ATOMIC_RELEASE);
+    ++cache.slab_count;
+    return page;
+}
+
+void release_page_locked(SlabCache& cache, SlabPage* page) {
+    size_t index = page->pool_index;
+    uint64_t phys = kernel_pool_base() + index * kPageSize;
+    page->magic = 0;
+    __atomic_store_n(&g_slab_pages[index], nullptr, __ATOMIC_RELEASE);
+    --cache.slab_count;
+    if (cache.first_offset == 0) {
+        slab_free_any(page);
+    }
+    free_kernel_block(phys);
+}
+
+void* take_object_locked(SlabCache& cache) {
+    SlabPage* page = cache.partial;
+    if (page == nullptr) {
+        page = cache.empty;
+        if (page != nullptr) {
+            list_remove(cache.empty, page);
+            --cache.empty_count;
+        } else {
+            page = grow_locked(cache);
+            if (page == nullptr) {
+                return nullptr;
+            }
+        }
+        list_push(cache.partial, page);
+    }
+
+    void* object = page->free_list;
+    page->free_list = *static_cast<void**>(object);
+    ++page->in_use;
+    ++cache.objects_allocated;
+    if (page->free_list == nullptr) {
+        list_remove(cache.partial, page);
+        list_push(cache.full, page);
+    }
+    return object;
+}
+
+void return_object_locked(SlabCache& cache, void* object) {
+    SlabPage* page = page_for_object(object);
+    bool was_full = page->free_list == nullptr;
+    *static_cast<void**>(object) = page->free_list;
+    page->free_list = object;
+    --page->in_use;
+    --cache.objects_allocated;
+
+    if (was_full) {
+        list_remove(cache.full, page);
+        list_push(cache.partial, page);
+    }
+    if (page->in_use == 0) {
+        list_remove(cache.partial, page);
+        if (cache.empty_count < kMaxEmptySlabs) {
+            list_push(cache.empty, page);
+            ++cache.empty_count;
+        } else {
+            release_page_locked(cache, page);
+        }
+    }
+}
+
+SlabMagazine* local_magazine(SlabCache& cache) {
+    percpu::Cpu* cpu = percpu::current_cpu();
+    if (cpu == nullptr || cpu->index >= percpu::kMaxCpus) {
+        return nullptr;
+    }
+    return &cache.magazines[cpu->index];
+}
+
+// Moves half a magazine's worth of objects between the slab lists and the
+// calling CPU's magazine so the next few operations stay lock-free.
+void refill_magazine(SlabCache& cache, SlabMagazine& magazine) {
+    sync::IrqLockGuard guard(cache.lock);
+    while (magazine.count < kSlabMagazineSize / 2) {
+        void* object = take_object_locked(cache);
+        if (object == nullptr) {
+            break;
+        }
+        magazine.objects[magazine.count++] = object;
+    }
+}
+
+void drain_magazine(SlabCache& cache, SlabMagazine& magazine) {
+    sync::IrqLockGuard guard(cache.lock);
+    while (magazine.count > kSlabMagazineSize / 2) {
+        return_object_locked(cache, magazine.objects[--magazine.count]);
+    }
+}
+
+SlabCache* claim_cache(const char* name, size_t object_size, size_t alignment) {
+    if (alignment < kSlabMinObjectSize) {
+        alignment = kSlabMinObjectSize;
+    }
+    if ((alignment & (alignment - 1)) != 0 || alignment > kSlabMaxObjectSize) {
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(align_up(object_size, alignment));
+    if (size < kSlabMinObjectSize) {
+        size = kSlabMinObjectSize;
+    }
+    size_t first_offset =
+        size >= kOffSlabMinObjectSize
+            ? 0
+            : static_cast<size_t>(align_up(sizeof(SlabPage), alignment));
+    if (first_offset + size > kPageSize) {
+        return nullptr;
+    }
+
+    sync::IrqLockGuard guard(g_cache_table_lock);
+    for (size_t i = 0; i < kSlabMaxCaches; ++i) {
+        SlabCache& cache = g_caches[i];
+        if (cache.in_use) {
+            continue;
+        }
+        string_util::copy(cache.name, sizeof(cache.name), name);
+        cache.object_size = size;
+        cache.first_offset = first_offset;
+        cache.objects_per_slab =
+            static_cast<uint32_t>((kPageSize - first_offset) / size);
+        cache.partial = nullptr;
+        cache.full = nullptr;
+        cache.empty = nullptr;
+        cache.empty_count = 0;
+        cache.slab_count = 0;
+        cache.objects_allocated = 0;
+        cache.alloc_count = 0;
+        cache.free_count = 0;
+        for (auto& magazine : cache.magazines) {
+            magazine.count = 0;
+        }
+        cache.in_use = true;
+        return &cache;
+    }
+    return nullptr;
+}
+
+}  // namespace
+
+void slab_init() {
+    if (g_ready) {
+        return;
+    }
+    memset(g_slab_pages, 0, sizeof(g_slab_pages));
+    for (size_t i = 0; i < kSizeClassCount; ++i) {
+        g_size_caches[i] = claim_cache(kSizeClassNames[i],
+                                       kSizeClasses[i],
+                                       kSizeClasses[i]);
+        if (g_size_caches[i] == nullptr) {
+            log_message(LogLevel::Error,
+                        "Slab: failed to create %s",
+                        kSizeClassNames[i]);
+        }
+    }
+    g_ready = true;
+}
+
+namespace {
+
+void* slab_alloc(SlabCache* cache, bool zero) {
+    if (cache == nullptr || !g_ready) {
+        return nullptr;
+    }
+    void* object = nullptr;
+    uint64_t flags = sync::disable_interrupts();
+    SlabMagazine* magazine = local_magazine(*cache);
+    if (magazine != nullptr) {
+        if (magazine->count == 0) {
+            refill_magazine(*cache, *magazine);
+        }
+        if (magazine->count != 0) {
+            object = magazine->objects[--magazine->count];
+        }
+    } else {
+        sync::IrqLockGuard guard(cache->lock);
+        object = take_object_locked(*cache);
+    }
+    if (object != nullptr) {
+        __atomic_fetch_add(&cache->alloc_count, 1, __ATOMIC_RELAXED);
+    }
+    sync::restore_interrupts(flags);
+
+    if (object != nullptr && zero) {
+        memset(object, 0, cache->object_size);
+    }
+    return object;
+}
+
+void slab_free(SlabCache* cache, void* ptr) {
+    if (cache == nullptr || ptr == nullptr) {
+        return;
+    }
+    uint64_t flags = sync::disable_interrupts();
+    __atomic_fetch_add(&cache->free_count, 1, __ATOMIC_RELAXED);
+    SlabMagazine* magazine = local_magazine(*cache);
+    if (magazine != nullptr) {
+        if (magazine->count == kSlabMagazineSize) {
+            drain_magazine(*cache, *magazine);
+        }
+        magazine->objects[magazine->count++] = ptr;
+    } else {
+        sync::IrqLockGuard guard(cache->lock);
+        return_object_locked(*cache, ptr);
+    }
+    sync::restore_interrupts(flags);
+}
+
+}  // namespace
+
+void* slab_alloc_sized(size_t bytes, size_t alignment, bool zero) {
+    if (!g_ready || bytes == 0) {
+        return nullptr;
+    }
+    size_t needed = bytes > alignment ? bytes : alignment;
+    for (size_t i = 0; i < kSizeClassCount; ++i) {
+        if (needed <= kSizeClasses[i]) {
+            return slab_alloc(g_size_caches[i], zero);
+        }
+    }
+    return nullptr;
+}
+
+bool slab_owns(const void* ptr) {
+    if (ptr == nullptr || !g_ready) {
+        return false;
+    }
+    return page_for_object(ptr) != nullptr;
+}
+
+void slab_free_any(void* ptr) {
+    if (ptr == nullptr || !g_ready) {
+        return;
+    }
+    SlabPage* page = page_for_object(ptr);
+    if (page == nullptr || page->magic != kSlabMagic) {
+        return;
+    }
+    slab_free(page->cache, ptr);
+}
+
+size_t slab_stats_snapshot(descriptor_defs::KernelHeapCacheStats* out,
+                           size_t max_entries) {
+    if (out == nullptr) {
+        return 0;
+    }
+    size_t written = 0;
+    for (size_t i = 0; i < kSlabMaxCaches && written < max_entries; ++i) {
+        SlabCache& cache = g_caches[i];
+        if (!cache.in_use) {
+            continue;
+        }
+        descriptor_defs::KernelHeapCacheStats& stats = out[written++];
+        memset(&stats, 0, sizeof(stats));
+        string_util::copy(stats.name, sizeof(stats.name), cache.name);
+        uint64_t cached = 0;
+        for (const auto& magazine : cache.magazines) {
+            cached += __atomic_load_n(&magazine.count, __ATOMIC_RELAXED);
+        }
+        {
+            sync::IrqLockGuard guard(cache.lock);
+            stats.object_size = static_cast<uint32_t>(cache.object_size);
+            stats.objects_per_slab = cache.objects_per_slab;
+            stats.slabs = cache.slab_count;
+            stats.objects_total = cache.slab_count * cache.objects_per_slab;
+            stats.objects_in_use = cache.objects_allocated >= cached
+                                       ? cache.objects_allocated - cached
+                                       : 0;
+        }
+        stats.objects_cached = cached;
+        stats.alloc_count = __atomic_load_n(&cache.alloc_count, __ATOMIC_RELAXED);
+        stats.free_count = __atomic_load_n(&cache.free_count, __ATOMIC_RELAXED);
+    }
+    return written;
+}
+
+}  // namespace memory
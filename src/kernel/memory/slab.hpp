@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "descriptors.hpp"
+#include "arch/x86_64/percpu.hpp"
+#include "kernel/sync.hpp"
+
+namespace memory {
+
+// Small-object caches carved out of single kernel buddy pages.  Each cache
+// keeps partially used slabs on a locked list and a per-CPU magazine of free
+// objects so that the common alloc/free pair never touches a shared lock.
+constexpr size_t kSlabMaxCaches = 8;
+constexpr size_t kSlabMagazineSize = 16;
+constexpr size_t kSlabMinObjectSize = 16;
+constexpr size_t kSlabMaxObjectSize = 1024;
+
+struct SlabPage;
+
+struct SlabMagazine {
+    void* objects[kSlabMagazineSize];
+    size_t count;
+};
+
+struct SlabCache {
+    char name[24];
+    size_t object_size;
+    // Offset of the first object; 0 when the slab header lives off the page.
+    size_t first_offset;
+    uint32_t objects_per_slab;
+    bool in_use;
+    sync::SpinLock lock;
+    SlabPage* partial;
+    SlabPage* full;
+    SlabPage* empty;
+    size_t empty_count;
+    uint64_t slab_count;
+    uint64_t objects_allocated;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    SlabMagazine magazines[percpu::kMaxCpus];
+};
+
+void slab_init();
+
+// Power-of-two size classes backing alloc_kernel() for small requests.
+void* slab_alloc_sized(size_t bytes, size_t alignment, bool zero);
+bool slab_owns(const void* ptr);
+void slab_free_any(void* ptr);
+
+size_t slab_stats_snapshot(descriptor_defs::KernelHeapCacheStats* out,
+                           size_t max_entries);
+
+}  // namespace memory
@@ -612,7 +612,8 @@ bool protect_module_sections(const uint8_t* data,
             }
         }
     }
-    return true;
+    // Other CPUs may still hold the loader's writable mappings.
+    return paging_flush_tlb_all_cpus();
 }
 
 bool resolve_external_symbol(const char* name, uint64_t& out_value) {
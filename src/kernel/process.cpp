@@ -5,8 +5,11 @@
 #include "arch/x86_64/memory/paging.hpp"
 #include "capabilities.hpp"
 #include "lib/mem.hpp"
+#include "loader.hpp"
 #include "scheduler.hpp"
 #include "string_util.hpp"
+#include "time.hpp"
+#include "trace.hpp"
 
 namespace {
 
@@ -42,7 +45,9 @@ void reset_process_resources(process::Process& proc) {
     proc.reclaim_cpu = UINT32_MAX;
     proc.kernel_entry = nullptr;
     proc.preferred_cpu = UINT32_MAX;
+    proc.run_queue = UINT32_MAX;
     proc.vty_id = 0;
+    timer_wheel::cancel(proc.sleep_timer);
     proc.sleep_until_tick = 0;
     proc.user_ticks = 0;
     proc.kernel_ticks = 0;
@@ -58,6 +63,10 @@ void reset_process_resources(process::Process& proc) {
         proc.standard_descriptors[i] = descriptor::kInvalidHandle;
     }
     proc.principal = nullptr;
+    for (size_t i = 0; i < process::kMaxMappedImages; ++i) {
+        proc.mapped_images[i] = nullptr;
+    }
+    proc.lazy_bindings = nullptr;
     capabilities::cap_table_clear(proc.cap_handles,
                                   capabilities::kMaxProcessCapabilities);
     descriptor::init_table(proc.descriptors);
@@ -125,6 +134,17 @@ process::Process* allocate_slot(uint32_t pid) {
     return nullptr;
 }
 
+void sleep_expired(void* context) {
+    auto* proc = static_cast<process::Process*>(context);
+    // The wheel may hand over a timer just as something else wakes the
+    // process; by then sleep_until_tick is cleared or re-armed later.
+    if (proc->sleep_until_tick == 0 ||
+        timekeeping::tick_count() < proc->sleep_until_tick) {
+        return;
+    }
+    (void)process::wake(*proc);
+}
+
 }  // namespace
 
 namespace process {
@@ -145,6 +165,7 @@ void init() {
         g_process_table[i].kernel_stack_top =
             g_process_table[i].kernel_stack_base + kKernelStackSize;
         g_process_table[i].kernel_stack_top &= ~0xFULL;
+        g_process_table[i].stack_cpu = UINT32_MAX;
         reset_process_resources(g_process_table[i]);
     }
 }
@@ -200,7 +221,13 @@ Process* current() {
 }
 
 void set_current(Process* proc) {
+    Process* previous = percpu::get_current_process();
     percpu::set_current_process(proc);
+    if (previous != proc) {
+        trace::record(trace::Event::ContextSwitch,
+                      previous != nullptr ? previous->pid : 0,
+                      proc != nullptr ? proc->pid : 0);
+    }
     if (proc != nullptr) {
         uint64_t target_cr3 =
             (proc->cr3 != 0) ? proc->cr3 : paging_kernel_cr3();
@@ -218,6 +245,14 @@ Process* table_entry(size_t index) {
     return &g_process_table[index];
 }
 
+size_t table_index(const Process& proc) {
+    const Process* base = &g_process_table[0];
+    if (&proc < base || &proc >= base + kMaxProcesses) {
+        return kMaxProcesses;
+    }
+    return static_cast<size_t>(&proc - base);
+}
+
 Process* find_by_pid(uint32_t pid) {
     if (pid == 0) {
         return nullptr;
@@ -271,6 +306,8 @@ size_t usage_snapshot(descriptor_defs::TaskUsage* out, size_t max_entries) {
         snapshot.reserved0 = 0;
         snapshot.user_ticks = proc.user_ticks;
         snapshot.kernel_ticks = proc.kernel_ticks;
+        snapshot.page_faults =
+            proc.is_kernel_task ? 0 : vm::page_fault_count(proc.cr3);
         string_util::copy(snapshot.image_path,
                           sizeof(snapshot.image_path),
                           proc.image_path[0] != '\0' ? proc.image_path : "(kernel)");
@@ -278,21 +315,32 @@ size_t usage_snapshot(descriptor_defs::TaskUsage* out, size_t max_entries) {
     return written;
 }
 
-void wake_ready_sleepers(uint64_t current_tick) {
-    for (size_t i = 0; i < kMaxProcesses; ++i) {
-        Process& proc = g_process_table[i];
-        if (load_state(proc) != State::Blocked ||
-            proc.sleep_until_tick == 0) {
-            continue;
-        }
-        if (current_tick < proc.sleep_until_tick) {
-            continue;
-        }
-        proc.sleep_until_tick = 0;
+void block_until(Process& proc, uint64_t wake_tick) {
+    // Armed before Blocked is published, so a wake() racing the store
+    // always finds the timer and cancels it.
+    arm_timeout(proc, wake_tick, sleep_expired);
+    store_state(proc, State::Blocked);
+    // An expiry that ran before the store saw the process still running.
+    if (!timer_wheel::pending(proc.sleep_timer) &&
+        timekeeping::tick_count() >= proc.sleep_until_tick) {
         (void)wake(proc);
     }
 }
 
+void arm_timeout(Process& proc,
+                 uint64_t wake_tick,
+                 timer_wheel::Callback callback) {
+    proc.sleep_until_tick = wake_tick != 0 ? wake_tick : 1;
+    if (timer_wheel::arm(proc.sleep_timer, wake_tick, callback, &proc)) {
+        scheduler::wake_tick_cpu();
+    }
+}
+
+void cancel_timeout(Process& proc) {
+    timer_wheel::cancel(proc.sleep_timer);
+    proc.sleep_until_tick = 0;
+}
+
 bool wake(Process& proc) {
     if (!begin_wake(proc)) {
         return false;
@@ -310,6 +358,8 @@ bool begin_wake(Process& proc) {
 }
 
 void finish_wake(Process& proc) {
+    trace::record(trace::Event::Wake, proc.pid);
+    cancel_timeout(proc);
     proc.waiting_on = nullptr;
     store_state(proc, State::Ready);
     scheduler::enqueue(&proc);
@@ -345,6 +395,7 @@ void terminate(Process& proc, uint16_t exit_code) {
             break;
         }
     }
+    cancel_timeout(proc);
     proc.has_exited = true;
     proc.exit_code = exit_code;
 
@@ -468,6 +519,12 @@ void reclaim(Process& proc) {
         vm::release_address_space(proc.cr3);
         paging_destroy_address_space(proc.cr3);
     }
+    // Only after the address space is gone: the frames may be freed here.
+    for (size_t i = 0; i < kMaxMappedImages; ++i) {
+        image_cache::release(proc.mapped_images[i]);
+        proc.mapped_images[i] = nullptr;
+    }
+    loader::release_lazy_bindings(proc);
 
     // Do not leave children pointing at a slot that can be reused for an
     // unrelated process.
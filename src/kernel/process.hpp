@@ -9,14 +9,21 @@
 #include "fs/vfs.hpp"
 #include "path_util.hpp"
 #include "capabilities.hpp"
+#include "image_cache.hpp"
+#include "timer_wheel.hpp"
 #include "vm.hpp"
 
+namespace loader {
+struct LazyBindings;
+}
+
 namespace process {
 
 constexpr size_t kMaxProcesses = 256;
 constexpr size_t kKernelStackSize = 0x4000;
 constexpr size_t kMaxFileHandles = 16;
 constexpr size_t kMaxDirectoryHandles = 8;
+constexpr size_t kMaxMappedImages = 8;
 
 enum class State {
     Unused = 0,
@@ -66,8 +73,11 @@ struct Process {
     uint32_t reclaim_cpu;
     void (*kernel_entry)(Process&);
     uint32_t preferred_cpu;  // UINT32_MAX means unassigned
+    uint32_t run_queue;      // CPU whose run queue holds this task, or UINT32_MAX
+    uint32_t stack_cpu;      // CPU still using kernel_stack, or UINT32_MAX
     uint32_t vty_id;
-    uint64_t sleep_until_tick;
+    uint64_t sleep_until_tick;  // 0 unless sleep_timer is armed
+    timer_wheel::Timer sleep_timer;
     uint64_t user_ticks;
     uint64_t kernel_ticks;
     uint64_t wait_descriptors_user;
@@ -81,10 +91,16 @@ struct Process {
     descriptor::Table descriptors;
     descriptor_defs::DescriptorWait
         wait_descriptors[descriptor::kMaxWaitDescriptors];
+    // Registrations on the wait queues of wait_descriptors while Blocked.
+    descriptor::WaitLink wait_links[descriptor::kMaxWaitDescriptors];
     capabilities::Principal* principal;
     capabilities::CapHandleEntry cap_handles[capabilities::kMaxProcessCapabilities];
     FileHandle file_handles[kMaxFileHandles];
     DirectoryHandle directory_handles[kMaxDirectoryHandles];
+    // Cached shared objects whose frames this process maps.
+    image_cache::Image* mapped_images[kMaxMappedImages];
+    // Symbol tables for PLT slots the loader left to bind on first call.
+    loader::LazyBindings* lazy_bindings;
 };
 
 inline State load_state(const Process& proc) {
@@ -113,10 +129,19 @@ Process* allocate_kernel_task(void (*entry)(Process&));
 Process* current();
 void set_current(Process* proc);
 Process* table_entry(size_t index);
+// Slot of proc in the process table, or kMaxProcesses for other tasks.
+size_t table_index(const Process& proc);
 Process* find_by_pid(uint32_t pid);
 void record_tick(bool user_mode);
 size_t usage_snapshot(descriptor_defs::TaskUsage* out, size_t max_entries);
-void wake_ready_sleepers(uint64_t current_tick);
+// Publishes proc as Blocked and arms its sleep timer for wake_tick. Any
+// earlier wake() cancels the timer. The caller still has to reschedule.
+void block_until(Process& proc, uint64_t wake_tick);
+// Arms proc's sleep timer with a custom expiry, for blocking calls with a
+// timeout. Arm it before publishing Blocked, so a concurrent wake() cancels
+// it; callback recheck that the wait it was armed for is still in progress.
+void arm_timeout(Process& proc, uint64_t wake_tick, timer_wheel::Callback callback);
+void cancel_timeout(Process& proc);
 bool wake(Process& proc);
 bool begin_wake(Process& proc);
 void finish_wake(Process& proc);
@@ -3,6 +3,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arch/x86_64/registers.hpp"
+
 namespace {
 
 uint64_t g_state = 0;
@@ -29,19 +31,12 @@ bool rdrand64(uint64_t& value) {
     return ok != 0;
 }
 
-uint64_t read_tsc() {
-    uint32_t low = 0;
-    uint32_t high = 0;
-    asm volatile("rdtsc" : "=a"(low), "=d"(high));
-    return (static_cast<uint64_t>(high) << 32) | low;
-}
-
 uint64_t fallback_value() {
     uint64_t observed = __atomic_load_n(&g_state, __ATOMIC_RELAXED);
     for (;;) {
         uint64_t state = observed;
         if (state == 0) {
-            state = read_tsc() ^ reinterpret_cast<uintptr_t>(&g_state) ^
+            state = cpu::read_tsc() ^ reinterpret_cast<uintptr_t>(&g_state) ^
                     0x9E3779B97F4A7C15ull;
         }
         state ^= state >> 12;
@@ -4,9 +4,11 @@
 
 #include "drivers/fs/block_cache.hpp"
 #include "drivers/log/logging.hpp"
+#include "drivers/timer/pit.hpp"
 #include "lib/mem.hpp"
 #include "arch/x86_64/cpu_features.hpp"
 #include "arch/x86_64/gdt.hpp"
+#include "arch/x86_64/lapic.hpp"
 #include "arch/x86_64/tss.hpp"
 #include "arch/x86_64/registers.hpp"
 #include "arch/x86_64/memory/paging.hpp"
@@ -15,20 +17,25 @@
 #include "arch/x86_64/smp.hpp"
 #include "descriptor.hpp"
 #include "debug_heartbeat.hpp"
+#include "interrupts.hpp"
 #include "sync.hpp"
 #include "time.hpp"
+#include "timer_wheel.hpp"
 
 namespace {
 
 struct RunQueue {
+    sync::SpinLock lock;
     process::Process* items[process::kMaxProcesses];
     size_t head = 0;
     size_t count = 0;
+    size_t user_count = 0;
 };
 
+constexpr uint32_t kNoCpu = UINT32_MAX;
+
 RunQueue g_run_queues[percpu::kMaxCpus];
 size_t g_cpu_total = 0;
-sync::SpinLock g_queue_lock;
 uint32_t g_rr_assign = 0;
 constexpr size_t kMaxPollFns = 16;
 scheduler::PollFn g_poll_fns[kMaxPollFns]{};
@@ -37,8 +44,26 @@ process::Process* g_poll_worker = nullptr;
 bool g_poll_worker_starting = false;
 constexpr uint64_t kTargetLatencyNs = 6'000'000ull;
 constexpr uint64_t kMinGranularityNs = 900'000ull;
+constexpr uint64_t kRebalanceIntervalNs = 20'000'000ull;
 uint64_t g_slice_start_ticks[percpu::kMaxCpus]{};
 uint64_t g_slice_duration_ticks[percpu::kMaxCpus]{};
+uint64_t g_last_rebalance_ticks[percpu::kMaxCpus]{};
+constexpr uint8_t kLocalTimerVector = 0x40;
+constexpr uint32_t kLocalTimerPeriodicCount = 10'000'000;
+// Longest an idle tickless CPU stays halted. Wake IPIs normally end the halt
+// sooner; this bounds how late a missed wakeup or a pending steal is noticed.
+constexpr uint64_t kIdleTimeoutNs = 100'000'000ull;
+// APs run their LAPIC timer one-shot once this is set. CPU 0 keeps the PIT,
+// which drives the global tick count and the timer wheel, and stops it only
+// while idle; see stop_tick().
+bool g_tickless = false;
+uint8_t g_wake_vector = 0;
+// Nonzero while a CPU is inside idle_wait() and may be halted.
+uint32_t g_idle[percpu::kMaxCpus]{};
+// Process whose kernel stack each CPU entered the kernel on most recently.
+// A CPU keeps running on that stack until it next enters from a different
+// process, so the owner cannot migrate until the CPU has moved on.
+process::Process* g_stack_owner[percpu::kMaxCpus]{};
 
 [[maybe_unused]] void halt_system() {
     for (;;) {
@@ -53,18 +78,8 @@ RunQueue& queue_for_cpu(size_t idx) {
     return g_run_queues[idx];
 }
 
-bool queue_contains(process::Process* proc) {
-    for (size_t q = 0; q < percpu::kMaxCpus; ++q) {
-        RunQueue& rq = g_run_queues[q];
-        size_t idx = rq.head;
-        for (size_t i = 0; i < rq.count; ++i) {
-            if (rq.items[idx] == proc) {
-                return true;
-            }
-            idx = (idx + 1) % process::kMaxProcesses;
-        }
-    }
-    return false;
+size_t queue_length(const RunQueue& rq) {
+    return __atomic_load_n(&rq.count, __ATOMIC_RELAXED);
 }
 
 void queue_push(RunQueue& rq, process::Process* proc) {
@@ -73,7 +88,10 @@ void queue_push(RunQueue& rq, process::Process* proc) {
     }
     size_t tail = (rq.head + rq.count) % process::kMaxProcesses;
     rq.items[tail] = proc;
-    ++rq.count;
+    __atomic_store_n(&rq.count, rq.count + 1, __ATOMIC_RELAXED);
+    if (!proc->is_kernel_task) {
+        __atomic_store_n(&rq.user_count, rq.user_count + 1, __ATOMIC_RELAXED);
+    }
 }
 
 process::Process* queue_pop(RunQueue& rq) {
@@ -82,7 +100,10 @@ process::Process* queue_pop(RunQueue& rq) {
     }
     process::Process* proc = rq.items[rq.head];
     rq.head = (rq.head + 1) % process::kMaxProcesses;
-    --rq.count;
+    __atomic_store_n(&rq.count, rq.count - 1, __ATOMIC_RELAXED);
+    if (proc != nullptr && !proc->is_kernel_task && rq.user_count != 0) {
+        __atomic_store_n(&rq.user_count, rq.user_count - 1, __ATOMIC_RELAXED);
+    }
     return proc;
 }
 
@@ -98,7 +119,7 @@ size_t poll_count_locked() {
 
 class QueueGuard {
 public:
-    QueueGuard() : guard_(g_queue_lock) {}
+    explicit QueueGuard(RunQueue& queue) : guard_(queue.lock) {}
 private:
     sync::IrqLockGuard guard_;
 };
@@ -111,80 +132,257 @@ private:
 };
 
 size_t current_cpu_index();
+void wake_idle_cpu(size_t target, bool stealable);
 
-process::Process* pop_next_runnable(bool include_kernel_tasks) {
-    for (;;) {
-        process::Process* candidate = nullptr;
+size_t active_cpu_total() {
+    size_t total = __atomic_load_n(&g_cpu_total, __ATOMIC_ACQUIRE);
+    size_t online = smp::online_cpus();
+    if (online != 0 && online < total) {
+        total = online;
+    }
+    if (total == 0) {
+        total = 1;
+    }
+    if (total > percpu::kMaxCpus) {
+        total = percpu::kMaxCpus;
+    }
+    return total;
+}
+
+// Records that this CPU is now executing on |proc|'s kernel stack and
+// releases the stack it was using before, which makes that task migratable.
+void note_stack_owner(process::Process* proc) {
+    size_t idx = current_cpu_index();
+    process::Process* previous = g_stack_owner[idx];
+    if (previous == proc) {
+        return;
+    }
+    if (previous != nullptr) {
+        uint32_t expected = static_cast<uint32_t>(idx);
+        __atomic_compare_exchange_n(&previous->stack_cpu,
+                                    &expected,
+                                    kNoCpu,
+                                    false,
+                                    __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED);
+    }
+    g_stack_owner[idx] = proc;
+}
+
+// Claims |proc|'s kernel stack for the CPU that is about to dispatch it.
+void claim_stack(process::Process& proc) {
+    if (proc.is_kernel_task) {
+        return;
+    }
+    __atomic_store_n(&proc.stack_cpu,
+                     static_cast<uint32_t>(current_cpu_index()),
+                     __ATOMIC_RELEASE);
+}
+
+// A task can run here only once no other CPU is still unwinding on its
+// kernel stack.
+bool stack_available(const process::Process& proc, size_t cpu_idx) {
+    uint32_t owner = __atomic_load_n(&proc.stack_cpu, __ATOMIC_ACQUIRE);
+    return owner == kNoCpu || owner == cpu_idx;
+}
+
+bool can_migrate(const process::Process& proc, size_t cpu_idx) {
+    return !proc.is_kernel_task &&
+           process::load_state(proc) == process::State::Ready &&
+           stack_available(proc, cpu_idx);
+}
+
+void mark_dequeued(process::Process* proc) {
+    __atomic_store_n(&proc->run_queue, kNoCpu, __ATOMIC_RELEASE);
+}
+
+// Pops the first task on |queue| accepted by |accept|, dropping stale entries
+// and rotating rejected ones back to the tail.  Caller holds the queue lock.
+template <typename Accept>
+process::Process* take_locked(RunQueue& queue, Accept accept) {
+    size_t remaining = queue.count;
+    while (remaining-- != 0) {
+        process::Process* proc = queue_pop(queue);
+        if (proc == nullptr) {
+            break;
+        }
+        process::State state = process::load_state(*proc);
+        if (state != process::State::Ready) {
+            mark_dequeued(proc);
+            continue;
+        }
+        if (!accept(*proc)) {
+            queue_push(queue, proc);
+            continue;
+        }
+        mark_dequeued(proc);
+        return proc;
+    }
+    return nullptr;
+}
+
+void adopt_task(process::Process& proc, size_t cpu_idx) {
+    __atomic_store_n(&proc.preferred_cpu,
+                     static_cast<uint32_t>(cpu_idx),
+                     __ATOMIC_RELAXED);
+}
+
+process::Process* steal_runnable(size_t self) {
+    size_t total = active_cpu_total();
+    for (size_t offset = 1; offset < total; ++offset) {
+        size_t victim = (self + offset) % total;
+        RunQueue& queue = g_run_queues[victim];
+        if (__atomic_load_n(&queue.user_count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        process::Process* proc = nullptr;
         {
-            QueueGuard guard;
-            RunQueue& queue = queue_for_cpu(current_cpu_index());
-            size_t remaining = queue.count;
-            while (remaining-- != 0) {
-                process::Process* proc = queue_pop(queue);
-                if (proc == nullptr) {
-                    break;
-                }
-                process::State state = process::load_state(*proc);
-                if (state == process::State::Reclaiming) {
-                    continue;
-                }
-                if (state != process::State::Ready) {
-                    continue;
-                }
-                if (!include_kernel_tasks && proc->is_kernel_task) {
-                    queue_push(queue, proc);
-                    continue;
-                }
+            QueueGuard guard(queue);
+            proc = take_locked(queue, [self](process::Process& candidate) {
+                return can_migrate(candidate, self);
+            });
+            if (proc != nullptr) {
                 process::State expected = process::State::Ready;
-                if (process::compare_exchange_state(*proc,
-                                                    expected,
-                                                    process::State::Running)) {
-                    candidate = proc;
-                    break;
+                if (!process::compare_exchange_state(*proc,
+                                                     expected,
+                                                     process::State::Running)) {
+                    proc = nullptr;
                 }
             }
         }
+        if (proc != nullptr) {
+            adopt_task(*proc, self);
+            percpu::record_steal();
+            return proc;
+        }
+    }
+    return nullptr;
+}
 
-        if (candidate == nullptr) {
-            return nullptr;
+process::Process* pop_next_runnable(bool include_kernel_tasks) {
+    size_t self = current_cpu_index();
+    RunQueue& queue = queue_for_cpu(self);
+    process::Process* candidate = nullptr;
+    {
+        QueueGuard guard(queue);
+        for (;;) {
+            candidate = take_locked(queue, [&](process::Process& proc) {
+                if (!include_kernel_tasks && proc.is_kernel_task) {
+                    return false;
+                }
+                return proc.is_kernel_task || stack_available(proc, self);
+            });
+            if (candidate == nullptr) {
+                break;
+            }
+            process::State expected = process::State::Ready;
+            if (process::compare_exchange_state(*candidate,
+                                                expected,
+                                                process::State::Running)) {
+                break;
+            }
         }
+    }
+    if (candidate != nullptr) {
         return candidate;
     }
+    return steal_runnable(self);
 }
 
 void poll_worker(process::Process& proc) {
     scheduler::service_polls();
-    {
-        PollGuard guard;
-        // Pollers are fallbacks for devices without a working interrupt path;
-        // they do not need to make this worker permanently runnable.  Keeping
-        // it Ready caused every userspace yield to service every poller inline,
-        // which could delay interactive input behind USB and network work.
-        if (poll_count_locked() != 0) {
-            uint64_t now = timekeeping::tick_count();
-            proc.sleep_until_tick = now == UINT64_MAX ? UINT64_MAX : now + 1;
-        } else {
-            proc.sleep_until_tick = 0;
+    // Pollers are fallbacks for devices without a working interrupt path;
+    // they do not need to make this worker permanently runnable.  Keeping
+    // it Ready caused every userspace yield to service every poller inline,
+    // which could delay interactive input behind USB and network work.
+    // CPU 0's tick wakes it for the next pass, see wake_poll_worker().
+    process::store_state(proc, process::State::Blocked);
+}
+
+void wake_poll_worker() {
+    process::Process* worker = __atomic_load_n(&g_poll_worker, __ATOMIC_ACQUIRE);
+    if (worker != nullptr) {
+        (void)process::wake(*worker);
+    }
+}
+
+size_t target_cpu_for(process::Process& proc) {
+    size_t total = active_cpu_total();
+    uint32_t preferred = __atomic_load_n(&proc.preferred_cpu, __ATOMIC_RELAXED);
+    if (preferred == UINT32_MAX || preferred >= total) {
+        uint32_t choice = __atomic_fetch_add(&g_rr_assign, 1, __ATOMIC_RELAXED);
+        preferred = static_cast<uint32_t>(choice % total);
+        __atomic_store_n(&proc.preferred_cpu, preferred, __ATOMIC_RELAXED);
+    }
+    return preferred;
+}
+
+// Queues |proc| on its preferred CPU unless it already sits on some queue.
+// The membership check runs under the lock of the queue holding the task, so
+// a concurrent pop either sees the Ready state or has already dequeued it.
+void enqueue_ready(process::Process* proc) {
+    uint32_t pushed = kNoCpu;
+    for (;;) {
+        uint32_t queued = __atomic_load_n(&proc->run_queue, __ATOMIC_ACQUIRE);
+        uint32_t target = queued != kNoCpu
+                              ? queued
+                              : static_cast<uint32_t>(target_cpu_for(*proc));
+        RunQueue& queue = queue_for_cpu(target);
+        QueueGuard guard(queue);
+        if (process::load_state(*proc) != process::State::Ready) {
+            return;
+        }
+        queued = __atomic_load_n(&proc->run_queue, __ATOMIC_ACQUIRE);
+        if (queued == target) {
+            return;
+        }
+        if (queued != kNoCpu) {
+            continue;
         }
-        process::store_state(proc, process::State::Blocked);
+        __atomic_store_n(&proc->run_queue, target, __ATOMIC_RELEASE);
+        queue_push(queue, proc);
+        pushed = target;
+        break;
     }
+    wake_idle_cpu(pushed, !proc->is_kernel_task);
 }
 
-void enqueue_locked(process::Process* proc) {
-    size_t total = g_cpu_total;
-    size_t online = smp::online_cpus();
-    if (online != 0 && online < total) {
-        total = online;
+// Pulls one migratable task from the busiest queue when it is at least two
+// tasks longer than ours.  Stealing only helps CPUs that are already idle;
+// this keeps busy CPUs from sitting next to an overloaded sibling.
+void rebalance(size_t self) {
+    size_t total = active_cpu_total();
+    if (total <= 1 || self >= total) {
+        return;
     }
-    if (total == 0) {
-        total = 1;
+    size_t own = __atomic_load_n(&g_run_queues[self].user_count, __ATOMIC_RELAXED);
+    size_t busiest = self;
+    size_t busiest_len = own;
+    for (size_t q = 0; q < total; ++q) {
+        size_t len = __atomic_load_n(&g_run_queues[q].user_count, __ATOMIC_RELAXED);
+        if (len > busiest_len) {
+            busiest = q;
+            busiest_len = len;
+        }
     }
-    if (proc->preferred_cpu == UINT32_MAX || proc->preferred_cpu >= total) {
-        uint32_t choice = __atomic_fetch_add(&g_rr_assign, 1, __ATOMIC_RELAXED);
-        proc->preferred_cpu = static_cast<uint32_t>(choice % total);
+    if (busiest == self || busiest_len < own + 2) {
+        return;
+    }
+
+    process::Process* proc = nullptr;
+    {
+        RunQueue& source = g_run_queues[busiest];
+        QueueGuard guard(source);
+        proc = take_locked(source, [self](process::Process& candidate) {
+            return can_migrate(candidate, self);
+        });
     }
-    size_t target = static_cast<size_t>(proc->preferred_cpu % total);
-    queue_push(queue_for_cpu(target), proc);
+    if (proc == nullptr) {
+        return;
+    }
+    adopt_task(*proc, self);
+    percpu::record_migration();
+    enqueue_ready(proc);
 }
 
 size_t current_cpu_index() {
@@ -195,21 +393,9 @@ size_t current_cpu_index() {
     return cpu->index;
 }
 
-size_t runnable_user_task_count_locked(process::Process* current_proc) {
-    size_t total = 0;
-    for (size_t q = 0; q < percpu::kMaxCpus; ++q) {
-        RunQueue& rq = g_run_queues[q];
-        size_t idx = rq.head;
-        for (size_t i = 0; i < rq.count; ++i) {
-            process::Process* proc = rq.items[idx];
-            if (proc != nullptr &&
-                !proc->is_kernel_task &&
-                process::load_state(*proc) == process::State::Ready) {
-                ++total;
-            }
-            idx = (idx + 1) % process::kMaxProcesses;
-        }
-    }
+size_t runnable_user_task_count(process::Process* current_proc) {
+    const RunQueue& queue = queue_for_cpu(current_cpu_index());
+    size_t total = __atomic_load_n(&queue.user_count, __ATOMIC_RELAXED);
     if (current_proc != nullptr &&
         !current_proc->is_kernel_task &&
         (process::load_state(*current_proc) == process::State::Running ||
@@ -219,8 +405,8 @@ size_t runnable_user_task_count_locked(process::Process* current_proc) {
     return total == 0 ? 1 : total;
 }
 
-uint64_t timeslice_ticks_locked(process::Process* current_proc) {
-    size_t task_count = runnable_user_task_count_locked(current_proc);
+uint64_t timeslice_ticks(process::Process* current_proc) {
+    size_t task_count = runnable_user_task_count(current_proc);
     uint64_t slice_ns = kTargetLatencyNs / static_cast<uint64_t>(task_count);
     if (slice_ns < kMinGranularityNs) {
         slice_ns = kMinGranularityNs;
@@ -228,27 +414,145 @@ uint64_t timeslice_ticks_locked(process::Process* current_proc) {
     return timekeeping::ticks_for_duration_ns(slice_ns);
 }
 
-void begin_timeslice_locked(process::Process* proc) {
+bool tickless_cpu(size_t idx) {
+    return idx != 0 && __atomic_load_n(&g_tickless, __ATOMIC_ACQUIRE);
+}
+
+// Programs the next local timer interrupt on a tickless CPU: the end of the
+// running user task's slice, or the idle timeout when there is none.
+void arm_local_timer(process::Process* proc) {
+    size_t idx = current_cpu_index();
+    if (!tickless_cpu(idx)) {
+        return;
+    }
+    if (proc == nullptr || proc->is_kernel_task) {
+        lapic::arm_oneshot(kIdleTimeoutNs);
+        return;
+    }
+    uint64_t elapsed = timekeeping::tick_count() - g_slice_start_ticks[idx];
+    uint64_t duration = g_slice_duration_ticks[idx];
+    uint64_t remaining = duration > elapsed ? duration - elapsed : 0;
+    uint64_t delay_ns = remaining * timekeeping::nanoseconds_per_tick();
+    if (delay_ns < kMinGranularityNs) {
+        delay_ns = kMinGranularityNs;
+    }
+    lapic::arm_oneshot(delay_ns);
+}
+
+void begin_timeslice(process::Process* proc) {
     if (proc == nullptr || proc->is_kernel_task) {
         return;
     }
     size_t idx = current_cpu_index();
     g_slice_start_ticks[idx] = timekeeping::tick_count();
-    g_slice_duration_ticks[idx] = timeslice_ticks_locked(proc);
+    g_slice_duration_ticks[idx] = timeslice_ticks(proc);
+    arm_local_timer(proc);
+}
+
+// CPU 0 idles without its periodic tick when no poller needs one: the PIT
+// is armed one-shot for the next timer wheel deadline, and the wheel makes
+// arm() report anything due sooner so wake_tick_cpu() can cut the halt
+// short. Called with interrupts disabled and the idle flag published.
+bool stop_tick() {
+    if (!__atomic_load_n(&g_tickless, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    {
+        PollGuard guard;
+        if (poll_count_locked() != 0) {
+            return false;
+        }
+    }
+    uint64_t now = timekeeping::tick_count();
+    uint64_t latest =
+        now + timekeeping::ticks_for_duration_ns(pit::max_oneshot_ns());
+    uint64_t wake = timer_wheel::suspend(latest);
+    if (wake <= now + 1 || !timekeeping::stop_ticks()) {
+        timer_wheel::resume();
+        return false;
+    }
+    pit::arm_oneshot((wake - now) * timekeeping::nanoseconds_per_tick());
+    return true;
+}
+
+void restart_tick() {
+    timekeeping::start_ticks(pit::resume_periodic());
+    timer_wheel::resume();
+    timer_wheel::advance(timekeeping::tick_count());
+}
+
+// Halts until the next interrupt unless work is already queued here. The
+// idle flag is published before the queue is checked, pairing with the fence
+// in wake_idle_cpu(), so an enqueue either is seen here or sends an IPI.
+void idle_wait() {
+    uint64_t flags = sync::disable_interrupts();
+    size_t idx = current_cpu_index();
+    __atomic_store_n(&g_idle[idx], 1u, __ATOMIC_SEQ_CST);
+    if (queue_length(queue_for_cpu(idx)) == 0) {
+        // APs do not run the timer wheel, so their timeout only bounds how
+        // late a missed wakeup or a stealable task is noticed.
+        if (tickless_cpu(idx)) {
+            lapic::arm_oneshot(kIdleTimeoutNs);
+        }
+        bool stopped = idx == 0 && stop_tick();
+        percpu::idle_enter();
+        asm volatile("sti; hlt; cli" ::: "memory");
+        percpu::idle_exit();
+        if (stopped) {
+            restart_tick();
+        }
+    }
+    __atomic_store_n(&g_idle[idx], 0u, __ATOMIC_RELEASE);
+    sync::restore_interrupts(flags);
+}
+
+// A halted tickless CPU only notices new work on an interrupt, so kick the
+// target if it is idle. User tasks queued behind a busy CPU can be stolen,
+// so an idle sibling is woken for them instead.
+void wake_idle_cpu(size_t target, bool stealable) {
+    if (!__atomic_load_n(&g_tickless, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    size_t self = current_cpu_index();
+    size_t total = active_cpu_total();
+    size_t chosen = percpu::kMaxCpus;
+    if (target != self && __atomic_load_n(&g_idle[target], __ATOMIC_RELAXED)) {
+        chosen = target;
+    } else if (stealable) {
+        for (size_t offset = 1; offset < total; ++offset) {
+            size_t candidate = (target + offset) % total;
+            if (candidate != self &&
+                __atomic_load_n(&g_idle[candidate], __ATOMIC_RELAXED)) {
+                chosen = candidate;
+                break;
+            }
+        }
+    }
+    if (chosen == percpu::kMaxCpus) {
+        return;
+    }
+    percpu::Cpu* cpu = percpu::cpu_from_index(chosen);
+    if (cpu != nullptr) {
+        lapic::send_ipi(cpu->lapic_id, g_wake_vector);
+    }
 }
 
-bool timeslice_expired_locked(process::Process* proc) {
+// The interrupt itself ends the halt; idle_wait() rechecks the queues.
+void wake_ipi_handler() {}
+
+bool timeslice_expired(process::Process* proc) {
     if (proc == nullptr || proc->is_kernel_task) {
         return false;
     }
-    if (runnable_user_task_count_locked(proc) <= 1) {
-        begin_timeslice_locked(proc);
+    if (runnable_user_task_count(proc) <= 1) {
+        begin_timeslice(proc);
         return false;
     }
     size_t idx = current_cpu_index();
     uint64_t duration = g_slice_duration_ticks[idx];
     if (duration == 0) {
-        begin_timeslice_locked(proc);
+        begin_timeslice(proc);
         duration = g_slice_duration_ticks[idx];
     }
     uint64_t now = timekeeping::tick_count();
@@ -284,6 +588,7 @@ void prepare_frame_for_process(process::Process& proc,
                     static_cast<unsigned long long>(proc.user_sp));
     }
 
+    claim_stack(proc);
     set_rsp0(proc.kernel_stack_top);
     cpu::restore_fpu_state(proc.fpu_state);
 }
@@ -342,8 +647,11 @@ void init() {
     for (size_t i = 0; i < percpu::kMaxCpus; ++i) {
         g_run_queues[i].head = 0;
         g_run_queues[i].count = 0;
+        g_run_queues[i].user_count = 0;
         g_slice_start_ticks[i] = 0;
         g_slice_duration_ticks[i] = 0;
+        g_last_rebalance_ticks[i] = 0;
+        g_stack_owner[i] = nullptr;
     }
 }
 
@@ -366,8 +674,11 @@ void register_cpu(percpu::Cpu* cpu) {
     cpu->index = static_cast<uint32_t>(idx);
     g_run_queues[idx].head = 0;
     g_run_queues[idx].count = 0;
+    g_run_queues[idx].user_count = 0;
     g_slice_start_ticks[idx] = 0;
     g_slice_duration_ticks[idx] = 0;
+    g_last_rebalance_ticks[idx] = 0;
+    g_stack_owner[idx] = nullptr;
     cpu->registered = true;
     log_message(LogLevel::Info,
                 "Scheduler: registered CPU (LAPIC=%u total=%u)",
@@ -379,6 +690,17 @@ size_t cpu_total() {
     return __atomic_load_n(&g_cpu_total, __ATOMIC_SEQ_CST);
 }
 
+void wake_tick_cpu() {
+    if (current_cpu_index() == 0 ||
+        !__atomic_load_n(&g_idle[0], __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    percpu::Cpu* cpu = percpu::cpu_from_index(0);
+    if (cpu != nullptr) {
+        lapic::send_ipi(cpu->lapic_id, g_wake_vector);
+    }
+}
+
 bool register_poll(PollFn fn) {
     if (fn == nullptr) {
         return false;
@@ -426,7 +748,7 @@ bool register_poll(PollFn fn) {
             g_poll_worker_starting = false;
             if (worker != nullptr) {
                 worker->preferred_cpu = 0;
-                g_poll_worker = worker;
+                __atomic_store_n(&g_poll_worker, worker, __ATOMIC_RELEASE);
                 worker_to_wake = worker;
             }
         }
@@ -466,23 +788,26 @@ void enqueue(process::Process* proc) {
     if (proc == nullptr) {
         return;
     }
-    QueueGuard guard;
-    process::State state = process::load_state(*proc);
-    if (state != process::State::Ready) {
+    if (process::load_state(*proc) != process::State::Ready) {
         return;
     }
-    if (!queue_contains(proc)) {
-        enqueue_locked(proc);
-    }
+    enqueue_ready(proc);
 }
 
 void remove(process::Process* proc) {
     if (proc == nullptr) {
         return;
     }
-    QueueGuard guard;
-    for (size_t q = 0; q < percpu::kMaxCpus; ++q) {
-        RunQueue& queue = g_run_queues[q];
+    for (;;) {
+        uint32_t queued = __atomic_load_n(&proc->run_queue, __ATOMIC_ACQUIRE);
+        if (queued == kNoCpu) {
+            return;
+        }
+        RunQueue& queue = queue_for_cpu(queued);
+        QueueGuard guard(queue);
+        if (__atomic_load_n(&proc->run_queue, __ATOMIC_ACQUIRE) != queued) {
+            continue;
+        }
         size_t remaining = queue.count;
         while (remaining-- != 0) {
             process::Process* candidate = queue_pop(queue);
@@ -490,6 +815,8 @@ void remove(process::Process* proc) {
                 queue_push(queue, candidate);
             }
         }
+        mark_dequeued(proc);
+        return;
     }
 }
 
@@ -499,9 +826,8 @@ void remove(process::Process* proc) {
         process::Process* next = pop_next_runnable(true);
         if (next == nullptr) {
             process::set_current(nullptr);
-            fs::block_cache::service_idle_flush();
-            asm volatile("pause");
-            asm volatile("sti; hlt");
+            fs::block_cache::service_idle();
+            idle_wait();
             continue;
         }
         if (next->is_kernel_task) {
@@ -512,10 +838,7 @@ void remove(process::Process* proc) {
                 next->kernel_entry(*next);
             }
             if (process::load_state(*next) == process::State::Ready) {
-                QueueGuard guard;
-                if (!queue_contains(next)) {
-                    enqueue_locked(next);
-                }
+                enqueue_ready(next);
             }
             continue;
         }
@@ -523,10 +846,8 @@ void remove(process::Process* proc) {
             continue;
         }
         process::set_current(next);
-        {
-            QueueGuard guard;
-            begin_timeslice_locked(next);
-        }
+        begin_timeslice(next);
+        claim_stack(*next);
         set_rsp0(next->kernel_stack_top);
         userspace::enter_process(*next);
         log_message(LogLevel::Error,
@@ -541,6 +862,7 @@ void reschedule_impl(syscall::SyscallFrame& frame, bool run_kernel_tasks) {
     if (current_proc == nullptr) {
         return;
     }
+    note_stack_owner(current_proc);
 
     process::State current_state = process::load_state(*current_proc);
     while (current_state == process::State::Waking) {
@@ -565,18 +887,13 @@ void reschedule_impl(syscall::SyscallFrame& frame, bool run_kernel_tasks) {
     }
 
     process::Process* next = nullptr;
-    {
-        QueueGuard guard;
-        if (!terminated) {
-            if (process::load_state(*current_proc) == process::State::Running) {
-                process::store_state(*current_proc, process::State::Ready);
-            }
-            if (process::load_state(*current_proc) == process::State::Ready &&
-                !queue_contains(current_proc)) {
-                enqueue_locked(current_proc);
-            }
+    if (!terminated) {
+        if (process::load_state(*current_proc) == process::State::Running) {
+            process::store_state(*current_proc, process::State::Ready);
+        }
+        if (process::load_state(*current_proc) == process::State::Ready) {
+            enqueue_ready(current_proc);
         }
-
     }
     next = pop_next_runnable(run_kernel_tasks);
 
@@ -589,10 +906,7 @@ void reschedule_impl(syscall::SyscallFrame& frame, bool run_kernel_tasks) {
                 next->kernel_entry(*next);
             }
             if (process::load_state(*next) == process::State::Ready) {
-                QueueGuard guard;
-                if (!queue_contains(next)) {
-                    enqueue_locked(next);
-                }
+                enqueue_ready(next);
             }
             // fetch another runnable task (prefer userspace)
             next = pop_next_runnable(run_kernel_tasks);
@@ -636,17 +950,14 @@ void reschedule_impl(syscall::SyscallFrame& frame, bool run_kernel_tasks) {
         cpu::write_fs_base(0);
 
         do {
-            fs::block_cache::service_idle_flush();
-            asm volatile("sti; hlt; cli" ::: "memory");
+            fs::block_cache::service_idle();
+            idle_wait();
             next = pop_next_runnable(run_kernel_tasks);
         } while (next == nullptr);
     }
 
     process::set_current(next);
-    {
-        QueueGuard guard;
-        begin_timeslice_locked(next);
-    }
+    begin_timeslice(next);
     if (terminated && current_proc != nullptr) {
         process::defer_reclaim(*current_proc);
     }
@@ -672,22 +983,72 @@ void tick(InterruptFrame& frame) {
     percpu::Cpu* cpu = percpu::current_cpu();
     if (cpu != nullptr && cpu->index == 0) {
         debug_heartbeat::tick(timekeeping::tick_count());
-        process::wake_ready_sleepers(timekeeping::tick_count());
+        timer_wheel::advance(timekeeping::tick_count());
+        bool polling = false;
+        {
+            PollGuard guard;
+            polling = poll_count_locked() != 0;
+        }
+        if (polling) {
+            wake_poll_worker();
+        }
+    }
+    size_t idx = current_cpu_index();
+    uint64_t now = timekeeping::tick_count();
+    if (now - g_last_rebalance_ticks[idx] >=
+        timekeeping::ticks_for_duration_ns(kRebalanceIntervalNs)) {
+        g_last_rebalance_ticks[idx] = now;
+        rebalance(idx);
     }
     if ((frame.cs & 0x3) != 0) {
         process::Process* current_proc = process::current();
-        bool expired = false;
-        {
-            QueueGuard guard;
-            expired = timeslice_expired_locked(current_proc);
-        }
+        note_stack_owner(current_proc);
+        bool expired = timeslice_expired(current_proc);
         if (expired) {
             scheduler::reschedule_from_interrupt(frame);
         }
+        arm_local_timer(process::current());
         return;
     }
     // If we interrupted kernel mode, avoid clobbering the kernel frame.
     // Potentially blocking I/O is serviced only by its kernel worker.
+    arm_local_timer(process::current());
+}
+
+bool enable_tickless() {
+    if (!lapic::oneshot_available()) {
+        log_message(LogLevel::Warn,
+                    "Scheduler: LAPIC timer uncalibrated, APs keep periodic ticks");
+        return false;
+    }
+    uint8_t vector = interrupts::allocate_vector();
+    if (vector == 0 || !interrupts::register_vector(vector, wake_ipi_handler)) {
+        if (vector != 0) {
+            interrupts::free_vector(vector);
+        }
+        log_message(LogLevel::Warn,
+                    "Scheduler: no vector for wake IPIs, APs keep periodic ticks");
+        return false;
+    }
+    g_wake_vector = vector;
+    __atomic_store_n(&g_tickless, true, __ATOMIC_RELEASE);
+    log_message(LogLevel::Info,
+                "Scheduler: tickless idle enabled (wake vector %u)",
+                static_cast<unsigned>(vector));
+    return true;
+}
+
+void start_local_timer() {
+    percpu::Cpu* cpu = percpu::current_cpu();
+    if (cpu != nullptr) {
+        cpu->last_sample_tick = timekeeping::tick_count();
+    }
+    if (!tickless_cpu(current_cpu_index())) {
+        lapic::setup_timer(kLocalTimerVector, kLocalTimerPeriodicCount);
+        return;
+    }
+    lapic::setup_oneshot(kLocalTimerVector);
+    lapic::arm_oneshot(kIdleTimeoutNs);
 }
 
 [[noreturn]] void run_cpu() {
@@ -19,7 +19,17 @@ void reschedule_from_interrupt(InterruptFrame& frame);
 process::Process* current();
 void register_cpu(percpu::Cpu* cpu);
 void tick(InterruptFrame& frame);
+// Switches APs to one-shot LAPIC timers that are armed only for the end of
+// a timeslice or an idle timeout, with IPIs waking idle CPUs for new work,
+// and lets CPU 0 stop its PIT tick while idle with no pollers registered.
+// Call on the BSP before the APs are released. Returns false if the LAPIC
+// timer could not be calibrated.
+bool enable_tickless();
+// Starts this AP's local timer: one-shot when tickless, periodic otherwise.
+void start_local_timer();
 size_t cpu_total();
+// Ends CPU 0's tickless halt early, for a timeout due before its wakeup.
+void wake_tick_cpu();
 bool register_poll(PollFn fn);
 void service_polls();
 
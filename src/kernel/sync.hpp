@@ -29,6 +29,78 @@ private:
     volatile bool locked_{false};
 };
 
+// Many readers or one writer. A waiting writer holds off new readers so a
+// steady stream of them cannot starve it. Interrupts are left alone; do not
+// take it from interrupt context.
+class RwLock {
+public:
+    void lock_shared() {
+        for (;;) {
+            uint32_t state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+            if ((state & (kWriter | kWriterWaiting)) == 0 &&
+                __atomic_compare_exchange_n(&state_, &state, state + 1, false,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return;
+            }
+            asm volatile("pause");
+        }
+    }
+    void unlock_shared() { __atomic_fetch_sub(&state_, 1u, __ATOMIC_RELEASE); }
+    void lock() {
+        for (;;) {
+            uint32_t state = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+            if ((state & ~kWriterWaiting) == 0) {
+                if (__atomic_compare_exchange_n(&state_, &state, kWriter, false,
+                                                __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED)) {
+                    return;
+                }
+                continue;
+            }
+            if ((state & kWriterWaiting) == 0) {
+                __atomic_fetch_or(&state_, kWriterWaiting, __ATOMIC_RELAXED);
+            }
+            asm volatile("pause");
+        }
+    }
+    void unlock() { __atomic_fetch_and(&state_, ~kWriter, __ATOMIC_RELEASE); }
+private:
+    static constexpr uint32_t kWriter = 1u << 31;
+    static constexpr uint32_t kWriterWaiting = 1u << 30;
+    uint32_t state_{0};
+};
+
+class ReadLockGuard {
+public:
+    explicit ReadLockGuard(RwLock& lock) : lock_(lock) { lock_.lock_shared(); }
+    ~ReadLockGuard() { lock_.unlock_shared(); }
+    ReadLockGuard(const ReadLockGuard&) = delete;
+    ReadLockGuard& operator=(const ReadLockGuard&) = delete;
+private:
+    RwLock& lock_;
+};
+
+class WriteLockGuard {
+public:
+    explicit WriteLockGuard(RwLock& lock) : lock_(lock) { lock_.lock(); }
+    ~WriteLockGuard() { lock_.unlock(); }
+    WriteLockGuard(const WriteLockGuard&) = delete;
+    WriteLockGuard& operator=(const WriteLockGuard&) = delete;
+private:
+    RwLock& lock_;
+};
+
+class LockGuard {
+public:
+    explicit LockGuard(SpinLock& lock) : lock_(lock) { lock_.lock(); }
+    ~LockGuard() { lock_.unlock(); }
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+private:
+    SpinLock& lock_;
+};
+
 class IrqLockGuard {
 public:
     explicit IrqLockGuard(SpinLock& lock) : lock_(lock), flags_(disable_interrupts()) {
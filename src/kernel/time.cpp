@@ -1,6 +1,7 @@
 #include "time.hpp"
 
 #include "arch/x86_64/io.hpp"
+#include "arch/x86_64/registers.hpp"
 #include "../drivers/log/logging.hpp"
 
 #include <uacpi/acpi.h>
@@ -43,6 +44,15 @@ uint32_t g_tick_nanos_remainder = 0;
 uint64_t g_tick_count = 0;
 uint64_t g_uptime_nanoseconds = 0;
 bool g_initialized = false;
+// TSC bookkeeping for stopped ticks. g_last_tick_tsc is when the tick count
+// last moved; g_tick_lag_tsc is how far the restarted PIT runs behind the
+// tick boundaries, credited at the next catch-up so the clock does not drift.
+uint64_t g_tsc_per_tick = 0;
+uint64_t g_last_tick_tsc = 0;
+uint64_t g_tick_lag_tsc = 0;
+bool g_ticks_stopped = false;
+bool g_stopped_irq_seen = false;
+bool g_skip_tick = false;
 
 bool clock_available() {
     return __atomic_load_n(&g_initialized, __ATOMIC_ACQUIRE);
@@ -227,6 +237,52 @@ void end_write() {
     __atomic_fetch_add(&g_time_seq, 1u, __ATOMIC_RELEASE);
 }
 
+void advance_tick_locked() {
+    uint32_t remainder = g_tick_remainder + g_tick_nanos_remainder;
+    bool carried = false;
+    if (remainder >= g_tick_hz) {
+        remainder -= g_tick_hz;
+        carried = true;
+    }
+    if (clock_available()) {
+        uint64_t nanoseconds =
+            static_cast<uint64_t>(g_nanoseconds) + g_tick_nanos_floor;
+        if (carried) {
+            ++nanoseconds;
+        }
+        while (nanoseconds >= kNanosecondsPerSecond) {
+            nanoseconds -= kNanosecondsPerSecond;
+            ++g_unix_seconds;
+        }
+        g_nanoseconds = static_cast<uint32_t>(nanoseconds);
+    }
+    g_tick_remainder = remainder;
+    ++g_tick_count;
+    g_uptime_nanoseconds += g_tick_nanos_floor;
+    if (carried) ++g_uptime_nanoseconds;
+}
+
+// Ticks owed since the count last moved while the PIT is stopped.
+uint64_t stopped_ticks(uint64_t now_tsc) {
+    if (!__atomic_load_n(&g_ticks_stopped, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    uint64_t last = __atomic_load_n(&g_last_tick_tsc, __ATOMIC_RELAXED);
+    uint64_t lag = __atomic_load_n(&g_tick_lag_tsc, __ATOMIC_RELAXED);
+    uint64_t elapsed = now_tsc - last + lag;
+    return elapsed / g_tsc_per_tick;
+}
+
+void catch_up_locked(uint64_t now_tsc) {
+    uint64_t elapsed = now_tsc - g_last_tick_tsc + g_tick_lag_tsc;
+    uint64_t ticks = elapsed / g_tsc_per_tick;
+    for (uint64_t i = 0; i < ticks; ++i) {
+        advance_tick_locked();
+    }
+    g_last_tick_tsc = now_tsc;
+    g_tick_lag_tsc = elapsed - ticks * g_tsc_per_tick;
+}
+
 }  // namespace
 
 namespace timekeeping {
@@ -268,29 +324,45 @@ bool init_from_rtc(uint32_t pit_frequency_hz) {
 }
 
 void tick_pit() {
+    uint64_t now_tsc = cpu::read_tsc();
     begin_write();
-    uint32_t remainder = g_tick_remainder + g_tick_nanos_remainder;
-    bool carried = false;
-    if (remainder >= g_tick_hz) {
-        remainder -= g_tick_hz;
-        carried = true;
+    if (g_ticks_stopped) {
+        catch_up_locked(now_tsc);
+        g_stopped_irq_seen = true;
+    } else if (g_skip_tick) {
+        g_skip_tick = false;
+    } else {
+        advance_tick_locked();
+        g_last_tick_tsc = now_tsc;
     }
-    if (clock_available()) {
-        uint64_t nanoseconds =
-            static_cast<uint64_t>(g_nanoseconds) + g_tick_nanos_floor;
-        if (carried) {
-            ++nanoseconds;
-        }
-        while (nanoseconds >= kNanosecondsPerSecond) {
-            nanoseconds -= kNanosecondsPerSecond;
-            ++g_unix_seconds;
-        }
-        g_nanoseconds = static_cast<uint32_t>(nanoseconds);
+    end_write();
+}
+
+void set_tsc_hz(uint64_t tsc_hz) {
+    begin_write();
+    g_tsc_per_tick = g_tick_hz != 0 ? tsc_hz / g_tick_hz : 0;
+    end_write();
+}
+
+bool stop_ticks() {
+    if (g_tsc_per_tick == 0) {
+        return false;
+    }
+    begin_write();
+    g_ticks_stopped = true;
+    g_stopped_irq_seen = false;
+    end_write();
+    return true;
+}
+
+void start_ticks(bool irq_raised) {
+    uint64_t now_tsc = cpu::read_tsc();
+    begin_write();
+    if (g_ticks_stopped) {
+        catch_up_locked(now_tsc);
+        g_ticks_stopped = false;
+        g_skip_tick = irq_raised && !g_stopped_irq_seen;
     }
-    g_tick_remainder = remainder;
-    ++g_tick_count;
-    g_uptime_nanoseconds += g_tick_nanos_floor;
-    if (carried) ++g_uptime_nanoseconds;
     end_write();
 }
 
@@ -350,7 +422,8 @@ uint64_t tick_count() {
         if ((seq_before & 1u) != 0) {
             continue;
         }
-        ticks = __atomic_load_n(&g_tick_count, __ATOMIC_RELAXED);
+        ticks = __atomic_load_n(&g_tick_count, __ATOMIC_RELAXED) +
+                stopped_ticks(cpu::read_tsc());
         uint32_t seq_after = __atomic_load_n(&g_time_seq, __ATOMIC_ACQUIRE);
         if (seq_before == seq_after) {
             return ticks;
@@ -399,4 +472,9 @@ uint64_t ticks_for_duration_ns(uint64_t duration_ns) {
     return ticks == 0 ? 1 : ticks;
 }
 
+uint64_t nanoseconds_per_tick() {
+    uint32_t tick_hz = __atomic_load_n(&g_tick_hz, __ATOMIC_RELAXED);
+    return tick_hz == 0 ? 0 : kNanosecondsPerSecond / tick_hz;
+}
+
 }  // namespace timekeeping
@@ -9,9 +9,20 @@ namespace timekeeping {
 
 bool init_from_rtc(uint32_t pit_frequency_hz);
 void tick_pit();
+// Lets the tick count follow the TSC while the PIT is stopped.
+void set_tsc_hz(uint64_t tsc_hz);
+// Brackets a stretch in which the PIT may not interrupt every tick. Until
+// start_ticks(), tick_count() is extrapolated from the TSC, and an IRQ 0
+// in between credits every tick that passed rather than one. Returns false
+// when no TSC rate is known. irq_raised tells start_ticks() whether the PIT
+// raised IRQ 0 meanwhile; if tick_pit() has not run for it yet, it skips
+// that IRQ when it arrives.
+bool stop_ticks();
+void start_ticks(bool irq_raised);
 bool snapshot(NeutrinoWallTime& out_time);
 uint64_t tick_count();
 uint64_t ticks_for_duration_ns(uint64_t duration_ns);
+uint64_t nanoseconds_per_tick();
 uint64_t nanoseconds_since_boot();
 
 }  // namespace timekeeping
@@ -0,0 +1,297 @@
+#include "timer_wheel.hpp"
+
+#include "kernel/sync.hpp"
+
+namespace timer_wheel {
+
+namespace {
+
+// Level 0 holds one slot per tick for the next 256 ticks. Each further
+// level covers 64 times the span of the one below and is sorted down a
+// level when the ticks reach it, so a timer moves at most three times
+// before it fires.
+constexpr uint32_t kLevel0Bits = 8;
+constexpr uint32_t kLevelBits = 6;
+constexpr size_t kUpperLevels = 3;
+constexpr size_t kLevel0Slots = size_t{1} << kLevel0Bits;
+constexpr size_t kLevelSlots = size_t{1} << kLevelBits;
+constexpr size_t kSlotCount = kLevel0Slots + kUpperLevels * kLevelSlots;
+constexpr uint64_t kMaxDelta =
+    (uint64_t{1} << (kLevel0Bits + kUpperLevels * kLevelBits)) - 1;
+constexpr size_t kBitmapWords = kSlotCount / 64;
+
+static_assert(kSlotCount % 64 == 0, "slot bitmap must cover whole words");
+
+Timer* g_slots[kSlotCount]{};
+uint64_t g_occupied[kBitmapWords]{};
+// Next tick advance() has not processed yet.
+uint64_t g_base = 0;
+size_t g_armed = 0;
+// Tick the driving CPU will next advance at while its tick is stopped, or 0.
+uint64_t g_wake_tick = 0;
+sync::SpinLock g_lock;
+
+constexpr uint32_t level_shift(size_t level) {
+    return kLevel0Bits + static_cast<uint32_t>(level - 1) * kLevelBits;
+}
+
+constexpr size_t level_first_slot(size_t level) {
+    return kLevel0Slots + (level - 1) * kLevelSlots;
+}
+
+size_t slot_for_locked(uint64_t expires) {
+    if (expires < g_base) {
+        expires = g_base;
+    }
+    uint64_t delta = expires - g_base;
+    if (delta < kLevel0Slots) {
+        return static_cast<size_t>(expires & (kLevel0Slots - 1));
+    }
+    if (delta > kMaxDelta) {
+        // Parked in the last level; it is sorted again when reached.
+        expires = g_base + kMaxDelta;
+    }
+    for (size_t level = 1; level <= kUpperLevels; ++level) {
+        uint32_t shift = level_shift(level);
+        if (level == kUpperLevels ||
+            delta < (uint64_t{1} << (shift + kLevelBits))) {
+            return level_first_slot(level) +
+                   static_cast<size_t>((expires >> shift) & (kLevelSlots - 1));
+        }
+    }
+    return 0;
+}
+
+void link_locked(Timer& timer) {
+    size_t slot = slot_for_locked(timer.expires);
+    timer.slot = static_cast<uint16_t>(slot);
+    timer.prev = nullptr;
+    timer.next = g_slots[slot];
+    if (timer.next != nullptr) {
+        timer.next->prev = &timer;
+    }
+    g_slots[slot] = &timer;
+    g_occupied[slot / 64] |= 1ull << (slot % 64);
+}
+
+void unlink_locked(Timer& timer) {
+    size_t slot = timer.slot;
+    if (timer.prev != nullptr) {
+        timer.prev->next = timer.next;
+    } else {
+        g_slots[slot] = timer.next;
+    }
+    if (timer.next != nullptr) {
+        timer.next->prev = timer.prev;
+    }
+    if (g_slots[slot] == nullptr) {
+        g_occupied[slot / 64] &= ~(1ull << (slot % 64));
+    }
+    timer.next = nullptr;
+    timer.prev = nullptr;
+}
+
+// Moves every timer of one upper-level slot back through slot_for_locked.
+void cascade_locked(size_t slot) {
+    Timer* timer = g_slots[slot];
+    g_slots[slot] = nullptr;
+    g_occupied[slot / 64] &= ~(1ull << (slot % 64));
+    while (timer != nullptr) {
+        Timer* next = timer->next;
+        link_locked(*timer);
+        timer = next;
+    }
+}
+
+void cascade_for_tick_locked(uint64_t tick) {
+    for (size_t level = 1; level <= kUpperLevels; ++level) {
+        uint32_t shift = level_shift(level);
+        size_t index = static_cast<size_t>((tick >> shift) & (kLevelSlots - 1));
+        cascade_locked(level_first_slot(level) + index);
+        if (index != 0) {
+            break;
+        }
+    }
+}
+
+bool level0_empty_locked() {
+    for (size_t word = 0; word < kLevel0Slots / 64; ++word) {
+        if (g_occupied[word] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// First slot index at or after start (wrapping) with its bit set in the
+// bitmap range [first, first + count), or count when there is none.
+size_t next_occupied_locked(size_t first, size_t count, size_t start) {
+    for (size_t step = 0; step < count; ++step) {
+        size_t index = (start + step) & (count - 1);
+        size_t slot = first + index;
+        if ((g_occupied[slot / 64] & (1ull << (slot % 64))) != 0) {
+            return step;
+        }
+    }
+    return count;
+}
+
+uint64_t next_deadline_locked() {
+    if (g_armed == 0) {
+        return UINT64_MAX;
+    }
+    size_t base_index = static_cast<size_t>(g_base & (kLevel0Slots - 1));
+    size_t step = next_occupied_locked(0, kLevel0Slots, base_index);
+    if (step < kLevel0Slots) {
+        return g_base + step;
+    }
+    // Level 0 is empty: the earliest work is the next cascade of a
+    // non-empty upper slot. The slot at the current index is sorted when
+    // g_base sits on its group boundary; past that boundary it was already
+    // sorted for this lap and holds timers for the next one.
+    uint64_t earliest = UINT64_MAX;
+    for (size_t level = 1; level <= kUpperLevels; ++level) {
+        uint32_t shift = level_shift(level);
+        size_t current = static_cast<size_t>((g_base >> shift) & (kLevelSlots - 1));
+        size_t found = next_occupied_locked(level_first_slot(level),
+                                            kLevelSlots,
+                                            current);
+        if (found == kLevelSlots) {
+            continue;
+        }
+        bool current_pending = (g_base & ((uint64_t{1} << shift) - 1)) == 0;
+        uint64_t group = (g_base >> shift) +
+                         (found == 0 && !current_pending ? kLevelSlots : found);
+        uint64_t tick = group << shift;
+        if (tick < earliest) {
+            earliest = tick;
+        }
+    }
+    return earliest;
+}
+
+void mark_fired(void* context) {
+    *static_cast<bool*>(context) = true;
+}
+
+}  // namespace
+
+bool arm(Timer& timer, uint64_t expires_tick, Callback callback, void* context) {
+    sync::IrqLockGuard guard(g_lock);
+    if (timer.armed) {
+        unlink_locked(timer);
+    } else {
+        ++g_armed;
+    }
+    timer.expires = expires_tick;
+    timer.callback = callback;
+    timer.context = context;
+    timer.armed = true;
+    link_locked(timer);
+    return expires_tick < g_wake_tick;
+}
+
+bool cancel(Timer& timer) {
+    if (!__atomic_load_n(&timer.armed, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    sync::IrqLockGuard guard(g_lock);
+    if (!timer.armed) {
+        return false;
+    }
+    unlink_locked(timer);
+    timer.armed = false;
+    --g_armed;
+    return true;
+}
+
+bool pending(const Timer& timer) {
+    return __atomic_load_n(&timer.armed, __ATOMIC_ACQUIRE);
+}
+
+void advance(uint64_t now_tick) {
+    uint64_t flags = sync::disable_interrupts();
+    g_lock.lock();
+    while (g_base <= now_tick) {
+        if (g_armed == 0) {
+            g_base = now_tick + 1;
+            break;
+        }
+        uint64_t tick = g_base;
+        size_t index = static_cast<size_t>(tick & (kLevel0Slots - 1));
+        if (index == 0) {
+            cascade_for_tick_locked(tick);
+        } else if (level0_empty_locked()) {
+            // Nothing can fire before the next cascade; skip to it.
+            uint64_t next_cascade = (tick | (kLevel0Slots - 1)) + 1;
+            g_base = next_cascade <= now_tick ? next_cascade : now_tick + 1;
+            continue;
+        }
+        // Timers armed by the callbacks below for this tick or earlier
+        // land in the next slot instead of this one.
+        g_base = tick + 1;
+        while (g_slots[index] != nullptr) {
+            Timer& timer = *g_slots[index];
+            unlink_locked(timer);
+            Callback callback = timer.callback;
+            void* context = timer.context;
+            __atomic_store_n(&timer.armed, false, __ATOMIC_RELEASE);
+            --g_armed;
+            g_lock.unlock();
+            callback(context);
+            g_lock.lock();
+        }
+    }
+    g_lock.unlock();
+    sync::restore_interrupts(flags);
+}
+
+uint64_t next_deadline() {
+    sync::IrqLockGuard guard(g_lock);
+    return next_deadline_locked();
+}
+
+uint64_t suspend(uint64_t latest_tick) {
+    sync::IrqLockGuard guard(g_lock);
+    uint64_t deadline = next_deadline_locked();
+    g_wake_tick = deadline < latest_tick ? deadline : latest_tick;
+    return g_wake_tick;
+}
+
+void resume() {
+    sync::IrqLockGuard guard(g_lock);
+    g_wake_tick = 0;
+}
+
+bool self_check() {
+    // CPU 0's tick must not advance the scratch base underneath us.
+    uint64_t flags = sync::disable_interrupts();
+    uint64_t saved_base = 0;
+    {
+        sync::IrqLockGuard guard(g_lock);
+        if (g_armed != 0) {
+            sync::restore_interrupts(flags);
+            return true;
+        }
+        saved_base = g_base;
+        g_base = 300;
+    }
+    // Leaves g_base on the group boundary at 512 with the level-1 slot
+    // for ticks 512..767 not yet sorted.
+    Timer timer{};
+    bool fired = false;
+    arm(timer, 600, mark_fired, &fired);
+    advance(511);
+    bool ok = next_deadline() == 512;
+    advance(600);
+    ok = ok && fired;
+    cancel(timer);
+    {
+        sync::IrqLockGuard guard(g_lock);
+        g_base = saved_base;
+    }
+    sync::restore_interrupts(flags);
+    return ok;
+}
+
+}  // namespace timer_wheel
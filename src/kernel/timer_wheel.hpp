@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace timer_wheel {
+
+using Callback = void (*)(void* context);
+
+// One pending timeout, embedded in whatever owns it. A zeroed Timer is
+// idle; the wheel links it in while armed and the owner must cancel it
+// before the memory is reused.
+struct Timer {
+    Timer* next;
+    Timer* prev;
+    uint64_t expires;  // timekeeping tick
+    Callback callback;
+    void* context;
+    uint16_t slot;
+    bool armed;
+};
+
+// Arms timer to run callback(context) from the tick at or after
+// expires_tick, replacing any earlier arming. Deadlines already in the
+// past fire on the next tick. Returns true when the CPU that advances the
+// wheel has stopped its tick beyond expires_tick and must be woken.
+bool arm(Timer& timer, uint64_t expires_tick, Callback callback, void* context);
+// Returns true when the timer was still pending. A callback that advance()
+// has already taken off the wheel still runs, so callbacks recheck their
+// own state.
+bool cancel(Timer& timer);
+bool pending(const Timer& timer);
+// Runs every callback due at or before now_tick, without the wheel lock
+// held so callbacks may arm and cancel timers. Called from one CPU's tick.
+void advance(uint64_t now_tick);
+// First tick at which advance() can have work, or UINT64_MAX when nothing
+// is armed. Far timers are reported at the tick their group is sorted,
+// so this may be earlier than any real expiry but never later.
+uint64_t next_deadline();
+// For the CPU that advances the wheel, before it stops its tick: returns
+// next_deadline() capped at latest_tick and remembers it, so arm() can
+// report timers due sooner. resume() forgets it once ticks run again.
+uint64_t suspend(uint64_t latest_tick);
+void resume();
+// Runs a far timer through a cascade on a scratch base and checks
+// next_deadline() along the way. Only meaningful before anything is armed;
+// returns true without testing otherwise.
+bool self_check();
+
+}  // namespace timer_wheel
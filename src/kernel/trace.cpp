@@ -0,0 +1,175 @@
+#include "trace.hpp"
+
+#include "arch/x86_64/percpu.hpp"
+#include "arch/x86_64/registers.hpp"
+#include "drivers/log/logging.hpp"
+#include "kernel/process.hpp"
+#include "kernel/sync.hpp"
+
+namespace trace {
+
+namespace detail {
+
+uint32_t g_enabled_mask = 0;
+
+}  // namespace detail
+
+namespace {
+
+constexpr size_t kRecordsPerCpu = 1024;
+// Records copied out per trip through the read lock.
+constexpr size_t kReadBatch = 16;
+
+static_assert((kRecordsPerCpu & (kRecordsPerCpu - 1)) == 0,
+              "trace buffer size must be a power of two");
+
+struct Slot {
+    uint64_t ready;  // ticket + 1 once record is complete
+    descriptor_defs::TraceRecord record;
+};
+
+// Producers reserve a ticket by advancing head, so an interrupt that traces
+// while the CPU is half way through a record simply takes the next slot.
+// The reader stops at the first slot whose ready marker does not match its
+// ticket yet.
+struct Ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t recorded;
+    uint64_t dropped;
+    Slot slots[kRecordsPerCpu];
+};
+
+Ring g_rings[percpu::kMaxCpus]{};
+sync::SpinLock g_read_lock;
+uint64_t g_tsc_hz = 0;
+
+size_t take_locked(Ring& ring,
+                   descriptor_defs::TraceRecord* out,
+                   size_t max_records) {
+    size_t taken = 0;
+    uint64_t tail = ring.tail;
+    uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    while (taken < max_records && tail != head) {
+        const Slot& slot = ring.slots[tail & (kRecordsPerCpu - 1)];
+        if (__atomic_load_n(&slot.ready, __ATOMIC_ACQUIRE) != tail + 1) {
+            break;
+        }
+        out[taken++] = slot.record;
+        ++tail;
+        // Frees the slot for producers; the copy above must land first.
+        __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+    }
+    return taken;
+}
+
+}  // namespace
+
+namespace detail {
+
+void record_slow(Event event, uint64_t arg0, uint64_t arg1) {
+    percpu::Cpu* cpu = percpu::current_cpu();
+    uint32_t index = (cpu != nullptr) ? cpu->index : 0;
+    if (index >= percpu::kMaxCpus) {
+        return;
+    }
+    Ring& ring = g_rings[index];
+    uint64_t ticket = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    do {
+        uint64_t tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+        if (ticket - tail >= kRecordsPerCpu) {
+            __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&ring.head,
+                                          &ticket,
+                                          ticket + 1,
+                                          true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    Slot& slot = ring.slots[ticket & (kRecordsPerCpu - 1)];
+    process::Process* proc =
+        (cpu != nullptr) ? cpu->current_process : nullptr;
+    slot.record.tsc = cpu::read_tsc();
+    slot.record.event = static_cast<uint16_t>(event);
+    slot.record.cpu = static_cast<uint16_t>(index);
+    slot.record.pid = (proc != nullptr) ? proc->pid : 0;
+    slot.record.arg0 = arg0;
+    slot.record.arg1 = arg1;
+    __atomic_store_n(&slot.ready, ticket + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ring.recorded, 1, __ATOMIC_RELAXED);
+}
+
+}  // namespace detail
+
+void init(uint64_t tsc_hz) {
+    g_tsc_hz = tsc_hz;
+    log_message(LogLevel::Info,
+                "Trace: %zu records per CPU, TSC %llu kHz",
+                kRecordsPerCpu,
+                static_cast<unsigned long long>(g_tsc_hz / 1000));
+}
+
+void configure(uint32_t enable_mask, bool clear) {
+    enable_mask &= descriptor_defs::kTraceAllEvents;
+    if (clear) {
+        // Stop producers first so the discarded window is well defined;
+        // anything reserved before the store is skipped along with the rest.
+        __atomic_store_n(&detail::g_enabled_mask, 0u, __ATOMIC_SEQ_CST);
+        sync::IrqLockGuard guard(g_read_lock);
+        for (auto& ring : g_rings) {
+            __atomic_store_n(&ring.tail,
+                             __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+            __atomic_store_n(&ring.recorded, 0ull, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring.dropped, 0ull, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&detail::g_enabled_mask, enable_mask, __ATOMIC_SEQ_CST);
+}
+
+descriptor_defs::TraceStatus status() {
+    descriptor_defs::TraceStatus result{};
+    result.enabled_mask =
+        __atomic_load_n(&detail::g_enabled_mask, __ATOMIC_RELAXED);
+    result.cpu_count = static_cast<uint32_t>(percpu::cpu_count());
+    result.tsc_hz = g_tsc_hz;
+    for (const auto& ring : g_rings) {
+        result.recorded += __atomic_load_n(&ring.recorded, __ATOMIC_RELAXED);
+        result.dropped += __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+size_t read(descriptor_defs::TraceRecord* out, size_t max_records) {
+    if (out == nullptr) {
+        return 0;
+    }
+    size_t total = 0;
+    for (auto& ring : g_rings) {
+        while (total < max_records) {
+            descriptor_defs::TraceRecord batch[kReadBatch];
+            size_t want = max_records - total;
+            if (want > kReadBatch) {
+                want = kReadBatch;
+            }
+            size_t taken = 0;
+            {
+                sync::IrqLockGuard guard(g_read_lock);
+                taken = take_locked(ring, batch, want);
+            }
+            // Copy to the caller with interrupts on; out may fault in.
+            for (size_t i = 0; i < taken; ++i) {
+                out[total + i] = batch[i];
+            }
+            total += taken;
+            if (taken < want) {
+                break;
+            }
+        }
+    }
+    return total;
+}
+
+}  // namespace trace
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "descriptors.hpp"
+
+namespace trace {
+
+using Event = descriptor_defs::TraceEvent;
+
+namespace detail {
+
+extern uint32_t g_enabled_mask;
+void record_slow(Event event, uint64_t arg0, uint64_t arg1);
+
+}  // namespace detail
+
+inline bool enabled(Event event) {
+    return (__atomic_load_n(&detail::g_enabled_mask, __ATOMIC_RELAXED) &
+            descriptor_defs::trace_event_bit(event)) != 0;
+}
+
+// Tracepoint. While its event is disabled this is one load and a branch;
+// enabled, it appends a record to the current CPU's buffer and never
+// blocks, so it is safe from interrupt handlers and under any lock. A full
+// buffer drops the record and counts it.
+inline void record(Event event, uint64_t arg0 = 0, uint64_t arg1 = 0) {
+    if (enabled(event)) {
+        detail::record_slow(event, arg0, arg1);
+    }
+}
+
+// Records the TSC rate reported by TraceStatus; every event starts disabled.
+void init(uint64_t tsc_hz);
+// Replaces the set of enabled events, optionally discarding what is
+// buffered first.
+void configure(uint32_t enable_mask, bool clear);
+descriptor_defs::TraceStatus status();
+// Moves up to max_records buffered records into out and returns how many.
+// Records are consumed; out may be a user buffer of the current process.
+size_t read(descriptor_defs::TraceRecord* out, size_t max_records);
+
+}  // namespace trace
@@ -11,16 +11,34 @@ namespace {
 constexpr uint64_t kPageSize = 0x1000;
 constexpr uint64_t kPageMask = kPageSize - 1;
 constexpr size_t kMaxAddressSpaces = 256;
+constexpr size_t kMaxLazyAreas = 32;
+constexpr uint64_t kPageFaultPresent = 1ull << 0;
+constexpr uint64_t kPageFaultWrite = 1ull << 1;
+// Pages unmapped per TLB shootdown before their frames are freed.
+constexpr size_t kUnmapBatchPages = 32;
+constexpr uint64_t kLargePageSize = PAGING_LARGE_PAGE_SIZE;
+constexpr size_t kLargePagePages = kLargePageSize / kPageSize;
 
 constexpr uint64_t kUserCodeBase = vm::kUserAddressSpaceBase;
 constexpr uint64_t kUserStackCeiling = vm::kUserAddressSpaceTop;
 uint64_t g_next_shared_user_code = kUserCodeBase;
 sync::SpinLock g_address_space_state_lock;
 
+// Anonymous mapping whose pages are only allocated and zeroed when they are
+// first touched. page_flags are the PTE flags used to populate it.
+struct LazyArea {
+    uint64_t base;
+    uint64_t length;
+    uint64_t page_flags;
+};
+
 struct AddressSpaceState {
     uint64_t cr3;
     uint64_t next_user_code;
     uint64_t next_user_stack;
+    uint64_t page_faults;
+    size_t lazy_count;
+    LazyArea lazy[kMaxLazyAreas];
     bool in_use;
 };
 
@@ -43,16 +61,69 @@ bool page_aligned_length(size_t length, size_t& out) {
     return out != 0;
 }
 
-void rollback_user_pages(uint64_t cr3, uint64_t base, size_t page_count) {
-    for (size_t i = 0; i < page_count; ++i) {
+// Allocates and zeroes a 2 MiB frame, or returns 0 when no block is free.
+// Zeroing takes a while, so callers do it before taking any lock.
+uint64_t alloc_zeroed_large_frame() {
+    uint64_t phys = memory::alloc_user_huge_page();
+    if (phys != 0) {
+        memset(paging_phys_to_virt(phys), 0, kLargePageSize);
+    }
+    return phys;
+}
+
+void free_large_frame(uint64_t phys) {
+    for (size_t i = 0; i < kLargePagePages; ++i) {
+        memory::free_user_page(phys + static_cast<uint64_t>(i) * kPageSize);
+    }
+}
+
+// Maps a frame from alloc_zeroed_large_frame() at virt. Returns false, with
+// the frame still owned by the caller, when the slot already holds pages.
+bool install_large_page(uint64_t cr3, uint64_t virt, uint64_t phys,
+                        uint64_t flags) {
+    return paging_large_slot_free_cr3(cr3, virt) &&
+           paging_map_large_page_cr3(cr3, virt, phys, flags);
+}
+
+// Unmaps page_count pages starting at base and frees their frames. Frames
+// are only released after the batch's TLB shootdown, so no other CPU can
+// still reach them through a stale translation.
+void unmap_user_pages(uint64_t cr3, uint64_t base, size_t page_count) {
+    uint64_t freed[kUnmapBatchPages];
+    size_t freed_count = 0;
+    size_t i = 0;
+    while (i < page_count) {
+        uint64_t virt = base + static_cast<uint64_t>(i) * kPageSize;
         uint64_t phys = 0;
-        if (paging_unmap_page_cr3(
-                cr3, base + static_cast<uint64_t>(i) * kPageSize, phys)) {
-            memory::free_user_page(phys);
+        uint64_t large_phys = 0;
+        size_t step = 1;
+        if ((virt & (kLargePageSize - 1)) == 0 &&
+            page_count - i >= kLargePagePages &&
+            paging_unmap_large_page_cr3(cr3, virt, large_phys)) {
+            step = kLargePagePages;
+        } else if (paging_unmap_page_cr3(cr3, virt, phys)) {
+            freed[freed_count++] = phys;
+        }
+        i += step;
+        if (large_phys != 0 || freed_count == kUnmapBatchPages ||
+            (i >= page_count && freed_count != 0)) {
+            (void)paging_flush_tlb_cr3(cr3);
+            for (size_t j = 0; j < freed_count; ++j) {
+                memory::free_user_page(freed[j]);
+            }
+            freed_count = 0;
+            for (size_t j = 0; large_phys != 0 && j < kLargePagePages; ++j) {
+                memory::free_user_page(large_phys +
+                                       static_cast<uint64_t>(j) * kPageSize);
+            }
         }
     }
 }
 
+void rollback_user_pages(uint64_t cr3, uint64_t base, size_t page_count) {
+    unmap_user_pages(cr3, base, page_count);
+}
+
 AddressSpaceState* find_address_space_state(uint64_t cr3) {
     if (cr3 == 0) {
         return nullptr;
@@ -70,11 +141,274 @@ AddressSpaceState* find_address_space_state(uint64_t cr3) {
         state.cr3 = cr3;
         state.next_user_code = kUserCodeBase;
         state.next_user_stack = kUserStackCeiling;
+        state.page_faults = 0;
+        state.lazy_count = 0;
         return &state;
     }
     return nullptr;
 }
 
+// Like find_address_space_state() but never claims a new slot.
+AddressSpaceState* lookup_address_space_state(uint64_t cr3) {
+    if (cr3 == 0) {
+        return nullptr;
+    }
+    for (auto& state : g_address_space_states) {
+        if (state.in_use && state.cr3 == cr3) {
+            return &state;
+        }
+    }
+    return nullptr;
+}
+
+const LazyArea* find_lazy_area(const AddressSpaceState& state,
+                               uint64_t address) {
+    for (size_t i = 0; i < state.lazy_count; ++i) {
+        const LazyArea& area = state.lazy[i];
+        if (address >= area.base && address - area.base < area.length) {
+            return &area;
+        }
+    }
+    return nullptr;
+}
+
+bool overlaps_lazy_area(const AddressSpaceState& state,
+                        uint64_t base,
+                        uint64_t length) {
+    for (size_t i = 0; i < state.lazy_count; ++i) {
+        const LazyArea& area = state.lazy[i];
+        if (base < area.base + area.length && area.base < base + length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool add_lazy_area(AddressSpaceState& state,
+                   uint64_t base,
+                   uint64_t length,
+                   uint64_t page_flags) {
+    // map_anonymous() hands out addresses in ascending order, so most new
+    // areas extend the previous one and do not need a slot of their own.
+    for (size_t i = 0; i < state.lazy_count; ++i) {
+        LazyArea& area = state.lazy[i];
+        if (area.page_flags == page_flags && area.base + area.length == base) {
+            area.length += length;
+            return true;
+        }
+    }
+    if (state.lazy_count >= kMaxLazyAreas) {
+        return false;
+    }
+    state.lazy[state.lazy_count++] = LazyArea{base, length, page_flags};
+    return true;
+}
+
+// Drops [base, base + length) from the lazy areas, splitting an area when the
+// range falls strictly inside it. Fails without changes if a split would
+// overflow the table.
+bool remove_lazy_range(AddressSpaceState& state,
+                       uint64_t base,
+                       uint64_t length) {
+    const uint64_t end = base + length;
+    size_t splits = 0;
+    for (size_t i = 0; i < state.lazy_count; ++i) {
+        const LazyArea& area = state.lazy[i];
+        if (area.base < base && area.base + area.length > end) {
+            ++splits;
+        }
+    }
+    if (state.lazy_count + splits > kMaxLazyAreas) {
+        return false;
+    }
+
+    size_t i = 0;
+    while (i < state.lazy_count) {
+        LazyArea& area = state.lazy[i];
+        const uint64_t area_end = area.base + area.length;
+        if (area_end <= base || area.base >= end) {
+            ++i;
+            continue;
+        }
+        if (area.base < base && area_end > end) {
+            state.lazy[state.lazy_count++] =
+                LazyArea{end, area_end - end, area.page_flags};
+            area.length = base - area.base;
+            ++i;
+        } else if (area.base < base) {
+            area.length = base - area.base;
+            ++i;
+        } else if (area_end > end) {
+            area.length = area_end - end;
+            area.base = end;
+            ++i;
+        } else {
+            state.lazy[i] = state.lazy[--state.lazy_count];
+        }
+    }
+    return true;
+}
+
+// Looks up the lazy area a fault at address may populate, with its address
+// space state. Needs g_address_space_state_lock.
+const LazyArea* fault_area_locked(uint64_t cr3,
+                                  uint64_t address,
+                                  bool write,
+                                  AddressSpaceState*& out_state) {
+    out_state = lookup_address_space_state(cr3);
+    if (out_state == nullptr) {
+        return nullptr;
+    }
+    const LazyArea* area = find_lazy_area(*out_state, address);
+    if (area == nullptr ||
+        (write && (area->page_flags & PAGE_FLAG_WRITE) == 0)) {
+        return nullptr;
+    }
+    return area;
+}
+
+bool area_covers_large(const LazyArea& area, uint64_t large) {
+    return large >= area.base &&
+           area.base + area.length - large >= kLargePageSize;
+}
+
+bool map_fault_page_locked(AddressSpaceState& state,
+                           uint64_t cr3,
+                           uint64_t page,
+                           uint64_t flags) {
+    uint64_t phys = memory::alloc_user_page();
+    if (phys == 0) {
+        return false;
+    }
+    memset(paging_phys_to_virt(phys), 0, kPageSize);
+    if (!paging_map_page_cr3(cr3, page, phys, flags)) {
+        memory::free_user_page(phys);
+        return false;
+    }
+    ++state.page_faults;
+    return true;
+}
+
+// Backs the page containing address with a fresh zeroed frame if it lies in
+// a lazy area. Returns true when the page is present afterwards.
+bool fault_in_user_page(uint64_t cr3, uint64_t address, bool write) {
+    uint64_t page = align_down(address, kPageSize);
+    uint64_t large = align_down(address, kLargePageSize);
+    {
+        sync::IrqLockGuard guard(g_address_space_state_lock);
+        AddressSpaceState* state = nullptr;
+        const LazyArea* area = fault_area_locked(cr3, address, write, state);
+        if (area == nullptr) {
+            return false;
+        }
+        uint64_t phys = 0;
+        if (paging_resolve_cr3(cr3, page, phys)) {
+            // Another path populated it first, or the CPU raised a spurious
+            // fault on a freshly installed page table.
+            return true;
+        }
+        if (!area_covers_large(*area, large) ||
+            !paging_large_slot_free_cr3(cr3, large)) {
+            return map_fault_page_locked(*state, cr3, page, area->page_flags);
+        }
+    }
+
+    // Back the whole 2 MiB block at once. Zeroing it takes too long to do
+    // under the lock, so the area and the slot are checked again after.
+    uint64_t large_phys = alloc_zeroed_large_frame();
+    bool present = false;
+    bool large_used = false;
+    {
+        sync::IrqLockGuard guard(g_address_space_state_lock);
+        AddressSpaceState* state = nullptr;
+        const LazyArea* area = fault_area_locked(cr3, address, write, state);
+        uint64_t phys = 0;
+        if (area == nullptr) {
+            present = false;
+        } else if (paging_resolve_cr3(cr3, page, phys)) {
+            present = true;
+        } else if (large_phys != 0 && area_covers_large(*area, large) &&
+                   install_large_page(cr3, large, large_phys,
+                                      area->page_flags)) {
+            ++state->page_faults;
+            present = true;
+            large_used = true;
+        } else {
+            present =
+                map_fault_page_locked(*state, cr3, page, area->page_flags);
+        }
+    }
+    if (large_phys != 0 && !large_used) {
+        free_large_frame(large_phys);
+    }
+    return present;
+}
+
+// Replaces a copy-on-write page with a private copy of its frame. The
+// shared frame stays with the image cache. Returns true when the page is
+// writable afterwards.
+bool break_copy_on_write(uint64_t cr3, uint64_t address) {
+    sync::IrqLockGuard guard(g_address_space_state_lock);
+    uint64_t page = align_down(address, kPageSize);
+    uint64_t shared = 0;
+    uint64_t flags = 0;
+    if (!paging_resolve_cr3(cr3, page, shared) ||
+        !paging_flags_cr3(cr3, page, flags)) {
+        return false;
+    }
+    if ((flags & PAGE_FLAG_COPY_ON_WRITE) == 0) {
+        // Already copied by an earlier fault or kernel access.
+        return (flags & PAGE_FLAG_WRITE) != 0;
+    }
+    if ((flags & PAGE_FLAG_COW_WRITABLE) == 0) {
+        return false;
+    }
+
+    uint64_t phys = memory::alloc_user_page();
+    if (phys == 0) {
+        return false;
+    }
+    memcpy(paging_phys_to_virt(phys),
+           paging_phys_to_virt(align_down(shared, kPageSize)),
+           kPageSize);
+    uint64_t private_flags = (flags & (PAGE_FLAG_USER | PAGE_FLAG_NO_EXECUTE)) |
+                             PAGE_FLAG_WRITE | PAGE_FLAG_MANAGED;
+    if (!paging_map_page_cr3(cr3, page, phys, private_flags)) {
+        memory::free_user_page(phys);
+        return false;
+    }
+    AddressSpaceState* state = lookup_address_space_state(cr3);
+    if (state != nullptr) {
+        ++state->page_faults;
+    }
+    return true;
+}
+
+// Resolves a user address for a kernel-side access, populating lazy pages
+// and copying shared image pages on the way so the kernel never takes the
+// fault itself.
+bool resolve_user_page(uint64_t cr3,
+                       uint64_t address,
+                       bool write,
+                       uint64_t& phys,
+                       uint64_t& flags) {
+    if (!paging_resolve_cr3(cr3, address, phys) &&
+        (!fault_in_user_page(cr3, address, write) ||
+         !paging_resolve_cr3(cr3, address, phys))) {
+        return false;
+    }
+    if (!paging_flags_cr3(cr3, address, flags)) {
+        return false;
+    }
+    if (!write || (flags & PAGE_FLAG_COW_WRITABLE) == 0 ||
+        (flags & PAGE_FLAG_COPY_ON_WRITE) == 0) {
+        return true;
+    }
+    return break_copy_on_write(cr3, address) &&
+           paging_resolve_cr3(cr3, address, phys) &&
+           paging_flags_cr3(cr3, address, flags);
+}
+
 vm::Region reserve_private_region(uint64_t cr3, size_t length) {
     vm::Region region{0, 0};
     if (cr3 == 0 || length == 0) {
@@ -90,7 +424,11 @@ vm::Region reserve_private_region(uint64_t cr3, size_t length) {
         return region;
     }
 
-    uint64_t base = align_up(state->next_user_code, kPageSize);
+    // Regions big enough for a 2 MiB page start on a 2 MiB boundary so the
+    // fault path can back them with large pages.
+    uint64_t base = align_up(state->next_user_code,
+                             padded >= kLargePageSize ? kLargePageSize
+                                                      : kPageSize);
     size_t pages = padded / kPageSize;
     uint64_t total = static_cast<uint64_t>(pages) * kPageSize;
     if (!vm::is_user_range(base, total)) {
@@ -364,14 +702,41 @@ uint64_t map_region(uint64_t cr3,
         map_flags |= PAGE_FLAG_WRITE;
     }
 
-    for (uint64_t offset = 0; offset < total; offset += kPageSize) {
-        uint64_t phys = 0;
-        if (paging_resolve_cr3(cr3, base + offset, phys)) {
+    {
+        sync::IrqLockGuard guard(g_address_space_state_lock);
+        AddressSpaceState* state = find_address_space_state(cr3);
+        if (state == nullptr || overlaps_lazy_area(*state, base, total)) {
             return 0;
         }
+        for (uint64_t offset = 0; offset < total; offset += kPageSize) {
+            uint64_t phys = 0;
+            if (paging_resolve_cr3(cr3, base + offset, phys)) {
+                return 0;
+            }
+        }
+        // Pages are populated by the fault handler on first touch. Fall back
+        // to eager mapping if the caller asked for it or the table is full.
+        if ((flags & kMapPopulate) == 0 &&
+            add_lazy_area(*state, base, total, map_flags)) {
+            return base;
+        }
     }
 
-    for (uint64_t offset = 0; offset < total; offset += kPageSize) {
+    uint64_t offset = 0;
+    while (offset < total) {
+        if (((base + offset) & (kLargePageSize - 1)) == 0 &&
+            total - offset >= kLargePageSize &&
+            paging_large_slot_free_cr3(cr3, base + offset)) {
+            uint64_t large_phys = alloc_zeroed_large_frame();
+            if (large_phys != 0) {
+                if (install_large_page(cr3, base + offset, large_phys,
+                                       map_flags)) {
+                    offset += kLargePageSize;
+                    continue;
+                }
+                free_large_frame(large_phys);
+            }
+        }
         uint64_t phys = memory::alloc_user_page();
         if (phys == 0) {
             rollback_user_pages(cr3,
@@ -388,6 +753,7 @@ uint64_t map_region(uint64_t cr3,
                                 static_cast<size_t>(offset / kPageSize));
             return 0;
         }
+        offset += kPageSize;
     }
 
     return base;
@@ -418,6 +784,8 @@ void release_address_space(uint64_t cr3) {
         state.cr3 = 0;
         state.next_user_code = 0;
         state.next_user_stack = 0;
+        state.page_faults = 0;
+        state.lazy_count = 0;
         return;
     }
 }
@@ -444,25 +812,51 @@ bool unmap_region(uint64_t cr3, uint64_t addr, size_t length) {
         return false;
     }
 
+    sync::IrqLockGuard guard(g_address_space_state_lock);
+    AddressSpaceState* state = lookup_address_space_state(cr3);
     for (uint64_t offset = 0; offset < total; offset += kPageSize) {
         uint64_t phys = 0;
         uint64_t page_flags = 0;
-        if (!paging_resolve_cr3(cr3, addr + offset, phys) ||
-            !paging_flags_cr3(cr3, addr + offset, page_flags) ||
+        if (!paging_resolve_cr3(cr3, addr + offset, phys)) {
+            // Untouched pages of a lazy mapping have nothing to free.
+            if (state == nullptr ||
+                find_lazy_area(*state, addr + offset) == nullptr) {
+                return false;
+            }
+            continue;
+        }
+        if (!paging_flags_cr3(cr3, addr + offset, page_flags) ||
             (page_flags & PAGE_FLAG_MANAGED) == 0) {
             return false;
         }
     }
-
-    for (uint64_t offset = 0; offset < total; offset += kPageSize) {
-        uint64_t phys = 0;
-        if (paging_unmap_page_cr3(cr3, addr + offset, phys)) {
-            memory::free_user_page(phys);
-        }
+    if (state != nullptr && !remove_lazy_range(*state, addr, total)) {
+        return false;
     }
+
+    unmap_user_pages(cr3, addr, static_cast<size_t>(total / kPageSize));
     return true;
 }
 
+bool handle_page_fault(uint64_t cr3, uint64_t address, uint64_t error_code) {
+    if (!is_user_range(address, 1)) {
+        return false;
+    }
+    if ((error_code & kPageFaultPresent) != 0) {
+        return (error_code & kPageFaultWrite) != 0 &&
+               break_copy_on_write(cr3, address);
+    }
+    return fault_in_user_page(cr3,
+                              address,
+                              (error_code & kPageFaultWrite) != 0);
+}
+
+uint64_t page_fault_count(uint64_t cr3) {
+    sync::IrqLockGuard guard(g_address_space_state_lock);
+    AddressSpaceState* state = lookup_address_space_state(cr3);
+    return state != nullptr ? state->page_faults : 0;
+}
+
 bool set_user_region_writable(uint64_t cr3,
                               uint64_t addr,
                               size_t length,
@@ -480,13 +874,12 @@ bool set_user_region_writable(uint64_t cr3,
         return false;
     }
 
-    for (uint64_t virt = base; virt < end; virt += kPageSize) {
-        if (!paging_set_writable_cr3(cr3, virt, writable)) {
-            return false;
-        }
+    bool ok = true;
+    for (uint64_t virt = base; virt < end && ok; virt += kPageSize) {
+        ok = paging_set_writable_cr3(cr3, virt, writable);
     }
-
-    return true;
+    // One shootdown covers the whole range.
+    return paging_flush_tlb_cr3(cr3) && ok;
 }
 
 bool set_user_region_executable(uint64_t cr3,
@@ -506,12 +899,24 @@ bool set_user_region_executable(uint64_t cr3,
         return false;
     }
 
-    for (uint64_t virt = base; virt < end; virt += kPageSize) {
-        if (!paging_set_executable_cr3(cr3, virt, executable)) {
-            return false;
-        }
+    bool ok = true;
+    for (uint64_t virt = base; virt < end && ok; virt += kPageSize) {
+        ok = paging_set_executable_cr3(cr3, virt, executable);
     }
-    return true;
+    return paging_flush_tlb_cr3(cr3) && ok;
+}
+
+bool map_copy_on_write(uint64_t cr3, uint64_t virt, uint64_t phys) {
+    if (cr3 == 0 || (virt & kPageMask) != 0 || (phys & kPageMask) != 0 ||
+        !is_user_range(virt, kPageSize)) {
+        return false;
+    }
+    return paging_map_page_cr3(cr3,
+                               virt,
+                               phys,
+                               PAGE_FLAG_USER | PAGE_FLAG_NO_EXECUTE |
+                                   PAGE_FLAG_COPY_ON_WRITE |
+                                   PAGE_FLAG_COW_WRITABLE);
 }
 
 void release_user_region(uint64_t cr3, const Region& region) {
@@ -520,14 +925,7 @@ void release_user_region(uint64_t cr3, const Region& region) {
     }
     uint64_t base = align_down(region.base, kPageSize);
     uint64_t limit = align_up(region.length, kPageSize);
-    for (uint64_t offset = 0; offset < limit; offset += kPageSize) {
-        uint64_t virt = base + offset;
-        uint64_t phys = 0;
-        if (!paging_unmap_page_cr3(cr3, virt, phys)) {
-            continue;
-        }
-        memory::free_user_page(phys);
-    }
+    unmap_user_pages(cr3, base, static_cast<size_t>(limit / kPageSize));
 }
 
 bool is_user_range(uint64_t address, uint64_t length) {
@@ -562,8 +960,7 @@ bool validate_user_buffer(uint64_t cr3,
     while (remaining != 0) {
         uint64_t phys = 0;
         uint64_t flags = 0;
-        if (!paging_resolve_cr3(cr3, current, phys) ||
-            !paging_flags_cr3(cr3, current, flags) ||
+        if (!resolve_user_page(cr3, current, writable, phys, flags) ||
             (flags & PAGE_FLAG_USER) == 0 ||
             (writable && (flags & PAGE_FLAG_WRITE) == 0)) {
             return false;
@@ -622,11 +1019,8 @@ bool copy_to_user(uint64_t cr3,
     while (offset < length) {
         uint64_t dest_addr = dest + offset;
         uint64_t phys = 0;
-        if (!paging_resolve_cr3(cr3, dest_addr, phys)) {
-            return false;
-        }
         uint64_t page_flags = 0;
-        if (!paging_flags_cr3(cr3, dest_addr, page_flags) ||
+        if (!resolve_user_page(cr3, dest_addr, true, phys, page_flags) ||
             (page_flags & PAGE_FLAG_USER) == 0 ||
             (page_flags & PAGE_FLAG_WRITE) == 0) {
             return false;
@@ -661,11 +1055,8 @@ bool copy_from_user(uint64_t cr3,
     while (offset < length) {
         uint64_t src_addr = src + offset;
         uint64_t phys = 0;
-        if (!paging_resolve_cr3(cr3, src_addr, phys)) {
-            return false;
-        }
         uint64_t page_flags = 0;
-        if (!paging_flags_cr3(cr3, src_addr, page_flags) ||
+        if (!resolve_user_page(cr3, src_addr, false, phys, page_flags) ||
             (page_flags & PAGE_FLAG_USER) == 0) {
             return false;
         }
@@ -698,11 +1089,8 @@ bool fill_user(uint64_t cr3,
     while (offset < length) {
         uint64_t dest_addr = dest + offset;
         uint64_t phys = 0;
-        if (!paging_resolve_cr3(cr3, dest_addr, phys)) {
-            return false;
-        }
         uint64_t page_flags = 0;
-        if (!paging_flags_cr3(cr3, dest_addr, page_flags) ||
+        if (!resolve_user_page(cr3, dest_addr, true, phys, page_flags) ||
             (page_flags & PAGE_FLAG_USER) == 0 ||
             (page_flags & PAGE_FLAG_WRITE) == 0) {
             return false;
@@ -719,4 +1107,52 @@ bool fill_user(uint64_t cr3,
     return true;
 }
 
+size_t resolve_user_segments(uint64_t cr3,
+                             uint64_t address,
+                             size_t length,
+                             bool writable,
+                             UserSegment* out,
+                             size_t max_segments,
+                             size_t& out_count) {
+    out_count = 0;
+    if (length == 0 || cr3 == 0 || address == 0 || out == nullptr ||
+        max_segments == 0) {
+        return 0;
+    }
+    if (!is_user_range(address, static_cast<uint64_t>(length))) {
+        return 0;
+    }
+    uint64_t next_phys = 0;
+    size_t offset = 0;
+    while (offset < length) {
+        uint64_t addr = address + offset;
+        uint64_t phys = 0;
+        uint64_t page_flags = 0;
+        if (!resolve_user_page(cr3, addr, writable, phys, page_flags) ||
+            (page_flags & PAGE_FLAG_USER) == 0 ||
+            (writable && (page_flags & PAGE_FLAG_WRITE) == 0)) {
+            // Faulting past the first page is a short transfer, not an error.
+            break;
+        }
+        size_t page_off = static_cast<size_t>(addr & kPageMask);
+        size_t chunk = kPageSize - page_off;
+        if (chunk > length - offset) {
+            chunk = length - offset;
+        }
+        if (out_count != 0 && phys == next_phys) {
+            out[out_count - 1].length += chunk;
+        } else if (out_count < max_segments) {
+            out[out_count].data =
+                static_cast<uint8_t*>(paging_phys_to_virt(phys));
+            out[out_count].length = chunk;
+            ++out_count;
+        } else {
+            break;
+        }
+        next_phys = phys + chunk;
+        offset += chunk;
+    }
+    return offset;
+}
+
 }  // namespace vm
@@ -18,6 +18,8 @@ struct Stack {
 
 enum MapFlags : uint64_t {
     kMapWrite = 1ull << 0,
+    // Allocate every page up front instead of on first touch.
+    kMapPopulate = 1ull << 1,
 };
 
 Region map_user_code(uint64_t cr3,
@@ -28,11 +30,20 @@ Region reserve_user_region(size_t length);
 Region reserve_user_region(uint64_t cr3, size_t length);
 Region allocate_user_region(uint64_t cr3, size_t length);
 Stack allocate_user_stack(uint64_t cr3, size_t length);
+// Maps a frame owned by the image cache at virt. The page is read-only and
+// non-executable; set_user_region_writable() and _executable() adjust it
+// like any other page, and the first write gets a private copy.
+bool map_copy_on_write(uint64_t cr3, uint64_t virt, uint64_t phys);
 void release_user_region(uint64_t cr3, const Region& region);
 void release_address_space(uint64_t cr3);
 uint64_t map_anonymous(uint64_t cr3, size_t length, uint64_t flags);
 uint64_t map_at(uint64_t cr3, uint64_t addr_hint, size_t length, uint64_t flags);
 bool unmap_region(uint64_t cr3, uint64_t addr, size_t length);
+// Populates a not-present page inside a lazy anonymous mapping, or copies a
+// copy-on-write page on a write. Returns false when the fault is not one
+// demand paging can resolve.
+bool handle_page_fault(uint64_t cr3, uint64_t address, uint64_t error_code);
+uint64_t page_fault_count(uint64_t cr3);
 bool set_user_region_writable(uint64_t cr3,
                               uint64_t addr,
                               size_t length,
@@ -58,4 +69,22 @@ bool copy_to_user(uint64_t cr3, uint64_t dest, const void* src, size_t length);
 bool copy_from_user(uint64_t cr3, void* dest, uint64_t src, size_t length);
 bool fill_user(uint64_t cr3, uint64_t dest, uint8_t value, size_t length);
 
+// Physically contiguous run of a user buffer, addressed through the HHDM.
+struct UserSegment {
+    uint8_t* data;
+    size_t length;
+};
+
+// Resolves [address, address + length) page by page, populating lazy pages,
+// and merges physically adjacent pages into one segment. Returns the number
+// of bytes covered from the start of the range; that is short when a page
+// cannot be resolved or max_segments runs out, and 0 when nothing could be.
+size_t resolve_user_segments(uint64_t cr3,
+                             uint64_t address,
+                             size_t length,
+                             bool writable,
+                             UserSegment* out,
+                             size_t max_segments,
+                             size_t& out_count);
+
 }  // namespace vm
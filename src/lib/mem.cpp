@@ -2,43 +2,11 @@
 
 #include "arch/x86_64/cpu_features.hpp"
 
-extern "C" void *memcpy(void *dest, const void *src, size_t n) {
-    uint8_t *d = (uint8_t*)dest;
-    const uint8_t *s = (const uint8_t*)src;
-    for (size_t i = 0; i < n; i++)
-        d[i] = s[i];
-    return dest;
-}
-
-extern "C" void *memmove(void *dest, const void *src, size_t n) {
-    uint8_t *d = (uint8_t*)dest;
-    const uint8_t *s = (const uint8_t*)src;
-    if (d < s) {
-        for (size_t i = 0; i < n; i++)
-            d[i] = s[i];
-    } else {
-        for (size_t i = n; i != 0; i--)
-            d[i-1] = s[i-1];
-    }
-    return dest;
-}
-
-extern "C" void *memset(void *s, int c, size_t n) {
-    uint8_t *p = (uint8_t*)s;
-    for (size_t i = 0; i < n; i++)
-        p[i] = (uint8_t)c;
-    return s;
-}
-
-extern "C" int memcmp(const void *s1, const void *s2, size_t n) {
-    const uint8_t *a = (const uint8_t*)s1;
-    const uint8_t *b = (const uint8_t*)s2;
-    for (size_t i = 0; i < n; i++) {
-        if (a[i] != b[i])
-            return (int)a[i] - (int)b[i];
-    }
-    return 0;
-}
+// The byte and word loops below implement memcpy/memset themselves; keep GCC
+// from recognising them and emitting calls back into the dispatcher.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("no-tree-loop-distribute-patterns")
+#endif
 
 namespace {
 
@@ -46,6 +14,13 @@ constexpr size_t kWordSize = sizeof(uint64_t);
 constexpr size_t kSimdBlockSize = 64;
 constexpr size_t kSimdThreshold = 1024;
 constexpr size_t kSimdChunkSize = 16 * 1024;
+// rep movsb/stosb have a fixed startup cost that word loops beat for short
+// transfers.
+constexpr size_t kErmsThreshold = 128;
+constexpr size_t kCacheLineSize = 64;
+
+mem::Variant g_variant = mem::Variant::Qwords;
+bool g_nontemporal_clear = false;
 
 inline void copy_forward_align(uint8_t*& dst,
                                const uint8_t*& src,
@@ -91,21 +66,18 @@ inline void copy_sse2_blocks(uint8_t*& dst,
         : "memory");
 }
 
-}  // namespace
-
-extern "C" void *memcpy_fast(void *dest, const void *src, size_t n) {
-    if (n == 0 || dest == src) {
-        return dest;
-    }
+void copy_bytes(uint8_t* d, const uint8_t* s, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        d[i] = s[i];
+}
 
+void copy_qwords(uint8_t* d, const uint8_t* s, size_t n) {
     if (n < 32) {
-        return memcpy(dest, src, n);
+        copy_bytes(d, s, n);
+        return;
     }
 
-    auto* d = static_cast<uint8_t*>(dest);
-    auto* s = static_cast<const uint8_t*>(src);
     size_t remaining = n;
-
     copy_forward_align(d, s, remaining);
 
     while (remaining >= kWordSize * 4) {
@@ -127,63 +99,271 @@ extern "C" void *memcpy_fast(void *dest, const void *src, size_t n) {
         remaining -= kWordSize;
     }
 
+    copy_bytes(d, s, remaining);
+}
+
+void copy_erms(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n < kErmsThreshold) {
+        copy_qwords(d, s, n);
+        return;
+    }
+    asm volatile("rep movsb"
+                 : "+D"(d), "+S"(s), "+c"(n)
+                 :
+                 : "memory");
+}
+
+// Copies high to low; safe when dest overlaps the tail of src.
+void copy_qwords_backward(uint8_t* d, const uint8_t* s, size_t n) {
+    size_t remaining = n;
+    auto* d_end = d + n;
+    auto* s_end = s + n;
+
+    if (remaining >= 32) {
+        copy_backward_align(d_end, s_end, remaining);
+
+        while (remaining >= kWordSize * 4) {
+            d_end -= kWordSize * 4;
+            s_end -= kWordSize * 4;
+            auto* dst64 = reinterpret_cast<uint64_t*>(d_end);
+            auto* src64 = reinterpret_cast<const uint64_t*>(s_end);
+            dst64[3] = src64[3];
+            dst64[2] = src64[2];
+            dst64[1] = src64[1];
+            dst64[0] = src64[0];
+            remaining -= kWordSize * 4;
+        }
+
+        while (remaining >= kWordSize) {
+            d_end -= kWordSize;
+            s_end -= kWordSize;
+            *reinterpret_cast<uint64_t*>(d_end) =
+                *reinterpret_cast<const uint64_t*>(s_end);
+            remaining -= kWordSize;
+        }
+    }
+
     while (remaining != 0) {
-        *d++ = *s++;
+        --d_end;
+        --s_end;
+        *d_end = *s_end;
         --remaining;
     }
+}
 
-    return dest;
+void copy_dispatch(mem::Variant variant, uint8_t* d, const uint8_t* s, size_t n) {
+    switch (variant) {
+    case mem::Variant::Bytes:
+        copy_bytes(d, s, n);
+        break;
+    case mem::Variant::Erms:
+        copy_erms(d, s, n);
+        break;
+    case mem::Variant::Qwords:
+    default:
+        copy_qwords(d, s, n);
+        break;
+    }
 }
 
-extern "C" void *memmove_fast(void *dest, const void *src, size_t n) {
-    if (n == 0 || dest == src) {
-        return dest;
+void fill_bytes(uint8_t* p, uint8_t value, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        p[i] = value;
+}
+
+inline uint64_t fill_pattern(uint8_t value) {
+    return 0x0101010101010101ull * value;
+}
+
+void fill_qwords(uint8_t* p, uint8_t value, size_t n) {
+    if (n < 32) {
+        fill_bytes(p, value, n);
+        return;
     }
 
-    auto* d = static_cast<uint8_t*>(dest);
-    auto* s = static_cast<const uint8_t*>(src);
+    while ((reinterpret_cast<uintptr_t>(p) & (kWordSize - 1)) != 0) {
+        *p++ = value;
+        --n;
+    }
 
-    if (d < s) {
-        return memcpy_fast(dest, src, n);
+    uint64_t pattern = fill_pattern(value);
+    while (n >= kWordSize * 4) {
+        auto* p64 = reinterpret_cast<uint64_t*>(p);
+        p64[0] = pattern;
+        p64[1] = pattern;
+        p64[2] = pattern;
+        p64[3] = pattern;
+        p += kWordSize * 4;
+        n -= kWordSize * 4;
     }
 
-    if (n < 32) {
-        return memmove(dest, src, n);
+    while (n >= kWordSize) {
+        *reinterpret_cast<uint64_t*>(p) = pattern;
+        p += kWordSize;
+        n -= kWordSize;
     }
 
-    size_t remaining = n;
-    auto* d_end = d + n;
-    auto* s_end = s + n;
+    fill_bytes(p, value, n);
+}
 
-    copy_backward_align(d_end, s_end, remaining);
+void fill_erms(uint8_t* p, uint8_t value, size_t n) {
+    if (n < kErmsThreshold) {
+        fill_qwords(p, value, n);
+        return;
+    }
+    asm volatile("rep stosb"
+                 : "+D"(p), "+c"(n)
+                 : "a"(value)
+                 : "memory");
+}
 
-    while (remaining >= kWordSize * 4) {
-        d_end -= kWordSize * 4;
-        s_end -= kWordSize * 4;
-        auto* dst64 = reinterpret_cast<uint64_t*>(d_end);
-        auto* src64 = reinterpret_cast<const uint64_t*>(s_end);
-        dst64[3] = src64[3];
-        dst64[2] = src64[2];
-        dst64[1] = src64[1];
-        dst64[0] = src64[0];
-        remaining -= kWordSize * 4;
+// movnti goes through write-combining buffers and bypasses the cache; whole
+// lines are written so no read-for-ownership is needed. It uses general
+// registers, so no FPU state has to be saved.
+void fill_nontemporal_lines(uint8_t* p, uint8_t value, size_t n) {
+    size_t head = (kCacheLineSize -
+                   (reinterpret_cast<uintptr_t>(p) & (kCacheLineSize - 1))) &
+                  (kCacheLineSize - 1);
+    if (head > n) {
+        head = n;
+    }
+    fill_qwords(p, value, head);
+    p += head;
+    n -= head;
+
+    size_t lines = n / kCacheLineSize;
+    if (lines != 0) {
+        uint64_t pattern = fill_pattern(value);
+        asm volatile(
+            "1:\n"
+            "movnti %[value], 0(%[dst])\n"
+            "movnti %[value], 8(%[dst])\n"
+            "movnti %[value], 16(%[dst])\n"
+            "movnti %[value], 24(%[dst])\n"
+            "movnti %[value], 32(%[dst])\n"
+            "movnti %[value], 40(%[dst])\n"
+            "movnti %[value], 48(%[dst])\n"
+            "movnti %[value], 56(%[dst])\n"
+            "add $64, %[dst]\n"
+            "dec %[count]\n"
+            "jnz 1b\n"
+            "sfence\n"
+            : [dst] "+r"(p), [count] "+r"(lines)
+            : [value] "r"(pattern)
+            : "memory");
+        n &= kCacheLineSize - 1;
     }
 
-    while (remaining >= kWordSize) {
-        d_end -= kWordSize;
-        s_end -= kWordSize;
-        *reinterpret_cast<uint64_t*>(d_end) =
-            *reinterpret_cast<const uint64_t*>(s_end);
-        remaining -= kWordSize;
+    fill_qwords(p, value, n);
+}
+
+void fill_dispatch(mem::Variant variant, uint8_t* p, uint8_t value, size_t n) {
+    switch (variant) {
+    case mem::Variant::Bytes:
+        fill_bytes(p, value, n);
+        break;
+    case mem::Variant::Erms:
+        fill_erms(p, value, n);
+        break;
+    case mem::Variant::Qwords:
+    default:
+        fill_qwords(p, value, n);
+        break;
     }
+}
 
-    while (remaining != 0) {
-        --d_end;
-        --s_end;
-        *d_end = *s_end;
-        --remaining;
+int compare_bytes(const uint8_t* a, const uint8_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i])
+            return (int)a[i] - (int)b[i];
+    }
+    return 0;
+}
+
+int compare_qwords(const uint8_t* a, const uint8_t* b, size_t n) {
+    while (n >= kWordSize) {
+        uint64_t wa = 0;
+        uint64_t wb = 0;
+        __builtin_memcpy(&wa, a, kWordSize);
+        __builtin_memcpy(&wb, b, kWordSize);
+        if (wa != wb) {
+            break;
+        }
+        a += kWordSize;
+        b += kWordSize;
+        n -= kWordSize;
+    }
+    return compare_bytes(a, b, n);
+}
+
+}  // namespace
+
+extern "C" void *memcpy(void *dest, const void *src, size_t n) {
+    copy_dispatch(g_variant,
+                  static_cast<uint8_t*>(dest),
+                  static_cast<const uint8_t*>(src),
+                  n);
+    return dest;
+}
+
+extern "C" void *memmove(void *dest, const void *src, size_t n) {
+    auto* d = static_cast<uint8_t*>(dest);
+    auto* s = static_cast<const uint8_t*>(src);
+    if (n == 0 || d == s) {
+        return dest;
+    }
+    // Ascending copies are safe whenever dest starts below src; every variant
+    // reads each chunk before the write that could overlap it.
+    if (d < s || d >= s + n) {
+        copy_dispatch(g_variant, d, s, n);
+    } else {
+        copy_qwords_backward(d, s, n);
+    }
+    return dest;
+}
+
+extern "C" void *memset(void *s, int c, size_t n) {
+    auto* p = static_cast<uint8_t*>(s);
+    if (g_nontemporal_clear && n >= mem::kNonTemporalThreshold) {
+        fill_nontemporal_lines(p, static_cast<uint8_t>(c), n);
+    } else {
+        fill_dispatch(g_variant, p, static_cast<uint8_t>(c), n);
+    }
+    return s;
+}
+
+extern "C" int memcmp(const void *s1, const void *s2, size_t n) {
+    auto* a = static_cast<const uint8_t*>(s1);
+    auto* b = static_cast<const uint8_t*>(s2);
+    if (g_variant == mem::Variant::Bytes) {
+        return compare_bytes(a, b, n);
+    }
+    return compare_qwords(a, b, n);
+}
+
+extern "C" void *memcpy_fast(void *dest, const void *src, size_t n) {
+    if (n == 0 || dest == src) {
+        return dest;
+    }
+    copy_qwords(static_cast<uint8_t*>(dest),
+                static_cast<const uint8_t*>(src),
+                n);
+    return dest;
+}
+
+extern "C" void *memmove_fast(void *dest, const void *src, size_t n) {
+    if (n == 0 || dest == src) {
+        return dest;
     }
 
+    auto* d = static_cast<uint8_t*>(dest);
+    auto* s = static_cast<const uint8_t*>(src);
+
+    if (d < s) {
+        copy_qwords(d, s, n);
+    } else {
+        copy_qwords_backward(d, s, n);
+    }
     return dest;
 }
 
@@ -224,3 +404,59 @@ extern "C" void *memmove_simd(void *dest, const void *src, size_t n) {
     }
     return memmove_fast(dest, src, n);
 }
+
+namespace mem {
+
+void select_variant(Variant variant, bool nontemporal_clear) {
+    g_variant = variant;
+    g_nontemporal_clear = nontemporal_clear;
+}
+
+Variant active_variant() {
+    return g_variant;
+}
+
+bool nontemporal_clear_enabled() {
+    return g_nontemporal_clear;
+}
+
+const char* variant_name(Variant variant) {
+    switch (variant) {
+    case Variant::Bytes:
+        return "bytes";
+    case Variant::Qwords:
+        return "qwords";
+    case Variant::Erms:
+        return "erms";
+    }
+    return "unknown";
+}
+
+void* copy_with(Variant variant, void* dest, const void* src, size_t n) {
+    copy_dispatch(variant,
+                  static_cast<uint8_t*>(dest),
+                  static_cast<const uint8_t*>(src),
+                  n);
+    return dest;
+}
+
+void* fill_with(Variant variant, void* dest, int c, size_t n) {
+    fill_dispatch(variant, static_cast<uint8_t*>(dest), static_cast<uint8_t>(c), n);
+    return dest;
+}
+
+void* fill_nontemporal(void* dest, int c, size_t n) {
+    fill_nontemporal_lines(static_cast<uint8_t*>(dest), static_cast<uint8_t>(c), n);
+    return dest;
+}
+
+int compare_with(Variant variant, const void* s1, const void* s2, size_t n) {
+    auto* a = static_cast<const uint8_t*>(s1);
+    auto* b = static_cast<const uint8_t*>(s2);
+    if (variant == Variant::Bytes) {
+        return compare_bytes(a, b, n);
+    }
+    return compare_qwords(a, b, n);
+}
+
+}  // namespace mem
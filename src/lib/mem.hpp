@@ -11,3 +11,30 @@ extern "C" void *memcpy_fast(void *dest, const void *src, size_t n);
 extern "C" void *memmove_fast(void *dest, const void *src, size_t n);
 extern "C" void *memcpy_simd(void *dest, const void *src, size_t n);
 extern "C" void *memmove_simd(void *dest, const void *src, size_t n);
+
+namespace mem {
+
+// Implementations the standard symbols can dispatch to. The kernel starts on
+// Qwords and cpu::init_boot_features() switches once CPUID has been read.
+enum class Variant : uint8_t {
+    Bytes,
+    Qwords,
+    Erms,  // rep movsb / rep stosb
+};
+
+// memset() calls at least this large use non-temporal stores when enabled,
+// so clearing big page runs does not flush the working set out of cache.
+constexpr size_t kNonTemporalThreshold = 256 * 1024;
+
+void select_variant(Variant variant, bool nontemporal_clear);
+Variant active_variant();
+bool nontemporal_clear_enabled();
+const char* variant_name(Variant variant);
+
+// Fixed-variant entry points, used by the boot self-benchmark.
+void* copy_with(Variant variant, void* dest, const void* src, size_t n);
+void* fill_with(Variant variant, void* dest, int c, size_t n);
+void* fill_nontemporal(void* dest, int c, size_t n);
+int compare_with(Variant variant, const void* s1, const void* s2, size_t n);
+
+}  // namespace mem
@@ -457,6 +457,26 @@ void handle_ipv4(LinkDevice& device,
     handle_icmp_echo(device, source_mac, payload, length);
 }
 
+// Copies a received frame straight into the owner's ring. A tail the owner
+// has pushed past the kernel's head reads as a full ring.
+bool ring_receive_locked(PacketRing& ring, const void* frame, size_t length) {
+    descriptor_defs::NetRingControl& control = *ring.control;
+    uint32_t tail = __atomic_load_n(&control.rx_tail, __ATOMIC_ACQUIRE);
+    if (ring.rx_head - tail >= descriptor_defs::kNetRingSlots) {
+        ++control.rx_dropped;
+        return false;
+    }
+    uint32_t slot = ring.rx_head % descriptor_defs::kNetRingSlots;
+    memcpy(ring.rx_slots +
+               static_cast<size_t>(slot) * descriptor_defs::kNetRingSlotSize,
+           frame,
+           length);
+    control.rx_lengths[slot] = static_cast<uint16_t>(length);
+    ++ring.rx_head;
+    __atomic_store_n(&control.rx_head, ring.rx_head, __ATOMIC_RELEASE);
+    return true;
+}
+
 }  // namespace
 
 void init(const char* cmdline) {
@@ -596,6 +616,7 @@ bool register_link(LinkDevice& device,
     device.rx_frames_received = 0;
     device.rx_frames_dropped = 0;
     device.rx_lock = 0;
+    device.ring = nullptr;
     memset(device.rx_lengths, 0, sizeof(device.rx_lengths));
 
     if (g_default_ipv4_configured) {
@@ -631,6 +652,14 @@ LinkDevice* device_at(size_t index) {
 
 size_t queued_frame_count(LinkDevice& device) {
     DeviceGuard guard(device);
+    if (device.ring != nullptr) {
+        uint32_t pending = device.ring->rx_head -
+                           __atomic_load_n(&device.ring->control->rx_tail,
+                                           __ATOMIC_ACQUIRE);
+        return pending > descriptor_defs::kNetRingSlots
+                   ? descriptor_defs::kNetRingSlots
+                   : pending;
+    }
     size_t count = (device.rx_head >= device.rx_tail)
                        ? static_cast<size_t>(device.rx_head - device.rx_tail)
                        : static_cast<size_t>(kMaxQueuedFrames -
@@ -666,6 +695,37 @@ int read_frame(LinkDevice& device,
     return 1;
 }
 
+int read_frames(LinkDevice& device,
+                uint8_t* buffer,
+                size_t buffer_size,
+                uint16_t* lengths,
+                size_t max_frames) {
+    if (buffer == nullptr || lengths == nullptr) {
+        return -1;
+    }
+
+    DeviceGuard guard(device);
+    int count = 0;
+    size_t used = 0;
+    while (static_cast<size_t>(count) < max_frames &&
+           device.rx_head != device.rx_tail) {
+        uint16_t slot = device.rx_tail;
+        size_t frame_size = device.rx_lengths[slot];
+        if (frame_size > buffer_size - used) {
+            if (count == 0) {
+                return -1;
+            }
+            break;
+        }
+        memcpy(buffer + used, device.rx_frames[slot], frame_size);
+        lengths[count++] = static_cast<uint16_t>(frame_size);
+        used += frame_size;
+        device.rx_lengths[slot] = 0;
+        device.rx_tail = static_cast<uint16_t>((slot + 1) % kMaxQueuedFrames);
+    }
+    return count;
+}
+
 bool write_frame(LinkDevice& device, const void* frame, size_t length) {
     if (!device.up || frame == nullptr || length == 0) {
         return false;
@@ -673,6 +733,71 @@ bool write_frame(LinkDevice& device, const void* frame, size_t length) {
     return device.transmit(device.context, frame, length);
 }
 
+bool attach_packet_ring(LinkDevice& device, PacketRing& ring) {
+    DeviceGuard guard(device);
+    if (device.ring != nullptr) {
+        return false;
+    }
+    ring.rx_head = 0;
+    ring.tx_tail = 0;
+    ring.tx_lock = 0;
+    // Frames queued for read() before the switch are dropped; the owner
+    // reads from the ring from now on.
+    device.rx_tail = device.rx_head;
+    device.ring = &ring;
+    return true;
+}
+
+void detach_packet_ring(LinkDevice& device, PacketRing& ring) {
+    {
+        DeviceGuard guard(device);
+        if (device.ring != &ring) {
+            return;
+        }
+        device.ring = nullptr;
+    }
+    // Let a transmit that is still reading the slots finish first.
+    while (__atomic_test_and_set(&ring.tx_lock, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    __atomic_clear(&ring.tx_lock, __ATOMIC_RELEASE);
+}
+
+int transmit_packet_ring(LinkDevice& device, PacketRing& ring) {
+    descriptor_defs::NetRingControl& control = *ring.control;
+    while (__atomic_test_and_set(&ring.tx_lock, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    uint32_t head = __atomic_load_n(&control.tx_head, __ATOMIC_ACQUIRE);
+    if (head - ring.tx_tail > descriptor_defs::kNetRingSlots) {
+        __atomic_clear(&ring.tx_lock, __ATOMIC_RELEASE);
+        return -1;
+    }
+    int sent = 0;
+    while (ring.tx_tail != head) {
+        uint32_t slot = ring.tx_tail % descriptor_defs::kNetRingSlots;
+        // Read the length once; the owner may rewrite it at any time.
+        uint16_t length = __atomic_load_n(&control.tx_lengths[slot],
+                                          __ATOMIC_RELAXED);
+        if (length == 0 || length > kMaxQueuedFrameSize) {
+            ++control.tx_failed;
+        } else if (!device.up ||
+                   !device.transmit(device.context,
+                                    ring.tx_slots +
+                                        static_cast<size_t>(slot) *
+                                            descriptor_defs::kNetRingSlotSize,
+                                    length)) {
+            break;
+        } else {
+            ++sent;
+        }
+        ++ring.tx_tail;
+        __atomic_store_n(&control.tx_tail, ring.tx_tail, __ATOMIC_RELEASE);
+    }
+    __atomic_clear(&ring.tx_lock, __ATOMIC_RELEASE);
+    return sent;
+}
+
 void get_ipv4_config(const LinkDevice& device,
                      bool& enabled,
                      bool& dhcp,
@@ -715,7 +840,12 @@ void receive_frame(LinkDevice* device, const void* frame, size_t length) {
             ++device->rx_frames_received;
             uint16_t next_head =
                 static_cast<uint16_t>((device->rx_head + 1) % kMaxQueuedFrames);
-            if (next_head != device->rx_tail) {
+            if (device->ring != nullptr) {
+                queued = ring_receive_locked(*device->ring, frame, length);
+                if (!queued) {
+                    ++device->rx_frames_dropped;
+                }
+            } else if (next_head != device->rx_tail) {
                 memcpy(device->rx_frames[device->rx_head], frame, length);
                 device->rx_lengths[device->rx_head] = static_cast<uint16_t>(length);
                 device->rx_head = next_head;
@@ -725,7 +855,7 @@ void receive_frame(LinkDevice* device, const void* frame, size_t length) {
             }
         }
         if (queued) {
-            descriptor::wake_waiters();
+            descriptor::wait_queue_wake(device->waiters);
         }
     } else {
         DeviceGuard guard(*device);
@@ -3,6 +3,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "kernel/descriptor.hpp"
+
 namespace net {
 
 using TransmitFn = bool (*)(void* context, const void* data, size_t length);
@@ -11,6 +13,22 @@ constexpr size_t kMaxQueuedFrames = 128;
 constexpr size_t kMaxQueuedFrameSize = 1600;
 constexpr size_t kEthernetMtu = 1500;
 
+static_assert(kMaxQueuedFrameSize <= descriptor_defs::kNetRingSlotSize,
+              "queued frames must fit a packet-ring slot");
+
+// Kernel view of a packet ring a NetDevice owner has mapped. The pointers
+// address the shared pages through the HHDM. The kernel keeps its own
+// indices here and only publishes them, since the owner can write anything
+// into the control page.
+struct PacketRing {
+    descriptor_defs::NetRingControl* control;
+    uint8_t* rx_slots;
+    uint8_t* tx_slots;
+    uint32_t rx_head;
+    uint32_t tx_tail;
+    volatile int tx_lock;
+};
+
 struct LinkDevice {
     const char* name;
     void* context;
@@ -31,6 +49,8 @@ struct LinkDevice {
     uint32_t rx_frames_received;
     uint32_t rx_frames_dropped;
     volatile int rx_lock;
+    PacketRing* ring;  // frames bypass rx_frames while set; under rx_lock
+    descriptor::WaitQueue waiters;  // signalled when a frame is queued
 };
 
 void init(const char* cmdline);
@@ -49,7 +69,23 @@ int read_frame(LinkDevice& device,
                void* buffer,
                size_t buffer_size,
                size_t& out_size);
+// Dequeues up to max_frames frames into buffer back to back, stopping early
+// at the first one that does not fit. Returns the number dequeued, or -1,
+// like read_frame(), when the first queued frame alone does not fit.
+int read_frames(LinkDevice& device,
+                uint8_t* buffer,
+                size_t buffer_size,
+                uint16_t* lengths,
+                size_t max_frames);
 bool write_frame(LinkDevice& device, const void* frame, size_t length);
+// Redirects received frames into ring until detach_packet_ring(). Fails
+// when another ring is already attached.
+bool attach_packet_ring(LinkDevice& device, PacketRing& ring);
+void detach_packet_ring(LinkDevice& device, PacketRing& ring);
+// Transmits the frames queued in ring since the last call, stopping at the
+// first one the driver cannot take yet. Returns the number sent, or -1 when
+// the owner's indices are inconsistent.
+int transmit_packet_ring(LinkDevice& device, PacketRing& ring);
 void get_ipv4_config(const LinkDevice& device,
                      bool& enabled,
                      bool& dhcp,
@@ -66,6 +66,7 @@ enum class SystemCall : long {
     RandomGet            = 56,
     FileGetAcl           = 57,
     FileSetAcl           = 58,
+    BindLazySymbol       = 59,
 };
 
 enum : uint32_t {
@@ -74,6 +75,7 @@ enum : uint32_t {
 
 enum : uint64_t {
     MAP_WRITE = 1ull << 0,
+    MAP_POPULATE = 1ull << 1,
 };
 
 enum class AclValue : uint8_t {
@@ -255,15 +257,19 @@ static inline long random_get(void* output, size_t length) {
                         static_cast<long>(length));
 }
 
+// timeout_ns of 0 waits indefinitely; otherwise returns 0 when it expires
+// with nothing ready.
 static inline long descriptor_wait(descriptor_defs::DescriptorWait* items,
-                                   size_t count) {
+                                   size_t count,
+                                   uint64_t timeout_ns = 0) {
     if (items == nullptr || count == 0) {
         return -1;
     }
-    return raw_syscall2(SystemCall::DescriptorWait,
+    return raw_syscall3(SystemCall::DescriptorWait,
                         static_cast<long>(
                             reinterpret_cast<uintptr_t>(items)),
-                        static_cast<long>(count));
+                        static_cast<long>(count),
+                        static_cast<long>(timeout_ns));
 }
 
 static inline void* map_anonymous(size_t length, uint64_t flags) {
@@ -732,6 +738,50 @@ static inline long net_endpoint_get_info(
         sizeof(*info));
 }
 
+// interest set for descriptor_wait: members stay registered between waits,
+// so blocking on the set handle costs the same for one or hundreds of
+// members. descriptor_read on the set returns the ready members.
+static inline long wait_set_open() {
+    return descriptor_open(
+        static_cast<uint32_t>(descriptor_defs::Type::WaitSet),
+        0,
+        0,
+        0);
+}
+
+static inline long wait_set_control(uint32_t set_handle,
+                                    uint32_t op,
+                                    uint32_t handle,
+                                    uint32_t events) {
+    descriptor_defs::WaitSetControl control{
+        .op = op,
+        .handle = handle,
+        .events = events,
+        .reserved = 0,
+    };
+    return descriptor_set_property(
+        set_handle,
+        static_cast<uint32_t>(descriptor_defs::Property::WaitSetControl),
+        &control,
+        sizeof(control));
+}
+
+static inline long wait_set_add(uint32_t set_handle,
+                                uint32_t handle,
+                                uint32_t events) {
+    return wait_set_control(set_handle,
+                            descriptor_defs::kWaitSetAdd,
+                            handle,
+                            events);
+}
+
+static inline long wait_set_remove(uint32_t set_handle, uint32_t handle) {
+    return wait_set_control(set_handle,
+                            descriptor_defs::kWaitSetRemove,
+                            handle,
+                            0);
+}
+
 static inline long net_device_open(uint32_t index = 0,
                                    uint64_t requested_flags = 0) {
     return descriptor_open(static_cast<uint32_t>(descriptor_defs::Type::NetDevice),
@@ -778,6 +828,30 @@ static inline long net_device_set_ipv4_config(
         sizeof(*config));
 }
 
+// command is a descriptor_defs::NetPacketRingCommand.
+static inline long net_device_ring_command(uint32_t handle, uint32_t command) {
+    descriptor_defs::NetPacketRingControl control{};
+    control.command = command;
+    return descriptor_set_property(
+        handle,
+        static_cast<uint32_t>(descriptor_defs::Property::NetPacketRing),
+        &control,
+        sizeof(control));
+}
+
+static inline long net_device_get_ring_info(
+    uint32_t handle,
+    descriptor_defs::NetPacketRingInfo* info) {
+    if (info == nullptr) {
+        return -1;
+    }
+    return descriptor_get_property(
+        handle,
+        static_cast<uint32_t>(descriptor_defs::Property::NetPacketRing),
+        info,
+        sizeof(*info));
+}
+
 static inline long descriptor_read(uint32_t handle,
                                        void* buffer,
                                        size_t length,
@@ -805,6 +879,37 @@ static inline long descriptor_close(uint32_t handle) {
                         static_cast<long>(handle));
 }
 
+// buffer starts with a descriptor_defs::NetFrameBatch; see there for the
+// layout. Both return the number of frames moved or kDescriptorWouldBlock.
+static inline long net_device_read_batch(uint32_t handle,
+                                         void* buffer,
+                                         size_t length) {
+    return descriptor_read(handle,
+                           buffer,
+                           length,
+                           descriptor_defs::kNetFrameBatchOffset);
+}
+
+static inline long net_device_write_batch(uint32_t handle,
+                                          const void* buffer,
+                                          size_t length) {
+    return descriptor_write(handle,
+                            buffer,
+                            length,
+                            descriptor_defs::kNetFrameBatchOffset);
+}
+
+// Blocks until at least one frame is queued on the device or timeout_ns
+// passes (0 waits indefinitely). Returns 1 when frames are ready, 0 on
+// timeout.
+static inline long net_device_wait_frames(uint32_t handle,
+                                          uint64_t timeout_ns = 0) {
+    descriptor_defs::DescriptorWait wait{};
+    wait.handle = handle;
+    wait.events = descriptor_defs::kWaitRead;
+    return descriptor_wait(&wait, 1, timeout_ns);
+}
+
 static inline long file_open(const char* path) {
     return raw_syscall1(SystemCall::FileOpen,
                         static_cast<long>(reinterpret_cast<uintptr_t>(path)));
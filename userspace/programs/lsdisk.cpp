@@ -212,6 +212,39 @@ bool list_disk(long console, uint64_t disk_index) {
     return true;
 }
 
+void print_cache_stats(long console) {
+    long disk = descriptor_open(kDescDisk, 0, 0, 0);
+    if (disk < 0) {
+        return;
+    }
+    descriptor_defs::BlockCacheStats stats{};
+    int result = descriptor_get_property(
+        static_cast<uint32_t>(disk),
+        static_cast<uint32_t>(descriptor_defs::Property::BlockCacheStats),
+        &stats,
+        sizeof(stats));
+    descriptor_close(static_cast<uint32_t>(disk));
+    if (result != 0) {
+        return;
+    }
+
+    userspace::write(console, "Block cache: ");
+    print_size(console, stats.page_size * stats.pages_total);
+    userspace::write(console, " dirty=");
+    userspace::write_u64(console, stats.pages_dirty);
+    userspace::write(console, " hits=");
+    userspace::write_u64(console, stats.read_hits);
+    userspace::write(console, " misses=");
+    userspace::write_u64(console, stats.read_misses);
+    userspace::write(console, " readahead=");
+    userspace::write_u64(console, stats.readahead_hits);
+    userspace::write(console, "/");
+    userspace::write_u64(console, stats.readahead_pages);
+    userspace::write(console, " evictions=");
+    userspace::write_u64(console, stats.evictions);
+    userspace::write_line(console, "");
+}
+
 bool valid_args(const char* raw) {
     raw = (raw == nullptr) ? "" : raw;
     while (*raw == ' ' || *raw == '\t' || *raw == '\n' || *raw == '\r') {
@@ -253,5 +286,6 @@ int main(uint64_t arg_ptr, uint64_t) {
         userspace::write_line(console, "lsdisk: no disks found");
         return 1;
     }
+    print_cache_stats(console);
     return 0;
 }
@@ -14,6 +14,9 @@ constexpr size_t kMaxBindings = 16;
 constexpr size_t kMaxArpEntries = 16;
 constexpr size_t kMaxPendingPings = 8;
 constexpr uint32_t kDeviceWriteRetryLimit = 100000;
+constexpr size_t kFrameBatchBytes =
+    sizeof(descriptor_defs::NetFrameBatch) +
+    descriptor_defs::kNetFrameBatchMax * usernet::kMaxFrameSize;
 constexpr uint8_t kBroadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 struct ArpEntry {
@@ -37,8 +40,27 @@ struct Binding {
     uint32_t pipe_handle;
 };
 
+// The device's packet ring when networkd could attach one. Frames are then
+// parsed in place in the receive slots and queued straight into the
+// transmit slots; kicks tell the kernel to send what is queued.
+struct PacketRing {
+    descriptor_defs::NetRingControl* control;
+    uint8_t* rx_slots;
+    uint8_t* tx_slots;
+};
+
+// Without a ring, frames move through batched reads and writes. Outgoing
+// frames collect in tx_batch until the next flush.
+struct FrameBatches {
+    descriptor_defs::NetFrameBatch* rx;
+    descriptor_defs::NetFrameBatch* tx;
+    size_t tx_bytes;
+};
+
 struct ServerContext {
     usernet::Device device;
+    PacketRing ring;
+    FrameBatches batches;
     uint32_t server_pipe;
     networkd_protocol::Registry* registry;
     Binding bindings[kMaxBindings];
@@ -256,10 +278,196 @@ bool load_ipv4_config(ServerContext& ctx, descriptor_defs::NetIpv4Config& out) {
            (out.flags & descriptor_defs::kNetIpv4FlagEnabled) != 0;
 }
 
+bool attach_packet_ring(ServerContext& ctx) {
+    if (net_device_ring_command(ctx.device.handle,
+                                descriptor_defs::kNetPacketRingAttach) != 0) {
+        return false;
+    }
+    descriptor_defs::NetPacketRingInfo info{};
+    if (net_device_get_ring_info(ctx.device.handle, &info) != 0 ||
+        info.base == 0 || info.length < descriptor_defs::kNetRingBytes ||
+        info.slot_count != descriptor_defs::kNetRingSlots ||
+        info.slot_size != descriptor_defs::kNetRingSlotSize) {
+        (void)net_device_ring_command(ctx.device.handle,
+                                      descriptor_defs::kNetPacketRingDetach);
+        return false;
+    }
+    auto* base = reinterpret_cast<uint8_t*>(static_cast<uintptr_t>(info.base));
+    ctx.ring.control = reinterpret_cast<descriptor_defs::NetRingControl*>(base);
+    ctx.ring.rx_slots = base + descriptor_defs::kNetRingControlBytes;
+    ctx.ring.tx_slots =
+        ctx.ring.rx_slots +
+        static_cast<size_t>(descriptor_defs::kNetRingSlots) *
+            descriptor_defs::kNetRingSlotSize;
+    return true;
+}
+
+// Hands every queued transmit slot to the driver in one call. Slots the
+// driver could not take yet stay queued for the next kick.
+void kick_packet_ring(ServerContext& ctx) {
+    if (ctx.ring.control == nullptr ||
+        ctx.ring.control->tx_head ==
+            __atomic_load_n(&ctx.ring.control->tx_tail, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (net_device_ring_command(ctx.device.handle,
+                                descriptor_defs::kNetPacketRingKick) != 0 &&
+        ctx.registry != nullptr) {
+        ++ctx.registry->net_tx_failures;
+    }
+}
+
+bool queue_ring_frame(ServerContext& ctx,
+                      const uint8_t* frame,
+                      size_t frame_length) {
+    descriptor_defs::NetRingControl& control = *ctx.ring.control;
+    if (frame_length > descriptor_defs::kNetRingSlotSize) {
+        return false;
+    }
+    for (uint32_t attempts = 0; attempts < kDeviceWriteRetryLimit; ++attempts) {
+        uint32_t head = control.tx_head;
+        uint32_t tail = __atomic_load_n(&control.tx_tail, __ATOMIC_ACQUIRE);
+        if (head - tail < descriptor_defs::kNetRingSlots) {
+            uint32_t slot = head % descriptor_defs::kNetRingSlots;
+            memcpy(ctx.ring.tx_slots +
+                       static_cast<size_t>(slot) *
+                           descriptor_defs::kNetRingSlotSize,
+                   frame,
+                   frame_length);
+            control.tx_lengths[slot] = static_cast<uint16_t>(frame_length);
+            __atomic_store_n(&control.tx_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        // Full: push what is queued, and give the driver time if that did
+        // not free a slot.
+        kick_packet_ring(ctx);
+        if (__atomic_load_n(&control.tx_tail, __ATOMIC_ACQUIRE) == tail) {
+            yield();
+        }
+    }
+    return false;
+}
+
+bool allocate_frame_batches(ServerContext& ctx) {
+    auto* rx = static_cast<descriptor_defs::NetFrameBatch*>(
+        map_anonymous(kFrameBatchBytes, MAP_WRITE));
+    auto* tx = static_cast<descriptor_defs::NetFrameBatch*>(
+        map_anonymous(kFrameBatchBytes, MAP_WRITE));
+    if (rx == nullptr || tx == nullptr) {
+        if (rx != nullptr) {
+            unmap(rx, kFrameBatchBytes);
+        }
+        if (tx != nullptr) {
+            unmap(tx, kFrameBatchBytes);
+        }
+        return false;
+    }
+    tx->count = 0;
+    ctx.batches.rx = rx;
+    ctx.batches.tx = tx;
+    ctx.batches.tx_bytes = sizeof(*tx);
+    return true;
+}
+
+// Writes the pending transmit batch, retrying the frames the driver could
+// not take yet. Frames still unsent after kDeviceWriteRetryLimit attempts
+// are dropped.
+bool flush_tx_batch(ServerContext& ctx) {
+    descriptor_defs::NetFrameBatch* batch = ctx.batches.tx;
+    if (batch == nullptr || batch->count == 0) {
+        return true;
+    }
+    for (uint32_t attempts = 0; attempts < kDeviceWriteRetryLimit; ++attempts) {
+        long sent = net_device_write_batch(ctx.device.handle,
+                                           batch,
+                                           ctx.batches.tx_bytes);
+        if (sent == kDescriptorWouldBlock) {
+            yield();
+            continue;
+        }
+        if (sent <= 0 || static_cast<uint32_t>(sent) > batch->count) {
+            break;
+        }
+        if (ctx.registry != nullptr) {
+            ctx.registry->net_tx_frames += static_cast<uint32_t>(sent);
+        }
+        uint32_t remaining = batch->count - static_cast<uint32_t>(sent);
+        size_t sent_bytes = 0;
+        for (long i = 0; i < sent; ++i) {
+            sent_bytes += batch->lengths[i];
+        }
+        auto* data = reinterpret_cast<uint8_t*>(batch + 1);
+        size_t data_bytes = ctx.batches.tx_bytes - sizeof(*batch);
+        memmove(data, data + sent_bytes, data_bytes - sent_bytes);
+        for (uint32_t i = 0; i < remaining; ++i) {
+            batch->lengths[i] = batch->lengths[i + static_cast<uint32_t>(sent)];
+        }
+        batch->count = remaining;
+        ctx.batches.tx_bytes -= sent_bytes;
+        if (remaining == 0) {
+            return true;
+        }
+    }
+    if (ctx.registry != nullptr) {
+        ctx.registry->net_tx_failures += batch->count;
+    }
+    batch->count = 0;
+    ctx.batches.tx_bytes = sizeof(*batch);
+    return false;
+}
+
+// Sends everything write_device_frame() has queued: one kick in ring mode,
+// batched writes otherwise.
+void flush_device_frames(ServerContext& ctx) {
+    if (ctx.ring.control != nullptr) {
+        kick_packet_ring(ctx);
+        return;
+    }
+    (void)flush_tx_batch(ctx);
+}
+
+void queue_batch_frame(ServerContext& ctx,
+                       const uint8_t* frame,
+                       size_t frame_length) {
+    descriptor_defs::NetFrameBatch* batch = ctx.batches.tx;
+    if (batch->count == descriptor_defs::kNetFrameBatchMax ||
+        ctx.batches.tx_bytes + frame_length > kFrameBatchBytes) {
+        (void)flush_tx_batch(ctx);
+    }
+    memcpy(reinterpret_cast<uint8_t*>(batch) + ctx.batches.tx_bytes,
+           frame,
+           frame_length);
+    batch->lengths[batch->count++] = static_cast<uint16_t>(frame_length);
+    ctx.batches.tx_bytes += frame_length;
+}
+
+// Queues a frame for the next flush; the main loop and poll_network()
+// flush, so a frame never waits longer than one pass over the loop.
 bool write_device_frame(ServerContext& ctx, const uint8_t* frame, size_t frame_length) {
     if (frame == nullptr || frame_length == 0) {
         return false;
     }
+    if (ctx.ring.control != nullptr) {
+        bool queued = queue_ring_frame(ctx, frame, frame_length);
+        if (ctx.registry != nullptr) {
+            if (queued) {
+                ++ctx.registry->net_tx_frames;
+            } else {
+                ++ctx.registry->net_tx_failures;
+            }
+        }
+        return queued;
+    }
+    if (ctx.batches.tx != nullptr) {
+        if (frame_length > usernet::kMaxFrameSize) {
+            if (ctx.registry != nullptr) {
+                ++ctx.registry->net_tx_failures;
+            }
+            return false;
+        }
+        queue_batch_frame(ctx, frame, frame_length);
+        return true;
+    }
     for (uint32_t attempts = 0; attempts < kDeviceWriteRetryLimit; ++attempts) {
         long written = descriptor_write(ctx.device.handle, frame, frame_length);
         if (written == static_cast<long>(frame_length)) {
@@ -796,98 +1004,161 @@ bool lookup_or_resolve_mac(ServerContext& ctx,
     return false;
 }
 
-bool poll_network(ServerContext& ctx) {
-    auto* frame = allocate_frame_buffer();
-    if (frame == nullptr) {
-        return false;
+void handle_frame(ServerContext& ctx, const uint8_t* frame, size_t length) {
+    if (ctx.registry != nullptr) {
+        ++ctx.registry->net_rx_frames;
     }
-    bool did_work = false;
-    for (;;) {
-        long result =
-            descriptor_read(ctx.device.handle, frame, usernet::kMaxFrameSize);
-        if (result == kDescriptorWouldBlock || result <= 0) {
-            return did_work;
+
+    usernet::ArpPacketView arp{};
+    if (usernet::parse_arp_frame(frame, length, arp)) {
+        if (ctx.registry != nullptr) {
+            ++ctx.registry->net_rx_arp;
         }
-        did_work = true;
+        if (arp.operation == 0x0001 || arp.operation == 0x0002) {
+            record_arp(ctx, arp.sender_ip, arp.sender_mac);
+        }
+        return;
+    }
+
+    usernet::UdpPacketView packet{};
+    if (usernet::parse_udp_frame(frame, length, packet)) {
         if (ctx.registry != nullptr) {
-            ++ctx.registry->net_rx_frames;
+            ++ctx.registry->net_rx_udp;
         }
 
-        usernet::ArpPacketView arp{};
-        if (usernet::parse_arp_frame(frame, static_cast<size_t>(result), arp)) {
+        Binding* binding =
+            find_binding(ctx, kBindingProtocolUdp, packet.destination_port);
+        if (binding == nullptr) {
             if (ctx.registry != nullptr) {
-                ++ctx.registry->net_rx_arp;
-            }
-            if (arp.operation == 0x0001 || arp.operation == 0x0002) {
-                record_arp(ctx, arp.sender_ip, arp.sender_mac);
+                ++ctx.registry->net_rx_no_binding;
             }
-            continue;
+            return;
+        }
+        if (ctx.registry != nullptr) {
+            ++ctx.registry->net_rx_delivered;
         }
+        send_udp_packet(*binding, packet);
+        return;
+    }
 
-        usernet::UdpPacketView packet{};
-        if (usernet::parse_udp_frame(frame, static_cast<size_t>(result), packet)) {
-            if (ctx.registry != nullptr) {
-                ++ctx.registry->net_rx_udp;
-            }
+    usernet::IcmpEchoReplyView icmp{};
+    if (usernet::parse_icmp_echo_reply_frame(frame, length, icmp)) {
+        if (ctx.registry != nullptr) {
+            ++ctx.registry->net_rx_icmp;
+        }
+        PendingPing* pending =
+            find_pending_ping(ctx, icmp.identifier, icmp.sequence);
+        if (pending == nullptr) {
+            return;
+        }
+        send_icmp_reply(*pending, icmp);
+        descriptor_close(pending->pipe_handle);
+        pending->in_use = false;
+        pending->pipe_handle = kInvalidDescriptor;
+        return;
+    }
 
-            Binding* binding =
-                find_binding(ctx, kBindingProtocolUdp, packet.destination_port);
-            if (binding == nullptr) {
-                if (ctx.registry != nullptr) {
-                    ++ctx.registry->net_rx_no_binding;
-                }
-                continue;
-            }
-            if (ctx.registry != nullptr) {
-                ++ctx.registry->net_rx_delivered;
-            }
-            send_udp_packet(*binding, packet);
-            continue;
+    usernet::TcpSegmentView segment{};
+    if (!usernet::parse_tcp_frame(frame, length, segment)) {
+        if (ctx.registry != nullptr) {
+            ++ctx.registry->net_rx_unrecognized;
         }
+        return;
+    }
+    if (ctx.registry != nullptr) {
+        ++ctx.registry->net_rx_tcp;
+    }
 
-        usernet::IcmpEchoReplyView icmp{};
-        if (usernet::parse_icmp_echo_reply_frame(frame,
-                                                 static_cast<size_t>(result),
-                                                 icmp)) {
-            if (ctx.registry != nullptr) {
-                ++ctx.registry->net_rx_icmp;
-            }
-            PendingPing* pending =
-                find_pending_ping(ctx, icmp.identifier, icmp.sequence);
-            if (pending == nullptr) {
-                continue;
-            }
-            send_icmp_reply(*pending, icmp);
-            descriptor_close(pending->pipe_handle);
-            pending->in_use = false;
-            pending->pipe_handle = kInvalidDescriptor;
-            continue;
+    Binding* binding =
+        find_binding(ctx, kBindingProtocolTcp, segment.destination_port);
+    if (binding == nullptr) {
+        if (ctx.registry != nullptr) {
+            ++ctx.registry->net_rx_no_binding;
         }
+        return;
+    }
+    if (ctx.registry != nullptr) {
+        ++ctx.registry->net_rx_delivered;
+    }
+    send_tcp_segment(*binding, segment);
+}
 
-        usernet::TcpSegmentView segment{};
-        if (!usernet::parse_tcp_frame(frame, static_cast<size_t>(result), segment)) {
-            if (ctx.registry != nullptr) {
-                ++ctx.registry->net_rx_unrecognized;
-            }
-            continue;
+// Parses each received slot where the kernel left it and releases it once
+// handled, so the frames are never copied out of the ring.
+bool poll_packet_ring(ServerContext& ctx) {
+    descriptor_defs::NetRingControl& control = *ctx.ring.control;
+    uint32_t tail = control.rx_tail;
+    uint32_t head = __atomic_load_n(&control.rx_head, __ATOMIC_ACQUIRE);
+    bool did_work = tail != head;
+    while (tail != head) {
+        uint32_t slot = tail % descriptor_defs::kNetRingSlots;
+        size_t length = control.rx_lengths[slot];
+        if (length <= descriptor_defs::kNetRingSlotSize) {
+            handle_frame(ctx,
+                         ctx.ring.rx_slots +
+                             static_cast<size_t>(slot) *
+                                 descriptor_defs::kNetRingSlotSize,
+                         length);
         }
-        if (ctx.registry != nullptr) {
-            ++ctx.registry->net_rx_tcp;
+        ++tail;
+        __atomic_store_n(&control.rx_tail, tail, __ATOMIC_RELEASE);
+        if (tail == head) {
+            head = __atomic_load_n(&control.rx_head, __ATOMIC_ACQUIRE);
         }
+    }
+    return did_work;
+}
 
-        Binding* binding =
-            find_binding(ctx, kBindingProtocolTcp, segment.destination_port);
-        if (binding == nullptr) {
-            if (ctx.registry != nullptr) {
-                ++ctx.registry->net_rx_no_binding;
-            }
-            continue;
+bool poll_frame_batches(ServerContext& ctx) {
+    descriptor_defs::NetFrameBatch* batch = ctx.batches.rx;
+    bool did_work = false;
+    for (;;) {
+        batch->count = 0;
+        long result =
+            net_device_read_batch(ctx.device.handle, batch, kFrameBatchBytes);
+        if (result == kDescriptorWouldBlock || result <= 0) {
+            return did_work;
         }
-        if (ctx.registry != nullptr) {
-            ++ctx.registry->net_rx_delivered;
+        did_work = true;
+        const auto* frame = reinterpret_cast<const uint8_t*>(batch + 1);
+        for (uint32_t i = 0; i < batch->count; ++i) {
+            handle_frame(ctx, frame, batch->lengths[i]);
+            frame += batch->lengths[i];
+        }
+    }
+}
+
+bool poll_single_frames(ServerContext& ctx) {
+    auto* frame = allocate_frame_buffer();
+    if (frame == nullptr) {
+        return false;
+    }
+    bool did_work = false;
+    for (;;) {
+        long result =
+            descriptor_read(ctx.device.handle, frame, usernet::kMaxFrameSize);
+        if (result == kDescriptorWouldBlock || result <= 0) {
+            return did_work;
         }
-        send_tcp_segment(*binding, segment);
+        did_work = true;
+        handle_frame(ctx, frame, static_cast<size_t>(result));
+    }
+}
+
+// Flushes queued transmits first so a request sent just before polling
+// (an ARP query, say) is on the wire while we look for the answer.
+bool poll_network(ServerContext& ctx) {
+    flush_device_frames(ctx);
+    bool did_work = false;
+    if (ctx.ring.control != nullptr) {
+        did_work = poll_packet_ring(ctx);
+    } else if (ctx.batches.rx != nullptr) {
+        did_work = poll_frame_batches(ctx);
+    } else {
+        did_work = poll_single_frames(ctx);
     }
+    flush_device_frames(ctx);
+    return did_work;
 }
 
 }  // namespace
@@ -903,6 +1174,13 @@ int main(uint64_t, uint64_t) {
         return 11;
     }
     print_line("networkd: device open ok");
+    if (attach_packet_ring(ctx)) {
+        print_line("networkd: packet ring attached");
+    } else if (allocate_frame_batches(ctx)) {
+        print_line("networkd: packet ring unavailable, using batched read/write");
+    } else {
+        print_line("networkd: packet ring unavailable, using read/write");
+    }
 
     uint64_t server_flags = static_cast<uint64_t>(descriptor_defs::Flag::Readable) |
                             static_cast<uint64_t>(descriptor_defs::Flag::Async);
@@ -57,6 +57,7 @@ struct Connection {
     uint8_t syn_retransmits;
     uint64_t syn_retry_deadline_ms;
     Listener* listener;
+    bool watched;  // endpoint_handle is a member of ServerContext::wait_set
 };
 
 struct ClientPort {
@@ -109,6 +110,7 @@ struct ServerContext {
     ClientPort client_ports[kMaxClientPorts];
     PendingConnect pending_connects[kMaxPendingConnects];
     uint32_t next_connection_id;
+    uint32_t wait_set;
 };
 
 void print(const char* text) {
@@ -500,6 +502,7 @@ void reset_connection(Connection& conn) {
     conn.syn_retransmits = 0;
     conn.syn_retry_deadline_ms = 0;
     conn.listener = nullptr;
+    conn.watched = false;
 }
 
 void clear_pending_ack(Connection& conn) {
@@ -524,6 +527,9 @@ void close_connection(ServerContext& ctx, Connection& conn, uint32_t reason) {
     bool outbound = conn.listener == nullptr;
     uint16_t local_port = conn.local_port;
     send_closed_event(conn, reason);
+    if (conn.watched) {
+        (void)wait_set_remove(ctx.wait_set, conn.endpoint_handle);
+    }
     if (conn.endpoint_handle != 0) {
         descriptor_close(conn.endpoint_handle);
     }
@@ -1458,11 +1464,31 @@ bool wait_for_networkd(uint32_t& server_pipe_id) {
     return true;
 }
 
+// Keeps established connections' endpoints in the wait set so the idle wait
+// in main() is a single handle regardless of how many connections are open.
+void watch_connection_endpoints(ServerContext& ctx) {
+    for (size_t i = 0; i < kMaxConnections; ++i) {
+        Connection& conn = ctx.connections[i];
+        bool wanted = conn.in_use &&
+                      conn.state == kConnStateEstablished &&
+                      conn.endpoint_handle != 0 &&
+                      conn.endpoint_handle != kInvalidDescriptor;
+        if (wanted && !conn.watched) {
+            conn.watched = wait_set_add(ctx.wait_set,
+                                        conn.endpoint_handle,
+                                        descriptor_defs::kWaitRead) == 0;
+        } else if (!wanted && conn.watched) {
+            (void)wait_set_remove(ctx.wait_set, conn.endpoint_handle);
+            conn.watched = false;
+        }
+    }
+}
+
 }  // namespace
 
 int main(uint64_t, uint64_t) {
     ServerContext ctx{};
-    descriptor_defs::DescriptorWait waits[64]{};
+    descriptor_defs::DescriptorWait wait{};
     print_line("tcpd: build dbg-2026-04-11b");
 
     if (!usernet::open_device(ctx.device, 0, static_cast<uint64_t>(descriptor_defs::Flag::Async))) {
@@ -1535,6 +1561,24 @@ int main(uint64_t, uint64_t) {
         ctx.registry->state = tcpd_protocol::kStateReady;
     }
 
+    long wait_set = wait_set_open();
+    if (wait_set < 0) {
+        print_line("tcpd: failed to create wait set");
+        return 29;
+    }
+    ctx.wait_set = static_cast<uint32_t>(wait_set);
+    if (wait_set_add(ctx.wait_set,
+                     ctx.tcpd_server_pipe,
+                     descriptor_defs::kWaitRead) != 0 ||
+        wait_set_add(ctx.wait_set,
+                     ctx.network_reply_pipe,
+                     descriptor_defs::kWaitRead) != 0) {
+        print_line("tcpd: failed to populate wait set");
+        return 29;
+    }
+    wait.handle = ctx.wait_set;
+    wait.events = descriptor_defs::kWaitRead;
+
     print_line("tcpd: ready");
 
     for (;;) {
@@ -1554,38 +1598,8 @@ int main(uint64_t, uint64_t) {
             continue;
         }
 
-        size_t wait_count = 0;
-        waits[wait_count].handle = ctx.tcpd_server_pipe;
-        waits[wait_count].events = descriptor_defs::kWaitRead;
-        waits[wait_count].revents = 0;
-        waits[wait_count].reserved = 0;
-        ++wait_count;
-
-        waits[wait_count].handle = ctx.network_reply_pipe;
-        waits[wait_count].events = descriptor_defs::kWaitRead;
-        waits[wait_count].revents = 0;
-        waits[wait_count].reserved = 0;
-        ++wait_count;
-
-        for (size_t i = 0;
-             i < kMaxConnections &&
-             wait_count < (sizeof(waits) / sizeof(waits[0]));
-             ++i) {
-            const Connection& conn = ctx.connections[i];
-            if (!conn.in_use ||
-                conn.state != kConnStateEstablished ||
-                conn.endpoint_handle == 0 ||
-                conn.endpoint_handle == kInvalidDescriptor) {
-                continue;
-            }
-            waits[wait_count].handle = conn.endpoint_handle;
-            waits[wait_count].events = descriptor_defs::kWaitRead;
-            waits[wait_count].revents = 0;
-            waits[wait_count].reserved = 0;
-            ++wait_count;
-        }
-
-        if (descriptor_wait(waits, wait_count) < 0) {
+        watch_connection_endpoints(ctx);
+        if (descriptor_wait(&wait, 1) < 0) {
             yield();
         }
     }
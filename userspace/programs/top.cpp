@@ -9,6 +9,7 @@ namespace {
 
 constexpr size_t kMaxCpuEntries = 16;
 constexpr size_t kMaxTaskEntries = 256;
+constexpr size_t kMaxHeapEntries = 32;
 constexpr size_t kMaxVisibleTasks = 12;
 constexpr size_t kMaxRenderRows = 64;
 constexpr uint64_t kExpectedTicksPerSecond = 100;
@@ -31,6 +32,7 @@ descriptor_defs::CpuUsage g_current_cpus[kMaxCpuEntries]{};
 descriptor_defs::TaskUsage g_previous_tasks[kMaxTaskEntries]{};
 descriptor_defs::TaskUsage g_current_tasks[kMaxTaskEntries]{};
 TaskDelta g_deltas[kMaxTaskEntries]{};
+descriptor_defs::KernelHeapCacheStats g_heap_caches[kMaxHeapEntries]{};
 char g_render_buffer[8192]{};
 uint32_t g_previous_line_widths[kMaxRenderRows]{};
 uint32_t g_current_line_widths[kMaxRenderRows]{};
@@ -219,6 +221,21 @@ void console_dimensions(long console, uint32_t& cols, uint32_t& rows) {
     }
 }
 
+size_t read_heap_stats(uint32_t handle,
+                       descriptor_defs::KernelHeapCacheStats* out,
+                       size_t capacity) {
+    long result = descriptor_read(
+        handle,
+        out,
+        capacity * sizeof(descriptor_defs::KernelHeapCacheStats),
+        0);
+    if (result <= 0) {
+        return 0;
+    }
+    return static_cast<size_t>(result) /
+           sizeof(descriptor_defs::KernelHeapCacheStats);
+}
+
 size_t read_cpu_stats(uint32_t handle,
                       descriptor_defs::CpuUsage* out,
                       size_t capacity) {
@@ -409,7 +426,64 @@ void append_cpu_line(char* buffer,
     append_percent_tenths_padded(buffer, capacity, length, idle, total, 5);
     append_text(buffer, capacity, length, "%  irq ");
     append_percent_tenths_padded(buffer, capacity, length, irq, total, 5);
-    append_text(buffer, capacity, length, "%");
+    append_text(buffer, capacity, length, "%  steal ");
+    append_u64(buffer, capacity, length, current.steals);
+    append_text(buffer, capacity, length, "  mig ");
+    append_u64(buffer, capacity, length, current.migrations);
+    append_text(buffer, capacity, length, "  tmr ");
+    append_u64(buffer,
+               capacity,
+               length,
+               delta_u64(current.timer_interrupts, previous.timer_interrupts));
+    finish_line(buffer, capacity, length, line_start, cols, row);
+}
+
+void append_heap_line(char* buffer,
+                      size_t capacity,
+                      size_t& length,
+                      const descriptor_defs::KernelHeapCacheStats* caches,
+                      size_t count,
+                      uint32_t cols,
+                      uint32_t row) {
+    uint64_t slab_pages = 0;
+    uint64_t objects_in_use = 0;
+    uint64_t objects_total = 0;
+    uint64_t used_bytes = 0;
+    uint64_t large_pages = 0;
+    uint64_t huge_user = 0;
+    uint64_t huge_kernel = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const descriptor_defs::KernelHeapCacheStats& cache = caches[i];
+        if (strcmp(cache.name, "kmalloc-large") == 0) {
+            large_pages = cache.slabs;
+            continue;
+        }
+        if (strcmp(cache.name, "pages-2m") == 0) {
+            huge_user = cache.objects_in_use;
+            huge_kernel = cache.slabs;
+            continue;
+        }
+        slab_pages += cache.slabs;
+        objects_in_use += cache.objects_in_use;
+        objects_total += cache.objects_total;
+        used_bytes += cache.objects_in_use * cache.object_size;
+    }
+
+    size_t line_start = length;
+    append_text(buffer, capacity, length, "heap  slabs ");
+    append_u64(buffer, capacity, length, slab_pages);
+    append_text(buffer, capacity, length, "  objs ");
+    append_u64(buffer, capacity, length, objects_in_use);
+    append_char(buffer, capacity, length, '/');
+    append_u64(buffer, capacity, length, objects_total);
+    append_text(buffer, capacity, length, "  used ");
+    append_u64(buffer, capacity, length, used_bytes / 1024);
+    append_text(buffer, capacity, length, " KiB  large ");
+    append_u64(buffer, capacity, length, large_pages);
+    append_text(buffer, capacity, length, " pages  2M ");
+    append_u64(buffer, capacity, length, huge_user);
+    append_char(buffer, capacity, length, '/');
+    append_u64(buffer, capacity, length, huge_kernel);
     finish_line(buffer, capacity, length, line_start, cols, row);
 }
 
@@ -423,7 +497,7 @@ void append_task_table(char* buffer,
                        size_t visible_limit,
                        uint32_t first_row) {
     append_line(buffer, capacity, length, "", cols, first_row);
-    append_line(buffer, capacity, length, "       pid   cpu%  state  kind    image", cols, first_row + 1);
+    append_line(buffer, capacity, length, "       pid   cpu%  state  kind      faults  image", cols, first_row + 1);
     append_line(buffer, capacity, length, "------------------------------------------------------------", cols, first_row + 2);
 
     size_t visible = count < visible_limit ? count : visible_limit;
@@ -454,6 +528,12 @@ void append_task_table(char* buffer,
                                : "user",
                            6);
         append_text(buffer, capacity, length, "  ");
+        append_padded_u64(buffer,
+                          capacity,
+                          length,
+                          deltas[i].snapshot.page_faults,
+                          8);
+        append_text(buffer, capacity, length, "  ");
         append_text(buffer, capacity, length, deltas[i].snapshot.image_path);
         finish_line(buffer, capacity, length, line_start, cols, row);
     }
@@ -480,6 +560,9 @@ extern "C" int main(uint64_t, uint64_t) {
         return 1;
     }
 
+    // Optional: older kernels do not expose heap statistics.
+    long heap_desc = open_monitor_descriptor(descriptor_defs::Type::KernelHeap);
+
     size_t previous_cpu_count =
         read_cpu_stats(static_cast<uint32_t>(cpu_desc), g_previous_cpus, kMaxCpuEntries);
     size_t previous_task_count =
@@ -535,6 +618,20 @@ extern "C" int main(uint64_t, uint64_t) {
             ++render_rows;
         }
 
+        if (heap_desc >= 0) {
+            size_t heap_count = read_heap_stats(static_cast<uint32_t>(heap_desc),
+                                                g_heap_caches,
+                                                kMaxHeapEntries);
+            append_heap_line(buffer,
+                             sizeof(g_render_buffer),
+                             length,
+                             g_heap_caches,
+                             heap_count,
+                             cols,
+                             render_rows);
+            ++render_rows;
+        }
+
         uint64_t interval_total =
             total_cpu_delta(g_current_cpus, g_previous_cpus, cpu_count);
         uint64_t displayed_interval_total =
@@ -0,0 +1,590 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../crt/syscall.hpp"
+#include "../libc/include/neutrino.h"
+
+namespace {
+
+constexpr uint64_t kDefaultSeconds = 1;
+constexpr uint64_t kMaxSeconds = 60;
+constexpr uint64_t kPollMs = 20;
+constexpr size_t kReadRecords = 128;
+constexpr size_t kMaxCpus = 16;
+constexpr size_t kMaxPids = 32;
+constexpr size_t kMaxSyscalls = 64;
+constexpr size_t kMaxPendingBlocks = 32;
+constexpr size_t kTopRows = 8;
+
+using descriptor_defs::TraceEvent;
+using descriptor_defs::TraceRecord;
+
+struct Latency {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+};
+
+struct PendingSyscall {
+    bool active;
+    uint32_t pid;
+    uint64_t number;
+    uint64_t tsc;
+};
+
+struct PendingBlock {
+    bool active;
+    uint64_t lba;
+    uint64_t bits;
+    uint64_t tsc;
+};
+
+struct PidCount {
+    uint32_t pid;
+    uint64_t syscalls;
+    uint64_t switches_in;
+};
+
+struct Options {
+    bool dump;
+    uint64_t seconds;
+    uint32_t mask;
+};
+
+TraceRecord g_records[kReadRecords]{};
+uint64_t g_event_counts[descriptor_defs::kTraceEventCount]{};
+uint64_t g_irq_counts[256]{};
+Latency g_syscalls[kMaxSyscalls]{};
+Latency g_block_reads{};
+Latency g_block_writes{};
+uint64_t g_block_errors = 0;
+PendingSyscall g_pending_syscalls[kMaxCpus]{};
+PendingBlock g_pending_blocks[kMaxPendingBlocks]{};
+PidCount g_pids[kMaxPids]{};
+size_t g_pid_count = 0;
+uint64_t g_first_tsc = 0;
+uint64_t g_tsc_hz = 0;
+uint64_t g_total_records = 0;
+
+const char* event_name(uint16_t event) {
+    switch (static_cast<TraceEvent>(event)) {
+        case TraceEvent::ContextSwitch:
+            return "switch";
+        case TraceEvent::Wake:
+            return "wake";
+        case TraceEvent::SyscallEnter:
+            return "sys-enter";
+        case TraceEvent::SyscallExit:
+            return "sys-exit";
+        case TraceEvent::BlockSubmit:
+            return "blk-submit";
+        case TraceEvent::BlockComplete:
+            return "blk-done";
+        case TraceEvent::PageFault:
+            return "fault";
+        case TraceEvent::Irq:
+            return "irq";
+    }
+    return "?";
+}
+
+void append_char(char* buffer, size_t capacity, size_t& length, char ch) {
+    if (length + 1 >= capacity) {
+        return;
+    }
+    buffer[length++] = ch;
+    buffer[length] = '\0';
+}
+
+void append_text(char* buffer, size_t capacity, size_t& length, const char* text) {
+    if (text == nullptr) {
+        return;
+    }
+    while (*text != '\0' && length + 1 < capacity) {
+        buffer[length++] = *text++;
+    }
+    buffer[length] = '\0';
+}
+
+void append_u64(char* buffer, size_t capacity, size_t& length, uint64_t value) {
+    char digits[32];
+    size_t count = 0;
+    do {
+        digits[count++] = static_cast<char>('0' + (value % 10));
+        value /= 10;
+    } while (value != 0 && count < sizeof(digits));
+
+    while (count > 0) {
+        append_char(buffer, capacity, length, digits[--count]);
+    }
+}
+
+void append_hex(char* buffer, size_t capacity, size_t& length, uint64_t value) {
+    static const char kDigits[] = "0123456789abcdef";
+    append_text(buffer, capacity, length, "0x");
+    bool started = false;
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        uint8_t nibble = static_cast<uint8_t>((value >> shift) & 0xF);
+        if (nibble != 0 || started || shift == 0) {
+            started = true;
+            append_char(buffer, capacity, length, kDigits[nibble]);
+        }
+    }
+}
+
+void pad_to(char* buffer, size_t capacity, size_t& length, size_t column) {
+    while (length < column) {
+        append_char(buffer, capacity, length, ' ');
+        if (length + 1 >= capacity) {
+            return;
+        }
+    }
+}
+
+uint64_t cycles_to_us(uint64_t cycles) {
+    if (g_tsc_hz < 1000000ull) {
+        return cycles;
+    }
+    return cycles / (g_tsc_hz / 1000000ull);
+}
+
+void add_latency(Latency& latency, uint64_t cycles) {
+    ++latency.count;
+    latency.total_cycles += cycles;
+    if (cycles > latency.max_cycles) {
+        latency.max_cycles = cycles;
+    }
+}
+
+PidCount* pid_entry(uint32_t pid) {
+    for (size_t i = 0; i < g_pid_count; ++i) {
+        if (g_pids[i].pid == pid) {
+            return &g_pids[i];
+        }
+    }
+    if (g_pid_count == kMaxPids) {
+        return nullptr;
+    }
+    PidCount& entry = g_pids[g_pid_count++];
+    entry.pid = pid;
+    return &entry;
+}
+
+bool parse_u64(const char* text, size_t length, uint64_t& out) {
+    if (length == 0) {
+        return false;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        value = value * 10u + static_cast<uint64_t>(text[i] - '0');
+    }
+    out = value;
+    return true;
+}
+
+bool token_is(const char* token, size_t length, const char* word) {
+    size_t i = 0;
+    for (; i < length; ++i) {
+        if (word[i] == '\0' || word[i] != token[i]) {
+            return false;
+        }
+    }
+    return word[i] == '\0';
+}
+
+uint32_t event_mask_for(const char* token, size_t length) {
+    using descriptor_defs::trace_event_bit;
+    if (token_is(token, length, "all")) {
+        return descriptor_defs::kTraceAllEvents;
+    }
+    if (token_is(token, length, "sched")) {
+        return trace_event_bit(TraceEvent::ContextSwitch) |
+               trace_event_bit(TraceEvent::Wake);
+    }
+    if (token_is(token, length, "syscall")) {
+        return trace_event_bit(TraceEvent::SyscallEnter) |
+               trace_event_bit(TraceEvent::SyscallExit);
+    }
+    if (token_is(token, length, "block")) {
+        return trace_event_bit(TraceEvent::BlockSubmit) |
+               trace_event_bit(TraceEvent::BlockComplete);
+    }
+    if (token_is(token, length, "fault")) {
+        return trace_event_bit(TraceEvent::PageFault);
+    }
+    if (token_is(token, length, "irq")) {
+        return trace_event_bit(TraceEvent::Irq);
+    }
+    return 0;
+}
+
+// trace [-d] [seconds] [all|sched|syscall|block|fault|irq ...]
+bool parse_options(const char* args, Options& options) {
+    options.dump = false;
+    options.seconds = kDefaultSeconds;
+    options.mask = 0;
+    if (args == nullptr) {
+        options.mask = descriptor_defs::kTraceAllEvents;
+        return true;
+    }
+    size_t i = 0;
+    while (args[i] != '\0') {
+        while (args[i] == ' ') {
+            ++i;
+        }
+        const char* token = args + i;
+        size_t length = 0;
+        while (token[length] != '\0' && token[length] != ' ') {
+            ++length;
+        }
+        i += length;
+        if (length == 0) {
+            continue;
+        }
+        if (token_is(token, length, "-d")) {
+            options.dump = true;
+            continue;
+        }
+        uint64_t seconds = 0;
+        if (parse_u64(token, length, seconds)) {
+            if (seconds == 0 || seconds > kMaxSeconds) {
+                return false;
+            }
+            options.seconds = seconds;
+            continue;
+        }
+        uint32_t mask = event_mask_for(token, length);
+        if (mask == 0) {
+            return false;
+        }
+        options.mask |= mask;
+    }
+    if (options.mask == 0) {
+        options.mask = descriptor_defs::kTraceAllEvents;
+    }
+    return true;
+}
+
+void dump_record(long console, const TraceRecord& record) {
+    char line[128];
+    size_t length = 0;
+    line[0] = '\0';
+    append_u64(line, sizeof(line), length, cycles_to_us(record.tsc - g_first_tsc));
+    pad_to(line, sizeof(line), length, 12);
+    append_text(line, sizeof(line), length, "cpu");
+    append_u64(line, sizeof(line), length, record.cpu);
+    pad_to(line, sizeof(line), length, 18);
+    append_text(line, sizeof(line), length, "pid ");
+    append_u64(line, sizeof(line), length, record.pid);
+    pad_to(line, sizeof(line), length, 28);
+    append_text(line, sizeof(line), length, event_name(record.event));
+    pad_to(line, sizeof(line), length, 40);
+    append_hex(line, sizeof(line), length, record.arg0);
+    append_char(line, sizeof(line), length, ' ');
+    append_hex(line, sizeof(line), length, record.arg1);
+    neutrino_write_line(console, line);
+}
+
+void account_block(const TraceRecord& record) {
+    uint64_t request_bits =
+        record.arg1 & ~(0xFFull << descriptor_defs::kTraceBlockStatusShift);
+    if (static_cast<TraceEvent>(record.event) == TraceEvent::BlockSubmit) {
+        for (auto& pending : g_pending_blocks) {
+            if (!pending.active) {
+                pending = PendingBlock{true, record.arg0, request_bits, record.tsc};
+                return;
+            }
+        }
+        return;
+    }
+    if ((record.arg1 >> descriptor_defs::kTraceBlockStatusShift) != 0) {
+        ++g_block_errors;
+    }
+    for (auto& pending : g_pending_blocks) {
+        if (pending.active && pending.lba == record.arg0 &&
+            pending.bits == request_bits) {
+            pending.active = false;
+            Latency& latency = (request_bits & descriptor_defs::kTraceBlockWrite) != 0
+                                   ? g_block_writes
+                                   : g_block_reads;
+            add_latency(latency, record.tsc - pending.tsc);
+            return;
+        }
+    }
+}
+
+void account(const TraceRecord& record) {
+    ++g_total_records;
+    if (g_first_tsc == 0 || record.tsc < g_first_tsc) {
+        g_first_tsc = record.tsc;
+    }
+    if (record.event < descriptor_defs::kTraceEventCount) {
+        ++g_event_counts[record.event];
+    }
+    size_t cpu = record.cpu < kMaxCpus ? record.cpu : 0;
+    switch (static_cast<TraceEvent>(record.event)) {
+        case TraceEvent::ContextSwitch:
+            if (PidCount* entry = pid_entry(static_cast<uint32_t>(record.arg1))) {
+                ++entry->switches_in;
+            }
+            break;
+        case TraceEvent::SyscallEnter:
+            g_pending_syscalls[cpu] =
+                PendingSyscall{true, record.pid, record.arg0, record.tsc};
+            if (PidCount* entry = pid_entry(record.pid)) {
+                ++entry->syscalls;
+            }
+            break;
+        case TraceEvent::SyscallExit: {
+            PendingSyscall& pending = g_pending_syscalls[cpu];
+            if (pending.active && pending.number == record.arg0 &&
+                pending.pid == record.pid) {
+                if (pending.number < kMaxSyscalls) {
+                    add_latency(g_syscalls[pending.number],
+                                record.tsc - pending.tsc);
+                }
+            }
+            pending.active = false;
+            break;
+        }
+        case TraceEvent::BlockSubmit:
+        case TraceEvent::BlockComplete:
+            account_block(record);
+            break;
+        case TraceEvent::Irq:
+            ++g_irq_counts[record.arg0 & 0xFF];
+            break;
+        default:
+            break;
+    }
+}
+
+// Returns false once the descriptor stops returning records.
+bool drain(uint32_t handle, long console, bool dump) {
+    long bytes = descriptor_read(handle,
+                                 g_records,
+                                 sizeof(g_records));
+    if (bytes <= 0) {
+        return false;
+    }
+    size_t count = static_cast<size_t>(bytes) / sizeof(TraceRecord);
+    for (size_t i = 0; i < count; ++i) {
+        account(g_records[i]);
+        if (dump) {
+            dump_record(console, g_records[i]);
+        }
+    }
+    return count == kReadRecords;
+}
+
+void print_latency(long console, const char* label, const Latency& latency) {
+    char line[128];
+    size_t length = 0;
+    line[0] = '\0';
+    append_text(line, sizeof(line), length, label);
+    pad_to(line, sizeof(line), length, 10);
+    append_u64(line, sizeof(line), length, latency.count);
+    pad_to(line, sizeof(line), length, 20);
+    append_text(line, sizeof(line), length, "avg ");
+    append_u64(line,
+               sizeof(line),
+               length,
+               latency.count != 0
+                   ? cycles_to_us(latency.total_cycles / latency.count)
+                   : 0);
+    append_text(line, sizeof(line), length, " us  max ");
+    append_u64(line, sizeof(line), length, cycles_to_us(latency.max_cycles));
+    append_text(line, sizeof(line), length, " us");
+    neutrino_write_line(console, line);
+}
+
+void print_summary(long console,
+                   const descriptor_defs::TraceStatus& status,
+                   uint64_t seconds) {
+    char line[128];
+    size_t length = 0;
+    line[0] = '\0';
+    append_text(line, sizeof(line), length, "trace: ");
+    append_u64(line, sizeof(line), length, g_total_records);
+    append_text(line, sizeof(line), length, " records in ");
+    append_u64(line, sizeof(line), length, seconds);
+    append_text(line, sizeof(line), length, " s, dropped ");
+    append_u64(line, sizeof(line), length, status.dropped);
+    neutrino_write_line(console, line);
+
+    for (uint32_t event = 1; event < descriptor_defs::kTraceEventCount; ++event) {
+        if (g_event_counts[event] == 0) {
+            continue;
+        }
+        length = 0;
+        line[0] = '\0';
+        append_text(line, sizeof(line), length, "  ");
+        append_text(line, sizeof(line), length, event_name(static_cast<uint16_t>(event)));
+        pad_to(line, sizeof(line), length, 16);
+        append_u64(line, sizeof(line), length, g_event_counts[event]);
+        neutrino_write_line(console, line);
+    }
+
+    bool header = false;
+    for (size_t rank = 0; rank < kTopRows; ++rank) {
+        size_t best = kMaxSyscalls;
+        for (size_t nr = 0; nr < kMaxSyscalls; ++nr) {
+            if (g_syscalls[nr].count != 0 &&
+                (best == kMaxSyscalls ||
+                 g_syscalls[nr].total_cycles > g_syscalls[best].total_cycles)) {
+                best = nr;
+            }
+        }
+        if (best == kMaxSyscalls) {
+            break;
+        }
+        if (!header) {
+            neutrino_write_line(console, "syscalls by total time:");
+            header = true;
+        }
+        char label[16];
+        size_t label_length = 0;
+        label[0] = '\0';
+        append_text(label, sizeof(label), label_length, "  nr ");
+        append_u64(label, sizeof(label), label_length, best);
+        print_latency(console, label, g_syscalls[best]);
+        g_syscalls[best].count = 0;
+    }
+
+    header = false;
+    for (size_t rank = 0; rank < kTopRows; ++rank) {
+        PidCount* best = nullptr;
+        for (size_t i = 0; i < g_pid_count; ++i) {
+            PidCount& entry = g_pids[i];
+            uint64_t activity = entry.syscalls + entry.switches_in;
+            if (activity != 0 &&
+                (best == nullptr ||
+                 activity > best->syscalls + best->switches_in)) {
+                best = &entry;
+            }
+        }
+        if (best == nullptr) {
+            break;
+        }
+        if (!header) {
+            neutrino_write_line(console, "busiest pids:     syscalls  switches-in");
+            header = true;
+        }
+        length = 0;
+        line[0] = '\0';
+        append_text(line, sizeof(line), length, "  pid ");
+        append_u64(line, sizeof(line), length, best->pid);
+        pad_to(line, sizeof(line), length, 18);
+        append_u64(line, sizeof(line), length, best->syscalls);
+        pad_to(line, sizeof(line), length, 28);
+        append_u64(line, sizeof(line), length, best->switches_in);
+        neutrino_write_line(console, line);
+        best->syscalls = 0;
+        best->switches_in = 0;
+    }
+
+    if (g_block_reads.count != 0 || g_block_writes.count != 0) {
+        neutrino_write_line(console, "block I/O latency:");
+        print_latency(console, "  reads", g_block_reads);
+        print_latency(console, "  writes", g_block_writes);
+        if (g_block_errors != 0) {
+            length = 0;
+            line[0] = '\0';
+            append_text(line, sizeof(line), length, "  failed ");
+            append_u64(line, sizeof(line), length, g_block_errors);
+            neutrino_write_line(console, line);
+        }
+    }
+
+    header = false;
+    for (size_t vector = 0; vector < 256; ++vector) {
+        if (g_irq_counts[vector] == 0) {
+            continue;
+        }
+        if (!header) {
+            neutrino_write_line(console, "interrupts by vector:");
+            header = true;
+        }
+        length = 0;
+        line[0] = '\0';
+        append_text(line, sizeof(line), length, "  ");
+        append_hex(line, sizeof(line), length, vector);
+        pad_to(line, sizeof(line), length, 10);
+        append_u64(line, sizeof(line), length, g_irq_counts[vector]);
+        neutrino_write_line(console, line);
+    }
+}
+
+}  // namespace
+
+int main(uint64_t arg_ptr, uint64_t) {
+    const char* args = reinterpret_cast<const char*>(arg_ptr);
+    long console = neutrino_open_stdout();
+
+    Options options{};
+    if (!parse_options(args, options)) {
+        neutrino_write_line(
+            console,
+            "usage: trace [-d] [seconds] [all|sched|syscall|block|fault|irq ...]");
+        return 1;
+    }
+
+    long handle = descriptor_open(
+        static_cast<uint32_t>(descriptor_defs::Type::Trace), 0, 0, 0);
+    if (handle < 0) {
+        neutrino_write_line(console, "trace: cannot open trace descriptor");
+        return 1;
+    }
+    uint32_t trace_handle = static_cast<uint32_t>(handle);
+
+    descriptor_defs::TraceControl control{};
+    control.enable_mask = options.mask;
+    control.flags = descriptor_defs::kTraceControlClear;
+    if (descriptor_set_property(
+            trace_handle,
+            static_cast<uint32_t>(descriptor_defs::Property::TraceControl),
+            &control,
+            sizeof(control)) != 0) {
+        neutrino_write_line(console, "trace: cannot enable tracing");
+        descriptor_close(trace_handle);
+        return 1;
+    }
+
+    descriptor_defs::TraceStatus status{};
+    descriptor_get_property(
+        trace_handle,
+        static_cast<uint32_t>(descriptor_defs::Property::TraceStatus),
+        &status,
+        sizeof(status));
+    g_tsc_hz = status.tsc_hz;
+
+    // Drain while tracing so the per-CPU buffers do not overflow.
+    uint64_t polls = options.seconds * (1000 / kPollMs);
+    for (uint64_t poll = 0; poll < polls; ++poll) {
+        sleep_ms(kPollMs);
+        while (drain(trace_handle, console, options.dump)) {
+        }
+    }
+
+    control.enable_mask = 0;
+    control.flags = 0;
+    descriptor_set_property(
+        trace_handle,
+        static_cast<uint32_t>(descriptor_defs::Property::TraceControl),
+        &control,
+        sizeof(control));
+    while (drain(trace_handle, console, options.dump)) {
+    }
+    descriptor_get_property(
+        trace_handle,
+        static_cast<uint32_t>(descriptor_defs::Property::TraceStatus),
+        &status,
+        sizeof(status));
+    descriptor_close(trace_handle);
+
+    print_summary(console, status, options.seconds);
+    return 0;
+}